@@ -1,31 +1,214 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <stdatomic.h>
 #include "block.h"
+#include "block_cache.h"
+#include "block_internal.h"
+#define MANIFEST_NAME "manifest"
+#define MANIFEST_MAGIC "wasql-blocks 1"
+#define MANIFEST_MAGIC_2 "wasql-blocks 2"   // compressed or checksummed, unreadable to older builds
+#define MANIFEST_NO_SYNC -1                 // manifest_save flags: left to a later durable sync
+#define DIRTY_HASH_SIZE 1024
+#define MAX_BACKENDS 16
+#define STAGED_HOLE -1             // token of an all-zero block in a batch: punch, not stage
+#define READAHEAD_THREADS 4       // background threads loading read-ahead blocks
+#define READAHEAD_QUEUE 64        // requests waiting for them
+#define READAHEAD_MIN 4           // window of a new stream, in blocks
+#define READAHEAD_MAX_STRIDE 64   // farthest apart reads can be and still form a stream
 
-#define BLOCK_SIZE 4096
-#define MAX_PATH_LEN 1024
+// In-memory copy of filename.blocks/manifest
+typedef struct {
+    long long size;            // logical file size in bytes
+    long long block_count;     // one past the highest block that may exist
+    unsigned long long generation;  // bumped each time the manifest is saved
+    char backend[32];          // name of the backend holding the blocks
+    int block_size;            // bytes per block
+    int compress;              // codec blocks are stored with, BLOCK_COMPRESS_*
+    int checksum;              // blocks have CRC32Cs in filename.blocks/checksums
+    long long *staged;         // block, token, checksum (0 if none) of each
+                               // block of a committed batch
+    long long staged_count;    // not yet known to be published
+    int dirty;                 // changed since it was last saved
+    int unsynced;              // saved since it was last made durable
+} block_manifest_t;
 
-// Get the directory path for a file's blocks
-static void get_block_dir(const char *filename, char *block_dir) {
-    snprintf(block_dir, MAX_PATH_LEN, "%s.blocks", filename);
+// A block written since the last flush
+typedef struct dirty_block dirty_block_t;
+struct dirty_block {
+    long long block_num;
+    dirty_block_t *next;       // hash chain
+    char data[];               // block_size bytes
+};
+
+// Per-filename state shared by every handle open on that file. Dirty blocks
+// and the backend live here, so every handle reads what any handle has
+// written. Reads hold the lock shared and go to the backend under
+// backend_lock; everything else holds it exclusively.
+struct block_shared {
+    block_rwlock_t lock;
+    block_mutex_t backend_lock;
+    char *filename;
+    unsigned long long file_id;  // identifies the file's blocks in the read cache
+    int refs;
+    int block_size;
+    block_cache_t *own_cache;    // read cache of this file alone, or NULL
+    char *scratch;               // one block of buffer space
+    block_manifest_t manifest;
+    const block_backend_t *backend;
+    void *state;                 // backend state
+    dirty_block_t *dirty[DIRTY_HASH_SIZE];
+    long long dirty_count;
+    block_writeback_stats_t wb_stats;
+    int temp;                    // private temporary file, removed on close
+    char *temp_dir;              // where it spilled to, NULL while in memory
+    int batch_active;            // inside an atomic batch
+    long long batch_size;        // manifest size and block count at its start
+    long long batch_block_count;
+    block_mutex_t sync_lock;     // covers the group commit fields below
+    block_cond_t sync_cond;      // a group sync finished
+    unsigned long long sync_tickets;   // durable syncs asked for so far
+    unsigned long long sync_done;      // tickets covered by finished group syncs
+    unsigned long long sync_failures;  // group syncs that failed
+    int sync_leader;             // a handle is running a group sync
+    int sync_full;               // a sync not yet covered asked for BLOCK_SYNC_FULL
+    int sync_metadata;           // a sync not yet covered did not ask for DATAONLY
+    int ra_pending;              // read-ahead requests queued or running, under ra_lock
+    int ra_busy;                 // a thread is running one of them, under ra_lock
+    _Atomic long long ra_streams;
+    _Atomic long long ra_issued;
+    _Atomic long long ra_hits;
+    _Atomic long long ra_misses;
+    _Atomic long long ra_dropped;
+    block_shared_t *next;
+};
+
+// The registry lock covers the shared list, the backend table and the
+// creation of the shared read cache. Settings are atomics.
+static block_mutex_t registry_lock = BLOCK_MUTEX_INITIALIZER;
+static block_shared_t *shared_list = NULL;
+static unsigned long long next_file_id = 1;
+static block_cache_t *_Atomic read_cache = NULL;
+static _Atomic long long read_cache_capacity = BLOCK_CACHE_CAPACITY_DEFAULT;
+static _Atomic long long dirty_limit = BLOCK_DIRTY_LIMIT_DEFAULT;
+static _Atomic int fsync_on_flush = 0;
+static _Atomic int group_commit_window = 0;
+static _Atomic long long temp_spill = BLOCK_TEMP_SPILL_DEFAULT;
+static _Atomic int readahead_max = BLOCK_READAHEAD_DEFAULT;
+
+// Read-ahead requests, taken by a pool of threads started on first use.
+// Backend calls on a file are serialized anyway, so a file's requests run
+// one at a time and in order; the pool serves several files at once.
+// ra_lock covers the queue and every file's ra_pending and ra_busy.
+typedef struct {
+    block_shared_t *s;
+    long long first;
+    long long stride;
+    int count;
+} readahead_job_t;
+
+static block_mutex_t ra_lock = BLOCK_MUTEX_INITIALIZER;
+static block_cond_t ra_wake = BLOCK_COND_INITIALIZER;   // a request may be runnable
+static block_cond_t ra_idle = BLOCK_COND_INITIALIZER;   // a file's requests are done
+static readahead_job_t ra_queue[READAHEAD_QUEUE];
+static int ra_head = 0;
+static int ra_count = 0;
+static int ra_threads = 0;
+
+static const block_backend_t *backends[MAX_BACKENDS];
+static int backend_count = 0;
+static const block_backend_t *default_backend = &block_fanout_backend;
+
+// Register the built-in backends on first use. Called with the registry
+// lock held, like everything touching the backend table.
+static void register_builtin_backends(void) {
+    if (backend_count == 0) {
+        backends[backend_count++] = &block_fanout_backend;
+        backends[backend_count++] = &block_flat_backend;
+        backends[backend_count++] = &block_packed_backend;
+        backends[backend_count++] = &block_memory_backend;
+        backends[backend_count++] = &block_dedup_backend;
+    }
 }
 
-// Get the path for a specific block file
-static int get_block_path(const char *filename, int block_num, char *block_path) {
-    char block_dir[MAX_PATH_LEN];
-    get_block_dir(filename, block_dir);
-    int result = snprintf(block_path, MAX_PATH_LEN, "%s/block_%06d", block_dir, block_num);
-    return (result >= MAX_PATH_LEN) ? -1 : 0;
+int block_register_backend(const block_backend_t *backend) {
+    if (!backend || !backend->name || !backend->open || !backend->close || !backend->read ||
+        !backend->write || !backend->truncate || !backend->size || !backend->sync ||
+        !backend->stage != !backend->publish || !backend->map != !backend->unmap) {
+        return -1;
+    }
+    if (strlen(backend->name) >= sizeof(((block_manifest_t *)0)->backend)) {
+        return -1;
+    }
+    
+    block_mutex_lock(&registry_lock);
+    register_builtin_backends();
+    int result = 0;
+    int i = 0;
+    while (i < backend_count && strcmp(backends[i]->name, backend->name) != 0) {
+        i++;
+    }
+    if (i < backend_count) {
+        backends[i] = backend;
+    } else if (backend_count < MAX_BACKENDS) {
+        backends[backend_count++] = backend;
+    } else {
+        result = -1;
+    }
+    block_mutex_unlock(&registry_lock);
+    return result;
+}
+
+static const block_backend_t *find_backend(const char *name) {
+    register_builtin_backends();
+    for (int i = 0; name && i < backend_count; i++) {
+        if (strcmp(backends[i]->name, name) == 0) {
+            return backends[i];
+        }
+    }
+    return NULL;
+}
+
+const block_backend_t *block_find_backend(const char *name) {
+    block_mutex_lock(&registry_lock);
+    const block_backend_t *backend = find_backend(name);
+    block_mutex_unlock(&registry_lock);
+    return backend;
+}
+
+int block_set_backend(const char *name) {
+    block_mutex_lock(&registry_lock);
+    const block_backend_t *backend = find_backend(name);
+    if (backend) {
+        default_backend = backend;
+    }
+    block_mutex_unlock(&registry_lock);
+    return backend ? 0 : -1;
+}
+
+// Block sizes are powers of two from 512 bytes to 64KB, as SQLite pages are
+static int block_size_valid(int block_size) {
+    return block_size >= BLOCK_SIZE_MIN && block_size <= BLOCK_SIZE_MAX &&
+           (block_size & (block_size - 1)) == 0;
+}
+
+int block_dir_path(const char *filename, char *block_dir) {
+    int result = snprintf(block_dir, MAX_PATH_LEN, "%s.blocks", filename);
+    return (result < 0 || result >= MAX_PATH_LEN) ? -1 : 0;
 }
 
 // Ensure the block directory exists
 static int ensure_block_dir(const char *filename) {
     char block_dir[MAX_PATH_LEN];
-    get_block_dir(filename, block_dir);
+    if (block_dir_path(filename, block_dir) != 0) {
+        return -1;
+    }
     
     struct stat st;
     if (stat(block_dir, &st) == -1) {
@@ -33,72 +216,1056 @@ static int ensure_block_dir(const char *filename) {
             return -1;
         }
     }
-    return 0;
-}
-
-int block_open(const char *filename, block_file_t **bf) {
-    *bf = malloc(sizeof(block_file_t));
-    if (!*bf) {
+    return 0;
+}
+
+// Get the path of a file's manifest, or of its temporary copy
+static int get_manifest_path(const char *filename, const char *suffix, char *path) {
+    char block_dir[MAX_PATH_LEN];
+    if (block_dir_path(filename, block_dir) != 0) {
+        return -1;
+    }
+    int result = snprintf(path, MAX_PATH_LEN, "%s/%s%s", block_dir, MANIFEST_NAME, suffix);
+    return (result >= MAX_PATH_LEN) ? -1 : 0;
+}
+
+// Save the manifest. The new copy is written beside the old one and renamed
+// over it, so a crash leaves either the old or the new manifest. Staged
+// blocks listed in it belong to a committed batch. The new copy is synced
+// as BLOCK_SYNC_* flags say before the rename, or not with MANIFEST_NO_SYNC.
+static int manifest_save(const char *filename, block_manifest_t *m, int flags) {
+    char path[MAX_PATH_LEN];
+    char tmp_path[MAX_PATH_LEN];
+    if (get_manifest_path(filename, "", path) != 0 ||
+        get_manifest_path(filename, ".tmp", tmp_path) != 0) {
+        return -1;
+    }
+    
+    FILE *f = fopen(tmp_path, "w");
+    if (!f) {
+        return -1;
+    }
+    int ok = fprintf(f, "%s\nsize %lld\nblocks %lld\ngeneration %llu\nbackend %s\nblock_size %d\n",
+                     (m->compress || m->checksum) ? MANIFEST_MAGIC_2 : MANIFEST_MAGIC, m->size, m->block_count,
+                     m->generation + 1, m->backend, m->block_size) > 0;
+    if (ok && m->compress) {
+        ok = fprintf(f, "compress lz\n") > 0;
+    }
+    if (ok && m->checksum) {
+        ok = fprintf(f, "checksum crc32c\n") > 0;
+    }
+    for (long long i = 0; ok && i < m->staged_count; i++) {
+        long long *b = m->staged + 3 * i;
+        ok = (b[2] ? fprintf(f, "staged %lld %lld %lld\n", b[0], b[1], b[2]) :
+                     fprintf(f, "staged %lld %lld\n", b[0], b[1])) > 0;
+    }
+    ok = (fflush(f) == 0) && ok && (flags == MANIFEST_NO_SYNC || block_sync_fd(fileno(f), flags) == 0);
+    ok = (fclose(f) == 0) && ok;
+    if (!ok || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+    
+    m->generation++;
+    m->dirty = 0;
+    m->unsynced = (flags == MANIFEST_NO_SYNC);
+    return 0;
+}
+
+// Load the manifest. Returns 0 on success, 1 if there is none.
+static int manifest_load(const char *filename, block_manifest_t *m) {
+    char path[MAX_PATH_LEN];
+    if (get_manifest_path(filename, "", path) != 0) {
+        return -1;
+    }
+    
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return (errno == ENOENT) ? 1 : -1;
+    }
+    
+    // Manifests written before the layout line existed describe flat stores
+    memset(m, 0, sizeof(*m));
+    strcpy(m->backend, "flat");
+    m->block_size = BLOCK_SIZE;
+    m->size = -1;
+    
+    char line[128];
+    int valid = fgets(line, sizeof(line), f) &&
+                (strncmp(line, MANIFEST_MAGIC, strlen(MANIFEST_MAGIC)) == 0 ||
+                 strncmp(line, MANIFEST_MAGIC_2, strlen(MANIFEST_MAGIC_2)) == 0);
+    while (valid && fgets(line, sizeof(line), f)) {
+        char key[32], value[32];
+        if (sscanf(line, "%31s %31s", key, value) != 2) continue;
+        
+        if (strcmp(key, "size") == 0) {
+            m->size = atoll(value);
+        } else if (strcmp(key, "blocks") == 0) {
+            m->block_count = atoll(value);
+        } else if (strcmp(key, "generation") == 0) {
+            m->generation = strtoull(value, NULL, 10);
+        } else if (strcmp(key, "backend") == 0 || strcmp(key, "layout") == 0) {
+            // Older manifests name the layout, which is now the backend name
+            snprintf(m->backend, sizeof(m->backend), "%s", value);
+        } else if (strcmp(key, "block_size") == 0) {
+            m->block_size = atoi(value);
+        } else if (strcmp(key, "compress") == 0) {
+            m->compress = (strcmp(value, "lz") == 0) ? BLOCK_COMPRESS_LZ : -1;
+        } else if (strcmp(key, "checksum") == 0) {
+            m->checksum = (strcmp(value, "crc32c") == 0) ? 1 : -1;
+        } else if (strcmp(key, "staged") == 0) {
+            // Older manifests list no checksum
+            long long entry[3] = { 0, 0, 0 };
+            long long *staged = realloc(m->staged, (m->staged_count + 1) * 3 * sizeof(long long));
+            if (!staged || sscanf(line, "staged %lld %lld %lld", &entry[0], &entry[1], &entry[2]) < 2) {
+                free(staged ? staged : m->staged);
+                m->staged = NULL;
+                valid = 0;
+                break;
+            }
+            m->staged = staged;
+            memcpy(m->staged + 3 * m->staged_count, entry, sizeof(entry));
+            m->staged_count++;
+        }
+    }
+    fclose(f);
+    
+    if (!valid || m->size < 0 || m->block_count < 0 || !block_size_valid(m->block_size) || m->compress < 0 ||
+        m->checksum < 0) {
+        free(m->staged);
+        m->staged = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// Extend the manifest to cover a whole block
+static void manifest_cover_block(block_manifest_t *m, long long block_num) {
+    long long block_end = (block_num + 1) * m->block_size;
+    if (block_end > m->size) {
+        m->size = block_end;
+        m->dirty = 1;
+    }
+    if (block_num + 1 > m->block_count) {
+        m->block_count = block_num + 1;
+        m->dirty = 1;
+    }
+}
+
+// Whether a store without a manifest holds flat block files, as stores
+// written before manifests do
+static int has_flat_blocks(const char *filename) {
+    char block_dir[MAX_PATH_LEN];
+    if (block_dir_path(filename, block_dir) != 0) {
+        return 0;
+    }
+    
+    DIR *d = opendir(block_dir);
+    if (!d) {
+        return 0;
+    }
+    
+    int found = 0;
+    struct dirent *entry;
+    while (!found && (entry = readdir(d)) != NULL) {
+        long long block_num;
+        char extra;
+        found = sscanf(entry->d_name, "block_%lld%c", &block_num, &extra) == 1;
+    }
+    closedir(d);
+    return found;
+}
+
+// Load the manifest, or start one for new and older stores. Older stores
+// without a manifest are flat with 4KB blocks; anything else gets the
+// requested backend, block size, compression and checksums.
+static int manifest_open(const char *filename, const block_backend_t *requested, int block_size,
+                         int compress, int checksum, block_manifest_t *m) {
+    int rc = manifest_load(filename, m);
+    if (rc < 0) {
+        return -1;
+    }
+    if (rc > 0) {
+        memset(m, 0, sizeof(*m));
+        const block_backend_t *backend = requested;
+        m->block_size = block_size;
+        m->compress = compress;
+        m->checksum = checksum;
+        if (has_flat_blocks(filename)) {
+            backend = &block_flat_backend;
+            m->block_size = BLOCK_SIZE;
+            m->compress = BLOCK_COMPRESS_NONE;
+            m->checksum = 0;
+        }
+        snprintf(m->backend, sizeof(m->backend), "%s", backend->name);
+        m->dirty = 1;
+    }
+    return 0;
+}
+
+// Publish or discard one block of a committed batch
+static int staged_publish(block_shared_t *s, long long block_num, long long token, int discard) {
+    if (token == STAGED_HOLE) {
+        if (discard) return 0;
+        return s->backend->punch ? s->backend->punch(s->state, block_num) : -1;
+    }
+    return s->backend->publish ? s->backend->publish(s->state, block_num, token, discard) : -1;
+}
+
+// Open the backend of a shared state and bring the manifest up to date.
+// An existing store keeps the backend, block size and compression it was
+// created with.
+static int shared_open_backend(block_shared_t *s, const block_backend_t *requested, int block_size,
+                               int compress, int checksum) {
+    block_manifest_t *m = &s->manifest;
+    if (!requested->persistent) {
+        s->backend = requested;
+        s->block_size = m->block_size = block_size;
+        return requested->open(s->filename, block_size, &s->state);
+    }
+    
+    // Nothing is created until the backend is known to hold the store as
+    // it was asked for
+    if (manifest_open(s->filename, requested, block_size, compress, checksum, m) != 0) {
+        return -1;
+    }
+    s->block_size = m->block_size;
+    s->backend = find_backend(m->backend);
+    if (!s->backend || (m->compress && !block_compress_supported(s->backend)) ||
+        ensure_block_dir(s->filename) != 0 || s->backend->open(s->filename, s->block_size, &s->state) != 0) {
+        free(m->staged);
+        return -1;
+    }
+    
+    // Compressed stores go through a wrapper that owns the backend's state
+    if (m->compress) {
+        void *state;
+        if (block_compress_open(s->backend, s->state, s->block_size, m->compress, &state) != 0) {
+            free(m->staged);
+            s->backend->close(s->state);
+            return -1;
+        }
+        s->backend = &block_compress_backend;
+        s->state = state;
+    }
+    
+    // Checksums wrap everything else, so they cover the blocks as written
+    if (m->checksum) {
+        void *state;
+        if (block_checksum_open(s->backend, s->state, s->filename, s->block_size, &state) != 0) {
+            free(m->staged);
+            s->backend->close(s->state);
+            return -1;
+        }
+        s->backend = &block_checksum_backend;
+        s->state = state;
+    }
+    
+    // Finish publishing a batch that committed before a crash. Staged
+    // blocks go first: until a backend has claimed them their space may
+    // look free, and punching the holes could give it back. Checksums come
+    // from the manifest, as the blocks on disk are what is in question.
+    int recovered = m->staged_count > 0;
+    for (int holes = 0; holes < 2; holes++) {
+        for (long long i = 0; i < m->staged_count; i++) {
+            long long *b = m->staged + 3 * i;
+            if ((b[1] == STAGED_HOLE) != holes) continue;
+            if ((m->checksum && b[2] && block_checksum_expect(s->state, b[0], b[1], (uint32_t)b[2]) != 0) ||
+                staged_publish(s, b[0], b[1], 0) != 0) {
+                free(m->staged);
+                s->backend->close(s->state);
+                return -1;
+            }
+        }
+    }
+    free(m->staged);
+    m->staged = NULL;
+    m->staged_count = 0;
+    
+    // The saved manifest may lag behind blocks stored since it was written
+    long long size = s->backend->size(s->state, m->size);
+    if (size > m->size) {
+        m->size = size;
+        m->block_count = (size + s->block_size - 1) / s->block_size;
+        m->dirty = 1;
+    }
+    
+    // Save right away: the backend must be on disk before any block is, and
+    // a recovered batch must not be published again over later writes. Its
+    // blocks and checksums are synced first, so the manifest never forgets
+    // a batch that is not all on disk.
+    if (recovered && s->backend->sync(s->state, BLOCK_SYNC_NORMAL) < 0) {
+        s->backend->close(s->state);
+        return -1;
+    }
+    if ((m->generation == 0 || recovered) && manifest_save(s->filename, m, MANIFEST_NO_SYNC) != 0) {
+        s->backend->close(s->state);
+        return -1;
+    }
+    return 0;
+}
+
+// Find or create the shared state for filename. Options only apply when
+// the state is created. Called with the registry lock held.
+static block_shared_t *shared_acquire(const char *filename, const block_backend_t *requested,
+                                      int block_size, int compress, int checksum,
+                                      long long cache_bytes) {
+    for (block_shared_t *s = shared_list; s; s = s->next) {
+        if (strcmp(s->filename, filename) == 0) {
+            s->refs++;
+            return s;
+        }
+    }
+    
+    block_shared_t *s = calloc(1, sizeof(block_shared_t));
+    if (!s) {
+        return NULL;
+    }
+    s->filename = strdup(filename);
+    if (!s->filename || shared_open_backend(s, requested, block_size, compress, checksum) != 0) {
+        free(s->filename);
+        free(s);
+        return NULL;
+    }
+    
+    // Other block sizes cannot use the shared cache, so get one of their own
+    if (cache_bytes == 0 && s->block_size != BLOCK_SIZE) {
+        cache_bytes = read_cache_capacity;
+    }
+    if (cache_bytes > 0) {
+        s->own_cache = block_cache_create(cache_bytes, s->block_size);
+    }
+    s->scratch = malloc(s->block_size);
+    if (!s->scratch || (cache_bytes > 0 && !s->own_cache)) {
+        block_cache_destroy(s->own_cache);
+        s->backend->close(s->state);
+        free(s->scratch);
+        free(s->filename);
+        free(s);
+        return NULL;
+    }
+    block_rwlock_init(&s->lock);
+    block_mutex_init(&s->backend_lock);
+    block_mutex_init(&s->sync_lock);
+    block_cond_init(&s->sync_cond);
+    s->file_id = next_file_id++;
+    s->refs = 1;
+    s->next = shared_list;
+    shared_list = s;
+    return s;
+}
+
+// Remove a directory and everything below it
+static int remove_tree(const char *path) {
+    DIR *d = opendir(path);
+    if (!d) {
+        return (errno == ENOENT) ? 0 : -1;
+    }
+    
+    int result = 0;
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        char child[MAX_PATH_LEN];
+        struct stat st;
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+            snprintf(child, sizeof(child), "%s/%s", path, entry->d_name) >= (int)sizeof(child)) {
+            continue;
+        }
+        if (lstat(child, &st) == 0 && S_ISDIR(st.st_mode)) {
+            if (remove_tree(child) != 0) result = -1;
+        } else if (unlink(child) != 0) {
+            result = -1;
+        }
+    }
+    closedir(d);
+    
+    return (rmdir(path) != 0) ? -1 : result;
+}
+
+// Called with the registry lock held, so nobody can find the state while
+// the last handle tears it down
+static void shared_release(block_shared_t *s) {
+    if (!s || --s->refs > 0) return;
+    
+    // Best effort: the store may already have been deleted
+    if (s->backend->persistent && s->manifest.dirty && !s->temp) {
+        manifest_save(s->filename, &s->manifest, MANIFEST_NO_SYNC);
+    }
+    if (s->own_cache) {
+        block_cache_destroy(s->own_cache);
+    } else if (read_cache) {
+        block_cache_invalidate(read_cache, s->file_id, 0);
+    }
+    s->backend->close(s->state);
+    if (s->temp_dir) {
+        remove_tree(s->temp_dir);
+        free(s->temp_dir);
+    }
+    
+    for (block_shared_t **pp = &shared_list; *pp; pp = &(*pp)->next) {
+        if (*pp == s) {
+            *pp = s->next;
+            break;
+        }
+    }
+    block_rwlock_destroy(&s->lock);
+    block_mutex_destroy(&s->backend_lock);
+    block_mutex_destroy(&s->sync_lock);
+    block_cond_destroy(&s->sync_cond);
+    free(s->scratch);
+    free(s->filename);
+    free(s);
+}
+
+int block_pread_full(int fd, char *buf, int size, long long offset) {
+    int done = 0;
+    while (done < size) {
+        ssize_t n = pread(fd, buf + done, size - done, offset + done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) break;
+        done += n;
+    }
+    return done;
+}
+
+int block_pwrite_full(int fd, const char *buf, int size, long long offset) {
+    int done = 0;
+    while (done < size) {
+        ssize_t n = pwrite(fd, buf + done, size - done, offset + done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+// The read cache a file uses, or NULL. The shared one holds default-sized
+// blocks only.
+static block_cache_t *file_cache(block_shared_t *s) {
+    if (s->own_cache) {
+        return s->own_cache;
+    }
+    return (s->block_size == BLOCK_SIZE && read_cache_capacity > 0) ? read_cache : NULL;
+}
+
+// Create the shared read cache on first use. Called with the registry lock
+// held; once created it lives as long as the process.
+static void read_cache_init(void) {
+    if (!read_cache && read_cache_capacity > 0) {
+        read_cache = block_cache_create(read_cache_capacity, BLOCK_SIZE);
+    }
+}
+
+static dirty_block_t **dirty_slot(block_shared_t *s, long long block_num) {
+    dirty_block_t **pp = &s->dirty[(unsigned long long)block_num % DIRTY_HASH_SIZE];
+    while (*pp && (*pp)->block_num != block_num) {
+        pp = &(*pp)->next;
+    }
+    return pp;
+}
+
+static dirty_block_t *dirty_find(block_shared_t *s, long long block_num) {
+    return *dirty_slot(s, block_num);
+}
+
+// Get a whole clean block through the read cache
+static int load_block(block_shared_t *s, long long block_num, char *data) {
+    block_cache_t *cache = file_cache(s);
+    if (cache && block_cache_read(cache, s->file_id, block_num, 0, s->block_size, data)) {
+        return 0;
+    }
+    if (s->backend->read(s->state, block_num, 0, s->block_size, data) != 0) {
+        return -1;
+    }
+    if (cache) {
+        block_cache_put(cache, s->file_id, block_num, data);
+    }
+    return 0;
+}
+
+static int compare_dirty(const void *a, const void *b) {
+    long long x = (*(dirty_block_t * const *)a)->block_num;
+    long long y = (*(dirty_block_t * const *)b)->block_num;
+    return (x > y) - (x < y);
+}
+
+// List the dirty blocks in block order
+static dirty_block_t **dirty_list(block_shared_t *s) {
+    dirty_block_t **list = malloc((s->dirty_count ? s->dirty_count : 1) * sizeof(dirty_block_t *));
+    if (!list) {
+        return NULL;
+    }
+    long long n = 0;
+    for (int i = 0; i < DIRTY_HASH_SIZE; i++) {
+        for (dirty_block_t *d = s->dirty[i]; d; d = d->next) {
+            list[n++] = d;
+        }
+    }
+    qsort(list, n, sizeof(dirty_block_t *), compare_dirty);
+    return list;
+}
+
+// A dirty block has reached the backend; refresh any cached copy and
+// forget it
+static void dirty_clean(block_shared_t *s, dirty_block_t *d) {
+    if (file_cache(s)) {
+        block_cache_put(file_cache(s), s->file_id, d->block_num, d->data);
+    }
+    dirty_block_t **pp = dirty_slot(s, d->block_num);
+    *pp = d->next;
+    free(d);
+    s->dirty_count--;
+    s->wb_stats.blocks_flushed++;
+}
+
+// Store an all-zero dirty block as a hole. Returns 0 once it is one, 1 if
+// the block has data or the backend keeps no holes, or -1 on error.
+static int dirty_punch(block_shared_t *s, dirty_block_t *d) {
+    if (!s->backend->punch || !block_is_zero(d->data, s->block_size)) {
+        return 1;
+    }
+    if (s->backend->punch(s->state, d->block_num) != 0) {
+        return -1;
+    }
+    s->wb_stats.blocks_elided++;
+    dirty_clean(s, d);
+    return 0;
+}
+
+// Hand a list of dirty blocks to the backend as one batch and clean them
+static int dirty_write_many(block_shared_t *s, dirty_block_t **list, long long n) {
+    long long *block_nums = malloc(n * sizeof(long long));
+    const char **data = malloc(n * sizeof(char *));
+    int rc = (block_nums && data && n <= INT_MAX) ? 0 : -1;
+    for (long long i = 0; rc == 0 && i < n; i++) {
+        block_nums[i] = list[i]->block_num;
+        data[i] = list[i]->data;
+    }
+    if (rc == 0) {
+        rc = s->backend->write_many(s->state, (int)n, block_nums, data);
+    }
+    if (rc == 0) {
+        for (long long i = 0; i < n; i++) {
+            dirty_clean(s, list[i]);
+        }
+    }
+    free(block_nums);
+    free(data);
+    return rc;
+}
+
+// Write every dirty block out in block order. Blocks that fail to write
+// stay dirty.
+static int dirty_flush(block_shared_t *s) {
+    if (s->dirty_count == 0) {
+        return 0;
+    }
+    
+    long long n = s->dirty_count;
+    dirty_block_t **list = dirty_list(s);
+    if (!list) {
+        return -1;
+    }
+    
+    // All-zero blocks become holes. Of the rest, a batch that fails is
+    // written again a block at a time, so the blocks that can be written are.
+    int result = 0;
+    long long kept = 0;
+    for (long long i = 0; i < n; i++) {
+        int rc = dirty_punch(s, list[i]);
+        if (rc < 0) {
+            result = -1;
+        } else if (rc > 0) {
+            list[kept++] = list[i];
+        }
+    }
+    n = kept;
+    long long done = 0;
+    if (s->backend->write_many && n > 1) {
+        done = (dirty_write_many(s, list, n) == 0) ? n : 0;
+    }
+    for (long long i = done; i < n; i++) {
+        if (s->backend->write(s->state, list[i]->block_num, list[i]->data) != 0) {
+            result = -1;
+            continue;
+        }
+        dirty_clean(s, list[i]);
+    }
+    s->wb_stats.flushes++;
+    
+    if (fsync_on_flush && s->backend->sync(s->state, BLOCK_SYNC_NORMAL) < 0) {
+        result = -1;
+    }
+    
+    free(list);
+    return result;
+}
+
+// Forget dirty blocks at or beyond first_block
+static void dirty_drop(block_shared_t *s, long long first_block) {
+    for (int i = 0; i < DIRTY_HASH_SIZE; i++) {
+        dirty_block_t **pp = &s->dirty[i];
+        while (*pp) {
+            if ((*pp)->block_num >= first_block) {
+                dirty_block_t *d = *pp;
+                *pp = d->next;
+                free(d);
+                s->dirty_count--;
+            } else {
+                pp = &(*pp)->next;
+            }
+        }
+    }
+}
+
+// Load the missing blocks of a request with one read_many
+static void readahead_run_many(readahead_job_t *job) {
+    block_shared_t *s = job->s;
+    char *data = malloc((size_t)job->count * s->block_size);
+    long long *block_nums = malloc(job->count * sizeof(long long));
+    char **bufs = malloc(job->count * sizeof(char *));
+    if (!data || !block_nums || !bufs) {
+        free(data);
+        free(block_nums);
+        free(bufs);
+        return;
+    }
+    
+    block_rwlock_rdlock(&s->lock);
+    block_cache_t *cache = file_cache(s);
+    if (cache) {
+        block_mutex_lock(&s->backend_lock);
+        int n = 0;
+        for (int i = 0; i < job->count; i++) {
+            long long block_num = job->first + i * job->stride;
+            if (block_num * s->block_size >= s->manifest.size) break;
+            if (dirty_find(s, block_num) || block_cache_peek(cache, s->file_id, block_num, 0, 0, NULL)) {
+                continue;
+            }
+            block_nums[n] = block_num;
+            bufs[n] = data + (size_t)n * s->block_size;
+            n++;
+        }
+        if (n > 0 && s->backend->read_many(s->state, n, block_nums, bufs) == 0) {
+            for (int i = 0; i < n; i++) {
+                block_cache_put(cache, s->file_id, block_nums[i], bufs[i]);
+            }
+        }
+        block_mutex_unlock(&s->backend_lock);
+    }
+    block_rwlock_unlock(&s->lock);
+    
+    free(data);
+    free(block_nums);
+    free(bufs);
+}
+
+// Load the blocks of a request that are neither cached nor dirty. The lock
+// is taken per block so writers are not held up behind a whole window,
+// unless the backend reads many blocks in one go, when it is taken for as
+// long as that batch takes.
+static void readahead_run(readahead_job_t *job) {
+    block_shared_t *s = job->s;
+    if (s->backend->read_many) {
+        readahead_run_many(job);
+        return;
+    }
+    char *data = malloc(s->block_size);
+    if (!data) return;
+    
+    for (int i = 0; i < job->count; i++) {
+        long long block_num = job->first + i * job->stride;
+        block_rwlock_rdlock(&s->lock);
+        block_cache_t *cache = file_cache(s);
+        int done = !cache;
+        if (cache && block_num * s->block_size < s->manifest.size && !dirty_find(s, block_num)) {
+            // Checked and cached under backend_lock, so a reader that loads
+            // the block meanwhile, or waits to, never reads it twice
+            block_mutex_lock(&s->backend_lock);
+            if (!block_cache_peek(cache, s->file_id, block_num, 0, 0, NULL) &&
+                s->backend->read(s->state, block_num, 0, s->block_size, data) == 0) {
+                block_cache_put(cache, s->file_id, block_num, data);
+            }
+            block_mutex_unlock(&s->backend_lock);
+        }
+        block_rwlock_unlock(&s->lock);
+        if (done) break;
+    }
+    free(data);
+}
+
+// Take the oldest queued request of a file no other thread is reading
+// ahead. Called with ra_lock held; returns 0 if there is none.
+static int readahead_take(readahead_job_t *job) {
+    for (int i = 0; i < ra_count; i++) {
+        int slot = (ra_head + i) % READAHEAD_QUEUE;
+        if (ra_queue[slot].s->ra_busy) continue;
+        
+        *job = ra_queue[slot];
+        for (int j = i; j > 0; j--) {
+            ra_queue[(ra_head + j) % READAHEAD_QUEUE] = ra_queue[(ra_head + j - 1) % READAHEAD_QUEUE];
+        }
+        ra_head = (ra_head + 1) % READAHEAD_QUEUE;
+        ra_count--;
+        return 1;
+    }
+    return 0;
+}
+
+#if BLOCK_HAVE_THREADS
+static void *readahead_worker(void *arg) {
+    block_mutex_lock(&ra_lock);
+    for (;;) {
+        readahead_job_t job;
+        while (!readahead_take(&job)) {
+            block_cond_wait(&ra_wake, &ra_lock);
+        }
+        job.s->ra_busy = 1;
+        block_mutex_unlock(&ra_lock);
+        
+        readahead_run(&job);
+        
+        block_mutex_lock(&ra_lock);
+        job.s->ra_busy = 0;
+        if (--job.s->ra_pending == 0) {
+            block_cond_broadcast(&ra_idle);
+        }
+        if (ra_count > 0) {
+            // The file's next request is runnable now
+            block_cond_signal(&ra_wake);
+        }
+    }
+    return NULL;
+}
+#endif
+
+// Queue count blocks from first at stride. Best effort: with no threads or
+// a full queue the request is dropped.
+static void readahead_submit(block_shared_t *s, long long first, long long stride, int count) {
+#if BLOCK_HAVE_THREADS
+    block_mutex_lock(&ra_lock);
+    while (ra_threads < READAHEAD_THREADS) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, readahead_worker, NULL) != 0) break;
+        pthread_detach(thread);
+        ra_threads++;
+    }
+    if (ra_threads == 0 || ra_count == READAHEAD_QUEUE) {
+        block_mutex_unlock(&ra_lock);
+        s->ra_dropped++;
+        return;
+    }
+    ra_queue[(ra_head + ra_count) % READAHEAD_QUEUE] = (readahead_job_t){ s, first, stride, count };
+    ra_count++;
+    s->ra_pending++;
+    block_cond_signal(&ra_wake);
+    block_mutex_unlock(&ra_lock);
+    s->ra_issued += count;
+#else
+    s->ra_dropped++;
+#endif
+}
+
+// Drop a file's queued requests and wait out the running ones, before the
+// file goes away
+static void readahead_cancel(block_shared_t *s) {
+    block_mutex_lock(&ra_lock);
+    int kept = 0;
+    for (int i = 0; i < ra_count; i++) {
+        readahead_job_t job = ra_queue[(ra_head + i) % READAHEAD_QUEUE];
+        if (job.s == s) {
+            s->ra_pending--;
+        } else {
+            ra_queue[(ra_head + kept++) % READAHEAD_QUEUE] = job;
+        }
+    }
+    ra_count = kept;
+    while (s->ra_pending > 0) {
+        block_cond_wait(&ra_idle, &ra_lock);
+    }
+    block_mutex_unlock(&ra_lock);
+}
+
+// Follow the blocks a handle reads, hit saying whether this one was cached.
+// Two steps in a row at the same stride make a stream; the blocks ahead of
+// it are topped up whenever fewer than half a window remain. Called with
+// the file's lock held shared.
+static void readahead_note(block_shared_t *s, block_readahead_t *ra, long long block_num, int hit) {
+    int max = readahead_max;
+    long long stride = block_num - ra->last_block;
+    if (!BLOCK_HAVE_THREADS || max <= 0 || (stride == 0 && ra->run > 0)) {
+        return;
+    }
+    ra->last_block = block_num;
+    if (stride != ra->stride || stride == 0 || stride > READAHEAD_MAX_STRIDE ||
+        stride < -READAHEAD_MAX_STRIDE) {
+        ra->stride = stride;
+        ra->run = 1;
+        ra->window = READAHEAD_MIN;
+        ra->next = block_num + stride;
+        return;
+    }
+    
+    if (++ra->run == 2) {
+        s->ra_streams++;
+    }
+    if ((stride > 0) ? block_num < ra->next : block_num > ra->next) {
+        // Queued earlier: loaded in time, or the reader got there first
+        if (hit) {
+            s->ra_hits++;
+        } else {
+            s->ra_misses++;
+        }
+    }
+    
+    // Blocks already queued past this one
+    long long ahead = (ra->next - block_num) / stride - 1;
+    if (ahead > ra->window / 2) {
+        return;
+    }
+    // Each refill of a stream that keeps going reaches twice as far
+    if (ra->run > 2) {
+        ra->window *= 2;
+    }
+    if (ra->window > max) {
+        ra->window = max;
+    }
+    if (ahead < 0) {
+        // The reader overtook the read-ahead
+        ahead = 0;
+        ra->next = block_num + stride;
+    }
+    
+    // Stay within the file
+    long long first = ra->next;
+    long long count = ra->window - ahead;
+    long long block_count = (s->manifest.size + s->block_size - 1) / s->block_size;
+    long long limit = (stride > 0) ? (block_count - first + stride - 1) / stride :
+                      (first < 0) ? 0 : first / -stride + 1;
+    if (count > limit) {
+        count = limit;
+    }
+    if (count > 0) {
+        readahead_submit(s, first, stride, (int)count);
+        ra->next = first + count * stride;
+    }
+}
+
+int block_open(const char *filename, block_file_t **bf) {
+    return block_open_with(filename, NULL, bf);
+}
+
+int block_open_with(const char *filename, const char *backend, block_file_t **bf) {
+    block_open_options_t options = { backend, 0, 0, 0, 0 };
+    return block_open_ex(filename, &options, bf);
+}
+
+int block_open_ex(const char *filename, const block_open_options_t *options, block_file_t **bf) {
+    int block_size = options->block_size ? options->block_size : BLOCK_SIZE;
+    if (!block_size_valid(block_size) || options->cache_bytes < 0 ||
+        (options->compress != BLOCK_COMPRESS_NONE && options->compress != BLOCK_COMPRESS_LZ)) {
+        return -1;
+    }
+    
+    *bf = calloc(1, sizeof(block_file_t));
+    if (!*bf) {
+        return -1;
+    }
+    (*bf)->filename = strdup(filename);
+    
+    block_mutex_lock(&registry_lock);
+    const block_backend_t *requested = options->backend ? find_backend(options->backend) : default_backend;
+    (*bf)->shared = ((*bf)->filename && requested) ?
+        shared_acquire(filename, requested, block_size, options->compress, options->checksum != 0,
+                       options->cache_bytes) : NULL;
+    read_cache_init();
+    block_mutex_unlock(&registry_lock);
+    
+    if (!(*bf)->shared) {
+        free((*bf)->filename);
+        free(*bf);
+        return -1;
+    }
+    return 0;
+}
+
+// Directory that temporary files spill to
+static const char *temp_parent_dir(void) {
+    const char *dir = getenv("TMPDIR");
+#ifdef __wasi__
+    return (dir && *dir) ? dir : ".";
+#else
+    return (dir && *dir) ? dir : "/tmp";
+#endif
+}
+
+// Move a temporary file that outgrew memory into a packed store of its
+// own, which takes a few files however many blocks it holds
+static int temp_spill_to_disk(block_shared_t *s) {
+    char dir[MAX_PATH_LEN - 16];
+    char filename[MAX_PATH_LEN];
+    if (snprintf(dir, sizeof(dir), "%s/wasql-temp-XXXXXX", temp_parent_dir()) >= (int)sizeof(dir) ||
+        !mkdtemp(dir)) {
+        return -1;
+    }
+    snprintf(filename, sizeof(filename), "%s/temp", dir);
+    
+    const block_backend_t *backend = &block_packed_backend;
+    void *state = NULL;
+    char *temp_dir = strdup(dir);
+    char *name = strdup(filename);
+    int ok = temp_dir && name && ensure_block_dir(filename) == 0 &&
+             backend->open(filename, BLOCK_SIZE, &state) == 0;
+    
+    // Copy the stored blocks; holes stay holes
+    char block[BLOCK_SIZE];
+    for (long long i = 0; ok && i < s->manifest.block_count; i++) {
+        ok = s->backend->read(s->state, i, 0, BLOCK_SIZE, block) == 0 &&
+             (block_is_zero(block, BLOCK_SIZE) || backend->write(state, i, block) == 0);
+    }
+    if (!ok) {
+        if (state) backend->close(state);
+        remove_tree(dir);
+        free(temp_dir);
+        free(name);
         return -1;
     }
     
-    (*bf)->filename = strdup(filename);
-    if (!(*bf)->filename) {
+    s->backend->close(s->state);
+    s->backend = backend;
+    s->state = state;
+    s->temp_dir = temp_dir;
+    free(s->filename);
+    s->filename = name;
+    snprintf(s->manifest.backend, sizeof(s->manifest.backend), "%s", backend->name);
+    return 0;
+}
+
+int block_open_temp(block_file_t **bf) {
+    *bf = calloc(1, sizeof(block_file_t));
+    block_shared_t *s = calloc(1, sizeof(block_shared_t));
+    if (!*bf || !s) {
         free(*bf);
+        free(s);
         return -1;
     }
     
-    if (ensure_block_dir(filename) != 0) {
+    // Private to this handle, so it stays out of the shared list
+    s->filename = strdup("temp");
+    s->scratch = malloc(BLOCK_SIZE);
+    (*bf)->filename = strdup("temp");
+    if (!s->filename || !s->scratch || !(*bf)->filename ||
+        shared_open_backend(s, &block_memory_backend, BLOCK_SIZE, BLOCK_COMPRESS_NONE, 0) != 0) {
         free((*bf)->filename);
+        free(s->scratch);
+        free(s->filename);
+        free(s);
         free(*bf);
         return -1;
     }
+    block_rwlock_init(&s->lock);
+    block_mutex_init(&s->backend_lock);
+    block_mutex_init(&s->sync_lock);
+    block_cond_init(&s->sync_cond);
+    s->temp = 1;
+    s->refs = 1;
+    (*bf)->shared = s;
     
+    block_mutex_lock(&registry_lock);
+    s->file_id = next_file_id++;
+    read_cache_init();
+    block_mutex_unlock(&registry_lock);
     return 0;
 }
 
+static int batch_rollback(block_shared_t *s);
+
 int block_close(block_file_t *bf) {
     if (!bf) return 0;
     
+    // The last handle writes back what is still dirty, except an
+    // unfinished batch, which never happened, and the blocks of a
+    // temporary file, which is about to vanish. The registry lock keeps
+    // the file from being opened again until that is done.
+    block_shared_t *s = bf->shared;
+    int result = 0;
+    block_mutex_lock(&registry_lock);
+    if (s->refs == 1) {
+        readahead_cancel(s);
+        block_rwlock_wrlock(&s->lock);
+        if (s->batch_active) {
+            batch_rollback(s);
+        }
+        if (s->temp) {
+            dirty_drop(s, 0);
+        }
+        if (dirty_flush(s) != 0) {
+            result = -1;
+            dirty_drop(s, 0);
+        }
+        block_rwlock_unlock(&s->lock);
+    }
+    shared_release(s);
+    block_mutex_unlock(&registry_lock);
+    
     free(bf->filename);
     free(bf);
-    return 0;
+    return result;
 }
 
-int block_read(block_file_t *bf, void *buffer, int size, long long offset) {
-    if (!bf || !buffer || size < 0 || offset < 0) {
-        return -1;
-    }
-    
-    char *buf = (char *)buffer;
+// Read with the lock held shared. Other readers may be here too, so the
+// backend and the scratch block are only used under backend_lock. Reads
+// through the cache feed the handle's read-ahead.
+static int shared_read(block_shared_t *s, block_readahead_t *ra, char *buf, int size, long long offset) {
     int total_read = 0;
     
+    block_cache_t *cache = file_cache(s);
+    int bs = s->block_size;
+    
     while (size > 0) {
-        int block_num = offset / BLOCK_SIZE;
-        int block_offset = offset % BLOCK_SIZE;
-        int to_read = (size < BLOCK_SIZE - block_offset) ? size : BLOCK_SIZE - block_offset;
-        
-        char block_path[MAX_PATH_LEN];
-        if (get_block_path(bf->filename, block_num, block_path) != 0) {
-            return -1;
-        }
+        long long block_num = offset / bs;
+        int block_offset = offset % bs;
+        int to_read = (size < bs - block_offset) ? size : bs - block_offset;
         
-        FILE *block_file = fopen(block_path, "rb");
-        if (!block_file) {
-            // Block doesn't exist, fill with zeros
-            memset(buf, 0, to_read);
+        dirty_block_t *d = dirty_find(s, block_num);
+        if (d) {
+            memcpy(buf, d->data + block_offset, to_read);
+            if (cache) {
+                readahead_note(s, ra, block_num, 1);
+            }
+        } else if (cache) {
+            int hit = block_cache_read(cache, s->file_id, block_num, block_offset, to_read, buf);
+            if (!hit) {
+                // Miss: fetch the whole block so later reads of it hit,
+                // unless read-ahead loaded it while we waited for the backend
+                block_mutex_lock(&s->backend_lock);
+                int rc = 0;
+                hit = block_cache_peek(cache, s->file_id, block_num, block_offset, to_read, buf);
+                if (!hit) {
+                    rc = s->backend->read(s->state, block_num, 0, bs, s->scratch);
+                    if (rc == 0) {
+                        block_cache_put(cache, s->file_id, block_num, s->scratch);
+                        memcpy(buf, s->scratch + block_offset, to_read);
+                    }
+                }
+                block_mutex_unlock(&s->backend_lock);
+                if (rc != 0) {
+                    return -1;
+                }
+            }
+            readahead_note(s, ra, block_num, hit);
         } else {
-            if (fseek(block_file, block_offset, SEEK_SET) != 0) {
-                fclose(block_file);
+            block_mutex_lock(&s->backend_lock);
+            int rc = s->backend->read(s->state, block_num, block_offset, to_read, buf);
+            block_mutex_unlock(&s->backend_lock);
+            if (rc != 0) {
                 return -1;
             }
-            
-            int bytes_read = fread(buf, 1, to_read, block_file);
-            if (bytes_read < to_read) {
-                // Partial read, fill remainder with zeros
-                memset(buf + bytes_read, 0, to_read - bytes_read);
-            }
-            fclose(block_file);
         }
         
         buf += to_read;
@@ -110,65 +1277,101 @@ int block_read(block_file_t *bf, void *buffer, int size, long long offset) {
     return total_read;
 }
 
-int block_write(block_file_t *bf, const void *buffer, int size, long long offset) {
+int block_read(block_file_t *bf, void *buffer, int size, long long offset) {
     if (!bf || !buffer || size < 0 || offset < 0) {
         return -1;
     }
     
-    const char *buf = (const char *)buffer;
+    block_shared_t *s = bf->shared;
+    block_rwlock_rdlock(&s->lock);
+    int result = shared_read(s, &bf->readahead, (char *)buffer, size, offset);
+    block_rwlock_unlock(&s->lock);
+    return result;
+}
+
+// Only clean blocks of a committed persistent file are mapped: a dirty
+// block's data is not in the backend yet, and a batch or a temporary file
+// may still move its blocks. SQLite stops using a mapping before it writes
+// the page, as it does with os_unix.c's.
+int block_fetch(block_file_t *bf, long long offset, int size, const void **ptr) {
+    if (!bf || !ptr || size <= 0 || offset < 0) {
+        return -1;
+    }
+    *ptr = NULL;
+    
+    block_shared_t *s = bf->shared;
+    int bs = s->block_size;
+    long long block_num = offset / bs;
+    int block_offset = offset % bs;
+    if (!s->backend->map || s->temp || block_offset + size > bs) {
+        return 0;
+    }
+    
+    block_rwlock_rdlock(&s->lock);
+    int rc = 0;
+    if (!s->batch_active && offset + size <= s->manifest.size && !dirty_find(s, block_num)) {
+        const char *data;
+        block_mutex_lock(&s->backend_lock);
+        rc = s->backend->map(s->state, block_num, &data);
+        block_mutex_unlock(&s->backend_lock);
+        if (rc == 0) {
+            *ptr = data + block_offset;
+        }
+    }
+    block_rwlock_unlock(&s->lock);
+    return (rc < 0) ? -1 : 0;
+}
+
+int block_unfetch(block_file_t *bf, long long offset, const void *ptr) {
+    if (!bf || !ptr || offset < 0) {
+        return -1;
+    }
+    
+    block_shared_t *s = bf->shared;
+    long long block_num = offset / s->block_size;
+    const char *data = (const char *)ptr - offset % s->block_size;
+    block_rwlock_rdlock(&s->lock);
+    block_mutex_lock(&s->backend_lock);
+    s->backend->unmap(s->state, block_num, data);
+    block_mutex_unlock(&s->backend_lock);
+    block_rwlock_unlock(&s->lock);
+    return 0;
+}
+
+// Write with the lock held exclusively
+static int shared_write(block_shared_t *s, const char *buf, int size, long long offset) {
     int total_written = 0;
+    int bs = s->block_size;
     
     while (size > 0) {
-        int block_num = offset / BLOCK_SIZE;
-        int block_offset = offset % BLOCK_SIZE;
-        int to_write = (size < BLOCK_SIZE - block_offset) ? size : BLOCK_SIZE - block_offset;
+        long long block_num = offset / bs;
+        int block_offset = offset % bs;
+        int to_write = (size < bs - block_offset) ? size : bs - block_offset;
         
-        char block_path[MAX_PATH_LEN];
-        if (get_block_path(bf->filename, block_num, block_path) != 0) {
-            return -1;
-        }
-        
-        
-        // If we're doing a partial block write, we need to read-modify-write
-        if (block_offset != 0 || to_write != BLOCK_SIZE) {
-            char block_data[BLOCK_SIZE];
-            memset(block_data, 0, BLOCK_SIZE);
-            
-            // Try to read existing block data
-            FILE *existing = fopen(block_path, "rb");
-            if (existing) {
-                fread(block_data, 1, BLOCK_SIZE, existing);
-                fclose(existing);
-            }
-            
-            // Modify the relevant portion
-            memcpy(block_data + block_offset, buf, to_write);
-            
-            // Write the entire block
-            FILE *block_file = fopen(block_path, "wb");
-            if (!block_file) {
-                return -1;
-            }
-            
-            if (fwrite(block_data, 1, BLOCK_SIZE, block_file) != BLOCK_SIZE) {
-                fclose(block_file);
-                return -1;
-            }
-            fclose(block_file);
+        // Writes land in the dirty block and reach the backend at the next flush
+        dirty_block_t *d = dirty_find(s, block_num);
+        if (d) {
+            s->wb_stats.writes_absorbed++;
         } else {
-            // Full block write
-            FILE *block_file = fopen(block_path, "wb");
-            if (!block_file) {
+            d = malloc(sizeof(dirty_block_t) + bs);
+            if (!d) {
                 return -1;
             }
+            d->block_num = block_num;
             
-            if (fwrite(buf, 1, to_write, block_file) != to_write) {
-                fclose(block_file);
+            // A partial write needs the rest of the block as it is stored
+            if (to_write != bs && load_block(s, block_num, d->data) != 0) {
+                free(d);
                 return -1;
             }
-            fclose(block_file);
+            
+            dirty_block_t **pp = dirty_slot(s, block_num);
+            d->next = NULL;
+            *pp = d;
+            s->dirty_count++;
         }
-        
+        memcpy(d->data + block_offset, buf, to_write);
+        manifest_cover_block(&s->manifest, block_num);
         
         buf += to_write;
         offset += to_write;
@@ -176,93 +1379,580 @@ int block_write(block_file_t *bf, const void *buffer, int size, long long offset
         total_written += to_write;
     }
     
+    // A temporary file past the spill threshold moves to disk
+    if (s->temp && !s->temp_dir && temp_spill > 0 && s->manifest.size > temp_spill &&
+        temp_spill_to_disk(s) != 0) {
+        return -1;
+    }
+    
+    // Memory pressure: write everything back once the dirty set is too big.
+    // A batch stays in memory until it commits.
+    if (!s->batch_active && s->dirty_count * bs > dirty_limit && dirty_flush(s) != 0) {
+        return -1;
+    }
+    
     return total_written;
 }
 
+int block_write(block_file_t *bf, const void *buffer, int size, long long offset) {
+    if (!bf || !buffer || size < 0 || offset < 0) {
+        return -1;
+    }
+    
+    block_shared_t *s = bf->shared;
+    block_rwlock_wrlock(&s->lock);
+    int result = shared_write(s, (const char *)buffer, size, offset);
+    block_rwlock_unlock(&s->lock);
+    return result;
+}
+
+static int shared_truncate(block_shared_t *s, long long size) {
+    block_manifest_t *m = &s->manifest;
+    long long last_block = (size + s->block_size - 1) / s->block_size;
+    int tail = size % s->block_size;
+    
+    dirty_drop(s, last_block);
+    if (file_cache(s)) {
+        // Includes a partial last block, whose tail is about to be cut
+        block_cache_invalidate(file_cache(s), s->file_id, size / s->block_size);
+    }
+    
+    if (s->backend->truncate(s->state, last_block, tail) != 0) {
+        return -1;
+    }
+    
+    // Handle partial last block
+    if (tail != 0) {
+        dirty_block_t *d = dirty_find(s, last_block - 1);
+        if (d) {
+            memset(d->data + tail, 0, s->block_size - tail);
+        }
+    }
+    
+    // Persist right away so a reopen never resurrects removed blocks
+    m->size = size;
+    m->block_count = last_block;
+    m->dirty = 1;
+    if (s->backend->persistent && manifest_save(s->filename, m, MANIFEST_NO_SYNC) != 0) {
+        return -1;
+    }
+    
+    return 0;
+}
+
 int block_truncate(block_file_t *bf, long long size) {
     if (!bf || size < 0) {
         return -1;
     }
     
-    int last_block = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    block_shared_t *s = bf->shared;
+    block_rwlock_wrlock(&s->lock);
+    int result = shared_truncate(s, size);
+    block_rwlock_unlock(&s->lock);
+    return result;
+}
+
+int block_get_block_size(block_file_t *bf) {
+    return bf ? bf->shared->block_size : -1;
+}
+
+long long block_file_size(block_file_t *bf) {
+    if (!bf) {
+        return -1;
+    }
     
-    // Remove blocks beyond the truncation point
-    char block_dir[MAX_PATH_LEN];
-    get_block_dir(bf->filename, block_dir);
+    block_rwlock_rdlock(&bf->shared->lock);
+    long long size = bf->shared->manifest.size;
+    block_rwlock_unlock(&bf->shared->lock);
+    return size;
+}
+
+static int shared_sync(block_shared_t *s) {
+    if (dirty_flush(s) != 0) {
+        return -1;
+    }
+    if (s->backend->persistent && s->manifest.dirty &&
+        manifest_save(s->filename, &s->manifest, MANIFEST_NO_SYNC) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Write back, then sync what the backend wrote since the last sync and the
+// manifest. The block directory, holding the manifest and the top of the
+// backend's files, is synced once for both if either changed it.
+static int shared_sync_durable(block_shared_t *s, int flags) {
+    if (dirty_flush(s) != 0) {
+        return -1;
+    }
+    int dir_changed = s->backend->sync(s->state, flags);
+    if (dir_changed < 0) {
+        return -1;
+    }
+    if (!s->backend->persistent || s->temp) {
+        return 0;
+    }
     
-    // Simple approach: try to remove blocks up to a reasonable limit
-    for (int block_num = last_block; block_num < 10000; block_num++) {
-        char block_path[MAX_PATH_LEN];
-        if (get_block_path(bf->filename, block_num, block_path) != 0) {
+    block_manifest_t *m = &s->manifest;
+    int data_only = (flags & BLOCK_SYNC_DATAONLY) != 0;
+    if (m->dirty || (m->unsynced && !data_only)) {
+        if (manifest_save(s->filename, m, data_only ? MANIFEST_NO_SYNC : flags) != 0) {
             return -1;
         }
-        
-        if (unlink(block_path) != 0) {
-            // If we can't remove it, it probably doesn't exist
-            if (errno != ENOENT) {
-                break;
-            }
+        dir_changed |= !data_only;
+    }
+    if (dir_changed) {
+        char block_dir[MAX_PATH_LEN];
+        if (block_dir_path(s->filename, block_dir) != 0) {
+            return -1;
         }
+        const char *dirs[1] = { block_dir };
+        return block_sync_dirs(dirs, 1, flags);
     }
+    return 0;
+}
+
+// Group commit. Each durable sync takes a ticket. With no group sync
+// running, its caller leads one: it waits out the window for others to
+// join, then syncs for every ticket taken so far with the strongest flags
+// any of them asked for. The others wait for a group sync that covers
+// their ticket. A sync fails if any group sync failed while it waited.
+static int group_sync(block_shared_t *s, int flags) {
+    block_mutex_lock(&s->sync_lock);
+    unsigned long long ticket = ++s->sync_tickets;
+    unsigned long long failures = s->sync_failures;
+    if (flags & BLOCK_SYNC_FULL) s->sync_full = 1;
+    if (!(flags & BLOCK_SYNC_DATAONLY)) s->sync_metadata = 1;
     
-    // Handle partial last block
-    if (size > 0 && (size % BLOCK_SIZE) != 0) {
-        int last_block_num = (size - 1) / BLOCK_SIZE;
-        int last_block_size = size % BLOCK_SIZE;
-        
-        char block_path[MAX_PATH_LEN];
-        get_block_path(bf->filename, last_block_num, block_path);
+    while (s->sync_done < ticket) {
+        if (s->sync_leader) {
+            block_cond_wait(&s->sync_cond, &s->sync_lock);
+            continue;
+        }
+        s->sync_leader = 1;
+        int window = group_commit_window;
+        if (window > 0 && BLOCK_HAVE_THREADS) {
+            block_mutex_unlock(&s->sync_lock);
+            struct timespec delay = { window / 1000000, (window % 1000000) * 1000L };
+            nanosleep(&delay, NULL);
+            block_mutex_lock(&s->sync_lock);
+        }
+        unsigned long long first = s->sync_done;
+        unsigned long long last = s->sync_tickets;
+        int group_flags = (s->sync_full ? BLOCK_SYNC_FULL : 0) | (s->sync_metadata ? 0 : BLOCK_SYNC_DATAONLY);
+        s->sync_full = 0;
+        s->sync_metadata = 0;
+        block_mutex_unlock(&s->sync_lock);
         
-        // Read existing block data
-        char block_data[BLOCK_SIZE];
-        memset(block_data, 0, BLOCK_SIZE);
+        block_rwlock_wrlock(&s->lock);
+        int rc = shared_sync_durable(s, group_flags);
+        s->wb_stats.syncs += last - first;
+        s->wb_stats.sync_batches++;
+        block_rwlock_unlock(&s->lock);
         
-        FILE *existing = fopen(block_path, "rb");
-        if (existing) {
-            fread(block_data, 1, BLOCK_SIZE, existing);
-            fclose(existing);
+        block_mutex_lock(&s->sync_lock);
+        s->sync_done = last;
+        if (rc != 0) s->sync_failures++;
+        s->sync_leader = 0;
+        block_cond_broadcast(&s->sync_cond);
+    }
+    int result = (s->sync_failures != failures) ? -1 : 0;
+    block_mutex_unlock(&s->sync_lock);
+    return result;
+}
+
+int block_sync(block_file_t *bf) {
+    if (!bf) {
+        return -1;
+    }
+    if (fsync_on_flush) {
+        return group_sync(bf->shared, BLOCK_SYNC_NORMAL);
+    }
+    
+    block_rwlock_wrlock(&bf->shared->lock);
+    int result = shared_sync(bf->shared);
+    block_rwlock_unlock(&bf->shared->lock);
+    return result;
+}
+
+int block_sync_durable(block_file_t *bf, int flags) {
+    if (!bf) {
+        return -1;
+    }
+    return group_sync(bf->shared, flags);
+}
+
+// The clone gets its map from the backend and a copy of the manifest once
+// every dirty block is in the map
+int block_clone(block_file_t *bf, const char *filename) {
+    if (!bf || !filename) {
+        return -1;
+    }
+    block_shared_t *s = bf->shared;
+    char block_dir[MAX_PATH_LEN];
+    if (block_dir_path(filename, block_dir) != 0) {
+        return -1;
+    }
+    
+    block_rwlock_wrlock(&s->lock);
+    int result = -1;
+    if (s->backend == &block_dedup_backend && !s->batch_active && shared_sync(s) == 0 &&
+        mkdir(block_dir, 0755) == 0) {
+        block_manifest_t copy = s->manifest;
+        copy.staged = NULL;
+        copy.staged_count = 0;
+        block_mutex_lock(&s->backend_lock);
+        result = block_dedup_clone(s->state, filename);
+        block_mutex_unlock(&s->backend_lock);
+        if (result == 0) {
+            result = manifest_save(filename, &copy, MANIFEST_NO_SYNC);
         }
-        
-        // Write truncated block
-        FILE *block_file = fopen(block_path, "wb");
-        if (block_file) {
-            fwrite(block_data, 1, last_block_size, block_file);
-            fclose(block_file);
+    }
+    block_rwlock_unlock(&s->lock);
+    return result;
+}
+
+int block_delete(const char *filename) {
+    char block_dir[MAX_PATH_LEN];
+    if (!filename || block_dir_path(filename, block_dir) != 0) {
+        return -1;
+    }
+    
+    // Only a backend with blocks elsewhere needs the store opened. One
+    // that cannot be opened leaks them, as a crash might.
+    block_manifest_t m;
+    if (manifest_load(filename, &m) == 0) {
+        free(m.staged);
+        block_mutex_lock(&registry_lock);
+        const block_backend_t *backend = find_backend(m.backend);
+        block_mutex_unlock(&registry_lock);
+        block_file_t *bf;
+        if (backend && backend->release && block_open(filename, &bf) == 0) {
+            block_shared_t *s = bf->shared;
+            block_rwlock_wrlock(&s->lock);
+            if (s->backend->release && !s->batch_active && shared_sync(s) == 0) {
+                block_mutex_lock(&s->backend_lock);
+                s->backend->release(s->state);
+                block_mutex_unlock(&s->backend_lock);
+            }
+            block_rwlock_unlock(&s->lock);
+            block_close(bf);
         }
     }
+    return remove_tree(block_dir);
+}
+
+int block_supports_atomic_write(block_file_t *bf) {
+    return bf && bf->shared->backend->stage != NULL;
+}
+
+static int batch_begin(block_shared_t *s) {
+    if (s->batch_active) {
+        return -1;
+    }
     
+    // Write back earlier blocks so the dirty set holds only the batch
+    if (dirty_flush(s) != 0) {
+        return -1;
+    }
+    s->batch_active = 1;
+    s->batch_size = s->manifest.size;
+    s->batch_block_count = s->manifest.block_count;
     return 0;
 }
 
-long long block_file_size(block_file_t *bf) {
-    if (!bf) {
+int block_begin_atomic_write(block_file_t *bf) {
+    if (!block_supports_atomic_write(bf)) {
         return -1;
     }
     
-    char block_dir[MAX_PATH_LEN];
-    get_block_dir(bf->filename, block_dir);
+    block_rwlock_wrlock(&bf->shared->lock);
+    int result = batch_begin(bf->shared);
+    block_rwlock_unlock(&bf->shared->lock);
+    return result;
+}
+
+// Stage one block of a batch. An all-zero block is not staged: its token
+// says to punch a hole when the batch is published.
+static int batch_stage(block_shared_t *s, dirty_block_t *d, long long *token) {
+    if (s->backend->punch && block_is_zero(d->data, s->block_size)) {
+        *token = STAGED_HOLE;
+        return 0;
+    }
+    return s->backend->stage(s->state, d->block_num, d->data, token);
+}
+
+// Drop the staged versions of the first count blocks of a batch
+static void batch_discard(block_shared_t *s, dirty_block_t **list, long long *tokens, long long count) {
+    for (long long i = 0; i < count; i++) {
+        staged_publish(s, list[i]->block_num, tokens[i], 1);
+    }
+}
+
+// Shadow paging: stage every block of the batch beside its current
+// version, switch to a manifest that lists the staged blocks, then publish
+// them. A crash before the switch leaves the old versions; after it, the
+// next open finishes publishing.
+static int batch_commit(block_shared_t *s) {
+    if (!s->batch_active) {
+        return -1;
+    }
+    
+    block_manifest_t *m = &s->manifest;
+    long long n = s->dirty_count;
+    dirty_block_t **list = dirty_list(s);
+    long long *staged = malloc((n ? n : 1) * 3 * sizeof(long long));
+    if (!list || !staged) {
+        free(list);
+        free(staged);
+        return -1;
+    }
     
-    long long max_size = 0;
+    long long *tokens = malloc((n ? n : 1) * sizeof(long long));
+    long long count = 0;
+    while (tokens && count < n &&
+           batch_stage(s, list[count], &tokens[count]) == 0) {
+        staged[3 * count] = list[count]->block_num;
+        staged[3 * count + 1] = tokens[count];
+        staged[3 * count + 2] = (m->checksum && tokens[count] != STAGED_HOLE) ?
+                                block_checksum_of(list[count]->data, s->block_size) : 0;
+        count++;
+    }
     
-    // Check blocks up to a reasonable limit
-    for (int block_num = 0; block_num < 10000; block_num++) {
-        char block_path[MAX_PATH_LEN];
-        if (get_block_path(bf->filename, block_num, block_path) != 0) {
-            return -1;
+    int result = (tokens && count == n) ? 0 : -1;
+    if (result == 0 && s->backend->persistent) {
+        m->staged = staged;
+        m->staged_count = n;
+        result = manifest_save(s->filename, m, MANIFEST_NO_SYNC);
+        m->staged = NULL;
+        m->staged_count = 0;
+    }
+    if (result != 0) {
+        // Still uncommitted: the batch stays open for a rollback
+        if (tokens) batch_discard(s, list, tokens, count);
+        free(tokens);
+        free(staged);
+        free(list);
+        return -1;
+    }
+    
+    // Committed. A failure from here on is repaired by the next open.
+    for (long long i = 0; i < n; i++) {
+        if (staged_publish(s, list[i]->block_num, tokens[i], 0) != 0) {
+            result = -1;
         }
-        
-        struct stat st;
-        if (stat(block_path, &st) == 0) {
-            long long block_end = (long long)(block_num + 1) * BLOCK_SIZE;
-            if (st.st_size < BLOCK_SIZE) {
-                // Partial block, calculate exact end
-                block_end = (long long)block_num * BLOCK_SIZE + st.st_size;
-            }
-            if (block_end > max_size) {
-                max_size = block_end;
-            }
+    }
+    if (result == 0) {
+        for (long long i = 0; i < n; i++) {
+            if (tokens[i] == STAGED_HOLE) s->wb_stats.blocks_elided++;
+            dirty_clean(s, list[i]);
         }
+        s->wb_stats.flushes++;
+        if (s->backend->persistent && manifest_save(s->filename, m, MANIFEST_NO_SYNC) != 0) {
+            result = -1;
+        }
+        if (fsync_on_flush && s->backend->sync(s->state, BLOCK_SYNC_NORMAL) < 0) {
+            result = -1;
+        }
+    }
+    s->batch_active = 0;
+    
+    free(tokens);
+    free(staged);
+    free(list);
+    return result;
+}
+
+int block_commit_atomic_write(block_file_t *bf) {
+    if (!bf) {
+        return -1;
+    }
+    
+    block_rwlock_wrlock(&bf->shared->lock);
+    int result = batch_commit(bf->shared);
+    block_rwlock_unlock(&bf->shared->lock);
+    return result;
+}
+
+static int batch_rollback(block_shared_t *s) {
+    if (!s->batch_active) {
+        return -1;
+    }
+    
+    // Nothing of the batch reached the backend
+    dirty_drop(s, 0);
+    s->manifest.size = s->batch_size;
+    s->manifest.block_count = s->batch_block_count;
+    s->batch_active = 0;
+    return 0;
+}
+
+int block_rollback_atomic_write(block_file_t *bf) {
+    if (!bf) {
+        return -1;
+    }
+    
+    block_rwlock_wrlock(&bf->shared->lock);
+    int result = batch_rollback(bf->shared);
+    block_rwlock_unlock(&bf->shared->lock);
+    return result;
+}
+
+// Find a backend among the layers of a file: the wrappers and the backend
+// under them. Called with the backend lock held.
+static int backend_layer(block_shared_t *s, const block_backend_t *want, void **state) {
+    const block_backend_t *backend = s->backend;
+    void *layer = s->state;
+    while (backend != want) {
+        if (backend == &block_checksum_backend) {
+            backend = block_checksum_inner(layer, &layer);
+        } else if (backend == &block_compress_backend) {
+            backend = block_compress_inner(layer, &layer);
+        } else {
+            return 0;
+        }
+    }
+    *state = layer;
+    return 1;
+}
+
+void block_get_fd_cache_stats(block_file_t *bf, block_fd_cache_stats_t *stats) {
+    if (!bf || !stats) return;
+    block_shared_t *s = bf->shared;
+    block_rwlock_rdlock(&s->lock);
+    block_mutex_lock(&s->backend_lock);
+    void *state;
+    if (backend_layer(s, &block_fanout_backend, &state) || backend_layer(s, &block_flat_backend, &state)) {
+        block_files_fd_stats(state, stats);
+    } else {
+        memset(stats, 0, sizeof(*stats));
+    }
+    block_mutex_unlock(&s->backend_lock);
+    block_rwlock_unlock(&s->lock);
+}
+
+void block_get_dedup_stats(block_file_t *bf, block_dedup_stats_t *stats) {
+    if (!bf || !stats) return;
+    block_shared_t *s = bf->shared;
+    block_rwlock_rdlock(&s->lock);
+    block_mutex_lock(&s->backend_lock);
+    void *state;
+    if (backend_layer(s, &block_dedup_backend, &state)) {
+        block_dedup_stats(state, stats);
+    } else {
+        memset(stats, 0, sizeof(*stats));
     }
+    block_mutex_unlock(&s->backend_lock);
+    block_rwlock_unlock(&s->lock);
+}
+
+void block_get_compress_stats(block_file_t *bf, block_compress_stats_t *stats) {
+    if (!bf || !stats) return;
+    block_shared_t *s = bf->shared;
+    block_rwlock_rdlock(&s->lock);
+    block_mutex_lock(&s->backend_lock);
+    void *state;
+    if (backend_layer(s, &block_compress_backend, &state)) {
+        block_compress_stats(state, stats);
+    } else {
+        memset(stats, 0, sizeof(*stats));
+    }
+    block_mutex_unlock(&s->backend_lock);
+    block_rwlock_unlock(&s->lock);
+}
+
+void block_get_checksum_stats(block_file_t *bf, block_checksum_stats_t *stats) {
+    if (!bf || !stats) return;
+    block_shared_t *s = bf->shared;
+    block_rwlock_rdlock(&s->lock);
+    block_mutex_lock(&s->backend_lock);
+    void *state;
+    if (backend_layer(s, &block_checksum_backend, &state)) {
+        block_checksum_stats(state, stats);
+    } else {
+        memset(stats, 0, sizeof(*stats));
+        stats->last_failed_block = -1;
+    }
+    block_mutex_unlock(&s->backend_lock);
+    block_rwlock_unlock(&s->lock);
+}
+
+void block_set_readahead(int max_blocks) {
+    readahead_max = (max_blocks > 0) ? max_blocks : 0;
+}
+
+void block_get_readahead_stats(block_file_t *bf, block_readahead_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+    if (!bf) return;
     
-    return max_size;
+    block_shared_t *s = bf->shared;
+    stats->streams = s->ra_streams;
+    stats->issued = s->ra_issued;
+    stats->hits = s->ra_hits;
+    stats->misses = s->ra_misses;
+    stats->dropped = s->ra_dropped;
+    long long used = stats->hits + stats->misses;
+    stats->hit_ratio = used ? (double)stats->hits / used : 0.0;
+}
+
+void block_set_temp_spill(long long bytes) {
+    temp_spill = (bytes > 0) ? bytes : 0;
+}
+
+void block_set_dirty_limit(long long bytes) {
+    dirty_limit = (bytes > 0) ? bytes : 0;
+}
+
+void block_set_fsync(int enable) {
+    fsync_on_flush = enable;
+}
+
+void block_set_group_commit_window(int window_us) {
+    group_commit_window = (window_us > 0) ? window_us : 0;
+}
+
+void block_get_writeback_stats(block_file_t *bf, block_writeback_stats_t *stats) {
+    if (!bf || !stats) return;
+    block_rwlock_rdlock(&bf->shared->lock);
+    *stats = bf->shared->wb_stats;
+    stats->dirty_blocks = bf->shared->dirty_count;
+    block_rwlock_unlock(&bf->shared->lock);
+}
+
+// Other threads may be using the shared cache, so a capacity of 0 empties
+// it and turns it off rather than freeing it
+void block_set_cache_capacity(long long bytes) {
+    block_mutex_lock(&registry_lock);
+    read_cache_capacity = (bytes > 0) ? bytes : 0;
+    if (read_cache) {
+        block_cache_resize(read_cache, read_cache_capacity);
+    } else {
+        read_cache_init();
+    }
+    block_mutex_unlock(&registry_lock);
+}
+
+void block_get_cache_stats(block_cache_stats_t *stats) {
+    if (!stats) return;
+    if (read_cache && read_cache_capacity > 0) {
+        block_cache_get_stats(read_cache, stats);
+    } else {
+        memset(stats, 0, sizeof(*stats));
+    }
+}
+
+void block_get_file_cache_stats(block_file_t *bf, block_cache_stats_t *stats) {
+    if (!bf || !stats) return;
+    block_cache_t *cache = file_cache(bf->shared);
+    if (cache) {
+        block_cache_get_stats(cache, stats);
+    } else {
+        memset(stats, 0, sizeof(*stats));
+    }
+}
+
+void block_reset_cache_stats(void) {
+    if (read_cache) {
+        block_cache_reset_stats(read_cache);
+    }
 }
\ No newline at end of file
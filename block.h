@@ -1,13 +1,204 @@
 #ifndef BLOCK_H
 #define BLOCK_H
 
+// Bytes per block of new stores, and the range other sizes may take
+#define BLOCK_SIZE_DEFAULT 4096
+#define BLOCK_SIZE_MIN 512
+#define BLOCK_SIZE_MAX 65536
+
+// Default number of block file descriptors each file keeps open
+#define BLOCK_FD_CACHE_DEFAULT 32
+
+// Default bytes of dirty blocks per file before they are written back
+#define BLOCK_DIRTY_LIMIT_DEFAULT (16LL * 1024 * 1024)
+
+// Default bytes a temporary file keeps in memory before it spills to disk
+#define BLOCK_TEMP_SPILL_DEFAULT (64LL * 1024 * 1024)
+
+// Default bytes of clean blocks kept in the shared read cache
+#define BLOCK_CACHE_CAPACITY_DEFAULT (8LL * 1024 * 1024)
+
+// Default most blocks kept read ahead of a sequential or strided reader
+#define BLOCK_READAHEAD_DEFAULT 64
+
+// Counters for the block descriptor cache of a file
+typedef struct {
+    long long hits;       // block served by an already-open descriptor
+    long long misses;     // block file had to be opened
+    long long evictions;  // descriptor closed to make room for another
+} block_fd_cache_stats_t;
+
+// Counters for the write-back cache of a file
+typedef struct {
+    long long writes_absorbed;  // writes to a block that was already dirty
+    long long blocks_flushed;   // dirty blocks written to disk
+    long long blocks_elided;    // of those, all-zero blocks stored as holes
+    long long flushes;          // write-back passes (sync, close, memory pressure)
+    long long dirty_blocks;     // blocks currently dirty
+    long long syncs;            // durable syncs asked for
+    long long sync_batches;     // group syncs run for them
+} block_writeback_stats_t;
+
+// Counters for the shared read cache
+typedef struct {
+    long long hits;
+    long long misses;
+    long long ghost_hits;   // misses on recently evicted blocks, admitted as hot
+    long long evictions;
+    long long capacity;     // bytes
+    long long used;         // bytes of cached blocks
+    double hit_ratio;       // hits / (hits + misses)
+} block_cache_stats_t;
+
+// Counters for read-ahead on a file
+typedef struct {
+    long long streams;      // sequential or strided runs detected
+    long long issued;       // blocks queued to be read ahead
+    long long hits;         // reads of read-ahead blocks found in the cache
+    long long misses;       // reads of read-ahead blocks not loaded in time
+    long long dropped;      // requests dropped because the queue was full
+    double hit_ratio;       // hits / (hits + misses)
+} block_readahead_stats_t;
+
+// A block storage backend. The block layer splits I/O into whole blocks,
+// keeps the write-back and read caches and the logical size, and calls a
+// backend only to store and fetch blocks. Backend state is per file and is
+// shared by every handle open on that file. The block layer never calls a
+// backend on the same state from two threads at once.
+typedef struct block_backend {
+    const char *name;
+    int persistent;     // keeps blocks under filename.blocks/ with a manifest
+    
+    // Open the blocks of filename
+    int (*open)(const char *filename, int block_size, void **state);
+    
+    // Release the state; stored blocks stay unless the backend is transient
+    void (*close)(void *state);
+    
+    // Read size bytes at offset within a block. Missing blocks read as zeros.
+    int (*read)(void *state, long long block_num, int offset, int size, char *buf);
+    
+    // Store a whole block
+    int (*write)(void *state, long long block_num, const char *data);
+    
+    // Drop blocks numbered block_count or higher. A non-zero tail means the
+    // file now ends tail bytes into block block_count - 1.
+    int (*truncate)(void *state, long long block_count, int tail);
+    
+    // Bytes the backend knows to be stored, at least known_size. Used on
+    // open to pick up blocks written after the manifest was last saved.
+    long long (*size)(void *state, long long known_size);
+    
+    // Make the blocks written since the last sync durable, with fdatasync
+    // or, for BLOCK_SYNC_FULL, fsync, along with the entries of the
+    // directories below filename.blocks that name them. Returns 1 if
+    // entries of filename.blocks itself changed, which the block layer
+    // then syncs once for the backend and the manifest together.
+    int (*sync)(void *state, int flags);
+    
+    // Optional, for atomic batches. Store a new version of a block beside
+    // the current one, which stays visible; *token says where it went.
+    int (*stage)(void *state, long long block_num, const char *data, long long *token);
+    
+    // Make a staged version current, or drop it if discard is set. Must be
+    // idempotent: after a crash, blocks staged by a committed batch are
+    // published again on open.
+    int (*publish)(void *state, long long block_num, long long token, int discard);
+    
+    // Optional, for memory-mapped reads. Point *data at a read-only mapping
+    // of a whole stored block that stays valid until unmap, or return 1 if
+    // the block is not stored whole where it can be mapped.
+    int (*map)(void *state, long long block_num, const char **data);
+    void (*unmap)(void *state, long long block_num, const char *data);
+    
+    // Optional, for batched I/O. Read or store whole distinct blocks, as
+    // that many calls to read or write would, but in as few system calls
+    // as the backend can manage. After a failed write_many any of the
+    // blocks may or may not have been stored.
+    int (*read_many)(void *state, int count, const long long *block_nums, char *const *bufs);
+    int (*write_many)(void *state, int count, const long long *block_nums, const char *const *data);
+    
+    // Optional. Drop a block so it reads as zeros, freeing its storage.
+    // All-zero blocks are stored this way. Must be idempotent.
+    int (*punch)(void *state, long long block_num);
+    
+    // Optional, for compressed stores: blocks stored with a length of
+    // their own, at most the block size. read_sized returns the length,
+    // 0 for a hole.
+    int (*read_sized)(void *state, long long block_num, char *buf);
+    int (*write_sized)(void *state, long long block_num, const char *data, int len);
+    int (*stage_sized)(void *state, long long block_num, const char *data, int len, long long *token);
+    
+    // Optional, for backends keeping blocks outside filename.blocks. Give
+    // them all up before block_delete removes the directory; the store is
+    // closed right after.
+    int (*release)(void *state);
+} block_backend_t;
+
+typedef struct block_shared block_shared_t;
+
+// Recent reads through a handle, for detecting sequential and strided access
+typedef struct {
+    long long last_block;   // block of the last read
+    long long stride;       // blocks between the last two reads
+    int run;                // reads in a row at that stride
+    int window;             // blocks to keep read ahead
+    long long next;         // next block of the stream not yet read ahead
+} block_readahead_t;
+
+// Handles may be used from different threads, each by one thread at a time.
+// Reads of a file run concurrently; writes, truncation, syncs and batches
+// take the file exclusively. Handles on different files never wait for one
+// another except in the shared read cache.
 typedef struct {
     char *filename;
+    block_shared_t *shared;            // state shared by all handles on filename
+    block_readahead_t readahead;       // access pattern of this handle
 } block_file_t;
 
 // Open a block-oriented file
 int block_open(const char *filename, block_file_t **bf);
 
+// Open a block-oriented file, creating it with the named backend if it does
+// not exist yet (NULL for the default)
+int block_open_with(const char *filename, const char *backend, block_file_t **bf);
+
+// Delete a store and its directory, first letting its backend give up
+// blocks kept elsewhere. Deleting a store that does not exist succeeds.
+int block_delete(const char *filename);
+
+// Open a private temporary file. Its blocks stay in memory until it grows
+// past the spill threshold, then move to a packed store in a new directory
+// under $TMPDIR (or /tmp). Nothing is left behind once it is closed.
+int block_open_temp(block_file_t **bf);
+
+// Set the size past which temporary files spill to disk; 0 never spills
+void block_set_temp_spill(long long bytes);
+
+// Per-block compression codecs. Only backends that keep the length of a
+// stored block (fanout, flat) can hold compressed stores.
+#define BLOCK_COMPRESS_NONE 0
+#define BLOCK_COMPRESS_LZ   1   // built-in LZ77, LZ4-style sequences
+
+// Per-file settings for block_open_ex; zero fields take the defaults
+typedef struct {
+    const char *backend;    // backend of a new store, NULL for the default
+    int block_size;         // block size of a new store, a power of two
+    long long cache_bytes;  // a read cache of this size for the file alone
+                            // instead of the shared one
+    int compress;           // codec of a new store, BLOCK_COMPRESS_*
+    int checksum;           // keep a CRC32C of each block of a new store,
+                            // verified whenever a block is read
+} block_open_options_t;
+
+// Open a block-oriented file with per-file settings. An existing store
+// keeps its backend, block size, compression and checksums; other
+// settings only take effect for the first handle open on a file.
+int block_open_ex(const char *filename, const block_open_options_t *options, block_file_t **bf);
+
+// Get the block size of the file behind a handle
+int block_get_block_size(block_file_t *bf);
+
 // Close a block-oriented file
 int block_close(block_file_t *bf);
 
@@ -23,4 +214,160 @@ int block_truncate(block_file_t *bf, long long size);
 // Get the size of a block-oriented file
 long long block_file_size(block_file_t *bf);
 
+// Write back dirty blocks and save the manifest
+int block_sync(block_file_t *bf);
+
+// How far block_sync_durable goes, after SQLite's xSync flags. Every sync
+// makes the blocks written since the last one durable, with the directory
+// entries naming them. DATAONLY leaves the manifest, and so the file size,
+// to a later sync; FULL syncs with fsync rather than fdatasync, through
+// F_FULLFSYNC where there is one.
+#define BLOCK_SYNC_NORMAL   0
+#define BLOCK_SYNC_FULL     1
+#define BLOCK_SYNC_DATAONLY 2
+
+// Write back dirty blocks and make them durable, syncing only the block
+// files written since the last sync and then each directory whose entries
+// changed once
+int block_sync_durable(block_file_t *bf, int flags);
+
+// Group commit: durable syncs of a file that arrive while one is running
+// are merged into a single write-back and sync, and return together. The
+// handle that starts a sync first waits window_us microseconds for others
+// to join (0 by default, so a lone sync is not delayed).
+void block_set_group_commit_window(int window_us);
+
+// Atomic batches: writes between begin and commit stay in memory, and
+// commit makes all of them visible or none, even across a crash. Only
+// backends with stage and publish support them.
+int block_supports_atomic_write(block_file_t *bf);
+int block_begin_atomic_write(block_file_t *bf);
+int block_commit_atomic_write(block_file_t *bf);
+int block_rollback_atomic_write(block_file_t *bf);
+
+// Memory-mapped reads: point *ptr at size bytes at offset, read-only and
+// valid until block_unfetch. *ptr is NULL when the range cannot be mapped:
+// it crosses a block boundary or the end of the file, holds writes not yet
+// flushed, or the backend cannot map it. Callers then use block_read.
+int block_fetch(block_file_t *bf, long long offset, int size, const void **ptr);
+
+// Release a pointer block_fetch returned for offset
+int block_unfetch(block_file_t *bf, long long offset, const void *ptr);
+
+// Register a backend under its name. Built in: "fanout" (one file per
+// block, the default), "flat" (older single-directory stores), "packed"
+// (segment files plus an index), "dedup" (content-addressed objects shared
+// between stores) and "memory" (nothing on disk).
+int block_register_backend(const block_backend_t *backend);
+
+// Find a registered backend by name
+const block_backend_t *block_find_backend(const char *name);
+
+// Set the backend of stores created afterwards
+int block_set_backend(const char *name);
+
+// Set the descriptor cache capacity used by files opened afterwards
+void block_set_fd_cache_capacity(int capacity);
+
+// Get the descriptor cache counters of the file behind a handle
+void block_get_fd_cache_stats(block_file_t *bf, block_fd_cache_stats_t *stats);
+
+// Counters for a compressed store, since it was opened; zero otherwise
+typedef struct {
+    long long blocks_compressed;    // blocks stored compressed
+    long long blocks_raw;           // blocks stored as is, saving too little
+    long long blocks_decompressed;
+    long long bytes_in;             // block bytes given to the codec
+    long long bytes_out;            // bytes stored for them
+    double ratio;                   // bytes_in / bytes_out
+    long long compress_ns;          // time spent compressing
+    long long decompress_ns;        // time spent decompressing
+} block_compress_stats_t;
+
+void block_get_compress_stats(block_file_t *bf, block_compress_stats_t *stats);
+
+// Counters for a store with checksums, since it was opened; zero otherwise
+typedef struct {
+    long long blocks_verified;      // blocks read from the backend and checked
+    long long failures;             // of those, blocks that did not match
+    long long last_failed_block;    // -1 if none
+} block_checksum_stats_t;
+
+void block_get_checksum_stats(block_file_t *bf, block_checksum_stats_t *stats);
+
+// Counters for a store on the dedup backend, since it was opened
+typedef struct {
+    long long blocks_written;   // blocks stored or staged
+    long long blocks_unchanged; // of those, already holding the same contents
+    long long blocks_shared;    // of those, found in an existing object
+    long long objects_created;
+    long long objects_freed;    // objects removed with their last reference
+} block_dedup_stats_t;
+
+// Set the object directory of dedup stores created afterwards; NULL for
+// the default, .wasql-objects beside each database. A store keeps the
+// directory it was created with.
+int block_set_object_dir(const char *dir);
+
+// Get the dedup counters of the file behind a handle; zero for other backends
+void block_get_dedup_stats(block_file_t *bf, block_dedup_stats_t *stats);
+
+// Create filename as a copy of a dedup store that shares all its objects,
+// so the copy costs a map and a reference per block. filename must not
+// exist yet; other backends, and dedup stores with checksums, cannot be
+// cloned.
+int block_clone(block_file_t *bf, const char *filename);
+
+// Set how many bytes of dirty blocks a file may hold before write-back
+void block_set_dirty_limit(long long bytes);
+
+// Enable or disable syncing the backend after each write-back
+void block_set_fsync(int enable);
+
+// Get the write-back counters of the file behind a handle
+void block_get_writeback_stats(block_file_t *bf, block_writeback_stats_t *stats);
+
+// Set the memory budget of the shared read cache; 0 disables it
+void block_set_cache_capacity(long long bytes);
+
+// Get or reset the shared read cache counters
+void block_get_cache_stats(block_cache_stats_t *stats);
+void block_reset_cache_stats(void);
+
+// Get the counters of the read cache the file behind a handle uses, which
+// is its own if it has one
+void block_get_file_cache_stats(block_file_t *bf, block_cache_stats_t *stats);
+
+// Read-ahead: once a handle reads blocks at a steady stride, background
+// threads load the next blocks of the stream into the read cache. The
+// window starts at 4 blocks and doubles each time the stream goes on
+// through it; any other read starts over. Set the largest window in
+// blocks; 0 disables read-ahead. Files without a read cache never read
+// ahead, nor do WASI builds.
+void block_set_readahead(int max_blocks);
+
+// Get the read-ahead counters of the file behind a handle
+void block_get_readahead_stats(block_file_t *bf, block_readahead_stats_t *stats);
+
+// I/O engines of the file backends. io_uring (Linux, the default where the
+// kernel supports it) sends the opens, reads, writes, syncs and unlinks of
+// a batch to the kernel together; POSIX makes one call per operation.
+#define BLOCK_IO_ENGINE_POSIX 0
+#define BLOCK_IO_ENGINE_URING 1
+
+// Counters for batched I/O, across all files
+typedef struct {
+    long long batches;      // batches run
+    long long ops;          // operations in them
+    long long syscalls;     // system calls made for them
+} block_io_stats_t;
+
+// Choose the I/O engine. Returns the one in use, which is POSIX when
+// io_uring is not available.
+int block_set_io_engine(int engine);
+
+// Get or reset the batched I/O counters
+void block_get_io_stats(block_io_stats_t *stats);
+void block_reset_io_stats(void);
+
 #endif // BLOCK_H
\ No newline at end of file
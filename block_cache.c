@@ -0,0 +1,309 @@
+#include <stdlib.h>
+#include <string.h>
+#include "block_cache.h"
+#include "block_internal.h"
+
+// Queue an entry belongs to
+#define Q_A1IN  0   // first-time blocks, FIFO
+#define Q_AM    1   // re-referenced blocks, LRU
+#define Q_A1OUT 2   // ghosts of blocks evicted from A1in, keys only
+
+typedef struct cache_entry cache_entry_t;
+struct cache_entry {
+    unsigned long long file_id;
+    long long block_num;
+    cache_entry_t *hash_next;
+    cache_entry_t *prev;       // towards the head (newest / most recent)
+    cache_entry_t *next;       // towards the tail (oldest / least recent)
+    int queue;
+    char *data;                // NULL for ghosts
+};
+
+typedef struct {
+    cache_entry_t *head;
+    cache_entry_t *tail;
+    long long count;
+} cache_queue_t;
+
+struct block_cache {
+    block_mutex_t lock;        // held by every public call
+    int block_size;
+    long long capacity;        // in blocks
+    cache_entry_t **buckets;
+    long long bucket_count;    // power of two
+    long long entry_count;     // including ghosts
+    cache_queue_t queues[3];
+    block_cache_stats_t stats;
+};
+
+static unsigned long long hash_key(unsigned long long file_id, long long block_num) {
+    unsigned long long h = file_id * 0x9e3779b97f4a7c15ULL ^ (unsigned long long)block_num;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static cache_entry_t **find_slot(block_cache_t *c, unsigned long long file_id, long long block_num) {
+    cache_entry_t **pp = &c->buckets[hash_key(file_id, block_num) & (c->bucket_count - 1)];
+    while (*pp && ((*pp)->file_id != file_id || (*pp)->block_num != block_num)) {
+        pp = &(*pp)->hash_next;
+    }
+    return pp;
+}
+
+// Double the hash table once it averages more than one entry per bucket
+static void maybe_grow(block_cache_t *c) {
+    if (c->entry_count < c->bucket_count) return;
+    
+    long long new_count = c->bucket_count * 2;
+    cache_entry_t **buckets = calloc(new_count, sizeof(cache_entry_t *));
+    if (!buckets) return;   // keep the longer chains
+    
+    for (long long i = 0; i < c->bucket_count; i++) {
+        cache_entry_t *e = c->buckets[i];
+        while (e) {
+            cache_entry_t *next = e->hash_next;
+            cache_entry_t **pp = &buckets[hash_key(e->file_id, e->block_num) & (new_count - 1)];
+            e->hash_next = *pp;
+            *pp = e;
+            e = next;
+        }
+    }
+    free(c->buckets);
+    c->buckets = buckets;
+    c->bucket_count = new_count;
+}
+
+static void queue_unlink(block_cache_t *c, cache_entry_t *e) {
+    cache_queue_t *q = &c->queues[e->queue];
+    if (e->prev) e->prev->next = e->next; else q->head = e->next;
+    if (e->next) e->next->prev = e->prev; else q->tail = e->prev;
+    e->prev = e->next = NULL;
+    q->count--;
+}
+
+static void queue_push_head(block_cache_t *c, cache_entry_t *e, int queue) {
+    cache_queue_t *q = &c->queues[queue];
+    e->queue = queue;
+    e->prev = NULL;
+    e->next = q->head;
+    if (q->head) q->head->prev = e; else q->tail = e;
+    q->head = e;
+    q->count++;
+}
+
+// Unlink an entry from its queue and the hash table and free it
+static void entry_remove(block_cache_t *c, cache_entry_t *e) {
+    cache_entry_t **pp = find_slot(c, e->file_id, e->block_num);
+    *pp = e->hash_next;
+    queue_unlink(c, e);
+    c->entry_count--;
+    if (e->data) {
+        c->stats.used -= c->block_size;
+    }
+    free(e->data);
+    free(e);
+}
+
+// A1in holds a quarter of the blocks, A1out remembers half as many keys
+static long long a1in_target(block_cache_t *c) {
+    long long k = c->capacity / 4;
+    return k > 0 ? k : 1;
+}
+
+static long long a1out_target(block_cache_t *c) {
+    return c->capacity / 2;
+}
+
+// Make room for one block. Returns the freed data buffer for reuse, or
+// NULL if nothing could be evicted.
+static char *reclaim(block_cache_t *c) {
+    cache_entry_t *victim;
+    if (c->queues[Q_A1IN].count > a1in_target(c) || !c->queues[Q_AM].tail) {
+        victim = c->queues[Q_A1IN].tail;
+        if (!victim) return NULL;
+        
+        // Keep the key as a ghost so a second reference promotes it
+        char *data = victim->data;
+        victim->data = NULL;
+        c->stats.used -= c->block_size;
+        queue_unlink(c, victim);
+        queue_push_head(c, victim, Q_A1OUT);
+        while (c->queues[Q_A1OUT].count > a1out_target(c)) {
+            entry_remove(c, c->queues[Q_A1OUT].tail);
+        }
+        c->stats.evictions++;
+        return data;
+    }
+    
+    victim = c->queues[Q_AM].tail;
+    char *data = victim->data;
+    victim->data = NULL;
+    c->stats.used -= c->block_size;
+    entry_remove(c, victim);
+    c->stats.evictions++;
+    return data;
+}
+
+block_cache_t *block_cache_create(long long capacity, int block_size) {
+    block_cache_t *c = calloc(1, sizeof(block_cache_t));
+    if (!c) return NULL;
+    
+    c->block_size = block_size;
+    c->capacity = capacity / block_size;
+    c->bucket_count = 256;
+    c->buckets = calloc(c->bucket_count, sizeof(cache_entry_t *));
+    if (!c->buckets) {
+        free(c);
+        return NULL;
+    }
+    c->stats.capacity = c->capacity * block_size;
+    block_mutex_init(&c->lock);
+    return c;
+}
+
+void block_cache_destroy(block_cache_t *c) {
+    if (!c) return;
+    for (int q = 0; q < 3; q++) {
+        while (c->queues[q].head) {
+            entry_remove(c, c->queues[q].head);
+        }
+    }
+    free(c->buckets);
+    block_mutex_destroy(&c->lock);
+    free(c);
+}
+
+void block_cache_resize(block_cache_t *c, long long capacity) {
+    block_mutex_lock(&c->lock);
+    c->capacity = capacity / c->block_size;
+    c->stats.capacity = c->capacity * c->block_size;
+    
+    while (c->stats.used > c->stats.capacity) {
+        free(reclaim(c));
+    }
+    while (c->queues[Q_A1OUT].count > a1out_target(c)) {
+        entry_remove(c, c->queues[Q_A1OUT].tail);
+    }
+    block_mutex_unlock(&c->lock);
+}
+
+int block_cache_read(block_cache_t *c, unsigned long long file_id, long long block_num,
+                     int offset, int size, char *buf) {
+    block_mutex_lock(&c->lock);
+    cache_entry_t *e = *find_slot(c, file_id, block_num);
+    if (!e || !e->data) {
+        c->stats.misses++;
+        block_mutex_unlock(&c->lock);
+        return 0;
+    }
+    
+    // Am is LRU; A1in is a FIFO and does not reorder on a hit
+    if (e->queue == Q_AM) {
+        queue_unlink(c, e);
+        queue_push_head(c, e, Q_AM);
+    }
+    memcpy(buf, e->data + offset, size);
+    c->stats.hits++;
+    block_mutex_unlock(&c->lock);
+    return 1;
+}
+
+int block_cache_peek(block_cache_t *c, unsigned long long file_id, long long block_num,
+                     int offset, int size, char *buf) {
+    block_mutex_lock(&c->lock);
+    cache_entry_t *e = *find_slot(c, file_id, block_num);
+    int found = e && e->data;
+    if (found && buf) {
+        memcpy(buf, e->data + offset, size);
+    }
+    block_mutex_unlock(&c->lock);
+    return found;
+}
+
+static void cache_put(block_cache_t *c, unsigned long long file_id, long long block_num,
+                      const char *data) {
+    if (c->capacity <= 0) return;
+    
+    cache_entry_t **pp = find_slot(c, file_id, block_num);
+    cache_entry_t *e = *pp;
+    if (e && e->data) {
+        memcpy(e->data, data, c->block_size);
+        return;
+    }
+    
+    char *buf = NULL;
+    if (c->stats.used + c->block_size > c->stats.capacity) {
+        buf = reclaim(c);
+        // Reclaiming may have dropped the ghost we found
+        pp = find_slot(c, file_id, block_num);
+        e = *pp;
+    }
+    if (!buf) {
+        buf = malloc(c->block_size);
+        if (!buf) return;
+    }
+    memcpy(buf, data, c->block_size);
+    
+    if (e) {
+        // Seen recently enough to be remembered: this block is hot
+        queue_unlink(c, e);
+        queue_push_head(c, e, Q_AM);
+        c->stats.ghost_hits++;
+    } else {
+        e = calloc(1, sizeof(cache_entry_t));
+        if (!e) {
+            free(buf);
+            return;
+        }
+        e->file_id = file_id;
+        e->block_num = block_num;
+        e->hash_next = NULL;
+        *pp = e;
+        c->entry_count++;
+        queue_push_head(c, e, Q_A1IN);
+        maybe_grow(c);
+    }
+    e->data = buf;
+    c->stats.used += c->block_size;
+}
+
+void block_cache_put(block_cache_t *c, unsigned long long file_id, long long block_num,
+                     const char *data) {
+    block_mutex_lock(&c->lock);
+    cache_put(c, file_id, block_num, data);
+    block_mutex_unlock(&c->lock);
+}
+
+void block_cache_invalidate(block_cache_t *c, unsigned long long file_id, long long first_block) {
+    block_mutex_lock(&c->lock);
+    for (long long i = 0; i < c->bucket_count; i++) {
+        cache_entry_t *e = c->buckets[i];
+        while (e) {
+            cache_entry_t *next = e->hash_next;
+            if (e->file_id == file_id && e->block_num >= first_block) {
+                entry_remove(c, e);
+            }
+            e = next;
+        }
+    }
+    block_mutex_unlock(&c->lock);
+}
+
+void block_cache_get_stats(block_cache_t *c, block_cache_stats_t *stats) {
+    block_mutex_lock(&c->lock);
+    *stats = c->stats;
+    block_mutex_unlock(&c->lock);
+    long long lookups = stats->hits + stats->misses;
+    stats->hit_ratio = lookups ? (double)stats->hits / lookups : 0.0;
+}
+
+void block_cache_reset_stats(block_cache_t *c) {
+    block_mutex_lock(&c->lock);
+    c->stats.hits = 0;
+    c->stats.misses = 0;
+    c->stats.ghost_hits = 0;
+    c->stats.evictions = 0;
+    block_mutex_unlock(&c->lock);
+}
\ No newline at end of file
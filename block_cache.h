@@ -0,0 +1,44 @@
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+#include "block.h"
+
+// A capacity-bounded cache of clean blocks using the 2Q replacement policy.
+// New blocks enter a small FIFO (A1in); only blocks referenced again after
+// falling out of it, while still remembered by the ghost queue (A1out), are
+// promoted to the main LRU (Am). A one-pass scan therefore cycles through
+// A1in without displacing the hot pages in Am. Every call takes the
+// cache's own lock, so threads may share a cache.
+typedef struct block_cache block_cache_t;
+
+// Create a cache holding up to capacity bytes of block_size blocks
+block_cache_t *block_cache_create(long long capacity, int block_size);
+
+// Free a cache and everything in it
+void block_cache_destroy(block_cache_t *c);
+
+// Change the capacity, evicting as needed
+void block_cache_resize(block_cache_t *c, long long capacity);
+
+// Copy size bytes at offset within a cached block into buf. Returns 1 on a
+// hit and 0 on a miss.
+int block_cache_read(block_cache_t *c, unsigned long long file_id, long long block_num,
+                     int offset, int size, char *buf);
+
+// Like block_cache_read, but neither counted nor moved in the queues; buf
+// may be NULL just to ask whether the block is cached
+int block_cache_peek(block_cache_t *c, unsigned long long file_id, long long block_num,
+                     int offset, int size, char *buf);
+
+// Insert or refresh a whole block
+void block_cache_put(block_cache_t *c, unsigned long long file_id, long long block_num,
+                     const char *data);
+
+// Drop a file's blocks numbered first_block or higher
+void block_cache_invalidate(block_cache_t *c, unsigned long long file_id, long long first_block);
+
+// Get or reset the counters
+void block_cache_get_stats(block_cache_t *c, block_cache_stats_t *stats);
+void block_cache_reset_stats(block_cache_t *c);
+
+#endif // BLOCK_CACHE_H
\ No newline at end of file
@@ -0,0 +1,567 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "block_internal.h"
+
+#define CHECKSUMS_NAME "checksums"
+#define CHECKSUMS_LOG_NAME "checksums-log"
+#define CHECKSUM_SIZE 4
+#define LOG_ENTRY_SIZE 16
+
+// Per-block CRC32C, as a backend that wraps the one holding the blocks.
+// The checksums live in a side table, one little-endian uint32 per block
+// in filename.blocks/checksums, so any backend can be wrapped and blocks
+// keep their size. An entry of 0 stands for a block never stored, which
+// must read as zeros; a block whose CRC is 0 is entered as 0xffffffff.
+// Every block read from the wrapped backend is checked in full; a
+// mismatch fails the read with EIO and is counted. Optional hooks the
+// wrapped backend lacks are done the plain way, except atomic batches,
+// which it must support.
+//
+// A block and its entry are separate writes, so a crash before the next
+// sync can keep one without the other. Before blocks are written, their
+// numbers go to filename.blocks/checksums-log (little-endian int64 first
+// block and block count per entry) and the log is synced, with fsync on or
+// off, since the log is what lets a crash be told from damage. A sync of
+// the store empties it, and so does a clean close, which syncs the blocks
+// and the table first. Opening a store whose log is not empty enters new
+// checksums for the blocks it lists, taking them as they are on disk, as
+// the file would have them. Torn tails that SQLite discards or rolls back
+// then read again rather than failing.
+typedef struct {
+    const block_backend_t *inner;
+    void *state;
+    int block_size;
+    int fd;
+    int unsynced;                // the table was written since the last sync
+    uint32_t *sums;
+    long long sums_len;
+    long long sums_cap;
+    char *block;                 // one block of buffer space
+    long long *pending;          // block, token, checksum and whether it was
+                                 // recovered, of each staged block
+    int pending_count;
+    int pending_cap;
+    int log_fd;
+    long long *log;              // first block, count of each entry since the last sync
+    int log_count;
+    int log_synced;              // entries on disk and synced
+    int log_cap;
+    unsigned char *logged;       // per block: logged alone since the last sync
+    block_checksum_stats_t stats;
+} checksum_state_t;
+
+static uint32_t block_sum(const char *data, int size) {
+    uint32_t crc = block_crc32c(0, data, size);
+    return crc ? crc : 0xffffffff;
+}
+
+uint32_t block_checksum_of(const char *data, int size) {
+    return block_sum(data, size);
+}
+
+static int sums_reserve(checksum_state_t *c, long long len) {
+    if (len <= c->sums_cap) return 0;
+    long long cap = c->sums_cap ? c->sums_cap : 1024;
+    while (cap < len) cap *= 2;
+    uint32_t *sums = realloc(c->sums, cap * sizeof(uint32_t));
+    if (!sums) return -1;
+    memset(sums + c->sums_cap, 0, (cap - c->sums_cap) * sizeof(uint32_t));
+    c->sums = sums;
+    unsigned char *logged = realloc(c->logged, cap);
+    if (!logged) return -1;
+    memset(logged + c->sums_cap, 0, cap - c->sums_cap);
+    c->logged = logged;
+    c->sums_cap = cap;
+    return 0;
+}
+
+// Note blocks about to change. A single block is noted once per sync.
+static int log_note(checksum_state_t *c, long long first, long long count) {
+    if (count <= 0 || (count == 1 && first < c->sums_cap && c->logged[first])) {
+        return 0;
+    }
+    if (count == 1 && sums_reserve(c, first + 1) != 0) {
+        return -1;
+    }
+    if (c->log_count == c->log_cap) {
+        int cap = c->log_cap ? c->log_cap * 2 : 64;
+        long long *log = realloc(c->log, cap * 2 * sizeof(long long));
+        if (!log) return -1;
+        c->log = log;
+        c->log_cap = cap;
+    }
+    c->log[2 * c->log_count] = first;
+    c->log[2 * c->log_count + 1] = count;
+    c->log_count++;
+    if (count == 1) c->logged[first] = 1;
+    return 0;
+}
+
+// Get the noted blocks on disk before any of them is written
+static int log_commit(checksum_state_t *c) {
+    int n = c->log_count - c->log_synced;
+    if (n == 0) {
+        return 0;
+    }
+    unsigned char *raw = malloc(n * LOG_ENTRY_SIZE);
+    if (!raw) {
+        return -1;
+    }
+    for (int i = 0; i < 2 * n; i++) {
+        unsigned long long value = c->log[2 * c->log_synced + i];
+        for (int j = 0; j < 8; j++) {
+            raw[8 * i + j] = (unsigned char)(value >> (8 * j));
+        }
+    }
+    int rc = block_pwrite_full(c->log_fd, (const char *)raw, n * LOG_ENTRY_SIZE,
+                               (long long)c->log_synced * LOG_ENTRY_SIZE);
+    free(raw);
+    if (rc != 0 || block_sync_fd(c->log_fd, BLOCK_SYNC_NORMAL) != 0) {
+        return -1;
+    }
+    c->log_synced = c->log_count;
+    return 0;
+}
+
+// Empty the log once the blocks and the table are synced. A truncation
+// lost in a crash only has blocks checked again for nothing.
+static int log_clear(checksum_state_t *c) {
+    if (c->log_count == 0) {
+        return 0;
+    }
+    if (ftruncate(c->log_fd, 0) != 0) {
+        return -1;
+    }
+    for (int i = 0; i < c->log_count; i++) {
+        if (c->log[2 * i + 1] == 1) c->logged[c->log[2 * i]] = 0;
+    }
+    c->log_count = 0;
+    c->log_synced = 0;
+    return 0;
+}
+
+static int sum_set(checksum_state_t *c, long long block_num, uint32_t sum) {
+    unsigned char raw[CHECKSUM_SIZE];
+    for (int i = 0; i < CHECKSUM_SIZE; i++) {
+        raw[i] = (unsigned char)(sum >> (8 * i));
+    }
+    if (sums_reserve(c, block_num + 1) != 0 ||
+        block_pwrite_full(c->fd, (const char *)raw, CHECKSUM_SIZE, block_num * CHECKSUM_SIZE) != 0) {
+        return -1;
+    }
+    c->unsynced = 1;
+    c->sums[block_num] = sum;
+    if (block_num >= c->sums_len) c->sums_len = block_num + 1;
+    return 0;
+}
+
+static int sums_load(checksum_state_t *c) {
+    struct stat sb;
+    if (fstat(c->fd, &sb) != 0) {
+        return -1;
+    }
+    long long len = sb.st_size / CHECKSUM_SIZE;
+    if (sums_reserve(c, len) != 0) {
+        return -1;
+    }
+    
+    unsigned char chunk[CHECKSUM_SIZE * 1024];
+    for (long long i = 0; i < len; i += 1024) {
+        int n = (len - i < 1024) ? (int)(len - i) : 1024;
+        if (block_pread_full(c->fd, (char *)chunk, n * CHECKSUM_SIZE, i * CHECKSUM_SIZE) != n * CHECKSUM_SIZE) {
+            return -1;
+        }
+        for (int j = 0; j < n; j++) {
+            const unsigned char *raw = chunk + j * CHECKSUM_SIZE;
+            c->sums[i + j] = raw[0] | raw[1] << 8 | raw[2] << 16 | (uint32_t)raw[3] << 24;
+        }
+    }
+    c->sums_len = len;
+    return 0;
+}
+
+// Check a whole block read from the wrapped backend
+static int verify(checksum_state_t *c, long long block_num, const char *data) {
+    uint32_t expected = (block_num < c->sums_len) ? c->sums[block_num] : 0;
+    int ok = expected ? block_sum(data, c->block_size) == expected : block_is_zero(data, c->block_size);
+    c->stats.blocks_verified++;
+    if (!ok) {
+        c->stats.failures++;
+        c->stats.last_failed_block = block_num;
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+static int sum_set(checksum_state_t *c, long long block_num, uint32_t sum);
+
+// Enter the checksums of the blocks a log left by a crash lists, as the
+// blocks are now. Blocks that cannot be read keep failing.
+static int log_replay(checksum_state_t *c) {
+    struct stat sb;
+    if (fstat(c->log_fd, &sb) != 0) {
+        return -1;
+    }
+    long long entries = sb.st_size / LOG_ENTRY_SIZE;
+    if (entries == 0) {
+        return 0;
+    }
+    long long stored = (c->inner->size(c->state, 0) + c->block_size - 1) / c->block_size;
+    long long end_limit = (stored > c->sums_len) ? stored : c->sums_len;
+    for (long long e = 0; e < entries; e++) {
+        unsigned char raw[LOG_ENTRY_SIZE];
+        if (block_pread_full(c->log_fd, (char *)raw, LOG_ENTRY_SIZE, e * LOG_ENTRY_SIZE) != LOG_ENTRY_SIZE) {
+            return -1;
+        }
+        long long first = 0, count = 0;
+        for (int j = 7; j >= 0; j--) {
+            first = (first << 8) | raw[j];
+            count = (count << 8) | raw[8 + j];
+        }
+        long long end = (count > end_limit - first) ? end_limit : first + count;
+        for (long long b = (first < 0) ? 0 : first; b < end; b++) {
+            if (c->inner->read(c->state, b, 0, c->block_size, c->block) != 0) {
+                continue;
+            }
+            uint32_t sum = block_is_zero(c->block, c->block_size) ? 0 : block_sum(c->block, c->block_size);
+            uint32_t old = (b < c->sums_len) ? c->sums[b] : 0;
+            if (sum != old && sum_set(c, b, sum) != 0) {
+                return -1;
+            }
+        }
+    }
+    if (c->unsynced && block_sync_fd(c->fd, BLOCK_SYNC_NORMAL) != 0) {
+        return -1;
+    }
+    c->unsynced = 0;
+    return ftruncate(c->log_fd, 0);
+}
+
+int block_checksum_open(const block_backend_t *inner, void *inner_state, const char *filename,
+                        int block_size, void **state) {
+    char block_dir[MAX_PATH_LEN];
+    char path[MAX_PATH_LEN];
+    char log_path[MAX_PATH_LEN];
+    if (block_dir_path(filename, block_dir) != 0 ||
+        snprintf(path, sizeof(path), "%s/%s", block_dir, CHECKSUMS_NAME) >= (int)sizeof(path) ||
+        snprintf(log_path, sizeof(log_path), "%s/%s", block_dir, CHECKSUMS_LOG_NAME) >= (int)sizeof(log_path)) {
+        return -1;
+    }
+    
+    if (!inner->stage) {
+        return -1;
+    }
+    checksum_state_t *c = calloc(1, sizeof(checksum_state_t));
+    if (!c) return -1;
+    c->inner = inner;
+    c->state = inner_state;
+    c->block_size = block_size;
+    c->stats.last_failed_block = -1;
+    c->block = malloc(block_size);
+    c->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    // The log must outlast a crash from its first use on, so a new one's
+    // directory entry is synced right away
+    c->log_fd = open(log_path, O_RDWR | O_CLOEXEC);
+    if (c->log_fd < 0 && errno == ENOENT) {
+        const char *dirs[1] = { block_dir };
+        c->log_fd = open(log_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (c->log_fd >= 0 && block_sync_dirs(dirs, 1, BLOCK_SYNC_NORMAL) != 0) {
+            close(c->log_fd);
+            c->log_fd = -1;
+        }
+    }
+    if (!c->block || c->fd < 0 || c->log_fd < 0 || sums_load(c) != 0 || log_replay(c) != 0) {
+        if (c->fd >= 0) close(c->fd);
+        if (c->log_fd >= 0) close(c->log_fd);
+        free(c->block);
+        free(c->sums);
+        free(c->logged);
+        free(c);
+        return -1;
+    }
+    *state = c;
+    return 0;
+}
+
+// Only made by block_checksum_open, around an open backend
+static int checksum_open(const char *filename, int block_size, void **state) {
+    return -1;
+}
+
+// Blocks written since the last sync are synced with their checksums, so
+// the log can be emptied and the next open checks them like any other
+static void checksum_close(void *state) {
+    checksum_state_t *c = state;
+    if (c->log_count > 0 && c->inner->sync(c->state, BLOCK_SYNC_NORMAL) >= 0 &&
+        (!c->unsynced || block_sync_fd(c->fd, BLOCK_SYNC_NORMAL) == 0)) {
+        log_clear(c);
+    }
+    c->inner->close(c->state);
+    close(c->fd);
+    close(c->log_fd);
+    free(c->block);
+    free(c->sums);
+    free(c->logged);
+    free(c->log);
+    free(c->pending);
+    free(c);
+}
+
+static int checksum_read(void *state, long long block_num, int offset, int size, char *buf) {
+    checksum_state_t *c = state;
+    int whole = (offset == 0 && size == c->block_size);
+    char *block = whole ? buf : c->block;
+    if (c->inner->read(c->state, block_num, 0, c->block_size, block) != 0 ||
+        verify(c, block_num, block) != 0) {
+        return -1;
+    }
+    if (!whole) {
+        memcpy(buf, block + offset, size);
+    }
+    return 0;
+}
+
+// The block is stored before its checksum, as the packed index follows
+// the slot it points at
+static int checksum_write(void *state, long long block_num, const char *data) {
+    checksum_state_t *c = state;
+    uint32_t sum = block_sum(data, c->block_size);
+    if (log_note(c, block_num, 1) != 0 || log_commit(c) != 0 ||
+        c->inner->write(c->state, block_num, data) != 0) {
+        return -1;
+    }
+    return sum_set(c, block_num, sum);
+}
+
+static int checksum_read_many(void *state, int count, const long long *block_nums, char *const *bufs) {
+    checksum_state_t *c = state;
+    if (!c->inner->read_many) {
+        for (int i = 0; i < count; i++) {
+            if (checksum_read(c, block_nums[i], 0, c->block_size, bufs[i]) != 0) return -1;
+        }
+        return 0;
+    }
+    if (c->inner->read_many(c->state, count, block_nums, bufs) != 0) {
+        return -1;
+    }
+    int result = 0;
+    for (int i = 0; i < count; i++) {
+        if (verify(c, block_nums[i], bufs[i]) != 0) {
+            result = -1;
+        }
+    }
+    return result;
+}
+
+// The whole batch is logged with one sync
+static int checksum_write_many(void *state, int count, const long long *block_nums, const char *const *data) {
+    checksum_state_t *c = state;
+    for (int i = 0; i < count; i++) {
+        if (log_note(c, block_nums[i], 1) != 0) return -1;
+    }
+    if (log_commit(c) != 0) {
+        return -1;
+    }
+    if (!c->inner->write_many) {
+        for (int i = 0; i < count; i++) {
+            if (checksum_write(c, block_nums[i], data[i]) != 0) return -1;
+        }
+        return 0;
+    }
+    if (c->inner->write_many(c->state, count, block_nums, data) != 0) {
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        if (sum_set(c, block_nums[i], block_sum(data[i], c->block_size)) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int checksum_truncate(void *state, long long block_count, int tail) {
+    checksum_state_t *c = state;
+    long long first = (tail > 0 && block_count > 0) ? block_count - 1 : block_count;
+    if (log_note(c, first, c->sums_len - first) != 0 || log_commit(c) != 0 ||
+        c->inner->truncate(c->state, block_count, tail) != 0) {
+        return -1;
+    }
+    if (block_count < c->sums_len) {
+        if (ftruncate(c->fd, block_count * CHECKSUM_SIZE) != 0) {
+            return -1;
+        }
+        c->unsynced = 1;
+        memset(c->sums + block_count, 0, (c->sums_len - block_count) * sizeof(uint32_t));
+        c->sums_len = block_count;
+    }
+    
+    // The backend zeroed the end of a partial last block
+    if (tail == 0 || block_count == 0 || block_count > c->sums_len || !c->sums[block_count - 1]) {
+        return 0;
+    }
+    if (c->inner->read(c->state, block_count - 1, 0, c->block_size, c->block) != 0) {
+        return -1;
+    }
+    return sum_set(c, block_count - 1, block_sum(c->block, c->block_size));
+}
+
+static long long checksum_size(void *state, long long known_size) {
+    checksum_state_t *c = state;
+    return c->inner->size(c->state, known_size);
+}
+
+// The side table is synced with the blocks, and only if they were written;
+// then nothing logged needs checking again
+static int checksum_sync(void *state, int flags) {
+    checksum_state_t *c = state;
+    int result = c->inner->sync(c->state, flags);
+    if (result < 0) {
+        return -1;
+    }
+    if (c->unsynced) {
+        if (block_sync_fd(c->fd, flags) != 0) return -1;
+        c->unsynced = 0;
+    }
+    return (log_clear(c) != 0) ? -1 : result;
+}
+
+static int pending_add(checksum_state_t *c, long long block_num, long long token, uint32_t sum,
+                       int recovered) {
+    if (c->pending_count == c->pending_cap) {
+        int cap = c->pending_cap ? c->pending_cap * 2 : 64;
+        long long *pending = realloc(c->pending, cap * 4 * sizeof(long long));
+        if (!pending) return -1;
+        c->pending = pending;
+        c->pending_cap = cap;
+    }
+    long long *p = c->pending + 4 * c->pending_count++;
+    p[0] = block_num;
+    p[1] = token;
+    p[2] = sum;
+    p[3] = recovered;
+    return 0;
+}
+
+// The checksum of a staged block is entered when it is published
+static int checksum_stage(void *state, long long block_num, const char *data, long long *token) {
+    checksum_state_t *c = state;
+    uint32_t sum = block_sum(data, c->block_size);
+    if (log_note(c, block_num, 1) != 0 || c->inner->stage(c->state, block_num, data, token) != 0) {
+        return -1;
+    }
+    if (pending_add(c, block_num, *token, sum, 0) != 0) {
+        c->inner->publish(c->state, block_num, *token, 1);
+        return -1;
+    }
+    return 0;
+}
+
+int block_checksum_expect(void *state, long long block_num, long long token, uint32_t sum) {
+    checksum_state_t *c = state;
+    return pending_add(c, block_num, token, sum, 1);
+}
+
+// A block published again after a crash gets the checksum it was staged
+// with, and is read back against it: one lost or torn in the crash is
+// counted as a failure now, and fails every read until rewritten. Blocks
+// with no checksum to go by, from older manifests, are read back for one.
+static int checksum_publish(void *state, long long block_num, long long token, int discard) {
+    checksum_state_t *c = state;
+    long long sum = -1;
+    int recovered = 0;
+    for (int i = 0; i < c->pending_count; i++) {
+        long long *p = c->pending + 4 * i;
+        if (p[0] == block_num && p[1] == token) {
+            sum = p[2];
+            recovered = (int)p[3];
+            memcpy(p, c->pending + 4 * --c->pending_count, 4 * sizeof(long long));
+            break;
+        }
+    }
+    // The blocks of a batch were noted as they were staged
+    if ((!discard && !recovered && log_commit(c) != 0) ||
+        c->inner->publish(c->state, block_num, token, discard) != 0) {
+        return -1;
+    }
+    if (discard) {
+        return 0;
+    }
+    if (sum < 0 || recovered) {
+        int rc = c->inner->read(c->state, block_num, 0, c->block_size, c->block);
+        if (sum < 0) {
+            if (rc != 0) return -1;
+            sum = block_sum(c->block, c->block_size);
+        } else {
+            c->stats.blocks_verified++;
+            if (rc != 0 || block_sum(c->block, c->block_size) != (uint32_t)sum) {
+                c->stats.failures++;
+                c->stats.last_failed_block = block_num;
+            }
+        }
+    }
+    return sum_set(c, block_num, (uint32_t)sum);
+}
+
+static int checksum_punch(void *state, long long block_num) {
+    checksum_state_t *c = state;
+    if (!c->inner->punch) {
+        memset(c->block, 0, c->block_size);
+        return checksum_write(c, block_num, c->block);
+    }
+    if (log_note(c, block_num, 1) != 0 || log_commit(c) != 0 || c->inner->punch(c->state, block_num) != 0) {
+        return -1;
+    }
+    return (block_num < c->sums_len && c->sums[block_num]) ? sum_set(c, block_num, 0) : 0;
+}
+
+// A mapped block is checked once per fetch
+static int checksum_map(void *state, long long block_num, const char **data) {
+    checksum_state_t *c = state;
+    if (!c->inner->map) {
+        return 1;
+    }
+    int rc = c->inner->map(c->state, block_num, data);
+    if (rc != 0) {
+        return rc;
+    }
+    if (verify(c, block_num, *data) != 0) {
+        c->inner->unmap(c->state, block_num, *data);
+        return -1;
+    }
+    return 0;
+}
+
+static void checksum_unmap(void *state, long long block_num, const char *data) {
+    checksum_state_t *c = state;
+    c->inner->unmap(c->state, block_num, data);
+}
+
+static int checksum_release(void *state) {
+    checksum_state_t *c = state;
+    return c->inner->release ? c->inner->release(c->state) : 0;
+}
+
+const block_backend_t block_checksum_backend = {
+    "checksum", 1, checksum_open, checksum_close, checksum_read, checksum_write,
+    checksum_truncate, checksum_size, checksum_sync, checksum_stage, checksum_publish,
+    checksum_map, checksum_unmap, checksum_read_many, checksum_write_many, checksum_punch,
+    NULL, NULL, NULL, checksum_release
+};
+
+void block_checksum_stats(void *state, block_checksum_stats_t *stats) {
+    checksum_state_t *c = state;
+    *stats = c->stats;
+}
+
+const block_backend_t *block_checksum_inner(void *state, void **inner_state) {
+    checksum_state_t *c = state;
+    *inner_state = c->state;
+    return c->inner;
+}
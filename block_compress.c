@@ -0,0 +1,355 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include "block_internal.h"
+
+// Per-block compression, as a backend that wraps the one holding the
+// blocks. Each block is stored as one of:
+//
+//   nothing          a hole, all zeros
+//   block_size bytes the block as is, when compressing saves too little
+//   shorter          a 4-byte header (codec, 0, payload length as a
+//                    little-endian uint16) and the compressed payload
+//
+// so the wrapped backend must keep the length of what it stores
+// (read_sized, write_sized, stage_sized). The codec is an LZ77 variant
+// with LZ4's sequence layout: a token byte holding literal and match
+// lengths, the literals, then a 2-byte offset and any match length bytes.
+
+#define COMPRESS_HEADER 4
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_SKIP_TRIGGER 5       // misses before the scan starts skipping ahead
+
+typedef struct {
+    const block_backend_t *inner;
+    void *state;
+    int block_size;
+    int codec;
+    char *stored;                // a block as stored
+    char *plain;                 // a block decompressed
+    block_compress_stats_t stats;
+} compress_state_t;
+
+static uint32_t read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+// Write the bytes that extend a length past 15
+static unsigned char *lz_put_length(unsigned char *op, unsigned char *oend, int len) {
+    while (len >= 255) {
+        if (op >= oend) return NULL;
+        *op++ = 255;
+        len -= 255;
+    }
+    if (op >= oend) return NULL;
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+// Append a sequence; match_len 0 ends the data with literals only
+static unsigned char *lz_put_sequence(unsigned char *op, unsigned char *oend, const unsigned char *lit,
+                                      int lit_len, int offset, int match_len) {
+    if (op >= oend) return NULL;
+    unsigned char *token = op++;
+    int ml = match_len ? match_len - LZ_MIN_MATCH : 0;
+    *token = (unsigned char)(((lit_len < 15 ? lit_len : 15) << 4) | (ml < 15 ? ml : 15));
+    if (lit_len >= 15 && !(op = lz_put_length(op, oend, lit_len - 15))) return NULL;
+    if (oend - op < lit_len) return NULL;
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+    if (!match_len) return op;
+    
+    if (oend - op < 2) return NULL;
+    *op++ = (unsigned char)(offset & 0xff);
+    *op++ = (unsigned char)(offset >> 8);
+    if (ml >= 15 && !(op = lz_put_length(op, oend, ml - 15))) return NULL;
+    return op;
+}
+
+int block_lz_compress(const char *input, int size, char *output, int capacity) {
+    const unsigned char *src = (const unsigned char *)input;
+    const unsigned char *ip = src;
+    const unsigned char *anchor = src;
+    const unsigned char *end = src + size;
+    unsigned char *op = (unsigned char *)output;
+    unsigned char *oend = op + capacity;
+    uint16_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+    if (size > 65536) {
+        return 0;
+    }
+    
+    int misses = 0;
+    while (ip + LZ_MIN_MATCH <= end) {
+        uint32_t seq = read32(ip);
+        uint32_t h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+        const unsigned char *ref = src + table[h];
+        table[h] = (uint16_t)(ip - src);
+        if (ref >= ip || ip - ref > 65535 || read32(ref) != seq) {
+            // Incompressible data is crossed in growing steps
+            ip += 1 + (misses++ >> LZ_SKIP_TRIGGER);
+            continue;
+        }
+        misses = 0;
+    
+        const unsigned char *mp = ip + LZ_MIN_MATCH;
+        const unsigned char *rp = ref + LZ_MIN_MATCH;
+        while (mp < end && *mp == *rp) {
+            mp++;
+            rp++;
+        }
+        op = lz_put_sequence(op, oend, anchor, (int)(ip - anchor), (int)(ip - ref), (int)(mp - ip));
+        if (!op) return 0;
+        ip = anchor = mp;
+    }
+    op = lz_put_sequence(op, oend, anchor, (int)(end - anchor), 0, 0);
+    return op ? (int)(op - (unsigned char *)output) : 0;
+}
+
+// Read the bytes that extend a length past 15
+static const unsigned char *lz_get_length(const unsigned char *ip, const unsigned char *iend, int *len) {
+    int b;
+    do {
+        if (ip >= iend) return NULL;
+        b = *ip++;
+        *len += b;
+    } while (b == 255);
+    return ip;
+}
+
+int block_lz_decompress(const char *input, int size, char *output, int capacity) {
+    const unsigned char *ip = (const unsigned char *)input;
+    const unsigned char *iend = ip + size;
+    unsigned char *dst = (unsigned char *)output;
+    unsigned char *op = dst;
+    unsigned char *oend = dst + capacity;
+    
+    while (ip < iend) {
+        int token = *ip++;
+        int lit = token >> 4;
+        if (lit == 15 && !(ip = lz_get_length(ip, iend, &lit))) return -1;
+        if (iend - ip < lit || oend - op < lit) return -1;
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == iend) break;
+    
+        if (iend - ip < 2) return -1;
+        int offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        int ml = token & 15;
+        if (ml == 15 && !(ip = lz_get_length(ip, iend, &ml))) return -1;
+        ml += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op - dst || oend - op < ml) return -1;
+    
+        // Byte by byte, since the match may overlap what it produces
+        const unsigned char *ref = op - offset;
+        while (ml--) *op++ = *ref++;
+    }
+    return (int)(op - dst);
+}
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Compress a block into c->stored. Returns the bytes to store and sets
+// *out to them, which is the block itself when compression is bypassed.
+static int encode(compress_state_t *c, const char *data, const char **out) {
+    int bs = c->block_size;
+    long long t0 = now_ns();
+    // Worth it only if at least an eighth of the block is saved
+    int len = block_lz_compress(data, bs, c->stored + COMPRESS_HEADER, bs - bs / 8 - COMPRESS_HEADER);
+    c->stats.compress_ns += now_ns() - t0;
+    c->stats.bytes_in += bs;
+    if (len == 0) {
+        c->stats.blocks_raw++;
+        c->stats.bytes_out += bs;
+        *out = data;
+        return bs;
+    }
+    
+    c->stored[0] = (char)c->codec;
+    c->stored[1] = 0;
+    c->stored[2] = (char)(len & 0xff);
+    c->stored[3] = (char)(len >> 8);
+    c->stats.blocks_compressed++;
+    c->stats.bytes_out += COMPRESS_HEADER + len;
+    *out = c->stored;
+    return COMPRESS_HEADER + len;
+}
+
+// Turn len stored bytes in c->stored into a whole block
+static int decode(compress_state_t *c, int len, char *block) {
+    int bs = c->block_size;
+    if (len == 0) {
+        memset(block, 0, bs);
+        return 0;
+    }
+    if (len == bs) {
+        memcpy(block, c->stored, bs);
+        return 0;
+    }
+    
+    const unsigned char *h = (const unsigned char *)c->stored;
+    int payload = h[2] | (h[3] << 8);
+    if (len < COMPRESS_HEADER || h[0] != c->codec || payload != len - COMPRESS_HEADER) {
+        errno = EIO;
+        return -1;
+    }
+    long long t0 = now_ns();
+    int n = block_lz_decompress(c->stored + COMPRESS_HEADER, payload, block, bs);
+    c->stats.decompress_ns += now_ns() - t0;
+    c->stats.blocks_decompressed++;
+    if (n != bs) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+// The wrapper stages and publishes through the inner backend, so it needs
+// atomic batches as well as sized blocks
+int block_compress_supported(const block_backend_t *inner) {
+    return inner->read_sized && inner->write_sized && inner->punch && inner->stage && inner->stage_sized &&
+           inner->publish;
+}
+
+int block_compress_open(const block_backend_t *inner, void *inner_state, int block_size, int codec,
+                        void **state) {
+    if (codec != BLOCK_COMPRESS_LZ || !block_compress_supported(inner)) {
+        return -1;
+    }
+    compress_state_t *c = calloc(1, sizeof(compress_state_t));
+    if (!c) return -1;
+    c->inner = inner;
+    c->state = inner_state;
+    c->block_size = block_size;
+    c->codec = codec;
+    c->stored = malloc(block_size);
+    c->plain = malloc(block_size);
+    if (!c->stored || !c->plain) {
+        free(c->stored);
+        free(c->plain);
+        free(c);
+        return -1;
+    }
+    *state = c;
+    return 0;
+}
+
+// Only made by block_compress_open, around an open backend
+static int compress_open(const char *filename, int block_size, void **state) {
+    return -1;
+}
+
+static void compress_close(void *state) {
+    compress_state_t *c = state;
+    c->inner->close(c->state);
+    free(c->stored);
+    free(c->plain);
+    free(c);
+}
+
+static int compress_read(void *state, long long block_num, int offset, int size, char *buf) {
+    compress_state_t *c = state;
+    int len = c->inner->read_sized(c->state, block_num, c->stored);
+    if (len < 0) {
+        return -1;
+    }
+    if (offset == 0 && size == c->block_size) {
+        return decode(c, len, buf);
+    }
+    if (decode(c, len, c->plain) != 0) {
+        return -1;
+    }
+    memcpy(buf, c->plain + offset, size);
+    return 0;
+}
+
+static int compress_write(void *state, long long block_num, const char *data) {
+    compress_state_t *c = state;
+    const char *out;
+    int len = encode(c, data, &out);
+    return c->inner->write_sized(c->state, block_num, out, len);
+}
+
+// A stored partial last block is cut by decompressing, zeroing and
+// storing it again
+static int compress_truncate(void *state, long long block_count, int tail) {
+    compress_state_t *c = state;
+    if (c->inner->truncate(c->state, block_count, 0) != 0) {
+        return -1;
+    }
+    if (tail == 0 || block_count == 0) {
+        return 0;
+    }
+    
+    int len = c->inner->read_sized(c->state, block_count - 1, c->stored);
+    if (len <= 0) {
+        return len;
+    }
+    if (decode(c, len, c->plain) != 0) {
+        return -1;
+    }
+    memset(c->plain + tail, 0, c->block_size - tail);
+    return compress_write(c, block_count - 1, c->plain);
+}
+
+// Stored blocks are shorter than they read, so blocks the manifest does
+// not know of count as whole
+static long long compress_size(void *state, long long known_size) {
+    compress_state_t *c = state;
+    long long size = c->inner->size(c->state, known_size);
+    if (size > known_size) {
+        size = (size + c->block_size - 1) / c->block_size * c->block_size;
+    }
+    return size;
+}
+
+static int compress_sync(void *state, int flags) {
+    compress_state_t *c = state;
+    return c->inner->sync(c->state, flags);
+}
+
+static int compress_stage(void *state, long long block_num, const char *data, long long *token) {
+    compress_state_t *c = state;
+    const char *out;
+    int len = encode(c, data, &out);
+    return c->inner->stage_sized(c->state, block_num, out, len, token);
+}
+
+static int compress_publish(void *state, long long block_num, long long token, int discard) {
+    compress_state_t *c = state;
+    return c->inner->publish(c->state, block_num, token, discard);
+}
+
+static int compress_punch(void *state, long long block_num) {
+    compress_state_t *c = state;
+    return c->inner->punch(c->state, block_num);
+}
+
+const block_backend_t block_compress_backend = {
+    "compress", 1, compress_open, compress_close, compress_read, compress_write,
+    compress_truncate, compress_size, compress_sync, compress_stage, compress_publish,
+    NULL, NULL, NULL, NULL, compress_punch
+};
+
+void block_compress_stats(void *state, block_compress_stats_t *stats) {
+    compress_state_t *c = state;
+    *stats = c->stats;
+    stats->ratio = c->stats.bytes_out ? (double)c->stats.bytes_in / c->stats.bytes_out : 1.0;
+}
+
+const block_backend_t *block_compress_inner(void *state, void **inner_state) {
+    compress_state_t *c = state;
+    *inner_state = c->state;
+    return c->inner;
+}
@@ -0,0 +1,932 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#ifndef __wasi__
+#include <sys/file.h>
+#endif
+#include "block_internal.h"
+#if defined(__x86_64__)
+#define BLOCK_HAVE_SHA_NI 1
+#include <immintrin.h>
+#endif
+
+#define HASH_SIZE 32
+#define OBJECT_HEADER 8             // little-endian reference count
+#define OBJECTS_NAME "objects"
+#define OBJECTS_DEFAULT ".wasql-objects"
+#define SYNC_CHUNK 64               // objects opened at once when syncing
+
+// Deduplicated block storage: every distinct block is stored once, as an
+// object named by the SHA-256 of its contents, in an object directory
+// that any number of stores share. A store keeps only a map from block
+// number to hash.
+//
+//   filename.blocks/objects:  path of the object directory
+//   filename.blocks/map:      32 bytes per block, the hash of its object,
+//                             all zero for a hole
+//   objects/XX/YY/<hash>:     the reference count, then the block
+//
+// A reference count changes under flock on the object, so stores in any
+// process can share objects. A count may err high after a crash, leaking
+// an object, but never low: new references are counted before the map
+// names them, and old ones are only dropped by sync, once the map that no
+// longer names them is on disk.
+typedef struct {
+    char *dir;
+    char *objects;
+    int block_size;
+    int map_fd;
+    unsigned char *map;             // HASH_SIZE bytes per block
+    long long map_len;              // blocks covered, trailing holes dropped
+    long long map_cap;
+    unsigned char *touched;         // objects referenced since the last sync
+    int touched_count;
+    int touched_cap;
+    unsigned char *created;         // objects created since the last sync
+    int created_count;
+    int created_cap;
+    int dirs_made;                  // object directories made since the last sync
+    unsigned char *released;        // references to drop at the next sync
+    int released_count;
+    int released_cap;
+    unsigned char *staged;          // hashes of staged blocks, by token
+    unsigned char *staged_fresh;    // staged since open, so not yet published
+    long long staged_count;
+    long long staged_cap;
+    long long staged_live;          // staged and not yet published or discarded
+    int staged_fd;
+    char *scratch;
+    block_dedup_stats_t stats;
+} dedup_state_t;
+
+static const unsigned char zero_hash[HASH_SIZE];
+
+// Object directory of stores created afterwards, "" for the default
+static block_mutex_t objects_lock = BLOCK_MUTEX_INITIALIZER;
+static char objects_setting[MAX_PATH_LEN];
+
+// SHA-256 (FIPS 180-4)
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(uint32_t *h, const unsigned char *p) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 |
+               (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], k = h[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = k + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        k = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+    h[5] += f;
+    h[6] += g;
+    h[7] += k;
+}
+
+#if BLOCK_HAVE_SHA_NI
+// The same rounds on the SHA extensions, four at a time. The state is
+// held as ABEF and CDGH, the order the instructions take it in.
+__attribute__((target("sha,sse4.1")))
+static void sha256_blocks_ni(uint32_t *h, const unsigned char *p, int count) {
+    const __m128i swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i cdab = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)h), 0xb1);
+    __m128i efgh = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)(h + 4)), 0x1b);
+    __m128i abef = _mm_alignr_epi8(cdab, efgh, 8);
+    __m128i cdgh = _mm_blend_epi16(efgh, cdab, 0xf0);
+    
+    for (; count > 0; count--, p += 64) {
+        __m128i abef_in = abef;
+        __m128i cdgh_in = cdgh;
+        __m128i w[4];
+        for (int i = 0; i < 16; i++) {
+            if (i < 4) {
+                w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 16 * i)), swap);
+            } else {
+                __m128i t = _mm_sha256msg1_epu32(w[i % 4], w[(i + 1) % 4]);
+                t = _mm_add_epi32(t, _mm_alignr_epi8(w[(i + 3) % 4], w[(i + 2) % 4], 4));
+                w[i % 4] = _mm_sha256msg2_epu32(t, w[(i + 3) % 4]);
+            }
+            __m128i k = _mm_add_epi32(w[i % 4], _mm_loadu_si128((const __m128i *)&sha256_k[4 * i]));
+            cdgh = _mm_sha256rnds2_epu32(cdgh, abef, k);
+            abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(k, 0x0e));
+        }
+        abef = _mm_add_epi32(abef, abef_in);
+        cdgh = _mm_add_epi32(cdgh, cdgh_in);
+    }
+    
+    __m128i feba = _mm_shuffle_epi32(abef, 0x1b);
+    __m128i dchg = _mm_shuffle_epi32(cdgh, 0xb1);
+    _mm_storeu_si128((__m128i *)h, _mm_blend_epi16(feba, dchg, 0xf0));
+    _mm_storeu_si128((__m128i *)(h + 4), _mm_alignr_epi8(dchg, feba, 8));
+}
+#endif
+
+static void sha256_blocks(uint32_t *h, const unsigned char *p, int count) {
+#if BLOCK_HAVE_SHA_NI
+    if (__builtin_cpu_supports("sha")) {
+        sha256_blocks_ni(h, p, count);
+        return;
+    }
+#endif
+    for (; count > 0; count--, p += 64) {
+        sha256_block(h, p);
+    }
+}
+
+void block_sha256(const char *data, int size, unsigned char *digest) {
+    uint32_t h[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    const unsigned char *p = (const unsigned char *)data;
+    int i = size / 64 * 64;
+    sha256_blocks(h, p, size / 64);
+    
+    // Pad with a one bit, zeros and the length in bits
+    unsigned char last[128] = {0};
+    int rest = size - i;
+    memcpy(last, p + i, rest);
+    last[rest] = 0x80;
+    int tail = (rest < 56) ? 64 : 128;
+    unsigned long long bits = (unsigned long long)size * 8;
+    for (int j = 0; j < 8; j++) {
+        last[tail - 1 - j] = (unsigned char)(bits >> (8 * j));
+    }
+    sha256_blocks(h, last, tail / 64);
+    
+    for (int j = 0; j < 8; j++) {
+        digest[4 * j] = (unsigned char)(h[j] >> 24);
+        digest[4 * j + 1] = (unsigned char)(h[j] >> 16);
+        digest[4 * j + 2] = (unsigned char)(h[j] >> 8);
+        digest[4 * j + 3] = (unsigned char)h[j];
+    }
+}
+
+int block_set_object_dir(const char *dir) {
+    if (dir && strlen(dir) >= sizeof(objects_setting)) {
+        return -1;
+    }
+    block_mutex_lock(&objects_lock);
+    strcpy(objects_setting, dir ? dir : "");
+    block_mutex_unlock(&objects_lock);
+    return 0;
+}
+
+// Path of an object, fanned out on the first two bytes of its hash like
+// the blocks of a fanout store
+static int object_path(dedup_state_t *st, const unsigned char *hash, char *path) {
+    char hex[2 * HASH_SIZE + 1];
+    for (int i = 0; i < HASH_SIZE; i++) {
+        snprintf(hex + 2 * i, 3, "%02x", hash[i]);
+    }
+    int n = snprintf(path, MAX_PATH_LEN, "%s/%.2s/%.2s/%s", st->objects, hex, hex + 2, hex);
+    return (n >= MAX_PATH_LEN) ? -1 : 0;
+}
+
+static int object_make_dirs(dedup_state_t *st, const char *path) {
+    char dir[MAX_PATH_LEN];
+    strcpy(dir, path);
+    for (int level = 0; level < 2; level++) {
+        *strrchr(dir, '/') = '\0';
+    }
+    for (int level = 0; level < 2; level++) {
+        if (mkdir(dir, 0755) == 0) {
+            st->dirs_made = 1;
+        } else if (errno != EEXIST) {
+            return -1;
+        }
+        dir[strlen(dir)] = '/';
+    }
+    return 0;
+}
+
+// Lock an object for a change of its reference count. An object unlinked
+// by another store while we waited is gone; opening again gets the new one.
+static int object_lock(const char *path, int create) {
+    for (;;) {
+        int fd = open(path, O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), 0644);
+        if (fd < 0) {
+            return -1;
+        }
+#ifndef __wasi__
+        struct stat sb;
+        if (flock(fd, LOCK_EX) != 0 || fstat(fd, &sb) != 0) {
+            close(fd);
+            return -1;
+        }
+        if (sb.st_nlink > 0) {
+            return fd;
+        }
+        close(fd);
+#else
+        return fd;
+#endif
+    }
+}
+
+static void encode_count(unsigned long long count, unsigned char *out) {
+    for (int i = 0; i < OBJECT_HEADER; i++) {
+        out[i] = (unsigned char)(count >> (8 * i));
+    }
+}
+
+static unsigned long long decode_count(const unsigned char *in) {
+    unsigned long long count = 0;
+    for (int i = 0; i < OBJECT_HEADER; i++) {
+        count |= (unsigned long long)in[i] << (8 * i);
+    }
+    return count;
+}
+
+static int hash_list_add(unsigned char **list, int *count, int *cap, const unsigned char *hash) {
+    if (*count == *cap) {
+        int new_cap = *cap ? *cap * 2 : 64;
+        unsigned char *grown = realloc(*list, (size_t)new_cap * HASH_SIZE);
+        if (!grown) return -1;
+        *list = grown;
+        *cap = new_cap;
+    }
+    memcpy(*list + (size_t)(*count)++ * HASH_SIZE, hash, HASH_SIZE);
+    return 0;
+}
+
+// Add a reference to the object holding data, storing it if it is new.
+// data may be NULL when the object is known to exist.
+static int object_ref(dedup_state_t *st, const unsigned char *hash, const char *data) {
+    char path[MAX_PATH_LEN];
+    if (object_path(st, hash, path) != 0) {
+        return -1;
+    }
+    int fd = object_lock(path, data != NULL);
+    if (fd < 0 && data && errno == ENOENT && object_make_dirs(st, path) == 0) {
+        fd = object_lock(path, 1);
+    }
+    if (fd < 0) {
+        return -1;
+    }
+    
+    // A new object, or one a crash left short, gets its data first
+    unsigned char header[OBJECT_HEADER];
+    struct stat sb;
+    int rc = fstat(fd, &sb);
+    unsigned long long count = 0;
+    if (rc == 0 && sb.st_size >= OBJECT_HEADER + st->block_size) {
+        rc = (block_pread_full(fd, (char *)header, OBJECT_HEADER, 0) == OBJECT_HEADER) ? 0 : -1;
+        count = decode_count(header);
+        if (data) st->stats.blocks_shared++;
+    } else if (rc == 0 && data) {
+        rc = block_pwrite_full(fd, data, st->block_size, OBJECT_HEADER);
+        if (rc == 0) rc = hash_list_add(&st->created, &st->created_count, &st->created_cap, hash);
+        st->stats.objects_created++;
+    } else {
+        errno = EIO;
+        rc = -1;
+    }
+    if (rc == 0) {
+        encode_count(count + 1, header);
+        rc = block_pwrite_full(fd, (const char *)header, OBJECT_HEADER, 0);
+    }
+    close(fd);
+    if (rc == 0) {
+        rc = hash_list_add(&st->touched, &st->touched_count, &st->touched_cap, hash);
+    }
+    return rc;
+}
+
+// Drop a reference, removing the object with the last one
+static int object_unref(dedup_state_t *st, const unsigned char *hash) {
+    char path[MAX_PATH_LEN];
+    if (object_path(st, hash, path) != 0) {
+        return -1;
+    }
+    int fd = object_lock(path, 0);
+    if (fd < 0) {
+        return (errno == ENOENT) ? 0 : -1;
+    }
+    
+    unsigned char header[OBJECT_HEADER];
+    int rc = (block_pread_full(fd, (char *)header, OBJECT_HEADER, 0) == OBJECT_HEADER) ? 0 : -1;
+    unsigned long long count = decode_count(header);
+    if (rc == 0 && count <= 1) {
+        rc = unlink(path);
+        st->stats.objects_freed++;
+    } else if (rc == 0) {
+        encode_count(count - 1, header);
+        rc = block_pwrite_full(fd, (const char *)header, OBJECT_HEADER, 0);
+    }
+    close(fd);
+    return rc;
+}
+
+static int map_reserve(dedup_state_t *st, long long len) {
+    if (len <= st->map_cap) return 0;
+    long long cap = st->map_cap ? st->map_cap : 1024;
+    while (cap < len) cap *= 2;
+    unsigned char *map = realloc(st->map, cap * HASH_SIZE);
+    if (!map) return -1;
+    memset(map + st->map_cap * HASH_SIZE, 0, (cap - st->map_cap) * HASH_SIZE);
+    st->map = map;
+    st->map_cap = cap;
+    return 0;
+}
+
+static const unsigned char *map_entry(dedup_state_t *st, long long block_num) {
+    return (block_num < st->map_len) ? st->map + block_num * HASH_SIZE : zero_hash;
+}
+
+// Point a block at an object, queueing the release of the one it replaces
+static int map_set(dedup_state_t *st, long long block_num, const unsigned char *hash) {
+    unsigned char old[HASH_SIZE];
+    memcpy(old, map_entry(st, block_num), HASH_SIZE);
+    if (map_reserve(st, block_num + 1) != 0 ||
+        block_pwrite_full(st->map_fd, (const char *)hash, HASH_SIZE, block_num * HASH_SIZE) != 0) {
+        return -1;
+    }
+    memcpy(st->map + block_num * HASH_SIZE, hash, HASH_SIZE);
+    if (block_num >= st->map_len) st->map_len = block_num + 1;
+    while (st->map_len > 0 && memcmp(st->map + (st->map_len - 1) * HASH_SIZE, zero_hash, HASH_SIZE) == 0) {
+        st->map_len--;
+    }
+    if (memcmp(old, zero_hash, HASH_SIZE) != 0) {
+        return hash_list_add(&st->released, &st->released_count, &st->released_cap, old);
+    }
+    return 0;
+}
+
+static int map_load(dedup_state_t *st) {
+    struct stat sb;
+    if (fstat(st->map_fd, &sb) != 0) {
+        return -1;
+    }
+    long long len = sb.st_size / HASH_SIZE;
+    if (map_reserve(st, len) != 0) {
+        return -1;
+    }
+    for (long long i = 0; i < len; i += 1024) {
+        int n = (len - i < 1024) ? (int)(len - i) : 1024;
+        if (block_pread_full(st->map_fd, (char *)st->map + i * HASH_SIZE, n * HASH_SIZE, i * HASH_SIZE)
+            != n * HASH_SIZE) {
+            return -1;
+        }
+    }
+    while (len > 0 && memcmp(st->map + (len - 1) * HASH_SIZE, zero_hash, HASH_SIZE) == 0) len--;
+    st->map_len = len;
+    return 0;
+}
+
+// Find the object directory of a store, recording it on creation: the
+// configured one, or .wasql-objects beside the database
+static char *objects_resolve(const char *block_dir) {
+    char path[MAX_PATH_LEN];
+    char objects[MAX_PATH_LEN];
+    if (snprintf(path, sizeof(path), "%s/%s", block_dir, OBJECTS_NAME) >= (int)sizeof(path)) {
+        return NULL;
+    }
+    FILE *f = fopen(path, "r");
+    if (f) {
+        int ok = fgets(objects, sizeof(objects), f) != NULL;
+        fclose(f);
+        if (!ok) return NULL;
+        objects[strcspn(objects, "\n")] = '\0';
+        return strdup(objects);
+    }
+    
+    block_mutex_lock(&objects_lock);
+    strcpy(objects, objects_setting);
+    block_mutex_unlock(&objects_lock);
+    if (objects[0] == '\0') {
+        char *slash = strrchr(block_dir, '/');
+        int n = slash ? (int)(slash - block_dir) : 1;
+        snprintf(objects, sizeof(objects), "%.*s/%s", n, slash ? block_dir : ".", OBJECTS_DEFAULT);
+    }
+    
+    // Recorded absolute, so the store finds it from any working directory
+    char absolute[PATH_MAX];
+    if ((mkdir(objects, 0755) != 0 && errno != EEXIST) || !realpath(objects, absolute)) {
+        return NULL;
+    }
+    f = fopen(path, "w");
+    if (!f) {
+        return NULL;
+    }
+    int ok = fprintf(f, "%s\n", absolute) > 0;
+    ok = (fflush(f) == 0) && ok && fsync(fileno(f)) == 0;
+    ok = (fclose(f) == 0) && ok;
+    return ok ? strdup(absolute) : NULL;
+}
+
+static void dedup_free(dedup_state_t *st) {
+    if (st->map_fd >= 0) close(st->map_fd);
+    if (st->staged_fd >= 0) close(st->staged_fd);
+    free(st->dir);
+    free(st->objects);
+    free(st->map);
+    free(st->touched);
+    free(st->created);
+    free(st->released);
+    free(st->staged);
+    free(st->staged_fresh);
+    free(st->scratch);
+    free(st);
+}
+
+// Hashes staged by a batch that may have committed before a crash, for
+// the block layer to publish on open
+static int staged_load(dedup_state_t *st) {
+    struct stat sb;
+    if (fstat(st->staged_fd, &sb) != 0) {
+        return -1;
+    }
+    long long len = sb.st_size / HASH_SIZE;
+    if (len == 0) {
+        return 0;
+    }
+    st->staged = malloc(len * HASH_SIZE);
+    st->staged_fresh = calloc(len, 1);
+    if (!st->staged || !st->staged_fresh ||
+        block_pread_full(st->staged_fd, (char *)st->staged, len * HASH_SIZE, 0) != len * HASH_SIZE) {
+        return -1;
+    }
+    st->staged_count = st->staged_cap = len;
+    return 0;
+}
+
+static int dedup_open(const char *filename, int block_size, void **state) {
+    dedup_state_t *st = calloc(1, sizeof(dedup_state_t));
+    if (!st) return -1;
+    st->map_fd = -1;
+    st->staged_fd = -1;
+    st->block_size = block_size;
+    
+    char block_dir[MAX_PATH_LEN];
+    char path[MAX_PATH_LEN];
+    if (block_dir_path(filename, block_dir) != 0) {
+        dedup_free(st);
+        return -1;
+    }
+    st->dir = strdup(block_dir);
+    st->objects = objects_resolve(block_dir);
+    st->scratch = malloc(block_size);
+    if (!st->dir || !st->objects || !st->scratch ||
+        snprintf(path, sizeof(path), "%s/map", block_dir) >= (int)sizeof(path)) {
+        dedup_free(st);
+        return -1;
+    }
+    st->map_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (st->map_fd < 0 || map_load(st) != 0 ||
+        snprintf(path, sizeof(path), "%s/staged", block_dir) >= (int)sizeof(path)) {
+        dedup_free(st);
+        return -1;
+    }
+    st->staged_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (st->staged_fd < 0 || staged_load(st) != 0) {
+        dedup_free(st);
+        return -1;
+    }
+    
+    *state = st;
+    return 0;
+}
+
+static int dedup_sync(void *state, int flags);
+
+static void dedup_close(void *state) {
+    dedup_state_t *st = state;
+    // Released references are only dropped once the map is on disk
+    dedup_sync(st, BLOCK_SYNC_NORMAL);
+    dedup_free(st);
+}
+
+static long long dedup_size(void *state, long long known_size) {
+    dedup_state_t *st = state;
+    long long known_blocks = (known_size + st->block_size - 1) / st->block_size;
+    return (st->map_len > known_blocks) ? st->map_len * st->block_size : known_size;
+}
+
+static int dedup_read(void *state, long long block_num, int offset, int size, char *buf) {
+    dedup_state_t *st = state;
+    const unsigned char *hash = map_entry(st, block_num);
+    if (memcmp(hash, zero_hash, HASH_SIZE) == 0) {
+        memset(buf, 0, size);
+        return 0;
+    }
+    
+    char path[MAX_PATH_LEN];
+    if (object_path(st, hash, path) != 0) {
+        return -1;
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    int n = block_pread_full(fd, buf, size, OBJECT_HEADER + offset);
+    close(fd);
+    if (n != size) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+// Objects are opened together, then read together
+static int dedup_read_many(void *state, int count, const long long *block_nums, char *const *bufs) {
+    dedup_state_t *st = state;
+    block_io_op_t *ops = malloc((count ? count : 1) * sizeof(block_io_op_t));
+    char (*paths)[MAX_PATH_LEN] = malloc((count ? count : 1) * MAX_PATH_LEN);
+    int *which = malloc((count ? count : 1) * sizeof(int));
+    if (!ops || !paths || !which) {
+        free(ops);
+        free(paths);
+        free(which);
+        return -1;
+    }
+    
+    int result = 0;
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        const unsigned char *hash = map_entry(st, block_nums[i]);
+        if (memcmp(hash, zero_hash, HASH_SIZE) == 0) {
+            memset(bufs[i], 0, st->block_size);
+            continue;
+        }
+        if (object_path(st, hash, paths[n]) != 0) {
+            result = -1;
+            break;
+        }
+        memset(&ops[n], 0, sizeof(block_io_op_t));
+        ops[n].op = BLOCK_IO_OPEN;
+        ops[n].path = paths[n];
+        ops[n].flags = O_RDONLY;
+        which[n++] = i;
+    }
+    if (result == 0) {
+        block_io_run(ops, n);
+        for (int j = 0; j < n; j++) {
+            int fd = ops[j].result;
+            ops[j].op = BLOCK_IO_READ;
+            ops[j].fd = fd;
+            ops[j].buf = bufs[which[j]];
+            ops[j].size = st->block_size;
+            ops[j].offset = OBJECT_HEADER;
+            if (fd < 0) result = -1;
+        }
+    }
+    if (result == 0) {
+        block_io_run(ops, n);
+        for (int j = 0; j < n; j++) {
+            if (ops[j].result != st->block_size) result = -1;
+        }
+    }
+    for (int j = 0; j < n; j++) {
+        if (ops[j].op == BLOCK_IO_READ && ops[j].fd >= 0) close(ops[j].fd);
+    }
+    free(ops);
+    free(paths);
+    free(which);
+    return result;
+}
+
+// Rewriting a block with what it already holds costs nothing
+static int dedup_write(void *state, long long block_num, const char *data) {
+    dedup_state_t *st = state;
+    unsigned char hash[HASH_SIZE];
+    block_sha256(data, st->block_size, hash);
+    st->stats.blocks_written++;
+    if (memcmp(hash, map_entry(st, block_num), HASH_SIZE) == 0) {
+        st->stats.blocks_unchanged++;
+        return 0;
+    }
+    if (object_ref(st, hash, data) != 0) {
+        return -1;
+    }
+    // The object is counted before the map names it
+    return map_set(st, block_num, hash);
+}
+
+static int dedup_punch(void *state, long long block_num) {
+    dedup_state_t *st = state;
+    if (memcmp(map_entry(st, block_num), zero_hash, HASH_SIZE) == 0) {
+        return 0;
+    }
+    return map_set(st, block_num, zero_hash);
+}
+
+static int dedup_truncate(void *state, long long block_count, int tail) {
+    dedup_state_t *st = state;
+    if (block_count < st->map_len) {
+        if (ftruncate(st->map_fd, block_count * HASH_SIZE) != 0) {
+            return -1;
+        }
+        for (long long i = block_count; i < st->map_len; i++) {
+            const unsigned char *hash = st->map + i * HASH_SIZE;
+            if (memcmp(hash, zero_hash, HASH_SIZE) != 0 &&
+                hash_list_add(&st->released, &st->released_count, &st->released_cap, hash) != 0) {
+                return -1;
+            }
+        }
+        memset(st->map + block_count * HASH_SIZE, 0, (st->map_len - block_count) * HASH_SIZE);
+        st->map_len = block_count;
+        while (st->map_len > 0 && memcmp(st->map + (st->map_len - 1) * HASH_SIZE, zero_hash, HASH_SIZE) == 0) {
+            st->map_len--;
+        }
+    }
+    
+    // A partial last block becomes a new object with its end zeroed
+    if (tail == 0 || block_count == 0 || memcmp(map_entry(st, block_count - 1), zero_hash, HASH_SIZE) == 0) {
+        return 0;
+    }
+    if (dedup_read(st, block_count - 1, 0, st->block_size, st->scratch) != 0) {
+        return -1;
+    }
+    memset(st->scratch + tail, 0, st->block_size - tail);
+    return dedup_write(st, block_count - 1, st->scratch);
+}
+
+static int hash_compare(const void *a, const void *b) {
+    return memcmp(a, b, HASH_SIZE);
+}
+
+// Sync the directories of the objects created since the last sync, each
+// once, and the ones above them if any were made
+static int objects_sync_dirs(dedup_state_t *st, int flags) {
+    if (st->created_count == 0) {
+        return 0;
+    }
+    int cap = 2 * st->created_count + 1;
+    char *paths = malloc((size_t)cap * MAX_PATH_LEN);
+    const char **list = malloc(cap * sizeof(char *));
+    if (!paths || !list) {
+        free(paths);
+        free(list);
+        return -1;
+    }
+    
+    qsort(st->created, st->created_count, HASH_SIZE, hash_compare);
+    int n = 0;
+    int result = 0;
+    for (int i = 0; i < st->created_count; i++) {
+        const unsigned char *hash = st->created + (size_t)i * HASH_SIZE;
+        const unsigned char *prev = hash - HASH_SIZE;
+        int new_leaf = (i == 0 || memcmp(hash, prev, 2) != 0);
+        int new_mid = (i == 0 || hash[0] != prev[0]);
+        if (st->dirs_made && new_mid) {
+            list[n] = paths + (size_t)n * MAX_PATH_LEN;
+            if (snprintf(paths + (size_t)n * MAX_PATH_LEN, MAX_PATH_LEN, "%s/%02x", st->objects, hash[0]) >=
+                MAX_PATH_LEN) result = -1;
+            n++;
+        }
+        if (new_leaf) {
+            list[n] = paths + (size_t)n * MAX_PATH_LEN;
+            if (snprintf(paths + (size_t)n * MAX_PATH_LEN, MAX_PATH_LEN, "%s/%02x/%02x", st->objects, hash[0],
+                         hash[1]) >= MAX_PATH_LEN) result = -1;
+            n++;
+        }
+    }
+    if (st->dirs_made) {
+        list[n++] = st->objects;
+    }
+    if (result == 0 && block_sync_dirs(list, n, flags) != 0) {
+        result = -1;
+    }
+    if (result == 0) {
+        st->created_count = 0;
+        st->dirs_made = 0;
+    }
+    free(paths);
+    free(list);
+    return result;
+}
+
+// Objects referenced since the last sync go to disk with the directories
+// of new ones, then the map; only then are released references dropped
+static int dedup_sync(void *state, int flags) {
+    dedup_state_t *st = state;
+    block_io_op_t ops[SYNC_CHUNK];
+    char paths[SYNC_CHUNK][MAX_PATH_LEN];
+    int result = 0;
+    for (int i = 0; i < st->touched_count; i += SYNC_CHUNK) {
+        int n = (st->touched_count - i < SYNC_CHUNK) ? st->touched_count - i : SYNC_CHUNK;
+        for (int j = 0; j < n; j++) {
+            memset(&ops[j], 0, sizeof(block_io_op_t));
+            ops[j].op = BLOCK_IO_OPEN;
+            ops[j].path = paths[j];
+            ops[j].flags = O_RDONLY;
+            if (object_path(st, st->touched + (size_t)(i + j) * HASH_SIZE, paths[j]) != 0) {
+                ops[j].op = BLOCK_IO_FDATASYNC;
+                ops[j].fd = -1;
+            }
+        }
+        block_io_run(ops, n);
+        for (int j = 0; j < n; j++) {
+            ops[j].fd = ops[j].result;
+            ops[j].op = block_sync_op(flags);
+        }
+        block_io_run(ops, n);
+        for (int j = 0; j < n; j++) {
+            if (ops[j].fd < 0 || ops[j].result < 0) result = -1;
+            if (ops[j].fd >= 0) close(ops[j].fd);
+        }
+    }
+    if (objects_sync_dirs(st, flags) != 0 || block_sync_fd(st->map_fd, flags) != 0 ||
+        block_sync_fd(st->staged_fd, flags) != 0) {
+        result = -1;
+    }
+    if (result != 0) {
+        return -1;
+    }
+    st->touched_count = 0;
+    
+    for (int i = 0; i < st->released_count; i++) {
+        if (object_unref(st, st->released + (size_t)i * HASH_SIZE) != 0) {
+            result = -1;
+        }
+    }
+    st->released_count = 0;
+    return result;
+}
+
+// The token indexes the hashes of staged blocks, which are kept in a file
+// of their own so that a batch committed before a crash can be published
+// on open. A new batch starts the file over once the last one is done.
+static int dedup_stage(void *state, long long block_num, const char *data, long long *token) {
+    dedup_state_t *st = state;
+    unsigned char hash[HASH_SIZE];
+    block_sha256(data, st->block_size, hash);
+    if (st->staged_live == 0) {
+        st->staged_count = 0;
+    }
+    if (st->staged_count == st->staged_cap) {
+        long long cap = st->staged_cap ? st->staged_cap * 2 : 64;
+        unsigned char *staged = realloc(st->staged, cap * HASH_SIZE);
+        if (!staged) return -1;
+        st->staged = staged;
+        unsigned char *fresh = realloc(st->staged_fresh, cap);
+        if (!fresh) return -1;
+        st->staged_fresh = fresh;
+        st->staged_cap = cap;
+    }
+    
+    st->stats.blocks_written++;
+    if (object_ref(st, hash, data) != 0 ||
+        block_pwrite_full(st->staged_fd, (const char *)hash, HASH_SIZE, st->staged_count * HASH_SIZE) != 0) {
+        return -1;
+    }
+    memcpy(st->staged + st->staged_count * HASH_SIZE, hash, HASH_SIZE);
+    st->staged_fresh[st->staged_count] = 1;
+    st->staged_live++;
+    *token = st->staged_count++;
+    return 0;
+}
+
+// Point the map at a staged object. A block already holding it either
+// had the same contents, and the reference staging took is one too many,
+// or was published before a crash, and the reference is the map's.
+static int dedup_publish(void *state, long long block_num, long long token, int discard) {
+    dedup_state_t *st = state;
+    if (token < 0 || token >= st->staged_count) {
+        return -1;
+    }
+    const unsigned char *hash = st->staged + token * HASH_SIZE;
+    int fresh = st->staged_fresh[token];
+    if (fresh) {
+        st->staged_fresh[token] = 0;
+        st->staged_live--;
+    }
+    
+    if (discard || memcmp(hash, map_entry(st, block_num), HASH_SIZE) == 0) {
+        if (!discard) st->stats.blocks_unchanged++;
+        return fresh ? hash_list_add(&st->released, &st->released_count, &st->released_cap, hash) : 0;
+    }
+    return map_set(st, block_num, hash);
+}
+
+// Drop every reference of a store being deleted: the map's, those of
+// blocks staged since open and not yet published, and those queued for
+// the next sync. The map and staged files are emptied first, so a crash
+// part way leaks objects rather than leaving the store naming freed ones.
+static int dedup_release(void *state) {
+    dedup_state_t *st = state;
+    if (ftruncate(st->map_fd, 0) != 0 || ftruncate(st->staged_fd, 0) != 0 ||
+        block_sync_fd(st->map_fd, BLOCK_SYNC_NORMAL) != 0 ||
+        block_sync_fd(st->staged_fd, BLOCK_SYNC_NORMAL) != 0) {
+        return -1;
+    }
+    
+    int result = 0;
+    for (long long i = 0; i < st->map_len; i++) {
+        const unsigned char *hash = st->map + i * HASH_SIZE;
+        if (memcmp(hash, zero_hash, HASH_SIZE) != 0 && object_unref(st, hash) != 0) {
+            result = -1;
+        }
+    }
+    for (long long i = 0; i < st->staged_count; i++) {
+        if (st->staged_fresh[i] && object_unref(st, st->staged + i * HASH_SIZE) != 0) {
+            result = -1;
+        }
+    }
+    for (int i = 0; i < st->released_count; i++) {
+        if (object_unref(st, st->released + (size_t)i * HASH_SIZE) != 0) {
+            result = -1;
+        }
+    }
+    
+    // Nothing is left for close to sync or drop
+    st->map_len = 0;
+    st->staged_count = 0;
+    st->staged_live = 0;
+    st->touched_count = 0;
+    st->released_count = 0;
+    return result;
+}
+
+const block_backend_t block_dedup_backend = {
+    "dedup", 1, dedup_open, dedup_close, dedup_read, dedup_write,
+    dedup_truncate, dedup_size, dedup_sync, dedup_stage, dedup_publish,
+    NULL, NULL, dedup_read_many, NULL, dedup_punch,
+    NULL, NULL, NULL, dedup_release
+};
+
+void block_dedup_stats(void *state, block_dedup_stats_t *stats) {
+    dedup_state_t *st = state;
+    *stats = st->stats;
+}
+
+// Give a new store the map of this one, sharing every object
+int block_dedup_clone(void *state, const char *filename) {
+    dedup_state_t *st = state;
+    char block_dir[MAX_PATH_LEN];
+    char path[MAX_PATH_LEN];
+    if (block_dir_path(filename, block_dir) != 0 ||
+        snprintf(path, sizeof(path), "%s/%s", block_dir, OBJECTS_NAME) >= (int)sizeof(path)) {
+        return -1;
+    }
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        return -1;
+    }
+    int ok = fprintf(f, "%s\n", st->objects) > 0;
+    ok = (fflush(f) == 0) && ok && fsync(fileno(f)) == 0;
+    if (fclose(f) != 0 || !ok) {
+        return -1;
+    }
+    
+    for (long long i = 0; i < st->map_len; i++) {
+        const unsigned char *hash = st->map + i * HASH_SIZE;
+        if (memcmp(hash, zero_hash, HASH_SIZE) != 0 && object_ref(st, hash, NULL) != 0) {
+            return -1;
+        }
+    }
+    if (snprintf(path, sizeof(path), "%s/map", block_dir) >= (int)sizeof(path)) {
+        return -1;
+    }
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    int rc = 0;
+    for (long long i = 0; rc == 0 && i < st->map_len; i += 1024) {
+        int n = (st->map_len - i < 1024) ? (int)(st->map_len - i) : 1024;
+        rc = block_pwrite_full(fd, (const char *)st->map + i * HASH_SIZE, n * HASH_SIZE, i * HASH_SIZE);
+    }
+    if (rc == 0) rc = fdatasync(fd);
+    close(fd);
+    
+    // The new references must be on disk before the clone's manifest is
+    return (rc == 0 && dedup_sync(st, BLOCK_SYNC_NORMAL) >= 0) ? 0 : -1;
+}
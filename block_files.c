@@ -0,0 +1,965 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <dirent.h>
+#include <stdatomic.h>
+#include "block_internal.h"
+#if BLOCK_HAVE_MMAP
+#include <sys/mman.h>
+#endif
+
+// One file per block. The fan-out layout spreads blocks over two levels of
+// 256 directories keyed by bits 16-23 and 8-15 of the block number, so no
+// directory grows past 256 entries below 64GB:
+//
+//   fanout: filename.blocks/00/00/block_000000000000002a
+//   flat:   filename.blocks/block_000042 (stores created before fan-out)
+
+#define LAYOUT_FLAT   0
+#define LAYOUT_FANOUT 1
+#define TRUNCATE_PROBE_LIMIT 1024
+
+// An open descriptor for one block file
+typedef struct {
+    long long block_num;
+    int fd;
+    int writable;
+    int unsynced;                  // written since the last sync
+    unsigned long long last_used;  // LRU clock value of the last access
+} fd_entry_t;
+
+typedef struct {
+    char *filename;
+    int layout;
+    int block_size;
+    long long block_count;         // one past the highest block that may exist
+    fd_entry_t *fd_cache;          // open block descriptors, LRU-evicted
+    int fd_cache_capacity;
+    int fd_cache_count;
+    unsigned long long fd_cache_tick;
+    block_fd_cache_stats_t fd_stats;
+    long long *unsynced;           // written blocks whose descriptor was evicted
+    int unsynced_count;
+    int unsynced_capacity;
+    long long *dirs;               // fan-out directories with changed entries, see dir_add
+    int dirs_count;
+    int dirs_capacity;
+    int top_changed;               // entries of filename.blocks itself changed
+} files_state_t;
+
+static _Atomic int fd_cache_capacity = BLOCK_FD_CACHE_DEFAULT;
+
+// Get the path for a specific block file
+static int get_block_path(files_state_t *st, long long block_num, char *block_path) {
+    char block_dir[MAX_PATH_LEN];
+    if (block_dir_path(st->filename, block_dir) != 0) {
+        return -1;
+    }
+    int result;
+    if (st->layout == LAYOUT_FANOUT) {
+        result = snprintf(block_path, MAX_PATH_LEN, "%s/%02x/%02x/block_%016llx", block_dir,
+                          (unsigned)(block_num >> 16) & 0xff, (unsigned)(block_num >> 8) & 0xff,
+                          (unsigned long long)block_num);
+    } else {
+        result = snprintf(block_path, MAX_PATH_LEN, "%s/block_%06lld", block_dir, block_num);
+    }
+    return (result >= MAX_PATH_LEN) ? -1 : 0;
+}
+
+// Note a fan-out directory whose entries changed since the last sync. Leaf
+// directories are keyed by bits 8-23 of the block number, and the middle
+// ones by -1 - bits 16-23.
+static void dir_add(files_state_t *st, long long key) {
+    if (st->dirs_count > 0 && st->dirs[st->dirs_count - 1] == key) return;
+    if (st->dirs_count == st->dirs_capacity) {
+        int capacity = st->dirs_capacity ? st->dirs_capacity * 2 : 64;
+        long long *list = realloc(st->dirs, capacity * sizeof(long long));
+        if (!list) return;
+        st->dirs = list;
+        st->dirs_capacity = capacity;
+    }
+    st->dirs[st->dirs_count++] = key;
+}
+
+// An entry of the directory holding a block was added, removed or renamed
+static void dir_changed(files_state_t *st, long long block_num) {
+    if (st->layout == LAYOUT_FANOUT) {
+        dir_add(st, (block_num >> 8) & 0xffff);
+    } else {
+        st->top_changed = 1;
+    }
+}
+
+// Create the fan-out directories leading to a block path
+static int ensure_block_parents(files_state_t *st, long long block_num, const char *block_path) {
+    char dir[MAX_PATH_LEN];
+    snprintf(dir, sizeof(dir), "%s", block_path);
+    
+    // Strip the file name, then the leaf directory, creating outer first
+    char *leaf = strrchr(dir, '/');
+    if (!leaf) return -1;
+    *leaf = '\0';
+    char *mid = strrchr(dir, '/');
+    if (!mid) return -1;
+    
+    *mid = '\0';
+    if (mkdir(dir, 0755) == 0) {
+        st->top_changed = 1;
+    } else if (errno != EEXIST) {
+        return -1;
+    }
+    *mid = '/';
+    if (mkdir(dir, 0755) == 0) {
+        dir_add(st, -1 - ((block_num >> 16) & 0xff));
+    } else if (errno != EEXIST) {
+        return -1;
+    }
+    return 0;
+}
+
+// Unlink every block numbered first_block or higher under dir, descending
+// into fan-out directories
+static int unlink_blocks_from(files_state_t *st, const char *dir, long long first_block) {
+    int layout = st->layout;
+    DIR *d = opendir(dir);
+    if (!d) {
+        return (errno == ENOENT) ? 0 : -1;
+    }
+    
+    int result = 0;
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        char path[MAX_PATH_LEN];
+        if (entry->d_name[0] == '.' ||
+            snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name) >= (int)sizeof(path)) {
+            continue;
+        }
+        
+        long long block_num;
+        char extra;
+        if (strncmp(entry->d_name, "block_", 6) == 0) {
+            const char *format = (layout == LAYOUT_FANOUT) ? "%llx%c" : "%lld%c";
+            if (sscanf(entry->d_name + 6, format, &block_num, &extra) != 1 || block_num < first_block) {
+                continue;
+            }
+            if (unlink(path) == 0) {
+                dir_changed(st, block_num);
+            } else if (errno != ENOENT) {
+                result = -1;
+            }
+        } else if (layout == LAYOUT_FANOUT && strlen(entry->d_name) == 2) {
+            if (unlink_blocks_from(st, path, first_block) != 0) {
+                result = -1;
+            }
+        }
+    }
+    
+    closedir(d);
+    return result;
+}
+
+// Remember a written block whose descriptor is going away before a sync
+static void unsynced_add(files_state_t *st, long long block_num) {
+    if (st->unsynced_count == st->unsynced_capacity) {
+        int capacity = st->unsynced_capacity ? st->unsynced_capacity * 2 : 64;
+        long long *list = realloc(st->unsynced, capacity * sizeof(long long));
+        if (!list) return;
+        st->unsynced = list;
+        st->unsynced_capacity = capacity;
+    }
+    st->unsynced[st->unsynced_count++] = block_num;
+}
+
+// Close a cached descriptor and remove it from the cache
+static void fd_cache_remove(files_state_t *st, int index) {
+    if (st->fd_cache[index].unsynced) {
+        unsynced_add(st, st->fd_cache[index].block_num);
+    }
+    close(st->fd_cache[index].fd);
+    st->fd_cache[index] = st->fd_cache[--st->fd_cache_count];
+}
+
+// Close the least recently used descriptor
+static void fd_cache_evict(files_state_t *st) {
+    int lru = 0;
+    for (int i = 1; i < st->fd_cache_count; i++) {
+        if (st->fd_cache[i].last_used < st->fd_cache[lru].last_used) {
+            lru = i;
+        }
+    }
+    fd_cache_remove(st, lru);
+    st->fd_stats.evictions++;
+}
+
+// Find a cached descriptor for a block, usable for writing if for_write
+static fd_entry_t *fd_cache_find(files_state_t *st, long long block_num, int for_write) {
+    for (int i = 0; i < st->fd_cache_count; i++) {
+        fd_entry_t *e = &st->fd_cache[i];
+        if (e->block_num != block_num) continue;
+        
+        if (for_write && !e->writable) {
+            // Opened read-only earlier, reopen for writing
+            fd_cache_remove(st, i);
+            break;
+        }
+        e->last_used = ++st->fd_cache_tick;
+        st->fd_stats.hits++;
+        return e;
+    }
+    st->fd_stats.misses++;
+    return NULL;
+}
+
+// Cache a newly opened descriptor, evicting the least recently used
+static fd_entry_t *fd_cache_insert(files_state_t *st, long long block_num, int fd, int writable) {
+    if (st->fd_cache_count == st->fd_cache_capacity) {
+        fd_cache_evict(st);
+    }
+    fd_entry_t *e = &st->fd_cache[st->fd_cache_count++];
+    e->block_num = block_num;
+    e->fd = fd;
+    e->writable = writable;
+    e->unsynced = 0;
+    e->last_used = ++st->fd_cache_tick;
+    return e;
+}
+
+// Open a block that is not cached, as fd_cache_get
+static int fd_cache_open(files_state_t *st, long long block_num, int for_write, fd_entry_t **entry) {
+    char block_path[MAX_PATH_LEN];
+    if (get_block_path(st, block_num, block_path) != 0) {
+        return -1;
+    }
+    
+    // Blocks past the end are created outright. Others are opened without
+    // O_CREAT first, so that creating one is known to change its directory.
+    int flags = O_RDWR;
+    if (for_write && block_num >= st->block_count) {
+        flags |= O_CREAT;
+        dir_changed(st, block_num);
+    }
+    int writable = 1;
+    int made_parents = 0;
+    int fd;
+    for (;;) {
+        fd = open(block_path, flags | O_CLOEXEC, 0644);
+        if (fd >= 0) break;
+        if (errno == ENOENT && for_write && !(flags & O_CREAT)) {
+            flags |= O_CREAT;
+            dir_changed(st, block_num);
+        } else if (errno == ENOENT && for_write && !made_parents && st->layout == LAYOUT_FANOUT) {
+            // First block in this part of the fan-out tree
+            if (ensure_block_parents(st, block_num, block_path) != 0) {
+                return -1;
+            }
+            made_parents = 1;
+        } else if ((errno == EMFILE || errno == ENFILE) && st->fd_cache_count > 0) {
+            // Out of descriptors, give one of ours back and retry
+            fd_cache_evict(st);
+        } else if (errno == EACCES && !for_write && writable) {
+            // Read-only store
+            flags = O_RDONLY;
+            writable = 0;
+        } else if (errno == EINTR) {
+            continue;
+        } else {
+            return (errno == ENOENT && !for_write) ? 1 : -1;
+        }
+    }
+    
+    *entry = fd_cache_insert(st, block_num, fd, writable);
+    return 0;
+}
+
+// Get an open descriptor for a block. Returns 0 with *entry set, 1 if the
+// block does not exist and for_write is 0, or -1 on error.
+static int fd_cache_get(files_state_t *st, long long block_num, int for_write, fd_entry_t **entry) {
+    fd_entry_t *e = fd_cache_find(st, block_num, for_write);
+    if (e) {
+        *entry = e;
+        return 0;
+    }
+    return fd_cache_open(st, block_num, for_write, entry);
+}
+
+// Get descriptors for up to fd_cache_capacity blocks, opening the uncached
+// ones in one batch. fds[i] is -1 for a block that does not exist when
+// for_write is 0. Blocks got for writing are marked unsynced.
+static int fd_cache_get_many(files_state_t *st, int count, const long long *block_nums, int for_write,
+                             int *fds) {
+    block_io_op_t *ops = malloc(count * sizeof(block_io_op_t));
+    char *paths = malloc((size_t)count * MAX_PATH_LEN);
+    if (!ops || !paths) {
+        free(ops);
+        free(paths);
+        return -1;
+    }
+    
+    int opens = 0;
+    for (int i = 0; i < count; i++) {
+        fds[i] = -2;    // should be cached by the end
+        int repeat = 0;
+        for (int k = 0; k < i && !repeat; k++) {
+            repeat = (block_nums[k] == block_nums[i]);
+        }
+        if (repeat || fd_cache_find(st, block_nums[i], for_write)) continue;
+        
+        char *path = paths + (size_t)opens * MAX_PATH_LEN;
+        if (get_block_path(st, block_nums[i], path) != 0) {
+            free(ops);
+            free(paths);
+            return -1;
+        }
+        memset(&ops[opens], 0, sizeof(block_io_op_t));
+        ops[opens].op = BLOCK_IO_OPEN;
+        ops[opens].path = path;
+        ops[opens].flags = O_RDWR;
+        ops[opens].size = i;    // which block, for the results below
+        if (for_write && block_nums[i] >= st->block_count) {
+            ops[opens].flags |= O_CREAT;
+            dir_changed(st, block_nums[i]);
+        }
+        opens++;
+    }
+    block_io_run(ops, opens);
+    
+    int result = 0;
+    for (int j = 0; j < opens; j++) {
+        int i = ops[j].size;
+        fd_entry_t *e;
+        if (ops[j].result >= 0) {
+            fd_cache_insert(st, block_nums[i], ops[j].result, 1);
+        } else if (ops[j].result == -ENOENT && !for_write) {
+            fds[i] = -1;
+        } else {
+            // Missing fan-out directories, holes being written, descriptor
+            // limits and read-only stores take the one-at-a-time path
+            int rc = fd_cache_open(st, block_nums[i], for_write, &e);
+            if (rc < 0) {
+                result = -1;
+            } else if (rc == 1) {
+                fds[i] = -1;
+            }
+        }
+    }
+    free(ops);
+    free(paths);
+    
+    // Look the descriptors up only now, since running out of them evicts
+    // entries that may have been opened earlier in the batch
+    for (int i = 0; i < count; i++) {
+        if (fds[i] == -1) continue;
+        for (int k = 0; k < st->fd_cache_count; k++) {
+            fd_entry_t *e = &st->fd_cache[k];
+            if (e->block_num == block_nums[i]) {
+                fds[i] = e->fd;
+                if (for_write) e->unsynced = 1;
+                break;
+            }
+        }
+        if (fds[i] == -2) {
+            fds[i] = -1;
+            result = -1;
+        }
+    }
+    return result;
+}
+
+static int files_open(const char *filename, int layout, int block_size, void **state) {
+    files_state_t *st = calloc(1, sizeof(files_state_t));
+    if (!st) return -1;
+    
+    st->filename = strdup(filename);
+    st->layout = layout;
+    st->block_size = block_size;
+    st->fd_cache_capacity = fd_cache_capacity;
+    st->fd_cache = calloc(st->fd_cache_capacity, sizeof(fd_entry_t));
+    if (!st->filename || !st->fd_cache) {
+        free(st->fd_cache);
+        free(st->filename);
+        free(st);
+        return -1;
+    }
+    *state = st;
+    return 0;
+}
+
+static int fanout_open(const char *filename, int block_size, void **state) {
+    return files_open(filename, LAYOUT_FANOUT, block_size, state);
+}
+
+static int flat_open(const char *filename, int block_size, void **state) {
+    return files_open(filename, LAYOUT_FLAT, block_size, state);
+}
+
+static void files_close(void *state) {
+    files_state_t *st = state;
+    while (st->fd_cache_count > 0) {
+        close(st->fd_cache[--st->fd_cache_count].fd);
+    }
+    free(st->unsynced);
+    free(st->dirs);
+    free(st->fd_cache);
+    free(st->filename);
+    free(st);
+}
+
+static int files_read(void *state, long long block_num, int offset, int size, char *buf) {
+    files_state_t *st = state;
+    fd_entry_t *e;
+    int rc = fd_cache_get(st, block_num, 0, &e);
+    if (rc < 0) {
+        return -1;
+    }
+    
+    int bytes_read = 0;
+    if (rc == 0) {
+        bytes_read = block_pread_full(e->fd, buf, size, offset);
+        if (bytes_read < 0) {
+            return -1;
+        }
+    }
+    // Missing block or short block file, fill with zeros
+    memset(buf + bytes_read, 0, size - bytes_read);
+    return 0;
+}
+
+// A block file is as long as the block was stored; a shorter write cuts
+// off what an earlier one left beyond it
+static int files_write_sized(void *state, long long block_num, const char *data, int len) {
+    files_state_t *st = state;
+    fd_entry_t *e;
+    if (fd_cache_get(st, block_num, 1, &e) != 0) {
+        return -1;
+    }
+    if (block_pwrite_full(e->fd, data, len, 0) != 0 || (len < st->block_size && ftruncate(e->fd, len) != 0)) {
+        return -1;
+    }
+    e->unsynced = 1;
+    if (block_num + 1 > st->block_count) {
+        st->block_count = block_num + 1;
+    }
+    return 0;
+}
+
+// Blocks go in chunks the descriptor cache can hold at once: one batch
+// opens the uncached ones and a second moves the data
+static int files_read_many(void *state, int count, const long long *block_nums, char *const *bufs) {
+    files_state_t *st = state;
+    int chunk = st->fd_cache_capacity;
+    int *fds = malloc(chunk * sizeof(int));
+    block_io_op_t *ops = malloc(chunk * sizeof(block_io_op_t));
+    if (!fds || !ops) {
+        free(fds);
+        free(ops);
+        return -1;
+    }
+    
+    int result = 0;
+    for (int done = 0; done < count && result == 0; done += chunk) {
+        int n = (count - done < chunk) ? count - done : chunk;
+        if (fd_cache_get_many(st, n, block_nums + done, 0, fds) != 0) {
+            result = -1;
+            break;
+        }
+        int reads = 0;
+        for (int i = 0; i < n; i++) {
+            if (fds[i] < 0) {
+                memset(bufs[done + i], 0, st->block_size);
+                continue;
+            }
+            memset(&ops[reads], 0, sizeof(block_io_op_t));
+            ops[reads].op = BLOCK_IO_READ;
+            ops[reads].fd = fds[i];
+            ops[reads].buf = bufs[done + i];
+            ops[reads].size = st->block_size;
+            reads++;
+        }
+        block_io_run(ops, reads);
+        for (int j = 0; j < reads; j++) {
+            if (ops[j].result < 0) {
+                result = -1;
+            } else {
+                // Short block file, fill with zeros
+                memset(ops[j].buf + ops[j].result, 0, st->block_size - ops[j].result);
+            }
+        }
+    }
+    free(fds);
+    free(ops);
+    return result;
+}
+
+static int files_write(void *state, long long block_num, const char *data) {
+    return files_write_sized(state, block_num, data, ((files_state_t *)state)->block_size);
+}
+
+static int files_read_sized(void *state, long long block_num, char *buf) {
+    files_state_t *st = state;
+    fd_entry_t *e;
+    int rc = fd_cache_get(st, block_num, 0, &e);
+    if (rc != 0) {
+        return (rc > 0) ? 0 : -1;
+    }
+    return block_pread_full(e->fd, buf, st->block_size, 0);
+}
+
+static int files_write_many(void *state, int count, const long long *block_nums, const char *const *data) {
+    files_state_t *st = state;
+    int chunk = st->fd_cache_capacity;
+    int *fds = malloc(chunk * sizeof(int));
+    block_io_op_t *ops = malloc(chunk * sizeof(block_io_op_t));
+    if (!fds || !ops) {
+        free(fds);
+        free(ops);
+        return -1;
+    }
+    
+    int result = 0;
+    for (int done = 0; done < count && result == 0; done += chunk) {
+        int n = (count - done < chunk) ? count - done : chunk;
+        if (fd_cache_get_many(st, n, block_nums + done, 1, fds) != 0) {
+            result = -1;
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            memset(&ops[i], 0, sizeof(block_io_op_t));
+            ops[i].op = BLOCK_IO_WRITE;
+            ops[i].fd = fds[i];
+            ops[i].buf = (char *)data[done + i];
+            ops[i].size = st->block_size;
+        }
+        block_io_run(ops, n);
+        for (int i = 0; i < n; i++) {
+            if (ops[i].result < 0) {
+                result = -1;
+            } else if (block_nums[done + i] + 1 > st->block_count) {
+                st->block_count = block_nums[done + i] + 1;
+            }
+        }
+    }
+    free(fds);
+    free(ops);
+    return result;
+}
+
+// A hole is a block file that is not there
+static int files_punch(void *state, long long block_num) {
+    files_state_t *st = state;
+    for (int i = 0; i < st->fd_cache_count; i++) {
+        if (st->fd_cache[i].block_num == block_num) {
+            st->fd_cache[i].unsynced = 0;
+            fd_cache_remove(st, i);
+            break;
+        }
+    }
+    for (int i = st->unsynced_count - 1; i >= 0; i--) {
+        if (st->unsynced[i] == block_num) {
+            st->unsynced[i] = st->unsynced[--st->unsynced_count];
+        }
+    }
+    
+    char block_path[MAX_PATH_LEN];
+    if (get_block_path(st, block_num, block_path) != 0) {
+        return -1;
+    }
+    if (unlink(block_path) == 0) {
+        dir_changed(st, block_num);
+    } else if (errno != ENOENT) {
+        return -1;
+    }
+    return 0;
+}
+
+static int files_truncate(void *state, long long block_count, int tail) {
+    files_state_t *st = state;
+    
+    // Descriptors for removed blocks would keep writing to unlinked inodes
+    for (int i = st->fd_cache_count - 1; i >= 0; i--) {
+        if (st->fd_cache[i].block_num >= block_count) {
+            st->fd_cache[i].unsynced = 0;
+            fd_cache_remove(st, i);
+        }
+    }
+    for (int i = st->unsynced_count - 1; i >= 0; i--) {
+        if (st->unsynced[i] >= block_count) {
+            st->unsynced[i] = st->unsynced[--st->unsynced_count];
+        }
+    }
+    
+    // Sparse files can span far more block numbers than exist on disk, so
+    // large ranges walk the tree instead
+    if (st->block_count - block_count > TRUNCATE_PROBE_LIMIT) {
+        char block_dir[MAX_PATH_LEN];
+        if (block_dir_path(st->filename, block_dir) != 0 ||
+            unlink_blocks_from(st, block_dir, block_count) != 0) {
+            return -1;
+        }
+    } else if (st->block_count > block_count) {
+        int n = (int)(st->block_count - block_count);
+        block_io_op_t *ops = calloc(n, sizeof(block_io_op_t));
+        char *paths = malloc((size_t)n * MAX_PATH_LEN);
+        int result = (ops && paths) ? 0 : -1;
+        for (int i = 0; i < n && result == 0; i++) {
+            ops[i].op = BLOCK_IO_UNLINK;
+            ops[i].path = paths + (size_t)i * MAX_PATH_LEN;
+            result = get_block_path(st, block_count + i, paths + (size_t)i * MAX_PATH_LEN);
+        }
+        if (result == 0) {
+            block_io_run(ops, n);
+            for (int i = 0; i < n; i++) {
+                if (ops[i].result == 0) {
+                    dir_changed(st, block_count + i);
+                } else if (ops[i].result != -ENOENT) {
+                    result = -1;
+                }
+            }
+        }
+        free(ops);
+        free(paths);
+        if (result != 0) {
+            return -1;
+        }
+    }
+    st->block_count = block_count;
+    
+    // Handle partial last block
+    if (tail > 0 && block_count > 0) {
+        fd_entry_t *e;
+        int rc = fd_cache_get(st, block_count - 1, 0, &e);
+        if (rc < 0 || (rc == 0 && (!e->writable || ftruncate(e->fd, tail) != 0))) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Size of the store from a list of its top-level directory, for flat stores
+// that predate manifests
+static long long flat_scan_size(files_state_t *st) {
+    char block_dir[MAX_PATH_LEN];
+    if (block_dir_path(st->filename, block_dir) != 0) {
+        return 0;
+    }
+    
+    DIR *d = opendir(block_dir);
+    if (!d) {
+        return 0;
+    }
+    
+    long long size = 0;
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        long long block_num;
+        char extra;
+        if (sscanf(entry->d_name, "block_%lld%c", &block_num, &extra) != 1 || block_num < 0) {
+            continue;
+        }
+        
+        char block_path[MAX_PATH_LEN];
+        struct stat sb;
+        if (get_block_path(st, block_num, block_path) == 0 && stat(block_path, &sb) == 0) {
+            long long end = block_num * st->block_size + (sb.st_size < st->block_size ? sb.st_size : st->block_size);
+            if (end > size) size = end;
+            if (block_num + 1 > st->block_count) st->block_count = block_num + 1;
+        }
+    }
+    
+    closedir(d);
+    return size;
+}
+
+static long long files_size(void *state, long long known_size) {
+    files_state_t *st = state;
+    long long size = known_size;
+    st->block_count = (known_size + st->block_size - 1) / st->block_size;
+    
+    if (st->layout == LAYOUT_FLAT && known_size == 0) {
+        return flat_scan_size(st);
+    }
+    
+    // Blocks appended after the manifest was last saved
+    for (;;) {
+        char block_path[MAX_PATH_LEN];
+        struct stat sb;
+        if (get_block_path(st, st->block_count, block_path) != 0 || stat(block_path, &sb) != 0) {
+            break;
+        }
+        size = st->block_count * st->block_size + (sb.st_size < st->block_size ? sb.st_size : st->block_size);
+        st->block_count++;
+    }
+    return size;
+}
+
+// Get the path a staged block is written to before it replaces the block
+static int get_staged_path(files_state_t *st, long long block_num, char *staged_path) {
+    char block_path[MAX_PATH_LEN];
+    if (get_block_path(st, block_num, block_path) != 0) {
+        return -1;
+    }
+    return (snprintf(staged_path, MAX_PATH_LEN, "%s.new", block_path) >= MAX_PATH_LEN) ? -1 : 0;
+}
+
+static int files_stage_sized(void *state, long long block_num, const char *data, int len, long long *token) {
+    files_state_t *st = state;
+    char staged_path[MAX_PATH_LEN];
+    if (get_staged_path(st, block_num, staged_path) != 0) {
+        return -1;
+    }
+    
+    int fd;
+    do {
+        fd = open(staged_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    } while (fd < 0 && errno == EINTR);
+    if (fd < 0 && errno == ENOENT && st->layout == LAYOUT_FANOUT) {
+        if (ensure_block_parents(st, block_num, staged_path) != 0) {
+            return -1;
+        }
+        fd = open(staged_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    }
+    if (fd < 0) {
+        return -1;
+    }
+    dir_changed(st, block_num);
+    int rc = block_pwrite_full(fd, data, len, 0);
+    if (close(fd) != 0) {
+        rc = -1;
+    }
+    *token = 0;
+    return rc;
+}
+
+static int files_stage(void *state, long long block_num, const char *data, long long *token) {
+    return files_stage_sized(state, block_num, data, ((files_state_t *)state)->block_size, token);
+}
+
+// Rename the staged file over the block. Once renamed there is nothing
+// left to publish, so a repeat finds no staged file and succeeds.
+static int files_publish(void *state, long long block_num, long long token, int discard) {
+    files_state_t *st = state;
+    char staged_path[MAX_PATH_LEN];
+    char block_path[MAX_PATH_LEN];
+    if (get_staged_path(st, block_num, staged_path) != 0 ||
+        get_block_path(st, block_num, block_path) != 0) {
+        return -1;
+    }
+    
+    if (discard) {
+        return (unlink(staged_path) != 0 && errno != ENOENT) ? -1 : 0;
+    }
+    if (rename(staged_path, block_path) != 0) {
+        return (errno == ENOENT) ? 0 : -1;
+    }
+    dir_changed(st, block_num);
+    
+    // A cached descriptor still reads the replaced inode; the new one needs
+    // a sync instead
+    for (int i = 0; i < st->fd_cache_count; i++) {
+        if (st->fd_cache[i].block_num == block_num) {
+            st->fd_cache[i].unsynced = 0;
+            fd_cache_remove(st, i);
+            break;
+        }
+    }
+    unsynced_add(st, block_num);
+    if (block_num + 1 > st->block_count) {
+        st->block_count = block_num + 1;
+    }
+    return 0;
+}
+
+// Sync every cached descriptor written since the last sync, in one batch
+static int files_sync_cached(files_state_t *st, int flags) {
+    block_io_op_t *ops = malloc((st->fd_cache_count ? st->fd_cache_count : 1) * sizeof(block_io_op_t));
+    int *which = malloc((st->fd_cache_count ? st->fd_cache_count : 1) * sizeof(int));
+    if (!ops || !which) {
+        free(ops);
+        free(which);
+        return -1;
+    }
+    
+    int n = 0;
+    for (int i = 0; i < st->fd_cache_count; i++) {
+        if (st->fd_cache[i].unsynced) {
+            memset(&ops[n], 0, sizeof(block_io_op_t));
+            ops[n].op = block_sync_op(flags);
+            ops[n].fd = st->fd_cache[i].fd;
+            which[n++] = i;
+        }
+    }
+    block_io_run(ops, n);
+    
+    int result = 0;
+    for (int j = 0; j < n; j++) {
+        if (ops[j].result < 0) {
+            result = -1;
+        } else {
+            st->fd_cache[which[j]].unsynced = 0;
+        }
+    }
+    free(ops);
+    free(which);
+    return result;
+}
+
+static int key_compare(const void *a, const void *b) {
+    long long x = *(const long long *)a;
+    long long y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+// Sync each fan-out directory whose entries changed, once
+static int files_sync_dirs(files_state_t *st, int flags) {
+    if (st->dirs_count == 0) {
+        return 0;
+    }
+    char block_dir[MAX_PATH_LEN];
+    char *paths = malloc((size_t)st->dirs_count * MAX_PATH_LEN);
+    const char **list = malloc(st->dirs_count * sizeof(char *));
+    if (!paths || !list || block_dir_path(st->filename, block_dir) != 0) {
+        free(paths);
+        free(list);
+        return -1;
+    }
+    
+    qsort(st->dirs, st->dirs_count, sizeof(long long), key_compare);
+    int n = 0;
+    int result = 0;
+    for (int i = 0; i < st->dirs_count; i++) {
+        long long key = st->dirs[i];
+        if (i > 0 && key == st->dirs[i - 1]) continue;
+        char *path = paths + (size_t)n * MAX_PATH_LEN;
+        int len = (key >= 0) ?
+            snprintf(path, MAX_PATH_LEN, "%s/%02x/%02x", block_dir, (unsigned)(key >> 8), (unsigned)(key & 0xff)) :
+            snprintf(path, MAX_PATH_LEN, "%s/%02x", block_dir, (unsigned)(-1 - key));
+        if (len >= MAX_PATH_LEN) {
+            result = -1;
+            continue;
+        }
+        list[n++] = path;
+    }
+    if (block_sync_dirs(list, n, flags) != 0) {
+        result = -1;
+    }
+    if (result == 0) {
+        st->dirs_count = 0;
+    }
+    free(paths);
+    free(list);
+    return result;
+}
+
+static int files_sync(void *state, int flags) {
+    files_state_t *st = state;
+    int result = files_sync_cached(st, flags);
+    
+    // Blocks whose descriptors were evicted are reopened, as many at a time
+    // as the cache holds. Every cached descriptor is synced by now, so the
+    // evictions this causes add nothing to the list.
+    int chunk = st->fd_cache_capacity;
+    long long *blocks = malloc(chunk * sizeof(long long));
+    int *fds = malloc(chunk * sizeof(int));
+    block_io_op_t *ops = malloc(chunk * sizeof(block_io_op_t));
+    if (!blocks || !fds || !ops) {
+        free(blocks);
+        free(fds);
+        free(ops);
+        return -1;
+    }
+    while (st->unsynced_count > 0) {
+        int n = (st->unsynced_count < chunk) ? st->unsynced_count : chunk;
+        st->unsynced_count -= n;
+        memcpy(blocks, st->unsynced + st->unsynced_count, n * sizeof(long long));
+        if (fd_cache_get_many(st, n, blocks, 0, fds) != 0) {
+            result = -1;
+        }
+        
+        int syncs = 0;
+        for (int i = 0; i < n; i++) {
+            if (fds[i] < 0) continue;
+            memset(&ops[syncs], 0, sizeof(block_io_op_t));
+            ops[syncs].op = block_sync_op(flags);
+            ops[syncs].fd = fds[i];
+            syncs++;
+        }
+        block_io_run(ops, syncs);
+        for (int j = 0; j < syncs; j++) {
+            if (ops[j].result < 0) {
+                result = -1;
+            }
+        }
+    }
+    free(blocks);
+    free(fds);
+    free(ops);
+    
+    // Directories after the blocks they name
+    if (files_sync_dirs(st, flags) != 0 || result != 0) {
+        return -1;
+    }
+    int top_changed = st->top_changed;
+    st->top_changed = 0;
+    return top_changed;
+}
+
+#if BLOCK_HAVE_MMAP
+// Map a block file of its own. Writes go to the same inode, so the mapping
+// follows them; a block file replaced or removed since keeps its old data
+// for as long as it stays mapped.
+static int files_map(void *state, long long block_num, const char **data) {
+    files_state_t *st = state;
+    fd_entry_t *e;
+    int rc = fd_cache_get(st, block_num, 0, &e);
+    if (rc != 0) {
+        return rc;
+    }
+    
+    // A short block file ends in zeros that only a read supplies
+    struct stat sb;
+    if (fstat(e->fd, &sb) != 0) {
+        return -1;
+    }
+    if (sb.st_size < st->block_size) {
+        return 1;
+    }
+    void *addr = mmap(NULL, st->block_size, PROT_READ, MAP_SHARED, e->fd, 0);
+    if (addr == MAP_FAILED) {
+        return 1;
+    }
+    *data = addr;
+    return 0;
+}
+
+static void files_unmap(void *state, long long block_num, const char *data) {
+    munmap((void *)data, ((files_state_t *)state)->block_size);
+}
+#else
+#define files_map NULL
+#define files_unmap NULL
+#endif
+
+const block_backend_t block_fanout_backend = {
+    "fanout", 1, fanout_open, files_close, files_read, files_write,
+    files_truncate, files_size, files_sync, files_stage, files_publish,
+    files_map, files_unmap, files_read_many, files_write_many, files_punch,
+    files_read_sized, files_write_sized, files_stage_sized
+};
+
+const block_backend_t block_flat_backend = {
+    "flat", 1, flat_open, files_close, files_read, files_write,
+    files_truncate, files_size, files_sync, files_stage, files_publish,
+    files_map, files_unmap, files_read_many, files_write_many, files_punch,
+    files_read_sized, files_write_sized, files_stage_sized
+};
+
+void block_files_fd_stats(void *state, block_fd_cache_stats_t *stats) {
+    *stats = ((files_state_t *)state)->fd_stats;
+}
+
+void block_set_fd_cache_capacity(int capacity) {
+    fd_cache_capacity = (capacity > 0) ? capacity : 1;
+}
\ No newline at end of file
@@ -0,0 +1,162 @@
+#ifndef BLOCK_INTERNAL_H
+#define BLOCK_INTERNAL_H
+
+#include <stdint.h>
+#include "block.h"
+
+// Helpers shared by the source files of the block layer
+
+#define BLOCK_SIZE BLOCK_SIZE_DEFAULT
+#define MAX_PATH_LEN 1024
+
+// Locks. WASI builds have no threads, so there they compile to nothing.
+#ifdef __wasi__
+#define BLOCK_HAVE_THREADS 0
+typedef int block_mutex_t;
+typedef int block_rwlock_t;
+typedef int block_cond_t;
+#define BLOCK_MUTEX_INITIALIZER 0
+#define BLOCK_COND_INITIALIZER 0
+#define block_mutex_init(m)     ((void)(m))
+#define block_mutex_destroy(m)  ((void)(m))
+#define block_mutex_lock(m)     ((void)(m))
+#define block_mutex_unlock(m)   ((void)(m))
+#define block_rwlock_init(l)    ((void)(l))
+#define block_rwlock_destroy(l) ((void)(l))
+#define block_rwlock_rdlock(l)  ((void)(l))
+#define block_rwlock_wrlock(l)  ((void)(l))
+#define block_rwlock_unlock(l)  ((void)(l))
+#define block_cond_init(c)      ((void)(c))
+#define block_cond_destroy(c)   ((void)(c))
+#define block_cond_wait(c, m)   ((void)(c), (void)(m))
+#define block_cond_signal(c)    ((void)(c))
+#define block_cond_broadcast(c) ((void)(c))
+#else
+#include <pthread.h>
+#define BLOCK_HAVE_THREADS 1
+typedef pthread_mutex_t block_mutex_t;
+typedef pthread_rwlock_t block_rwlock_t;
+typedef pthread_cond_t block_cond_t;
+#define BLOCK_MUTEX_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+#define BLOCK_COND_INITIALIZER  PTHREAD_COND_INITIALIZER
+#define block_mutex_init(m)     pthread_mutex_init(m, NULL)
+#define block_mutex_destroy(m)  pthread_mutex_destroy(m)
+#define block_mutex_lock(m)     pthread_mutex_lock(m)
+#define block_mutex_unlock(m)   pthread_mutex_unlock(m)
+#define block_rwlock_init(l)    pthread_rwlock_init(l, NULL)
+#define block_rwlock_destroy(l) pthread_rwlock_destroy(l)
+#define block_rwlock_rdlock(l)  pthread_rwlock_rdlock(l)
+#define block_rwlock_wrlock(l)  pthread_rwlock_wrlock(l)
+#define block_rwlock_unlock(l)  pthread_rwlock_unlock(l)
+#define block_cond_init(c)      pthread_cond_init(c, NULL)
+#define block_cond_destroy(c)   pthread_cond_destroy(c)
+#define block_cond_wait(c, m)   pthread_cond_wait(c, m)
+#define block_cond_signal(c)    pthread_cond_signal(c)
+#define block_cond_broadcast(c) pthread_cond_broadcast(c)
+#endif
+
+// Memory-mapped reads need mmap, which WASI lacks
+#ifdef __wasi__
+#define BLOCK_HAVE_MMAP 0
+#else
+#define BLOCK_HAVE_MMAP 1
+#endif
+
+// Per-block compression (block_compress.c). The LZ codec returns the
+// compressed length, 0 if it does not fit in capacity, or the
+// decompressed length, -1 for corrupt input.
+int block_lz_compress(const char *input, int size, char *output, int capacity);
+int block_lz_decompress(const char *input, int size, char *output, int capacity);
+
+// Wrap an open backend so that it stores blocks compressed. The wrapper
+// owns the inner state from then on. Only backends that pass
+// block_compress_supported can be wrapped.
+extern const block_backend_t block_compress_backend;
+int block_compress_supported(const block_backend_t *inner);
+int block_compress_open(const block_backend_t *inner, void *inner_state, int block_size, int codec,
+                        void **state);
+void block_compress_stats(void *state, block_compress_stats_t *stats);
+const block_backend_t *block_compress_inner(void *state, void **inner_state);
+
+// Wrap an open backend so that every block has a CRC32C, checked when it
+// is read (block_checksum.c). The wrapper owns the inner state from then on.
+extern const block_backend_t block_checksum_backend;
+int block_checksum_open(const block_backend_t *inner, void *inner_state, const char *filename,
+                        int block_size, void **state);
+void block_checksum_stats(void *state, block_checksum_stats_t *stats);
+const block_backend_t *block_checksum_inner(void *state, void **inner_state);
+
+// The checksum the wrapper keeps for a block, never 0. A batch committed
+// before a crash is published again with the checksums it was staged with,
+// given to block_checksum_expect before each block is published.
+uint32_t block_checksum_of(const char *data, int size);
+int block_checksum_expect(void *state, long long block_num, long long token, uint32_t sum);
+
+// Content-addressed stores (block_dedup.c)
+void block_sha256(const char *data, int size, unsigned char *digest);
+void block_dedup_stats(void *state, block_dedup_stats_t *stats);
+int block_dedup_clone(void *state, const char *filename);
+
+// Whether size bytes are all zero, scanned with SIMD where available
+// (block_simd.c)
+int block_is_zero(const char *data, int size);
+
+// CRC32C of size bytes, continuing from crc (0 to start), with the CRC
+// instructions of SSE4.2 or ARMv8 where available (block_simd.c)
+uint32_t block_crc32c(uint32_t crc, const char *data, int size);
+
+// Batched I/O (block_io.c). The operations of a batch are independent and
+// may run in any order, in parallel under io_uring.
+enum {
+    BLOCK_IO_READ,          // fd, buf, size, offset: bytes read, short only at EOF
+    BLOCK_IO_WRITE,         // fd, buf, size, offset: size
+    BLOCK_IO_FDATASYNC,     // fd
+    BLOCK_IO_OPEN,          // path, flags (mode 0644): the new descriptor
+    BLOCK_IO_UNLINK,        // path
+    BLOCK_IO_FSYNC          // fd, metadata too, through F_FULLFSYNC where there is one
+};
+
+typedef struct {
+    int op;
+    int fd;
+    const char *path;
+    int flags;
+    char *buf;
+    int size;
+    long long offset;
+    int result;             // as above, or -errno
+} block_io_op_t;
+
+// Run a batch and fill in every result
+void block_io_run(block_io_op_t *ops, int count);
+
+// The sync operation for BLOCK_SYNC_* flags, and the same as one call
+int block_sync_op(int flags);
+int block_sync_fd(int fd, int flags);
+
+// Sync the entries of directories, opening them in one batch and syncing
+// them in another. Directories that are gone are skipped.
+int block_sync_dirs(const char *const *paths, int count, int flags);
+
+// Built-in backends
+extern const block_backend_t block_fanout_backend;
+extern const block_backend_t block_flat_backend;
+extern const block_backend_t block_packed_backend;
+extern const block_backend_t block_memory_backend;
+extern const block_backend_t block_dedup_backend;
+
+// Get the directory holding a file's blocks. Returns -1 if its path would
+// not fit in MAX_PATH_LEN.
+int block_dir_path(const char *filename, char *block_dir);
+
+// Descriptor cache counters of a file stored by the fanout or flat backend
+void block_files_fd_stats(void *state, block_fd_cache_stats_t *stats);
+
+// pread that retries on EINTR and short reads. Returns bytes read (less
+// than size only at end of file) or -1 on error.
+int block_pread_full(int fd, char *buf, int size, long long offset);
+
+// pwrite that retries on EINTR and short writes. Returns 0 or -1.
+int block_pwrite_full(int fd, const char *buf, int size, long long offset);
+
+#endif // BLOCK_INTERNAL_H
\ No newline at end of file
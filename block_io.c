@@ -0,0 +1,479 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include "block_internal.h"
+
+// Batched I/O for the file backends. With io_uring a batch goes to the
+// kernel in one io_uring_enter and its operations run in parallel; the
+// POSIX engine makes one call per operation. Each thread has a ring of its
+// own, set up on its first batch. If io_uring is missing, or the kernel
+// lacks one of the operations, everything falls back to POSIX.
+
+#if defined(__linux__) && !defined(__wasi__) && __has_include(<linux/io_uring.h>)
+#define BLOCK_HAVE_URING 1
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#else
+#define BLOCK_HAVE_URING 0
+#endif
+
+#define URING_ENTRIES 64
+#define URING_UNSENT INT_MIN    // result of an operation the ring never took
+#define SYNC_THREADS 4          // threads a large POSIX batch of syncs runs on
+#define SYNC_THREADS_MIN 8      // syncs in a batch before it is split
+#define SYNC_DIRS_CHUNK 64      // directories opened at once
+
+static _Atomic int io_engine = BLOCK_HAVE_URING ? BLOCK_IO_ENGINE_URING : BLOCK_IO_ENGINE_POSIX;
+static _Atomic int uring_broken = 0;   // setup failed once; stay on POSIX
+static _Atomic long long stat_batches = 0;
+static _Atomic long long stat_ops = 0;
+static _Atomic long long stat_syscalls = 0;
+
+// fsync, through F_FULLFSYNC where the platform has it, so the data gets
+// past the drive's cache too
+static int full_fsync(int fd) {
+#ifdef F_FULLFSYNC
+    if (fcntl(fd, F_FULLFSYNC) == 0) {
+        return 0;
+    }
+#endif
+    return fsync(fd);
+}
+
+// Run one operation with plain system calls
+static void posix_run(block_io_op_t *op) {
+    int rc;
+    switch (op->op) {
+    case BLOCK_IO_READ:
+        rc = block_pread_full(op->fd, op->buf, op->size, op->offset);
+        break;
+    case BLOCK_IO_WRITE:
+        rc = (block_pwrite_full(op->fd, op->buf, op->size, op->offset) == 0) ? op->size : -1;
+        break;
+    case BLOCK_IO_FDATASYNC:
+        rc = fdatasync(op->fd);
+        break;
+    case BLOCK_IO_OPEN:
+        do {
+            rc = open(op->path, op->flags | O_CLOEXEC, 0644);
+        } while (rc < 0 && errno == EINTR);
+        break;
+    case BLOCK_IO_UNLINK:
+        rc = unlink(op->path);
+        break;
+    case BLOCK_IO_FSYNC:
+        rc = full_fsync(op->fd);
+        break;
+    default:
+        errno = EINVAL;
+        rc = -1;
+        break;
+    }
+    op->result = (rc < 0) ? -errno : rc;
+    stat_syscalls++;
+}
+
+#if BLOCK_HAVE_URING
+typedef struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+} uring_t;
+
+static pthread_key_t uring_key;
+static pthread_once_t uring_key_once = PTHREAD_ONCE_INIT;
+
+static void uring_free(void *arg) {
+    uring_t *r = arg;
+    if (r->sqes) munmap(r->sqes, r->sqes_size);
+    if (r->cq_ring && r->cq_ring != r->sq_ring) munmap(r->cq_ring, r->cq_ring_size);
+    if (r->sq_ring) munmap(r->sq_ring, r->sq_ring_size);
+    close(r->fd);
+    free(r);
+}
+
+static void uring_key_init(void) {
+    pthread_key_create(&uring_key, uring_free);
+}
+
+// Whether the kernel knows every opcode the engine issues
+static int uring_probe(int fd) {
+    static const int needed[] = {
+        IORING_OP_READ, IORING_OP_WRITE, IORING_OP_FSYNC, IORING_OP_OPENAT, IORING_OP_UNLINKAT
+    };
+    size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, len);
+    if (!probe) return 0;
+    int ok = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    for (size_t i = 0; ok && i < sizeof(needed) / sizeof(needed[0]); i++) {
+        ok = needed[i] <= probe->last_op && (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return ok;
+}
+
+static uring_t *uring_setup(void) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    stat_syscalls++;
+    if (fd < 0) {
+        return NULL;
+    }
+    uring_t *r = calloc(1, sizeof(uring_t));
+    if (!r) {
+        close(fd);
+        return NULL;
+    }
+    r->fd = fd;
+    
+    r->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    r->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_ring_size > r->sq_ring_size) r->sq_ring_size = r->cq_ring_size;
+        r->cq_ring_size = r->sq_ring_size;
+    }
+    r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      fd, IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED) {
+        r->sq_ring = NULL;
+        uring_free(r);
+        return NULL;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ring = r->sq_ring;
+    } else {
+        r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          fd, IORING_OFF_CQ_RING);
+        if (r->cq_ring == MAP_FAILED) {
+            r->cq_ring = NULL;
+            uring_free(r);
+            return NULL;
+        }
+    }
+    r->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        uring_free(r);
+        return NULL;
+    }
+    
+    char *sq = r->sq_ring;
+    char *cq = r->cq_ring;
+    r->sq_head = (unsigned *)(sq + params.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + params.sq_off.array);
+    r->cq_head = (unsigned *)(cq + params.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    
+    if (!uring_probe(fd)) {
+        uring_free(r);
+        return NULL;
+    }
+    return r;
+}
+
+// The calling thread's ring, or NULL to use POSIX
+static uring_t *uring_get(void) {
+    if (uring_broken) {
+        return NULL;
+    }
+    pthread_once(&uring_key_once, uring_key_init);
+    uring_t *r = pthread_getspecific(uring_key);
+    if (!r) {
+        r = uring_setup();
+        if (!r || pthread_setspecific(uring_key, r) != 0) {
+            if (r) uring_free(r);
+            uring_broken = 1;
+            return NULL;
+        }
+    }
+    return r;
+}
+
+static void uring_prep(struct io_uring_sqe *sqe, block_io_op_t *op, unsigned long long index) {
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = index;
+    switch (op->op) {
+    case BLOCK_IO_READ:
+    case BLOCK_IO_WRITE:
+        sqe->opcode = (op->op == BLOCK_IO_READ) ? IORING_OP_READ : IORING_OP_WRITE;
+        sqe->fd = op->fd;
+        sqe->addr = (unsigned long long)(uintptr_t)op->buf;
+        sqe->len = op->size;
+        sqe->off = op->offset;
+        break;
+    case BLOCK_IO_FDATASYNC:
+    case BLOCK_IO_FSYNC:
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fd = op->fd;
+        sqe->fsync_flags = (op->op == BLOCK_IO_FDATASYNC) ? IORING_FSYNC_DATASYNC : 0;
+        break;
+    case BLOCK_IO_OPEN:
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (unsigned long long)(uintptr_t)op->path;
+        sqe->len = 0644;
+        sqe->open_flags = op->flags | O_CLOEXEC;
+        break;
+    case BLOCK_IO_UNLINK:
+        sqe->opcode = IORING_OP_UNLINKAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (unsigned long long)(uintptr_t)op->path;
+        break;
+    }
+}
+
+// Submit up to the ring size of operations and wait for all of them.
+// Returns -1 if io_uring_enter failed: entries the kernel had not taken are
+// withdrawn and left with result URING_UNSENT, and those it had are still
+// waited for, since they read into and write from the callers' buffers.
+// Operations that could not be waited for either fail with EIO.
+static int uring_run_chunk(uring_t *r, block_io_op_t *ops, int count) {
+    unsigned first = *r->sq_tail;
+    unsigned tail = first;
+    for (int i = 0; i < count; i++) {
+        unsigned index = tail & *r->sq_mask;
+        uring_prep(&r->sqes[index], &ops[i], i);
+        r->sq_array[index] = index;
+        ops[i].result = URING_UNSENT;
+        tail++;
+    }
+    atomic_store_explicit((_Atomic unsigned *)r->sq_tail, tail, memory_order_release);
+    
+    int submitted = 0;
+    int reaped = 0;
+    int failed = 0;
+    while (reaped < (failed ? submitted : count)) {
+        int to_submit = failed ? 0 : count - submitted;
+        int rc = syscall(__NR_io_uring_enter, r->fd, to_submit, (failed ? submitted : count) - reaped,
+                         IORING_ENTER_GETEVENTS, NULL, 0);
+        stat_syscalls++;
+        submitted = atomic_load_explicit((_Atomic unsigned *)r->sq_head, memory_order_acquire) - first;
+        if (rc < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            if (failed) {
+                break;
+            }
+            // Take back what the kernel has not seen, then wait for the rest
+            failed = 1;
+            atomic_store_explicit((_Atomic unsigned *)r->sq_tail, first + submitted, memory_order_release);
+        }
+        
+        unsigned head = *r->cq_head;
+        unsigned cq_tail = atomic_load_explicit((_Atomic unsigned *)r->cq_tail, memory_order_acquire);
+        while (head != cq_tail) {
+            struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+            ops[cqe->user_data].result = cqe->res;
+            head++;
+            reaped++;
+        }
+        atomic_store_explicit((_Atomic unsigned *)r->cq_head, head, memory_order_release);
+    }
+    if (!failed) {
+        return 0;
+    }
+    
+    // Submitted but never seen complete; running them again could repeat
+    // a write or an unlink
+    for (int i = 0; i < submitted; i++) {
+        if (ops[i].result == URING_UNSENT) ops[i].result = -EIO;
+    }
+    return -1;
+}
+
+// Finish what io_uring left undone: short transfers, and operations it
+// could not run right now
+static void uring_complete(block_io_op_t *op) {
+    int res = op->result;
+    if (res == -EAGAIN || res == -EINTR) {
+        posix_run(op);
+        return;
+    }
+    if (res <= 0 || res >= op->size || (op->op != BLOCK_IO_READ && op->op != BLOCK_IO_WRITE)) {
+        return;
+    }
+    if (op->op == BLOCK_IO_READ) {
+        int n = block_pread_full(op->fd, op->buf + res, op->size - res, op->offset + res);
+        op->result = (n < 0) ? -errno : res + n;
+    } else {
+        int rc = block_pwrite_full(op->fd, op->buf + res, op->size - res, op->offset + res);
+        op->result = (rc < 0) ? -errno : op->size;
+    }
+    stat_syscalls++;
+}
+#endif
+
+#if BLOCK_HAVE_THREADS
+typedef struct {
+    block_io_op_t *ops;
+    int count;
+} sync_share_t;
+
+static void *sync_worker(void *arg) {
+    sync_share_t *share = arg;
+    for (int i = 0; i < share->count; i++) {
+        posix_run(&share->ops[i]);
+    }
+    return NULL;
+}
+
+// Syncs wait on the device rather than the CPU, so a large batch of them
+// is split over a few threads, as io_uring would run it. Returns 0 if the
+// batch is not one to split.
+static int posix_run_syncs(block_io_op_t *ops, int count) {
+    if (count < SYNC_THREADS_MIN) {
+        return 0;
+    }
+    for (int i = 0; i < count; i++) {
+        if (ops[i].op != BLOCK_IO_FDATASYNC && ops[i].op != BLOCK_IO_FSYNC) return 0;
+    }
+    
+    sync_share_t shares[SYNC_THREADS];
+    pthread_t threads[SYNC_THREADS];
+    int started[SYNC_THREADS] = { 0 };
+    int per = (count + SYNC_THREADS - 1) / SYNC_THREADS;
+    for (int t = 0; t < SYNC_THREADS; t++) {
+        int first = t * per;
+        shares[t].ops = ops + first;
+        shares[t].count = (first >= count) ? 0 : (count - first < per) ? count - first : per;
+        if (t > 0 && shares[t].count > 0) {
+            started[t] = pthread_create(&threads[t], NULL, sync_worker, &shares[t]) == 0;
+        }
+    }
+    // The first share, and any a thread could not be started for, run here
+    for (int t = 0; t < SYNC_THREADS; t++) {
+        if (!started[t]) sync_worker(&shares[t]);
+    }
+    for (int t = 0; t < SYNC_THREADS; t++) {
+        if (started[t]) pthread_join(threads[t], NULL);
+    }
+    return 1;
+}
+#endif
+
+void block_io_run(block_io_op_t *ops, int count) {
+    if (count <= 0) return;
+    stat_batches++;
+    stat_ops += count;
+    
+#if BLOCK_HAVE_URING
+    // A lone operation costs one call either way
+    uring_t *r = (count > 1 && io_engine == BLOCK_IO_ENGINE_URING) ? uring_get() : NULL;
+    if (r) {
+        for (int done = 0; done < count; done += URING_ENTRIES) {
+            int n = (count - done < URING_ENTRIES) ? count - done : URING_ENTRIES;
+            if (uring_run_chunk(r, ops + done, n) != 0) {
+                // The ring is unusable: drop it, run on POSIX what it never
+                // took, and stay on POSIX
+                uring_broken = 1;
+                pthread_setspecific(uring_key, NULL);
+                uring_free(r);
+                for (int i = done; i < done + n; i++) {
+                    if (ops[i].result == URING_UNSENT) {
+                        posix_run(&ops[i]);
+                    } else {
+                        uring_complete(&ops[i]);
+                    }
+                }
+                for (int i = done + n; i < count; i++) posix_run(&ops[i]);
+                return;
+            }
+            for (int i = done; i < done + n; i++) uring_complete(&ops[i]);
+        }
+        return;
+    }
+#endif
+#if BLOCK_HAVE_THREADS
+    if (posix_run_syncs(ops, count)) {
+        return;
+    }
+#endif
+    for (int i = 0; i < count; i++) {
+        posix_run(&ops[i]);
+    }
+}
+
+int block_sync_op(int flags) {
+    return (flags & BLOCK_SYNC_FULL) ? BLOCK_IO_FSYNC : BLOCK_IO_FDATASYNC;
+}
+
+int block_sync_fd(int fd, int flags) {
+    block_io_op_t op;
+    memset(&op, 0, sizeof(op));
+    op.op = block_sync_op(flags);
+    op.fd = fd;
+    posix_run(&op);
+    return (op.result < 0) ? -1 : 0;
+}
+
+int block_sync_dirs(const char *const *paths, int count, int flags) {
+    block_io_op_t ops[SYNC_DIRS_CHUNK];
+    int result = 0;
+    for (int done = 0; done < count; done += SYNC_DIRS_CHUNK) {
+        int n = (count - done < SYNC_DIRS_CHUNK) ? count - done : SYNC_DIRS_CHUNK;
+        for (int i = 0; i < n; i++) {
+            memset(&ops[i], 0, sizeof(block_io_op_t));
+            ops[i].op = BLOCK_IO_OPEN;
+            ops[i].path = paths[done + i];
+            ops[i].flags = O_RDONLY | O_DIRECTORY;
+        }
+        block_io_run(ops, n);
+        
+        int syncs = 0;
+        for (int i = 0; i < n; i++) {
+            int fd = ops[i].result;
+            if (fd < 0) {
+                if (fd != -ENOENT) result = -1;
+                continue;
+            }
+            memset(&ops[syncs], 0, sizeof(block_io_op_t));
+            ops[syncs].op = block_sync_op(flags);
+            ops[syncs++].fd = fd;
+        }
+        block_io_run(ops, syncs);
+        for (int i = 0; i < syncs; i++) {
+            if (ops[i].result < 0) result = -1;
+            close(ops[i].fd);
+        }
+    }
+    return result;
+}
+
+int block_set_io_engine(int engine) {
+    io_engine = BLOCK_IO_ENGINE_POSIX;
+#if BLOCK_HAVE_URING
+    // Set up this thread's ring now, so the answer is the engine in use
+    if (engine == BLOCK_IO_ENGINE_URING && uring_get()) {
+        io_engine = BLOCK_IO_ENGINE_URING;
+    }
+#endif
+    return io_engine;
+}
+
+void block_get_io_stats(block_io_stats_t *stats) {
+    stats->batches = stat_batches;
+    stats->ops = stat_ops;
+    stats->syscalls = stat_syscalls;
+}
+
+void block_reset_io_stats(void) {
+    stat_batches = 0;
+    stat_ops = 0;
+    stat_syscalls = 0;
+}
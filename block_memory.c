@@ -0,0 +1,168 @@
+#include <stdlib.h>
+#include <string.h>
+#include "block_internal.h"
+
+// Blocks kept in memory only: nothing touches the disk and everything is
+// freed when the last handle closes. Suited to temporary databases.
+
+#define MEMORY_HASH_SIZE 1024
+
+typedef struct memory_block memory_block_t;
+struct memory_block {
+    long long block_num;
+    memory_block_t *next;      // hash chain
+    char data[];
+};
+
+typedef struct {
+    int block_size;
+    memory_block_t *blocks[MEMORY_HASH_SIZE];
+    memory_block_t *staged[MEMORY_HASH_SIZE];  // versions of an uncommitted batch
+} memory_state_t;
+
+static memory_block_t **memory_find(memory_block_t **table, long long block_num) {
+    memory_block_t **pp = &table[(unsigned long long)block_num % MEMORY_HASH_SIZE];
+    while (*pp && (*pp)->block_num != block_num) {
+        pp = &(*pp)->next;
+    }
+    return pp;
+}
+
+static memory_block_t **memory_slot(memory_state_t *st, long long block_num) {
+    return memory_find(st->blocks, block_num);
+}
+
+static int memory_open(const char *filename, int block_size, void **state) {
+    memory_state_t *st = calloc(1, sizeof(memory_state_t));
+    if (!st) return -1;
+    st->block_size = block_size;
+    *state = st;
+    return 0;
+}
+
+static int memory_truncate(void *state, long long block_count, int tail) {
+    memory_state_t *st = state;
+    for (int i = 0; i < MEMORY_HASH_SIZE; i++) {
+        memory_block_t **pp = &st->blocks[i];
+        while (*pp) {
+            if ((*pp)->block_num >= block_count) {
+                memory_block_t *b = *pp;
+                *pp = b->next;
+                free(b);
+            } else {
+                pp = &(*pp)->next;
+            }
+        }
+    }
+    
+    memory_block_t *last = (tail > 0 && block_count > 0) ? *memory_slot(st, block_count - 1) : NULL;
+    if (last) {
+        memset(last->data + tail, 0, st->block_size - tail);
+    }
+    return 0;
+}
+
+static void memory_close(void *state) {
+    memory_state_t *st = state;
+    memory_truncate(st, 0, 0);
+    for (int i = 0; i < MEMORY_HASH_SIZE; i++) {
+        while (st->staged[i]) {
+            memory_block_t *b = st->staged[i];
+            st->staged[i] = b->next;
+            free(b);
+        }
+    }
+    free(st);
+}
+
+static int memory_read(void *state, long long block_num, int offset, int size, char *buf) {
+    memory_block_t *b = *memory_slot(state, block_num);
+    if (b) {
+        memcpy(buf, b->data + offset, size);
+    } else {
+        memset(buf, 0, size);
+    }
+    return 0;
+}
+
+static int memory_write(void *state, long long block_num, const char *data) {
+    memory_state_t *st = state;
+    memory_block_t **pp = memory_slot(st, block_num);
+    if (!*pp) {
+        memory_block_t *b = malloc(sizeof(memory_block_t) + st->block_size);
+        if (!b) return -1;
+        b->block_num = block_num;
+        b->next = NULL;
+        *pp = b;
+    }
+    memcpy((*pp)->data, data, st->block_size);
+    return 0;
+}
+
+static int memory_punch(void *state, long long block_num) {
+    memory_block_t **pp = memory_slot(state, block_num);
+    memory_block_t *b = *pp;
+    if (b) {
+        *pp = b->next;
+        free(b);
+    }
+    return 0;
+}
+
+// The staged copy is allocated up front, so publishing cannot fail
+static int memory_stage(void *state, long long block_num, const char *data, long long *token) {
+    memory_state_t *st = state;
+    memory_block_t **pp = memory_find(st->staged, block_num);
+    if (!*pp) {
+        memory_block_t *b = malloc(sizeof(memory_block_t) + st->block_size);
+        if (!b) return -1;
+        b->block_num = block_num;
+        b->next = NULL;
+        *pp = b;
+    }
+    memcpy((*pp)->data, data, st->block_size);
+    *token = 0;
+    return 0;
+}
+
+static int memory_publish(void *state, long long block_num, long long token, int discard) {
+    memory_state_t *st = state;
+    memory_block_t **staged = memory_find(st->staged, block_num);
+    memory_block_t *b = *staged;
+    if (!b) {
+        return 0;
+    }
+    *staged = b->next;
+    if (discard) {
+        free(b);
+        return 0;
+    }
+    
+    // Swap the staged block in for the current one
+    memory_block_t **pp = memory_slot(st, block_num);
+    if (*pp) {
+        memory_block_t *old = *pp;
+        b->next = old->next;
+        free(old);
+    } else {
+        b->next = NULL;
+    }
+    *pp = b;
+    return 0;
+}
+
+// Nothing outlives the process, so there is never more than the block
+// layer already knows about
+static long long memory_size(void *state, long long known_size) {
+    return known_size;
+}
+
+static int memory_sync(void *state, int flags) {
+    return 0;
+}
+
+const block_backend_t block_memory_backend = {
+    "memory", 0, memory_open, memory_close, memory_read, memory_write,
+    memory_truncate, memory_size, memory_sync, memory_stage, memory_publish,
+    NULL, NULL, NULL, NULL, memory_punch
+};
\ No newline at end of file
@@ -0,0 +1,667 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include "block_internal.h"
+#if BLOCK_HAVE_MMAP
+#include <sys/mman.h>
+#endif
+
+#define SEGMENT_BYTES (1LL << 30)
+#define INDEX_ENTRY_SIZE 8
+
+// Packed block storage: blocks live in fixed-size slots of a few large
+// segment files (segment_0000, segment_0001, ... of 1GB each at 4KB blocks)
+// and an index file maps each block number to its slot. Holes and blocks
+// past the end read as zeros.
+//
+//   index:    one little-endian uint64 per block: slot + 1, or 0 for a hole
+//   segments: slot s is at offset (s % slots per segment) * block_size of
+//             segment s / slots per segment
+typedef struct {
+    char *dir;
+    int block_size;
+    long long slots_per_segment;
+    int index_fd;
+    int index_unsynced;         // written since the last sync
+    int *segment_fds;           // -1 until a segment is first needed
+    unsigned char *segment_unsynced;
+    int dir_changed;            // a file was created since the last sync
+    char **segment_maps;        // read-only mappings, NULL until first mapped
+    long long *segment_bytes;   // segment file size last seen by map
+    int segment_count;
+    unsigned long long *index;  // slot + 1 per block, 0 for a hole
+    long long index_len;        // blocks covered by the index
+    long long index_cap;
+    unsigned char *slot_used;   // bitmap of allocated slots
+    long long slot_count;       // one past the highest allocated slot
+    long long slot_cap;         // slots the bitmap can hold
+    long long free_hint;        // no free slot below this one
+} block_packed_t;
+
+static void packed_close(void *state);
+
+static int slot_is_used(block_packed_t *p, long long slot) {
+    return slot < p->slot_cap && (p->slot_used[slot / 8] >> (slot % 8)) & 1;
+}
+
+static int slot_mark(block_packed_t *p, long long slot, int used) {
+    if (slot >= p->slot_cap) {
+        long long cap = p->slot_cap ? p->slot_cap : 4096;
+        while (cap <= slot) cap *= 2;
+        unsigned char *bits = realloc(p->slot_used, cap / 8);
+        if (!bits) return -1;
+        memset(bits + p->slot_cap / 8, 0, (cap - p->slot_cap) / 8);
+        p->slot_used = bits;
+        p->slot_cap = cap;
+    }
+    if (used) {
+        p->slot_used[slot / 8] |= 1 << (slot % 8);
+    } else {
+        p->slot_used[slot / 8] &= ~(1 << (slot % 8));
+    }
+    return 0;
+}
+
+static int index_reserve(block_packed_t *p, long long len) {
+    if (len <= p->index_cap) return 0;
+    long long cap = p->index_cap ? p->index_cap : 1024;
+    while (cap < len) cap *= 2;
+    unsigned long long *index = realloc(p->index, cap * sizeof(unsigned long long));
+    if (!index) return -1;
+    memset(index + p->index_cap, 0, (cap - p->index_cap) * sizeof(unsigned long long));
+    p->index = index;
+    p->index_cap = cap;
+    return 0;
+}
+
+static void encode_entry(unsigned long long value, unsigned char *out) {
+    for (int i = 0; i < INDEX_ENTRY_SIZE; i++) {
+        out[i] = (unsigned char)(value >> (8 * i));
+    }
+}
+
+static unsigned long long decode_entry(const unsigned char *in) {
+    unsigned long long value = 0;
+    for (int i = 0; i < INDEX_ENTRY_SIZE; i++) {
+        value |= (unsigned long long)in[i] << (8 * i);
+    }
+    return value;
+}
+
+// Open a file of the store, noting when it had to be created
+static int packed_file_open(block_packed_t *p, const char *path, int create) {
+    int fd = open(path, O_RDWR | O_CLOEXEC, 0644);
+    if (fd < 0 && errno == ENOENT && create) {
+        fd = open(path, O_RDWR | O_CLOEXEC | O_CREAT, 0644);
+        if (fd >= 0) p->dir_changed = 1;
+    }
+    return fd;
+}
+
+// Get the descriptor of the segment holding a slot, opening it on demand.
+// A segment got to write to, with create set, is synced at the next sync.
+static int segment_fd(block_packed_t *p, long long slot, int create) {
+    long long seg = slot / p->slots_per_segment;
+    if (seg >= p->segment_count) {
+        int *fds = realloc(p->segment_fds, (seg + 1) * sizeof(int));
+        if (!fds) return -1;
+        p->segment_fds = fds;
+        char **maps = realloc(p->segment_maps, (seg + 1) * sizeof(char *));
+        if (!maps) return -1;
+        p->segment_maps = maps;
+        long long *bytes = realloc(p->segment_bytes, (seg + 1) * sizeof(long long));
+        if (!bytes) return -1;
+        p->segment_bytes = bytes;
+        unsigned char *unsynced = realloc(p->segment_unsynced, seg + 1);
+        if (!unsynced) return -1;
+        p->segment_unsynced = unsynced;
+        for (long long i = p->segment_count; i <= seg; i++) {
+            fds[i] = -1;
+            maps[i] = NULL;
+            bytes[i] = 0;
+            unsynced[i] = 0;
+        }
+        p->segment_count = seg + 1;
+    }
+    
+    if (p->segment_fds[seg] < 0) {
+        char path[MAX_PATH_LEN];
+        if (snprintf(path, sizeof(path), "%s/segment_%04lld", p->dir, seg) >= (int)sizeof(path)) {
+            return -1;
+        }
+        p->segment_fds[seg] = packed_file_open(p, path, create);
+    }
+    if (create && p->segment_fds[seg] >= 0) {
+        p->segment_unsynced[seg] = 1;
+    }
+    return p->segment_fds[seg];
+}
+
+static long long slot_offset(block_packed_t *p, long long slot) {
+    return (slot % p->slots_per_segment) * p->block_size;
+}
+
+// Load the index and rebuild the slot bitmap from it
+static int index_load(block_packed_t *p) {
+    struct stat st;
+    if (fstat(p->index_fd, &st) != 0) {
+        return -1;
+    }
+    
+    long long len = st.st_size / INDEX_ENTRY_SIZE;
+    if (index_reserve(p, len) != 0) {
+        return -1;
+    }
+    
+    unsigned char chunk[INDEX_ENTRY_SIZE * 512];
+    for (long long i = 0; i < len; i += 512) {
+        int n = (len - i < 512) ? (int)(len - i) : 512;
+        if (block_pread_full(p->index_fd, (char *)chunk, n * INDEX_ENTRY_SIZE, i * INDEX_ENTRY_SIZE)
+            != n * INDEX_ENTRY_SIZE) {
+            return -1;
+        }
+        for (int j = 0; j < n; j++) {
+            unsigned long long entry = decode_entry(chunk + j * INDEX_ENTRY_SIZE);
+            p->index[i + j] = entry;
+            if (entry) {
+                if (slot_mark(p, entry - 1, 1) != 0) return -1;
+                if ((long long)entry > p->slot_count) p->slot_count = entry;
+            }
+        }
+    }
+    
+    // Drop trailing holes so the block count reflects mapped blocks
+    while (len > 0 && p->index[len - 1] == 0) len--;
+    p->index_len = len;
+    return 0;
+}
+
+static int packed_open(const char *filename, int block_size, void **state) {
+    block_packed_t *p = calloc(1, sizeof(block_packed_t));
+    if (!p) return -1;
+    
+    char block_dir[MAX_PATH_LEN];
+    if (block_dir_path(filename, block_dir) != 0) {
+        free(p);
+        return -1;
+    }
+    p->dir = strdup(block_dir);
+    p->block_size = block_size;
+    p->slots_per_segment = SEGMENT_BYTES / block_size;
+    p->index_fd = -1;
+    
+    char path[MAX_PATH_LEN];
+    if (!p->dir || snprintf(path, sizeof(path), "%s/index", block_dir) >= (int)sizeof(path)) {
+        packed_close(p);
+        return -1;
+    }
+    p->index_fd = packed_file_open(p, path, 1);
+    if (p->index_fd < 0 || index_load(p) != 0) {
+        packed_close(p);
+        return -1;
+    }
+    
+    *state = p;
+    return 0;
+}
+
+static void packed_close(void *state) {
+    block_packed_t *p = state;
+    for (int i = 0; i < p->segment_count; i++) {
+        if (p->segment_fds[i] >= 0) close(p->segment_fds[i]);
+#if BLOCK_HAVE_MMAP
+        if (p->segment_maps[i]) munmap(p->segment_maps[i], p->slots_per_segment * p->block_size);
+#endif
+    }
+    if (p->index_fd >= 0) close(p->index_fd);
+    free(p->segment_fds);
+    free(p->segment_maps);
+    free(p->segment_bytes);
+    free(p->segment_unsynced);
+    free(p->index);
+    free(p->slot_used);
+    free(p->dir);
+    free(p);
+}
+
+// Blocks mapped past the known size count as whole; within it the
+// manifest knows the exact size of a partial last block
+static long long packed_size(void *state, long long known_size) {
+    block_packed_t *p = state;
+    long long known_blocks = (known_size + p->block_size - 1) / p->block_size;
+    return (p->index_len > known_blocks) ? p->index_len * p->block_size : known_size;
+}
+
+static int packed_read(void *state, long long block_num, int offset, int size, char *buf) {
+    block_packed_t *p = state;
+    unsigned long long entry = (block_num < p->index_len) ? p->index[block_num] : 0;
+    if (!entry) {
+        memset(buf, 0, size);
+        return 0;
+    }
+    
+    int fd = segment_fd(p, entry - 1, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    int n = block_pread_full(fd, buf, size, slot_offset(p, entry - 1) + offset);
+    if (n < 0) {
+        return -1;
+    }
+    memset(buf + n, 0, size - n);
+    return 0;
+}
+
+// Allocate the lowest free slot, so freed space is reused before the
+// segments grow
+static long long slot_alloc(block_packed_t *p) {
+    long long slot = p->free_hint;
+    while (slot < p->slot_count && slot_is_used(p, slot)) slot++;
+    if (slot_mark(p, slot, 1) != 0) {
+        return -1;
+    }
+    p->free_hint = slot + 1;
+    if (slot >= p->slot_count) p->slot_count = slot + 1;
+    return slot;
+}
+
+static void slot_free(block_packed_t *p, long long slot) {
+    slot_mark(p, slot, 0);
+    if (slot < p->free_hint) p->free_hint = slot;
+}
+
+// Point the index entry of a block at a slot
+static int index_set(block_packed_t *p, long long block_num, unsigned long long entry) {
+    unsigned char raw[INDEX_ENTRY_SIZE];
+    encode_entry(entry, raw);
+    if (index_reserve(p, block_num + 1) != 0 ||
+        block_pwrite_full(p->index_fd, (char *)raw, INDEX_ENTRY_SIZE, block_num * INDEX_ENTRY_SIZE) != 0) {
+        return -1;
+    }
+    p->index_unsynced = 1;
+    p->index[block_num] = entry;
+    if (block_num >= p->index_len) p->index_len = block_num + 1;
+    return 0;
+}
+
+static int packed_write(void *state, long long block_num, const char *data) {
+    block_packed_t *p = state;
+    unsigned long long entry = (block_num < p->index_len) ? p->index[block_num] : 0;
+    int new_slot = (entry == 0);
+    
+    if (new_slot) {
+        long long slot = slot_alloc(p);
+        if (slot < 0) {
+            return -1;
+        }
+        entry = slot + 1;
+    }
+    
+    int fd = segment_fd(p, entry - 1, 1);
+    if (fd < 0 || block_pwrite_full(fd, data, p->block_size, slot_offset(p, entry - 1)) != 0) {
+        if (new_slot) slot_free(p, entry - 1);
+        return -1;
+    }
+    
+    // The data is in place before the index points at it
+    if (new_slot && index_set(p, block_num, entry) != 0) {
+        slot_free(p, entry - 1);
+        return -1;
+    }
+    return 0;
+}
+
+static int packed_read_many(void *state, int count, const long long *block_nums, char *const *bufs) {
+    block_packed_t *p = state;
+    block_io_op_t *ops = malloc((count ? count : 1) * sizeof(block_io_op_t));
+    if (!ops) {
+        return -1;
+    }
+    
+    int reads = 0;
+    for (int i = 0; i < count; i++) {
+        unsigned long long entry = (block_nums[i] < p->index_len) ? p->index[block_nums[i]] : 0;
+        int fd = entry ? segment_fd(p, entry - 1, 0) : -1;
+        if (!entry) {
+            memset(bufs[i], 0, p->block_size);
+            continue;
+        }
+        if (fd < 0) {
+            free(ops);
+            return -1;
+        }
+        memset(&ops[reads], 0, sizeof(block_io_op_t));
+        ops[reads].op = BLOCK_IO_READ;
+        ops[reads].fd = fd;
+        ops[reads].buf = bufs[i];
+        ops[reads].size = p->block_size;
+        ops[reads].offset = slot_offset(p, entry - 1);
+        reads++;
+    }
+    block_io_run(ops, reads);
+    
+    int result = 0;
+    for (int j = 0; j < reads; j++) {
+        if (ops[j].result < 0) {
+            result = -1;
+        } else {
+            memset(ops[j].buf + ops[j].result, 0, p->block_size - ops[j].result);
+        }
+    }
+    free(ops);
+    return result;
+}
+
+// One batch writes the data of every block, a second the index entries of
+// the blocks that got new slots
+static int packed_write_many(void *state, int count, const long long *block_nums, const char *const *data) {
+    block_packed_t *p = state;
+    block_io_op_t *ops = malloc((count ? count : 1) * sizeof(block_io_op_t));
+    unsigned long long *entries = malloc((count ? count : 1) * sizeof(unsigned long long));
+    unsigned char *raw = malloc((count ? count : 1) * INDEX_ENTRY_SIZE);
+    if (!ops || !entries || !raw) {
+        free(ops);
+        free(entries);
+        free(raw);
+        return -1;
+    }
+    
+    // Slots are allocated up front; entries[i] is 0 once block i has failed
+    int result = 0;
+    for (int i = 0; i < count; i++) {
+        unsigned long long entry = (block_nums[i] < p->index_len) ? p->index[block_nums[i]] : 0;
+        int new_slot = (entry == 0);
+        if (new_slot) {
+            long long slot = slot_alloc(p);
+            entry = (slot < 0) ? 0 : slot + 1;
+        }
+        int fd = entry ? segment_fd(p, entry - 1, 1) : -1;
+        memset(&ops[i], 0, sizeof(block_io_op_t));
+        ops[i].op = BLOCK_IO_WRITE;
+        ops[i].fd = fd;
+        ops[i].buf = (char *)data[i];
+        ops[i].size = p->block_size;
+        ops[i].offset = entry ? slot_offset(p, entry - 1) : 0;
+        ops[i].flags = new_slot;
+        if (fd < 0) {
+            if (entry && new_slot) slot_free(p, entry - 1);
+            entry = 0;
+            result = -1;
+        }
+        entries[i] = entry;
+    }
+    
+    // Failed blocks are left out of the batch by running it in pieces
+    // between them
+    for (int start = 0; start < count; start++) {
+        int end = start;
+        while (end < count && entries[end]) end++;
+        block_io_run(ops + start, end - start);
+        start = end;
+    }
+    
+    // The data is in place before the index points at it
+    int updates = 0;
+    for (int i = 0; i < count; i++) {
+        if (!entries[i]) continue;
+        if (ops[i].result < 0) {
+            if (ops[i].flags) slot_free(p, entries[i] - 1);
+            entries[i] = 0;
+            result = -1;
+        } else if (ops[i].flags) {
+            if (index_reserve(p, block_nums[i] + 1) != 0) {
+                slot_free(p, entries[i] - 1);
+                entries[i] = 0;
+                result = -1;
+                continue;
+            }
+            unsigned char *out = raw + updates * INDEX_ENTRY_SIZE;
+            encode_entry(entries[i], out);
+            memset(&ops[updates], 0, sizeof(block_io_op_t));
+            ops[updates].op = BLOCK_IO_WRITE;
+            ops[updates].fd = p->index_fd;
+            ops[updates].buf = (char *)out;
+            ops[updates].size = INDEX_ENTRY_SIZE;
+            ops[updates].offset = block_nums[i] * INDEX_ENTRY_SIZE;
+            ops[updates].flags = i;
+            updates++;
+        }
+    }
+    block_io_run(ops, updates);
+    if (updates > 0) p->index_unsynced = 1;
+    for (int j = 0; j < updates; j++) {
+        int i = ops[j].flags;
+        if (ops[j].result < 0) {
+            slot_free(p, entries[i] - 1);
+            result = -1;
+            continue;
+        }
+        p->index[block_nums[i]] = entries[i];
+        if (block_nums[i] >= p->index_len) p->index_len = block_nums[i] + 1;
+    }
+    
+    free(ops);
+    free(entries);
+    free(raw);
+    return result;
+}
+
+
+// Staged blocks go to a fresh slot; the token is the slot
+static int packed_stage(void *state, long long block_num, const char *data, long long *token) {
+    block_packed_t *p = state;
+    long long slot = slot_alloc(p);
+    if (slot < 0) {
+        return -1;
+    }
+    
+    int fd = segment_fd(p, slot, 1);
+    if (fd < 0 || block_pwrite_full(fd, data, p->block_size, slot_offset(p, slot)) != 0) {
+        slot_free(p, slot);
+        return -1;
+    }
+    *token = slot;
+    return 0;
+}
+
+// Point the index at the staged slot and free the old one. After a crash
+// the staged slot is free in the rebuilt bitmap, so it is claimed here.
+static int packed_publish(void *state, long long block_num, long long token, int discard) {
+    block_packed_t *p = state;
+    if (discard) {
+        slot_free(p, token);
+        return 0;
+    }
+    
+    unsigned long long entry = (block_num < p->index_len) ? p->index[block_num] : 0;
+    if (entry == (unsigned long long)token + 1) {
+        return 0;
+    }
+    if (slot_mark(p, token, 1) != 0 || index_set(p, block_num, token + 1) != 0) {
+        return -1;
+    }
+    if (token >= p->slot_count) p->slot_count = token + 1;
+    if (entry) {
+        slot_free(p, entry - 1);
+    }
+    return 0;
+}
+
+// Give trailing free slots back to the filesystem. Segments not opened
+// since the store was are opened to be cut; ones never created are skipped.
+static int slots_trim(block_packed_t *p) {
+    long long old_slots = p->slot_count;
+    while (p->slot_count > 0 && !slot_is_used(p, p->slot_count - 1)) p->slot_count--;
+    if (p->slot_count < old_slots) {
+        long long last = (old_slots - 1) / p->slots_per_segment;
+        for (long long seg = p->slot_count / p->slots_per_segment; seg <= last; seg++) {
+            int fd = segment_fd(p, seg * p->slots_per_segment, 0);
+            if (fd < 0) {
+                if (errno == ENOENT) continue;
+                return -1;
+            }
+            long long keep = p->slot_count - seg * p->slots_per_segment;
+            if (ftruncate(fd, keep > 0 ? keep * p->block_size : 0) != 0) {
+                return -1;
+            }
+            p->segment_unsynced[seg] = 1;
+            p->segment_bytes[seg] = 0;
+        }
+    }
+    return 0;
+}
+
+static int packed_truncate(void *state, long long block_count, int tail) {
+    block_packed_t *p = state;
+    // Cut the index first so a crash never leaves it pointing at freed slots
+    if (block_count < p->index_len) {
+        if (ftruncate(p->index_fd, block_count * INDEX_ENTRY_SIZE) != 0) {
+            return -1;
+        }
+        p->index_unsynced = 1;
+        for (long long i = block_count; i < p->index_len; i++) {
+            if (p->index[i]) {
+                slot_free(p, p->index[i] - 1);
+                p->index[i] = 0;
+            }
+        }
+        p->index_len = block_count;
+        while (p->index_len > 0 && p->index[p->index_len - 1] == 0) p->index_len--;
+    }
+    
+    if (slots_trim(p) != 0) {
+        return -1;
+    }
+    
+    // Zero the cut-off part of a partial last block
+    if (tail > 0 && block_count > 0 && block_count - 1 < p->index_len && p->index[block_count - 1]) {
+        unsigned long long entry = p->index[block_count - 1];
+        int fd = segment_fd(p, entry - 1, 1);
+        char *zeros = calloc(1, p->block_size - tail);
+        int rc = (fd >= 0 && zeros) ?
+            block_pwrite_full(fd, zeros, p->block_size - tail, slot_offset(p, entry - 1) + tail) : -1;
+        free(zeros);
+        if (rc != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Clear the index entry, then free the slot, giving it back to the
+// filesystem if it was the last
+static int packed_punch(void *state, long long block_num) {
+    block_packed_t *p = state;
+    unsigned long long entry = (block_num < p->index_len) ? p->index[block_num] : 0;
+    if (!entry) {
+        return 0;
+    }
+    if (index_set(p, block_num, 0) != 0) {
+        return -1;
+    }
+    slot_free(p, entry - 1);
+    return slots_trim(p);
+}
+
+// Segments and the index are synced only if written since the last sync.
+// Every file of the store is in the block directory itself.
+static int packed_sync(void *state, int flags) {
+    block_packed_t *p = state;
+    block_io_op_t *ops = calloc(p->segment_count + 1, sizeof(block_io_op_t));
+    int *which = calloc(p->segment_count + 1, sizeof(int));
+    if (!ops || !which) {
+        free(ops);
+        free(which);
+        return -1;
+    }
+    
+    int n = 0;
+    for (int i = 0; i < p->segment_count; i++) {
+        if (p->segment_fds[i] >= 0 && p->segment_unsynced[i]) {
+            ops[n].op = block_sync_op(flags);
+            ops[n].fd = p->segment_fds[i];
+            which[n++] = i;
+        }
+    }
+    if (p->index_unsynced) {
+        ops[n].op = block_sync_op(flags);
+        ops[n].fd = p->index_fd;
+        which[n++] = -1;
+    }
+    block_io_run(ops, n);
+    
+    int result = 0;
+    for (int i = 0; i < n; i++) {
+        if (ops[i].result < 0) {
+            result = -1;
+        } else if (which[i] < 0) {
+            p->index_unsynced = 0;
+        } else {
+            p->segment_unsynced[which[i]] = 0;
+        }
+    }
+    free(ops);
+    free(which);
+    if (result == 0 && p->dir_changed) {
+        p->dir_changed = 0;
+        return 1;
+    }
+    return result;
+}
+
+#if BLOCK_HAVE_MMAP
+// Each segment is mapped whole once, on its first mapped read, and stays
+// mapped until close; slots written later show through the same mapping.
+// A slot is only handed out once the segment file covers it, since pages
+// past the end of a file fault instead of reading as zeros.
+static int packed_map(void *state, long long block_num, const char **data) {
+    block_packed_t *p = state;
+    unsigned long long entry = (block_num < p->index_len) ? p->index[block_num] : 0;
+    if (!entry) {
+        return 1;
+    }
+    
+    long long slot = entry - 1;
+    long long seg = slot / p->slots_per_segment;
+    int fd = segment_fd(p, slot, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    long long end = slot_offset(p, slot) + p->block_size;
+    if (p->segment_bytes[seg] < end) {
+        struct stat sb;
+        if (fstat(fd, &sb) != 0) {
+            return -1;
+        }
+        p->segment_bytes[seg] = sb.st_size;
+        if (sb.st_size < end) {
+            return 1;
+        }
+    }
+    if (!p->segment_maps[seg]) {
+        void *addr = mmap(NULL, p->slots_per_segment * p->block_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (addr == MAP_FAILED) {
+            return 1;
+        }
+        p->segment_maps[seg] = addr;
+    }
+    *data = p->segment_maps[seg] + slot_offset(p, slot);
+    return 0;
+}
+
+static void packed_unmap(void *state, long long block_num, const char *data) {
+}
+#else
+#define packed_map NULL
+#define packed_unmap NULL
+#endif
+
+const block_backend_t block_packed_backend = {
+    "packed", 1, packed_open, packed_close, packed_read, packed_write,
+    packed_truncate, packed_size, packed_sync, packed_stage, packed_publish,
+    packed_map, packed_unmap, packed_read_many, packed_write_many, packed_punch
+};
\ No newline at end of file
@@ -0,0 +1,183 @@
+#include <string.h>
+#include <stdint.h>
+#include "block_internal.h"
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define BLOCK_HAVE_SSE2 1
+#include <immintrin.h>
+#endif
+#if defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#endif
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#define BLOCK_HAVE_ARM_CRC 1
+#include <arm_acle.h>
+#endif
+
+// Vectorized scans and checksums of block data. Each routine has a
+// portable version and variants for the instruction sets the build or the
+// CPU offers.
+
+// Database pages almost never start with eight zero bytes unless they are
+// zero throughout, so the first word settles most calls
+static int zero_words(const unsigned char *p, int size) {
+    int i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, p + i, 8);
+        if (word) return 0;
+    }
+    for (; i < size; i++) {
+        if (p[i]) return 0;
+    }
+    return 1;
+}
+
+#if BLOCK_HAVE_SSE2
+static int zero_sse2(const unsigned char *p, int size) {
+    int i = 0;
+    for (; i + 64 <= size; i += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(p + i + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(p + i + 32));
+        __m128i d = _mm_loadu_si128((const __m128i *)(p + i + 48));
+        __m128i any = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(any, _mm_setzero_si128())) != 0xffff) return 0;
+    }
+    return zero_words(p + i, size - i);
+}
+
+__attribute__((target("avx2")))
+static int zero_avx2(const unsigned char *p, int size) {
+    int i = 0;
+    for (; i + 128 <= size; i += 128) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(p + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(p + i + 32));
+        __m256i c = _mm256_loadu_si256((const __m256i *)(p + i + 64));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(p + i + 96));
+        __m256i any = _mm256_or_si256(_mm256_or_si256(a, b), _mm256_or_si256(c, d));
+        if (!_mm256_testz_si256(any, any)) return 0;
+    }
+    return zero_sse2(p + i, size - i);
+}
+#endif
+
+#if defined(__wasm_simd128__)
+static int zero_simd128(const unsigned char *p, int size) {
+    int i = 0;
+    for (; i + 64 <= size; i += 64) {
+        v128_t a = wasm_v128_load(p + i);
+        v128_t b = wasm_v128_load(p + i + 16);
+        v128_t c = wasm_v128_load(p + i + 32);
+        v128_t d = wasm_v128_load(p + i + 48);
+        if (wasm_v128_any_true(wasm_v128_or(wasm_v128_or(a, b), wasm_v128_or(c, d)))) return 0;
+    }
+    return zero_words(p + i, size - i);
+}
+#endif
+
+int block_is_zero(const char *data, int size) {
+    const unsigned char *p = (const unsigned char *)data;
+    if (size >= 8 && !zero_words(p, 8)) {
+        return 0;
+    }
+#if BLOCK_HAVE_SSE2
+    if (__builtin_cpu_supports("avx2")) {
+        return zero_avx2(p, size);
+    }
+    return zero_sse2(p, size);
+#elif defined(__wasm_simd128__)
+    return zero_simd128(p, size);
+#else
+    return zero_words(p, size);
+#endif
+}
+
+// CRC32C (Castagnoli, reflected polynomial 0x82f63b78). The portable
+// version reads eight bytes per step through eight tables, built before
+// main runs.
+static uint32_t crc_tables[8][256];
+
+__attribute__((constructor))
+static void crc_tables_init(void) {
+    for (int i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));
+        }
+        crc_tables[0][i] = crc;
+    }
+    for (int i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            uint32_t prev = crc_tables[t - 1][i];
+            crc_tables[t][i] = (prev >> 8) ^ crc_tables[0][prev & 0xff];
+        }
+    }
+}
+
+static uint32_t crc_slice8(uint32_t crc, const unsigned char *p, int size) {
+    int i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p + i, 4);
+        memcpy(&hi, p + i + 4, 4);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        lo = __builtin_bswap32(lo);
+        hi = __builtin_bswap32(hi);
+#endif
+        lo ^= crc;
+        crc = crc_tables[7][lo & 0xff] ^ crc_tables[6][(lo >> 8) & 0xff] ^
+              crc_tables[5][(lo >> 16) & 0xff] ^ crc_tables[4][lo >> 24] ^
+              crc_tables[3][hi & 0xff] ^ crc_tables[2][(hi >> 8) & 0xff] ^
+              crc_tables[1][(hi >> 16) & 0xff] ^ crc_tables[0][hi >> 24];
+    }
+    for (; i < size; i++) {
+        crc = (crc >> 8) ^ crc_tables[0][(crc ^ p[i]) & 0xff];
+    }
+    return crc;
+}
+
+#if BLOCK_HAVE_SSE2 && defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc_sse42(uint32_t crc, const unsigned char *p, int size) {
+    unsigned long long c = crc;
+    int i = 0;
+    for (; i + 8 <= size; i += 8) {
+        unsigned long long word;
+        memcpy(&word, p + i, 8);
+        c = _mm_crc32_u64(c, word);
+    }
+    crc = (uint32_t)c;
+    for (; i < size; i++) {
+        crc = _mm_crc32_u8(crc, p[i]);
+    }
+    return crc;
+}
+#endif
+
+#if BLOCK_HAVE_ARM_CRC
+static uint32_t crc_armv8(uint32_t crc, const unsigned char *p, int size) {
+    int i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, p + i, 8);
+        crc = __crc32cd(crc, word);
+    }
+    for (; i < size; i++) {
+        crc = __crc32cb(crc, p[i]);
+    }
+    return crc;
+}
+#endif
+
+uint32_t block_crc32c(uint32_t crc, const char *data, int size) {
+    const unsigned char *p = (const unsigned char *)data;
+    crc = ~crc;
+#if BLOCK_HAVE_SSE2 && defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        return ~crc_sse42(crc, p, size);
+    }
+#elif BLOCK_HAVE_ARM_CRC
+    return ~crc_armv8(crc, p, size);
+#endif
+    return ~crc_slice8(crc, p, size);
+}
@@ -11,40 +11,705 @@
 #include <stdlib.h>
 #include <time.h>
 #include <stdarg.h>
-#include <dirent.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include "block.h"
+#include "logging_vfs.h"
+#include "vfs_trace.h"
 
 /*
-** Forward declarations
+** Log records are written by a background thread unless the build has no
+** threads (WASI) or LOGGING_VFS_SYNC_LOG is defined.
+*/
+#if !defined(__wasi__) && !defined(LOGGING_VFS_SYNC_LOG)
+# define LOGGING_VFS_ASYNC_LOG 1
+# include <pthread.h>
+# include <sched.h>
+#else
+# define LOGGING_VFS_ASYNC_LOG 0
+#endif
+
+/*
+** Shared memory for WAL in block mode is a heap region everywhere, or an
+** mmap'd file where the platform has mmap.
+*/
+#if !defined(__wasi__)
+# define LOGGING_VFS_SHM_MMAP 1
+# include <fcntl.h>
+# include <sys/mman.h>
+#else
+# define LOGGING_VFS_SHM_MMAP 0
+#endif
+
+/*
+** Forward declarations. Settings are atomics because connections on other
+** threads read them on every call.
 */
 static sqlite3_vfs *pDefaultVfs = 0;
-static FILE *logFile = 0;
-static int useBlockStorage = 0; /* 0 = use default VFS, 1 = use block storage */
-static int loggingEnabled = 1; /* 0 = disable logging, 1 = enable logging */
+static FILE *_Atomic logFile = 0;
+static _Atomic int useBlockStorage = 0; /* 0 = use default VFS, 1 = use block storage */
+static _Atomic int loggingEnabled = 1; /* 0 = disable logging, 1 = enable logging */
+static _Atomic int shmMode = 0;        /* LOGGINGVFS_SHM_HEAP or LOGGINGVFS_SHM_MMAP */
+static FILE *_Atomic traceFile = 0;     /* binary trace, see vfs_trace.h */
+static _Atomic unsigned traceGeneration = 0;  /* bumped each time a trace is started */
 
 /*
-** Logging helper function
+** Mutexes. The output mutex covers log and trace records written inline
+** and the trace name table; the node mutex covers the lists of LockNode
+** and ShmNode objects. Both compile to nothing in SQLITE_THREADSAFE=0
+** builds, where sqlite3_mutex_alloc() returns NULL.
 */
-static void logVfsOperation(const char *operation, const char *filename, const char *format, ...) {
-    if (!logFile || !loggingEnabled) return;
+static sqlite3_mutex *outputMutex(void){
+    return sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_VFS3);
+}
+static sqlite3_mutex *nodeMutex(void){
+    return sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_VFS2);
+}
+
+/*
+** Write one binary trace record, followed by the name for NAME records.
+*/
+static void traceWriteRecord(FILE *out, const vfs_trace_record_t *t, const char *zName){
+    unsigned char raw[VFS_TRACE_RECORD_SIZE];
+    vfs_trace_encode(t, raw);
+    fwrite(raw, 1, sizeof(raw), out);
+    if( zName ){
+        static const unsigned char zeros[VFS_TRACE_RECORD_SIZE];
+        fwrite(zName, 1, t->length, out);
+        fwrite(zeros, 1, vfs_trace_name_padding(t->length), out);
+    }
+}
+
+/*
+** Write one formatted log line.
+*/
+static void logWriteLine(FILE *out, time_t when, const char *operation, const char *filename,
+                         const char *format, va_list args){
+    char timeStr[32];
+    ctime_r(&when, timeStr);
+    timeStr[strlen(timeStr)-1] = '\0'; // Remove newline
     
-    time_t now;
-    time(&now);
-    char *timeStr = ctime(&now);
+    fprintf(out, "[%s] %s: %s - ", timeStr, operation, filename ? filename : "NULL");
+    vfprintf(out, format, args);
+    fprintf(out, "\n");
+}
+
+#if LOGGING_VFS_ASYNC_LOG
+/*
+** Asynchronous log pipeline.
+**
+** A VFS call only captures its record: a timestamp, the format string and
+** its raw arguments, with the filename and any %s arguments copied into the
+** record. Records go into a bounded lock-free ring (Vyukov's multi-producer
+** queue: each slot carries a sequence number that says whose turn it is).
+** A writer thread formats them, writes them out and flushes whenever the
+** ring runs empty.
+**
+** When the ring is full the record is dropped and counted, or with the
+** blocking policy the caller yields until the writer makes room.
+*/
+#define LOG_RING_SIZE 4096            /* records, a power of two */
+#define LOG_MAX_ARGS 6
+#define LOG_TEXT_SIZE 256             /* filename plus copied %s arguments */
+
+#define LOG_KIND_TEXT  0              /* a text log line */
+#define LOG_KIND_TRACE 1              /* a binary trace record */
+#define LOG_KIND_NAME  2              /* a trace NAME record, name in text */
+
+typedef struct LogRecord LogRecord;
+struct LogRecord {
+    _Atomic size_t seq;               /* ring position this slot is ready for */
+    int kind;                         /* LOG_KIND_* */
+    vfs_trace_record_t trace;
+    time_t when;
+    const char *operation;            /* string literals, never copied */
+    const char *format;
+    int hasFilename;
+    int nArg;
+    long long aArg[LOG_MAX_ARGS];     /* integers, or text offsets for %s */
+    char text[LOG_TEXT_SIZE];
+};
+
+static LogRecord logRing[LOG_RING_SIZE];
+static _Atomic size_t logEnqueuePos = 0;
+static size_t logDequeuePos = 0;      /* only the writer touches this */
+static _Atomic size_t logFlushedPos = 0;  /* records written and flushed */
+static int logRingReady = 0;
+static _Atomic long long logDropped = 0;
+static _Atomic int logBlockWhenFull = 0;
+
+static pthread_t logWriter;
+static pthread_mutex_t logMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t logCond = PTHREAD_COND_INITIALIZER;
+static _Atomic int logWriterRunning = 0;
+static _Atomic int logWriterSleeping = 0;
+static _Atomic int logWriterStop = 0;
+
+/*
+** Length modifier of a conversion: 0 for int, 1 for long, 2 for long long.
+** Advances *pz past the flags, width, precision and modifiers.
+*/
+static int logParseSpec(const char **pz){
+    const char *z = *pz;
+    int nLong = 0;
+    while( *z && strchr("-+ #0123456789.*", *z) ) z++;
+    while( *z=='l' || *z=='h' || *z=='z' || *z=='j' ){
+        if( *z=='l' ) nLong++;
+        if( *z=='z' || *z=='j' ) nLong = 2;
+        z++;
+    }
+    *pz = z;
+    return nLong;
+}
+
+/*
+** Copy a string into the record's text area; returns its offset, or -1 if
+** there is no room left (the writer prints it as "...").
+*/
+static int logCopyText(LogRecord *r, int *pUsed, const char *z){
+    if( !z ) z = "NULL";
+    int avail = LOG_TEXT_SIZE - *pUsed;
+    if( avail<=1 ) return -1;
+    int n = (int)strlen(z);
+    if( n>avail-1 ) n = avail-1;
+    memcpy(r->text + *pUsed, z, n);
+    r->text[*pUsed + n] = '\0';
+    int offset = *pUsed;
+    *pUsed += n + 1;
+    return offset;
+}
+
+/*
+** Capture the arguments of a record from its format string.
+*/
+static void logCapture(LogRecord *r, const char *filename, const char *format, va_list args){
+    int used = 0;
+    r->hasFilename = filename!=0;
+    if( filename ) logCopyText(r, &used, filename);
+    
+    r->nArg = 0;
+    for(const char *z=format; *z; z++){
+        if( *z!='%' ) continue;
+        z++;
+        if( *z=='%' ) continue;
+        int nLong = logParseSpec(&z);
+        if( r->nArg==LOG_MAX_ARGS ) break;
+        long long *pArg = &r->aArg[r->nArg++];
+        switch( *z ){
+            case 's':
+                *pArg = logCopyText(r, &used, va_arg(args, const char*));
+                break;
+            case 'p':
+                *pArg = (long long)(intptr_t)va_arg(args, void*);
+                break;
+            case 'f': case 'g': case 'e': {
+                double d = va_arg(args, double);
+                memcpy(pArg, &d, sizeof(d));
+                break;
+            }
+            default:
+                if( nLong>=2 ) *pArg = va_arg(args, long long);
+                else if( nLong==1 ) *pArg = va_arg(args, long);
+                else *pArg = va_arg(args, int);
+                break;
+        }
+    }
+}
+
+/*
+** Format a captured record, one conversion at a time.
+*/
+static void logFormatRecord(FILE *out, LogRecord *r){
+    char timeStr[32];
+    ctime_r(&r->when, timeStr);
     timeStr[strlen(timeStr)-1] = '\0'; // Remove newline
+    fprintf(out, "[%s] %s: %s - ", timeStr, r->operation, r->hasFilename ? r->text : "NULL");
+    
+    int iArg = 0;
+    const char *z = r->format;
+    while( *z ){
+        const char *zPct = strchr(z, '%');
+        if( !zPct ){
+            fputs(z, out);
+            break;
+        }
+        fwrite(z, 1, zPct - z, out);
+        if( zPct[1]=='%' ){
+            fputc('%', out);
+            z = zPct + 2;
+            continue;
+        }
+        
+        const char *zEnd = zPct + 1;
+        int nLong = logParseSpec(&zEnd);
+        char zSpec[32];
+        int nSpec = (int)(zEnd - zPct) + 1;
+        if( !*zEnd || nSpec>=(int)sizeof(zSpec) || iArg==r->nArg ){
+            fputs(zPct, out);
+            break;
+        }
+        memcpy(zSpec, zPct, nSpec);
+        zSpec[nSpec] = '\0';
+        
+        long long v = r->aArg[iArg++];
+        switch( *zEnd ){
+            case 's':
+                fprintf(out, zSpec, v>=0 ? r->text + v : "...");
+                break;
+            case 'p':
+                fprintf(out, zSpec, (void*)(intptr_t)v);
+                break;
+            case 'f': case 'g': case 'e': {
+                double d;
+                memcpy(&d, &v, sizeof(d));
+                fprintf(out, zSpec, d);
+                break;
+            }
+            default:
+                if( nLong>=2 ) fprintf(out, zSpec, v);
+                else if( nLong==1 ) fprintf(out, zSpec, (long)v);
+                else fprintf(out, zSpec, (int)v);
+                break;
+        }
+        z = zEnd + 1;
+    }
+    fputc('\n', out);
+}
+
+/*
+** Write out one record from the ring.
+*/
+static void logWriteRecord(LogRecord *r){
+    if( r->kind==LOG_KIND_TEXT ){
+        if( logFile ) logFormatRecord(logFile, r);
+    }else if( traceFile ){
+        traceWriteRecord(traceFile, &r->trace, r->kind==LOG_KIND_NAME ? r->text : 0);
+    }
+}
+
+/*
+** Claim a ring slot. Returns 0 if the ring is full.
+*/
+static LogRecord *logRingClaim(size_t *pPos){
+    size_t pos = atomic_load_explicit(&logEnqueuePos, memory_order_relaxed);
+    for(;;){
+        LogRecord *r = &logRing[pos & (LOG_RING_SIZE-1)];
+        size_t seq = atomic_load_explicit(&r->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if( diff==0 ){
+            if( atomic_compare_exchange_weak_explicit(&logEnqueuePos, &pos, pos+1,
+                                                      memory_order_relaxed, memory_order_relaxed) ){
+                *pPos = pos;
+                return r;
+            }
+        }else if( diff<0 ){
+            return 0;
+        }else{
+            pos = atomic_load_explicit(&logEnqueuePos, memory_order_relaxed);
+        }
+    }
+}
+
+static void logWakeWriter(void){
+    if( atomic_load(&logWriterSleeping) ){
+        pthread_mutex_lock(&logMutex);
+        pthread_cond_signal(&logCond);
+        pthread_mutex_unlock(&logMutex);
+    }
+}
+
+/*
+** Claim a slot for a new record, applying the overflow policy. Returns 0
+** if the record was dropped.
+*/
+static LogRecord *logRingAcquire(size_t *pPos){
+    LogRecord *r;
+    while( (r = logRingClaim(pPos))==0 ){
+        if( !atomic_load_explicit(&logBlockWhenFull, memory_order_relaxed) ){
+            atomic_fetch_add_explicit(&logDropped, 1, memory_order_relaxed);
+            return 0;
+        }
+        logWakeWriter();
+        sched_yield();
+    }
+    return r;
+}
+
+/*
+** Hand a filled slot to the writer.
+*/
+static void logRingPublish(LogRecord *r, size_t pos){
+    atomic_store_explicit(&r->seq, pos + 1, memory_order_release);
+    logWakeWriter();
+}
+
+/*
+** Write out every ready record. Returns the number written.
+*/
+static int logDrain(void){
+    int n = 0;
+    for(;;){
+        LogRecord *r = &logRing[logDequeuePos & (LOG_RING_SIZE-1)];
+        if( atomic_load_explicit(&r->seq, memory_order_acquire)!=logDequeuePos+1 ) break;
+        logWriteRecord(r);
+        atomic_store_explicit(&r->seq, logDequeuePos + LOG_RING_SIZE, memory_order_release);
+        logDequeuePos++;
+        n++;
+    }
     
-    fprintf(logFile, "[%s] %s: %s - ", timeStr, operation, filename ? filename : "NULL");
+    long long dropped = atomic_exchange(&logDropped, 0);
+    if( dropped>0 && logFile ){
+        fprintf(logFile, "[log] %lld records dropped, ring full\n", dropped);
+    }
+    return n;
+}
+
+static void logFlushFiles(void){
+    if( logFile ) fflush(logFile);
+    if( traceFile ) fflush(traceFile);
+}
+
+static void *logWriterMain(void *arg){
+    for(;;){
+        if( logDrain()>0 ) continue;
+        logFlushFiles();
+        atomic_store(&logFlushedPos, logDequeuePos);
+        if( atomic_load(&logWriterStop) ) break;
+        
+        // Sleep until a producer signals; the timeout bounds any missed wakeup
+        pthread_mutex_lock(&logMutex);
+        atomic_store(&logWriterSleeping, 1);
+        LogRecord *r = &logRing[logDequeuePos & (LOG_RING_SIZE-1)];
+        if( atomic_load(&r->seq)!=logDequeuePos+1 && !atomic_load(&logWriterStop) ){
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += 100*1000*1000;
+            if( deadline.tv_nsec>=1000000000 ){
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&logCond, &logMutex, &deadline);
+        }
+        atomic_store(&logWriterSleeping, 0);
+        pthread_mutex_unlock(&logMutex);
+    }
+    logDrain();
+    logFlushFiles();
+    atomic_store(&logFlushedPos, logDequeuePos);
+    return 0;
+}
+
+static void logStartWriter(void){
+    if( (!logFile && !traceFile) || atomic_load(&logWriterRunning) ) return;
+    if( !logRingReady ){
+        for(size_t i=0; i<LOG_RING_SIZE; i++) atomic_init(&logRing[i].seq, i);
+        logRingReady = 1;
+    }
+    atomic_store(&logWriterStop, 0);
+    if( pthread_create(&logWriter, 0, logWriterMain, 0)==0 ){
+        atomic_store(&logWriterRunning, 1);
+    }
+}
+
+/*
+** Write out everything queued and stop the writer.
+*/
+static void logStopWriter(void){
+    if( !atomic_load(&logWriterRunning) ) return;
+    pthread_mutex_lock(&logMutex);
+    atomic_store(&logWriterStop, 1);
+    pthread_cond_signal(&logCond);
+    pthread_mutex_unlock(&logMutex);
+    pthread_join(logWriter, 0);
+    atomic_store(&logWriterRunning, 0);
+}
+#endif /* LOGGING_VFS_ASYNC_LOG */
+
+/*
+** Logging helper function
+*/
+static void logVfsOperation(const char *operation, const char *filename, const char *format, ...) {
+    if (!logFile || !loggingEnabled) return;
     
     va_list args;
     va_start(args, format);
-    vfprintf(logFile, format, args);
-    va_end(args);
     
-    fprintf(logFile, "\n");
+#if LOGGING_VFS_ASYNC_LOG
+    if (atomic_load_explicit(&logWriterRunning, memory_order_relaxed)) {
+        size_t pos;
+        LogRecord *r = logRingAcquire(&pos);
+        if (r) {
+            r->kind = LOG_KIND_TEXT;
+            r->when = time(0);
+            r->operation = operation;
+            r->format = format;
+            logCapture(r, filename, format, args);
+            logRingPublish(r, pos);
+        }
+        va_end(args);
+        return;
+    }
+#endif
+    
+    // No writer thread: format and write inline
+    sqlite3_mutex_enter(outputMutex());
+    logWriteLine(logFile, time(0), operation, filename, format, args);
     fflush(logFile);
+    sqlite3_mutex_leave(outputMutex());
+    va_end(args);
+}
+
+#ifndef LOG_TEXT_SIZE
+# define LOG_TEXT_SIZE 256
+# define LOG_KIND_TRACE 1
+# define LOG_KIND_NAME 2
+#endif
+
+/*
+** Binary tracing. Each traced call takes its start time with traceNow(),
+** which is 0 while no trace is being written, and hands the finished
+** record to traceVfsOperation(). Records share the log ring and writer.
+*/
+#define TRACE_NAME_HASH 256
+#define TRACE_MAX_FILE_ID 0xffff
+
+typedef struct TraceName TraceName;
+struct TraceName {
+    char *zName;
+    unsigned short id;
+    TraceName *pNext;
+};
+static TraceName *traceNames[TRACE_NAME_HASH];
+static int traceNameCount = 0;
+
+static unsigned long long traceNow(void){
+    if( !traceFile ) return 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (unsigned long long)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+/*
+** Queue a record for the writer thread. Returns 0 if there is none and
+** the caller must write the record itself, holding the output mutex.
+*/
+static int traceQueue(int kind, const vfs_trace_record_t *t, const char *zName){
+#if LOGGING_VFS_ASYNC_LOG
+    if( atomic_load_explicit(&logWriterRunning, memory_order_relaxed) ){
+        size_t pos;
+        LogRecord *r = logRingAcquire(&pos);
+        if( r ){
+            r->kind = kind;
+            r->trace = *t;
+            if( zName ) memcpy(r->text, zName, t->length);
+            logRingPublish(r, pos);
+        }
+        return 1;
+    }
+#endif
+    return 0;
+}
+
+/*
+** Queue a record, or write it inline when there is no writer thread.
+*/
+static void traceEmit(int kind, const vfs_trace_record_t *t, const char *zName){
+    if( traceQueue(kind, t, zName) ) return;
+    sqlite3_mutex_enter(outputMutex());
+    FILE *out = traceFile;
+    if( out ) traceWriteRecord(out, t, zName);
+    sqlite3_mutex_leave(outputMutex());
+}
+
+static void traceForgetNames(void){
+    for(int i=0; i<TRACE_NAME_HASH; i++){
+        while( traceNames[i] ){
+            TraceName *pName = traceNames[i];
+            traceNames[i] = pName->pNext;
+            free(pName->zName);
+            free(pName);
+        }
+    }
+    traceNameCount = 0;
+}
+
+/*
+** Get the trace id of a file name, announcing new names with a NAME
+** record. Id 0 stands for no name, and names past the last id share it.
+** Called with the output mutex held, so the NAME record is queued before
+** any other thread can learn the id.
+*/
+static unsigned short traceNameIdLocked(const char *zName){
+    unsigned h = 0;
+    for(const char *z=zName; *z; z++) h = h*31 + (unsigned char)*z;
+    TraceName **pp = &traceNames[h % TRACE_NAME_HASH];
+    for(TraceName *pName=*pp; pName; pName=pName->pNext){
+        if( strcmp(pName->zName, zName)==0 ) return pName->id;
+    }
+    if( traceNameCount==TRACE_MAX_FILE_ID ) return TRACE_MAX_FILE_ID;
+    
+    TraceName *pName = malloc(sizeof(TraceName));
+    if( !pName ) return TRACE_MAX_FILE_ID;
+    pName->zName = strdup(zName);
+    if( !pName->zName ){
+        free(pName);
+        return TRACE_MAX_FILE_ID;
+    }
+    pName->id = (unsigned short)++traceNameCount;
+    pName->pNext = *pp;
+    *pp = pName;
+    
+    // Names longer than a ring record can hold are cut short
+    vfs_trace_record_t t = {0};
+    size_t n = strlen(zName);
+    t.length = (uint32_t)(n < LOG_TEXT_SIZE ? n : LOG_TEXT_SIZE);
+    t.file_id = pName->id;
+    t.op = VFS_TRACE_NAME;
+    if( !traceQueue(LOG_KIND_NAME, &t, zName) && traceFile ){
+        traceWriteRecord(traceFile, &t, zName);
+    }
+    return pName->id;
+}
+
+static unsigned short traceNameId(const char *zName){
+    if( !zName ) return 0;
+    sqlite3_mutex_enter(outputMutex());
+    unsigned short id = traceNameIdLocked(zName);
+    sqlite3_mutex_leave(outputMutex());
+    return id;
+}
+
+static void traceRecord(int op, unsigned short fileId, long long offset, unsigned length,
+                        int rc, unsigned long long start){
+    vfs_trace_record_t t;
+    unsigned long long elapsed = traceNow() - start;
+    t.start_ns = start;
+    t.offset = offset;
+    t.length = length;
+    t.rc = rc;
+    t.duration_ns = elapsed > 0xffffffffULL ? 0xffffffffU : (uint32_t)elapsed;
+    t.file_id = fileId;
+    t.op = (uint8_t)op;
+    traceEmit(LOG_KIND_TRACE, &t, 0);
+}
+
+/*
+** Latency histograms, one per method and file role. Buckets are
+** log-linear like HDR histograms: values below HIST_SUB nanoseconds get a
+** bucket each, and every power of two above is split into HIST_SUB
+** buckets, so a bucket is never wider than 1/16 of its values.
+*/
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct LatencyHistogram LatencyHistogram;
+struct LatencyHistogram {
+    _Atomic unsigned long long aBucket[HIST_BUCKETS];
+    _Atomic unsigned long long total;
+    _Atomic unsigned long long max;
+};
+
+static LatencyHistogram statsHist[LOGGINGVFS_ROLE_COUNT][LOGGINGVFS_OP_COUNT];
+static _Atomic int statsEnabled = 1;
+
+static int histBucket(unsigned long long v){
+    if( v<HIST_SUB ) return (int)v;
+    int shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    return (shift + 1)*HIST_SUB + (int)((v >> shift) & (HIST_SUB - 1));
+}
+
+/* Smallest value that falls in a bucket */
+static unsigned long long histBucketLow(int b){
+    if( b<HIST_SUB ) return b;
+    int shift = b/HIST_SUB - 1;
+    return (unsigned long long)(HIST_SUB + b%HIST_SUB) << shift;
+}
+
+static unsigned long long statsNow(void){
+    if( !statsEnabled ) return 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static void statsRecord(int role, int op, unsigned long long start){
+    if( !start ) return;
+    unsigned long long elapsed = statsNow() - start;
+    LatencyHistogram *h = &statsHist[role][op];
+    atomic_fetch_add_explicit(&h->aBucket[histBucket(elapsed)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->total, elapsed, memory_order_relaxed);
+    unsigned long long max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    while( elapsed>max && !atomic_compare_exchange_weak_explicit(&h->max, &max, elapsed,
+                                                                  memory_order_relaxed, memory_order_relaxed) ){
+    }
+}
+
+/*
+** Role of a file from its open flags.
+*/
+static int statsRoleFromFlags(const char *zName, int flags){
+    if( !zName || (flags & (SQLITE_OPEN_TEMP_DB|SQLITE_OPEN_TEMP_JOURNAL|SQLITE_OPEN_TRANSIENT_DB)) ){
+        return LOGGINGVFS_ROLE_TEMP;
+    }
+    if( flags & (SQLITE_OPEN_MAIN_JOURNAL|SQLITE_OPEN_WAL|SQLITE_OPEN_SUBJOURNAL|SQLITE_OPEN_SUPER_JOURNAL) ){
+        return LOGGINGVFS_ROLE_JOURNAL;
+    }
+    return LOGGINGVFS_ROLE_MAIN;
+}
+
+/*
+** Role of a file from its name, for calls that have no open flags.
+*/
+static int statsRoleFromName(const char *zPath){
+    size_t n = zPath ? strlen(zPath) : 0;
+    if( (n>8 && strcmp(zPath+n-8, "-journal")==0) || (n>4 && strcmp(zPath+n-4, "-wal")==0) ){
+        return LOGGINGVFS_ROLE_JOURNAL;
+    }
+    return LOGGINGVFS_ROLE_MAIN;
 }
 
+/*
+** WAL index shared memory for a block-mode database, shared by every
+** connection to it in this process. In mmap mode the regions are mapped
+** from filename.blocks/shm and locks are also taken as fcntl byte-range
+** locks on that file. That does not make the database safe to share with
+** other processes: its file locks (LockNode) exclude only this process.
+*/
+typedef struct ShmNode ShmNode;
+struct ShmNode {
+    char *zPath;               /* Database file name */
+    int nRef;                  /* Connections using this node */
+    sqlite3_mutex *pMutex;     /* Guards the regions and lock counts */
+    int fd;                    /* shm file in mmap mode, else -1 */
+    int szRegion;
+    int nRegion;
+    char **apRegion;
+    int aShared[SQLITE_SHM_NLOCK];  /* shared holders of each lock */
+    int aExcl[SQLITE_SHM_NLOCK];    /* 1 if a connection holds it exclusively */
+    ShmNode *pNext;
+};
+static ShmNode *shmNodes = 0;
+
+/*
+** SQLite's database file locks for a block-mode database. A block store
+** has no single file to take fcntl locks on, so the connections of this
+** process share a LockNode per database and follow the rules os_unix.c
+** applies to the locks on one inode. Other processes are not excluded.
+*/
+typedef struct LockNode LockNode;
+struct LockNode {
+    char *zPath;               /* Database file name */
+    int nRef;                  /* Connections using this node */
+    sqlite3_mutex *pMutex;     /* Guards eLock and nShared */
+    int eLock;                 /* Strongest lock any connection holds */
+    int nShared;               /* Connections holding SHARED or more */
+    LockNode *pNext;
+};
+static LockNode *lockNodes = 0;
+
 /*
 ** File structure for our VFS
 */
@@ -52,20 +717,161 @@ typedef struct LoggingFile LoggingFile;
 struct LoggingFile {
     sqlite3_file base;          /* Base class. Must be first. */
     sqlite3_file *pReal;        /* The real underlying file */
-    block_file_t *pBlock;       /* Block-based file handle */
+    block_file_t *pBlock;       /* Block-based file handle; set if and only if
+                                ** the file was opened in block mode */
+    int blockSize;              /* bytes per block in block mode */
+    LockNode *pLock;            /* database locks, block-mode databases only */
+    int eLock;                  /* SQLITE_LOCK_* this connection holds */
+    sqlite3_int64 mmapSize;     /* block mode maps no page past this offset */
+    ShmNode *pShm;              /* WAL index memory, block mode only */
+    unsigned short shmShared;   /* shm locks held shared, one bit per lock */
+    unsigned short shmExcl;     /* shm locks held exclusively */
     char *zName;               /* Name of the file */
+    unsigned short traceId;    /* id of zName in the current trace */
+    unsigned traceGen;         /* trace traceId belongs to */
+    int role;                  /* LOGGINGVFS_ROLE_* for latency statistics */
 };
 
+static int loggingShmUnmap(sqlite3_file *pFile, int deleteFlag);
+
+/*
+** Trace a call on an open file.
+*/
+static void traceFileOperation(LoggingFile *p, int op, long long offset, unsigned length,
+                               int rc, unsigned long long start){
+    if( !start || !traceFile ) return;
+    if( p->traceGen!=traceGeneration ){
+        p->traceId = traceNameId(p->zName);
+        p->traceGen = traceGeneration;
+    }
+    traceRecord(op, p->traceId, offset, length, rc, start);
+}
+
+/*
+** Trace a call that names a file by path.
+*/
+static void tracePathOperation(const char *zPath, int op, long long offset, unsigned length,
+                               int rc, unsigned long long start){
+    if( !start || !traceFile ) return;
+    traceRecord(op, traceNameId(zPath), offset, length, rc, start);
+}
+
+/*
+** Find or create the lock node of a database.
+*/
+static int lockNodeAcquire(const char *zPath, LockNode **ppNode){
+    int rc = SQLITE_OK;
+    sqlite3_mutex_enter(nodeMutex());
+    LockNode *pNode = lockNodes;
+    while( pNode && strcmp(pNode->zPath, zPath)!=0 ) pNode = pNode->pNext;
+    if( pNode ){
+        pNode->nRef++;
+    }else{
+        pNode = sqlite3_malloc(sizeof(LockNode));
+        if( pNode ){
+            memset(pNode, 0, sizeof(LockNode));
+            pNode->zPath = sqlite3_mprintf("%s", zPath);
+            pNode->pMutex = sqlite3_mutex_alloc(SQLITE_MUTEX_FAST);
+            pNode->nRef = 1;
+            pNode->pNext = lockNodes;
+        }
+        if( !pNode || !pNode->zPath ){
+            if( pNode ) sqlite3_mutex_free(pNode->pMutex);
+            sqlite3_free(pNode);
+            pNode = 0;
+            rc = SQLITE_NOMEM;
+        }else{
+            lockNodes = pNode;
+        }
+    }
+    sqlite3_mutex_leave(nodeMutex());
+    *ppNode = pNode;
+    return rc;
+}
+
+static void lockNodeRelease(LockNode *pNode){
+    sqlite3_mutex_enter(nodeMutex());
+    if( --pNode->nRef==0 ){
+        for(LockNode **pp=&lockNodes; *pp; pp=&(*pp)->pNext){
+            if( *pp==pNode ){
+                *pp = pNode->pNext;
+                break;
+            }
+        }
+        sqlite3_mutex_free(pNode->pMutex);
+        sqlite3_free(pNode->zPath);
+        sqlite3_free(pNode);
+    }
+    sqlite3_mutex_leave(nodeMutex());
+}
+
+/*
+** Take a database lock in block mode. PENDING keeps new readers out while
+** a writer waits for the last ones to leave, as in os_unix.c.
+*/
+static int blockLock(LoggingFile *p, int eLock){
+    LockNode *pNode = p->pLock;
+    if( !pNode || p->eLock>=eLock ) return SQLITE_OK;
+    
+    int rc = SQLITE_OK;
+    sqlite3_mutex_enter(pNode->pMutex);
+    if( p->eLock!=pNode->eLock
+     && (pNode->eLock>=SQLITE_LOCK_PENDING || eLock>SQLITE_LOCK_SHARED) ){
+        rc = SQLITE_BUSY;
+    }else if( eLock==SQLITE_LOCK_SHARED ){
+        if( pNode->nShared==0 ) pNode->eLock = SQLITE_LOCK_SHARED;
+        pNode->nShared++;
+        p->eLock = SQLITE_LOCK_SHARED;
+    }else if( eLock==SQLITE_LOCK_RESERVED ){
+        pNode->eLock = p->eLock = SQLITE_LOCK_RESERVED;
+    }else{
+        pNode->eLock = p->eLock = SQLITE_LOCK_PENDING;
+        if( pNode->nShared>1 ){
+            rc = SQLITE_BUSY;
+        }else{
+            pNode->eLock = p->eLock = SQLITE_LOCK_EXCLUSIVE;
+        }
+    }
+    sqlite3_mutex_leave(pNode->pMutex);
+    return rc;
+}
+
+/*
+** Drop a database lock in block mode to SHARED or NONE.
+*/
+static void blockUnlock(LoggingFile *p, int eLock){
+    LockNode *pNode = p->pLock;
+    if( !pNode || p->eLock<=eLock ) return;
+    
+    sqlite3_mutex_enter(pNode->pMutex);
+    if( p->eLock>SQLITE_LOCK_SHARED ){
+        pNode->eLock = SQLITE_LOCK_SHARED;
+    }
+    if( eLock==SQLITE_LOCK_NONE && --pNode->nShared==0 ){
+        pNode->eLock = SQLITE_LOCK_NONE;
+    }
+    p->eLock = eLock;
+    sqlite3_mutex_leave(pNode->pMutex);
+}
+
 /*
 ** Close a file.
 */
 static int loggingClose(sqlite3_file *pFile){
     LoggingFile *p = (LoggingFile*)pFile;
     int rc = SQLITE_OK;
+    unsigned long long t0 = traceNow();
     
     logVfsOperation("CLOSE", p->zName, "Closing file");
     
-    if (useBlockStorage && p->pBlock) {
+    if (p->pShm) {
+        loggingShmUnmap(pFile, 0);
+    }
+    if (p->pLock) {
+        blockUnlock(p, SQLITE_LOCK_NONE);
+        lockNodeRelease(p->pLock);
+    }
+    if (p->pBlock) {
         rc = block_close(p->pBlock);
         if (rc != 0) rc = SQLITE_IOERR_CLOSE;
     } else if (p->pReal) {
@@ -73,9 +879,10 @@ static int loggingClose(sqlite3_file *pFile){
         sqlite3_free(p->pReal);
     }
     
-    sqlite3_free(p->zName);
-    
     logVfsOperation("CLOSE", p->zName, "File closed, rc=%d", rc);
+    traceFileOperation(p, VFS_TRACE_CLOSE, 0, 0, rc, t0);
+    
+    sqlite3_free(p->zName);
     return rc;
 }
 
@@ -86,9 +893,11 @@ static int loggingRead(sqlite3_file *pFile, void *zBuf, int iAmt, sqlite3_int64
     LoggingFile *p = (LoggingFile*)pFile;
     int rc;
     
+    unsigned long long t0 = traceNow();
+    unsigned long long s0 = statsNow();
     logVfsOperation("READ", p->zName, "Reading %d bytes at offset %lld", iAmt, iOfst);
     
-    if (useBlockStorage && p->pBlock) {
+    if (p->pBlock) {
         int bytes_read = block_read(p->pBlock, zBuf, iAmt, iOfst);
         if (bytes_read < 0) {
             /* Actual I/O error */
@@ -106,6 +915,8 @@ static int loggingRead(sqlite3_file *pFile, void *zBuf, int iAmt, sqlite3_int64
     }
     
     logVfsOperation("READ", p->zName, "Read completed, rc=%d", rc);
+    statsRecord(p->role, LOGGINGVFS_OP_READ, s0);
+    traceFileOperation(p, VFS_TRACE_READ, iOfst, iAmt, rc, t0);
     return rc;
 }
 
@@ -116,9 +927,11 @@ static int loggingWrite(sqlite3_file *pFile, const void *zBuf, int iAmt, sqlite3
     LoggingFile *p = (LoggingFile*)pFile;
     int rc;
     
+    unsigned long long t0 = traceNow();
+    unsigned long long s0 = statsNow();
     logVfsOperation("WRITE", p->zName, "Writing %d bytes at offset %lld", iAmt, iOfst);
     
-    if (useBlockStorage && p->pBlock) {
+    if (p->pBlock) {
         int bytes_written = block_write(p->pBlock, zBuf, iAmt, iOfst);
         if (bytes_written == iAmt) {
             rc = SQLITE_OK;
@@ -130,6 +943,8 @@ static int loggingWrite(sqlite3_file *pFile, const void *zBuf, int iAmt, sqlite3
     }
     
     logVfsOperation("WRITE", p->zName, "Write completed, rc=%d", rc);
+    statsRecord(p->role, LOGGINGVFS_OP_WRITE, s0);
+    traceFileOperation(p, VFS_TRACE_WRITE, iOfst, iAmt, rc, t0);
     return rc;
 }
 
@@ -140,9 +955,11 @@ static int loggingTruncate(sqlite3_file *pFile, sqlite3_int64 size){
     LoggingFile *p = (LoggingFile*)pFile;
     int rc;
     
+    unsigned long long t0 = traceNow();
+    unsigned long long s0 = statsNow();
     logVfsOperation("TRUNCATE", p->zName, "Truncating to %lld bytes", size);
     
-    if (useBlockStorage && p->pBlock) {
+    if (p->pBlock) {
         rc = block_truncate(p->pBlock, size);
         if (rc != 0) rc = SQLITE_IOERR_TRUNCATE;
     } else {
@@ -150,6 +967,8 @@ static int loggingTruncate(sqlite3_file *pFile, sqlite3_int64 size){
     }
     
     logVfsOperation("TRUNCATE", p->zName, "Truncate completed, rc=%d", rc);
+    statsRecord(p->role, LOGGINGVFS_OP_TRUNCATE, s0);
+    traceFileOperation(p, VFS_TRACE_TRUNCATE, size, 0, rc, t0);
     return rc;
 }
 
@@ -160,16 +979,26 @@ static int loggingSync(sqlite3_file *pFile, int flags){
     LoggingFile *p = (LoggingFile*)pFile;
     int rc;
     
+    unsigned long long t0 = traceNow();
+    unsigned long long s0 = statsNow();
     logVfsOperation("SYNC", p->zName, "Syncing with flags %d", flags);
     
-    if (useBlockStorage && p->pBlock) {
-        /* Block storage doesn't need explicit sync - data is written immediately */
-        rc = SQLITE_OK;
+    if (p->pBlock) {
+        /* Write back the blocks dirtied since the last sync and make them
+        ** durable. SQLITE_SYNC_FULL asks for fsync over fdatasync, and
+        ** SQLITE_SYNC_DATAONLY says the file size need not be synced. */
+        int blockFlags = BLOCK_SYNC_NORMAL;
+        if( (flags & 0x0F)==SQLITE_SYNC_FULL ) blockFlags |= BLOCK_SYNC_FULL;
+        if( flags & SQLITE_SYNC_DATAONLY ) blockFlags |= BLOCK_SYNC_DATAONLY;
+        rc = block_sync_durable(p->pBlock, blockFlags);
+        if (rc != 0) rc = SQLITE_IOERR_FSYNC;
     } else {
         rc = p->pReal->pMethods->xSync(p->pReal, flags);
     }
     
     logVfsOperation("SYNC", p->zName, "Sync completed, rc=%d", rc);
+    statsRecord(p->role, LOGGINGVFS_OP_SYNC, s0);
+    traceFileOperation(p, VFS_TRACE_SYNC, 0, flags, rc, t0);
     return rc;
 }
 
@@ -179,8 +1008,10 @@ static int loggingSync(sqlite3_file *pFile, int flags){
 static int loggingFileSize(sqlite3_file *pFile, sqlite3_int64 *pSize){
     LoggingFile *p = (LoggingFile*)pFile;
     int rc;
+    unsigned long long t0 = traceNow();
+    unsigned long long s0 = statsNow();
     
-    if (useBlockStorage && p->pBlock) {
+    if (p->pBlock) {
         long long size = block_file_size(p->pBlock);
         if (size >= 0) {
             *pSize = size;
@@ -194,6 +1025,8 @@ static int loggingFileSize(sqlite3_file *pFile, sqlite3_int64 *pSize){
     }
     
     logVfsOperation("FILESIZE", p->zName, "File size: %lld bytes, rc=%d", *pSize, rc);
+    statsRecord(p->role, LOGGINGVFS_OP_FILESIZE, s0);
+    traceFileOperation(p, VFS_TRACE_FILESIZE, *pSize, 0, rc, t0);
     return rc;
 }
 
@@ -213,16 +1046,18 @@ static int loggingLock(sqlite3_file *pFile, int eLock){
         case SQLITE_LOCK_EXCLUSIVE: lockType = "EXCLUSIVE"; break;
     }
     
+    unsigned long long t0 = traceNow();
     logVfsOperation("LOCK", p->zName, "Acquiring %s lock", lockType);
     
-    if (useBlockStorage && p->pBlock) {
-        /* Block storage doesn't need file locks - always succeed */
-        rc = SQLITE_OK;
+    if (p->pBlock) {
+        /* Connections in this process share the lock; temp files have none */
+        rc = blockLock(p, eLock);
     } else {
         rc = p->pReal->pMethods->xLock(p->pReal, eLock);
     }
     
     logVfsOperation("LOCK", p->zName, "Lock acquisition completed, rc=%d", rc);
+    traceFileOperation(p, VFS_TRACE_LOCK, 0, eLock, rc, t0);
     return rc;
 }
 
@@ -242,16 +1077,18 @@ static int loggingUnlock(sqlite3_file *pFile, int eLock){
         case SQLITE_LOCK_EXCLUSIVE: lockType = "EXCLUSIVE"; break;
     }
     
+    unsigned long long t0 = traceNow();
     logVfsOperation("UNLOCK", p->zName, "Releasing to %s lock", lockType);
     
-    if (useBlockStorage && p->pBlock) {
-        /* Block storage doesn't need file locks - always succeed */
+    if (p->pBlock) {
+        blockUnlock(p, eLock);
         rc = SQLITE_OK;
     } else {
         rc = p->pReal->pMethods->xUnlock(p->pReal, eLock);
     }
     
     logVfsOperation("UNLOCK", p->zName, "Lock release completed, rc=%d", rc);
+    traceFileOperation(p, VFS_TRACE_UNLOCK, 0, eLock, rc, t0);
     return rc;
 }
 
@@ -261,10 +1098,16 @@ static int loggingUnlock(sqlite3_file *pFile, int eLock){
 static int loggingCheckReservedLock(sqlite3_file *pFile, int *pResOut){
     LoggingFile *p = (LoggingFile*)pFile;
     int rc;
+    unsigned long long t0 = traceNow();
     
-    if (useBlockStorage && p->pBlock) {
-        /* Block storage doesn't use file locks - no reserved lock */
+    if (p->pBlock) {
+        /* Reserved by a connection of this process */
         *pResOut = 0;
+        if (p->pLock) {
+            sqlite3_mutex_enter(p->pLock->pMutex);
+            *pResOut = p->pLock->eLock>SQLITE_LOCK_SHARED;
+            sqlite3_mutex_leave(p->pLock->pMutex);
+        }
         rc = SQLITE_OK;
     } else {
         rc = p->pReal->pMethods->xCheckReservedLock(p->pReal, pResOut);
@@ -272,6 +1115,7 @@ static int loggingCheckReservedLock(sqlite3_file *pFile, int *pResOut){
     
     logVfsOperation("CHECK_RESERVED", p->zName, "Reserved lock check: %s, rc=%d", 
                    *pResOut ? "RESERVED" : "NOT RESERVED", rc);
+    traceFileOperation(p, VFS_TRACE_CHECK_RESERVED, *pResOut, 0, rc, t0);
     return rc;
 }
 
@@ -282,16 +1126,41 @@ static int loggingFileControl(sqlite3_file *pFile, int op, void *pArg){
     LoggingFile *p = (LoggingFile*)pFile;
     int rc;
     
+    unsigned long long t0 = traceNow();
     logVfsOperation("FILE_CONTROL", p->zName, "File control operation %d", op);
     
-    if (useBlockStorage && p->pBlock) {
-        /* Block storage doesn't support file control operations */
-        rc = SQLITE_NOTFOUND;
+    if (p->pBlock) {
+        /* Block storage implements batch-atomic writes, which SQLite
+        ** issues around the page writes of a commit when the file reports
+        ** SQLITE_IOCAP_BATCH_ATOMIC, and the mmap_size limit. */
+        switch( op ){
+            case SQLITE_FCNTL_BEGIN_ATOMIC_WRITE:
+                rc = block_begin_atomic_write(p->pBlock) ? SQLITE_IOERR_BEGIN_ATOMIC : SQLITE_OK;
+                break;
+            case SQLITE_FCNTL_COMMIT_ATOMIC_WRITE:
+                rc = block_commit_atomic_write(p->pBlock) ? SQLITE_IOERR_COMMIT_ATOMIC : SQLITE_OK;
+                break;
+            case SQLITE_FCNTL_ROLLBACK_ATOMIC_WRITE:
+                rc = block_rollback_atomic_write(p->pBlock) ? SQLITE_IOERR_ROLLBACK_ATOMIC : SQLITE_OK;
+                break;
+            case SQLITE_FCNTL_MMAP_SIZE: {
+                /* Report the old limit; a negative new one only queries */
+                sqlite3_int64 newLimit = *(sqlite3_int64*)pArg;
+                *(sqlite3_int64*)pArg = p->mmapSize;
+                if( newLimit>=0 ) p->mmapSize = newLimit;
+                rc = SQLITE_OK;
+                break;
+            }
+            default:
+                rc = SQLITE_NOTFOUND;
+                break;
+        }
     } else {
         rc = p->pReal->pMethods->xFileControl(p->pReal, op, pArg);
     }
     
     logVfsOperation("FILE_CONTROL", p->zName, "File control completed, rc=%d", rc);
+    traceFileOperation(p, VFS_TRACE_FILE_CONTROL, 0, op, rc, t0);
     return rc;
 }
 
@@ -302,9 +1171,9 @@ static int loggingSectorSize(sqlite3_file *pFile){
     LoggingFile *p = (LoggingFile*)pFile;
     int sectorSize;
     
-    if (useBlockStorage && p->pBlock) {
-        /* Block storage uses 4KB sectors */
-        sectorSize = 4096;
+    if (p->pBlock) {
+        /* A block is the unit block storage writes */
+        sectorSize = p->blockSize;
     } else {
         sectorSize = p->pReal->pMethods->xSectorSize(p->pReal);
     }
@@ -320,9 +1189,15 @@ static int loggingDeviceCharacteristics(sqlite3_file *pFile){
     LoggingFile *p = (LoggingFile*)pFile;
     int characteristics;
     
-    if (useBlockStorage && p->pBlock) {
-        /* Block storage characteristics */
-        characteristics = SQLITE_IOCAP_ATOMIC4K | SQLITE_IOCAP_SAFE_APPEND;
+    if (p->pBlock) {
+        /* Block storage characteristics. With batch-atomic writes SQLite
+        ** skips the rollback journal for commits that fit in its cache. */
+        int atomic = SQLITE_IOCAP_ATOMIC512;
+        for(int n=512; n<p->blockSize; n*=2) atomic <<= 1;
+        characteristics = atomic | SQLITE_IOCAP_SAFE_APPEND;
+        if( block_supports_atomic_write(p->pBlock) ){
+            characteristics |= SQLITE_IOCAP_BATCH_ATOMIC;
+        }
     } else {
         characteristics = p->pReal->pMethods->xDeviceCharacteristics(p->pReal);
     }
@@ -331,6 +1206,352 @@ static int loggingDeviceCharacteristics(sqlite3_file *pFile){
     return characteristics;
 }
 
+/*
+** Shared memory for WAL mode. Outside block mode the real file does it.
+*/
+#define SHM_LOCK_BASE 120                       /* lock bytes, as in os_unix.c */
+#define SHM_DMS_LOCK (SHM_LOCK_BASE + SQLITE_SHM_NLOCK)   /* held by every user */
+
+#if LOGGING_VFS_SHM_MMAP
+/*
+** Take or release an fcntl lock on n lock bytes of the shm file. Returns
+** SQLITE_BUSY if another process holds a conflicting lock.
+*/
+static int shmFileLock(ShmNode *pNode, short type, int ofst, int n){
+    if( pNode->fd<0 ) return SQLITE_OK;
+    struct flock lk;
+    memset(&lk, 0, sizeof(lk));
+    lk.l_type = type;
+    lk.l_whence = SEEK_SET;
+    lk.l_start = ofst;
+    lk.l_len = n;
+    return fcntl(pNode->fd, F_SETLK, &lk)==0 ? SQLITE_OK : SQLITE_BUSY;
+}
+#endif
+
+/*
+** Find or create the node for a database. Called with the node mutex held.
+*/
+static int shmNodeOpen(const char *zPath, ShmNode **ppNode){
+    for(ShmNode *pNode=shmNodes; pNode; pNode=pNode->pNext){
+        if( strcmp(pNode->zPath, zPath)==0 ){
+            pNode->nRef++;
+            *ppNode = pNode;
+            return SQLITE_OK;
+        }
+    }
+    
+    ShmNode *pNode = sqlite3_malloc(sizeof(ShmNode));
+    if( !pNode ) return SQLITE_NOMEM;
+    memset(pNode, 0, sizeof(ShmNode));
+    pNode->fd = -1;
+    pNode->zPath = sqlite3_mprintf("%s", zPath);
+    if( !pNode->zPath ){
+        sqlite3_free(pNode);
+        return SQLITE_NOMEM;
+    }
+    
+#if LOGGING_VFS_SHM_MMAP
+    if( shmMode==LOGGINGVFS_SHM_MMAP ){
+        char zShm[1024];
+        snprintf(zShm, sizeof(zShm), "%s.blocks/shm", zPath);
+        pNode->fd = open(zShm, O_RDWR|O_CREAT|O_CLOEXEC, 0644);
+        if( pNode->fd<0 ){
+            sqlite3_free(pNode->zPath);
+            sqlite3_free(pNode);
+            return SQLITE_CANTOPEN;
+        }
+        
+        // The first user anywhere starts from an empty WAL index; everyone
+        // then holds the dead-man switch shared until they let go
+        if( shmFileLock(pNode, F_WRLCK, SHM_DMS_LOCK, 1)==SQLITE_OK ){
+            if( ftruncate(pNode->fd, 0)!=0 ){
+                close(pNode->fd);
+                sqlite3_free(pNode->zPath);
+                sqlite3_free(pNode);
+                return SQLITE_IOERR_SHMOPEN;
+            }
+        }
+        if( shmFileLock(pNode, F_RDLCK, SHM_DMS_LOCK, 1)!=SQLITE_OK ){
+            close(pNode->fd);
+            sqlite3_free(pNode->zPath);
+            sqlite3_free(pNode);
+            return SQLITE_BUSY;
+        }
+    }
+#endif
+    
+    pNode->pMutex = sqlite3_mutex_alloc(SQLITE_MUTEX_FAST);
+    pNode->nRef = 1;
+    pNode->pNext = shmNodes;
+    shmNodes = pNode;
+    *ppNode = pNode;
+    return SQLITE_OK;
+}
+
+static int shmNodeAcquire(const char *zPath, ShmNode **ppNode){
+    sqlite3_mutex_enter(nodeMutex());
+    int rc = shmNodeOpen(zPath, ppNode);
+    sqlite3_mutex_leave(nodeMutex());
+    return rc;
+}
+
+/*
+** Unlink and free a node nobody uses. Called with the node mutex held.
+*/
+static void shmNodeFree(ShmNode *pNode, int deleteFlag){
+    for(ShmNode **pp=&shmNodes; *pp; pp=&(*pp)->pNext){
+        if( *pp==pNode ){
+            *pp = pNode->pNext;
+            break;
+        }
+    }
+    for(int i=0; i<pNode->nRegion; i++){
+#if LOGGING_VFS_SHM_MMAP
+        if( pNode->fd>=0 ){
+            munmap(pNode->apRegion[i], pNode->szRegion);
+            continue;
+        }
+#endif
+        sqlite3_free(pNode->apRegion[i]);
+    }
+#if LOGGING_VFS_SHM_MMAP
+    if( pNode->fd>=0 ){
+        /* As in os_unix.c, only the last user anywhere removes the file */
+        if( deleteFlag && shmFileLock(pNode, F_WRLCK, SHM_DMS_LOCK, 1)==SQLITE_OK ){
+            char zShm[1024];
+            snprintf(zShm, sizeof(zShm), "%s.blocks/shm", pNode->zPath);
+            unlink(zShm);
+        }
+        close(pNode->fd);
+    }
+#endif
+    sqlite3_mutex_free(pNode->pMutex);
+    sqlite3_free(pNode->apRegion);
+    sqlite3_free(pNode->zPath);
+    sqlite3_free(pNode);
+}
+
+static void shmNodeRelease(ShmNode *pNode, int deleteFlag){
+    sqlite3_mutex_enter(nodeMutex());
+    if( --pNode->nRef==0 ) shmNodeFree(pNode, deleteFlag);
+    sqlite3_mutex_leave(nodeMutex());
+}
+
+/*
+** Map region iRegion of a node, growing it if bExtend is set. Called with
+** the node's mutex held.
+*/
+static int shmNodeMap(ShmNode *pNode, int iRegion, int szRegion, int bExtend,
+                      void volatile **pp){
+    if( pNode->nRegion>0 && pNode->szRegion!=szRegion ) return SQLITE_IOERR_SHMSIZE;
+    pNode->szRegion = szRegion;
+    
+    if( iRegion>=pNode->nRegion ){
+        if( !bExtend ){
+            *pp = 0;
+            return SQLITE_OK;
+        }
+        char **apNew = sqlite3_realloc(pNode->apRegion, (iRegion+1)*sizeof(char*));
+        if( !apNew ) return SQLITE_NOMEM;
+        pNode->apRegion = apNew;
+        
+#if LOGGING_VFS_SHM_MMAP
+        if( pNode->fd>=0 ){
+            struct stat st;
+            off_t need = (off_t)(iRegion+1)*szRegion;
+            if( fstat(pNode->fd, &st)!=0 || (st.st_size<need && ftruncate(pNode->fd, need)!=0) ){
+                return SQLITE_IOERR_SHMSIZE;
+            }
+        }
+#endif
+        while( pNode->nRegion<=iRegion ){
+            char *pRegion;
+#if LOGGING_VFS_SHM_MMAP
+            if( pNode->fd>=0 ){
+                pRegion = mmap(0, szRegion, PROT_READ|PROT_WRITE, MAP_SHARED, pNode->fd,
+                               (off_t)pNode->nRegion*szRegion);
+                if( pRegion==MAP_FAILED ) return SQLITE_IOERR_SHMMAP;
+            }else
+#endif
+            {
+                pRegion = sqlite3_malloc(szRegion);
+                if( !pRegion ) return SQLITE_NOMEM;
+                memset(pRegion, 0, szRegion);
+            }
+            pNode->apRegion[pNode->nRegion++] = pRegion;
+        }
+    }
+    
+    *pp = pNode->apRegion[iRegion];
+    return SQLITE_OK;
+}
+
+static int loggingShmMap(sqlite3_file *pFile, int iRegion, int szRegion, int bExtend,
+                         void volatile **pp){
+    LoggingFile *p = (LoggingFile*)pFile;
+    if( !p->pBlock ){
+        if( !p->pReal->pMethods->xShmMap ) return SQLITE_IOERR_SHMMAP;
+        return p->pReal->pMethods->xShmMap(p->pReal, iRegion, szRegion, bExtend, pp);
+    }
+    
+    if( !p->pShm ){
+        int rc = shmNodeAcquire(p->zName, &p->pShm);
+        if( rc!=SQLITE_OK ) return rc;
+        p->shmShared = p->shmExcl = 0;
+    }
+    ShmNode *pNode = p->pShm;
+    sqlite3_mutex_enter(pNode->pMutex);
+    int rc = shmNodeMap(pNode, iRegion, szRegion, bExtend, pp);
+    sqlite3_mutex_leave(pNode->pMutex);
+    return rc;
+}
+
+/*
+** Take or release shm locks for a connection. Called with the node's
+** mutex held.
+*/
+static int shmNodeLock(LoggingFile *p, ShmNode *pNode, int ofst, int n, int flags){
+    unsigned short mask = (unsigned short)(((1<<(ofst+n)) - 1) & ~((1<<ofst) - 1));
+    
+    if( flags & SQLITE_SHM_UNLOCK ){
+        for(int i=ofst; i<ofst+n; i++){
+            if( p->shmShared & (1<<i) ){
+                pNode->aShared[i]--;
+#if LOGGING_VFS_SHM_MMAP
+                if( pNode->aShared[i]==0 ) shmFileLock(pNode, F_UNLCK, SHM_LOCK_BASE+i, 1);
+#endif
+            }
+            if( p->shmExcl & (1<<i) ){
+                pNode->aExcl[i] = 0;
+#if LOGGING_VFS_SHM_MMAP
+                shmFileLock(pNode, F_UNLCK, SHM_LOCK_BASE+i, 1);
+#endif
+            }
+        }
+        p->shmShared &= ~mask;
+        p->shmExcl &= ~mask;
+        return SQLITE_OK;
+    }
+    
+    if( flags & SQLITE_SHM_SHARED ){
+        if( p->shmShared & mask ) return SQLITE_OK;
+        if( pNode->aExcl[ofst] ) return SQLITE_BUSY;
+#if LOGGING_VFS_SHM_MMAP
+        if( pNode->aShared[ofst]==0 && shmFileLock(pNode, F_RDLCK, SHM_LOCK_BASE+ofst, 1)!=SQLITE_OK ){
+            return SQLITE_BUSY;
+        }
+#endif
+        pNode->aShared[ofst]++;
+        p->shmShared |= mask;
+        return SQLITE_OK;
+    }
+    
+    // Exclusive: nobody else may hold any of the locks
+    if( (p->shmExcl & mask)==mask ) return SQLITE_OK;
+    for(int i=ofst; i<ofst+n; i++){
+        int ownShared = (p->shmShared >> i) & 1;
+        if( pNode->aExcl[i] || pNode->aShared[i]>ownShared ) return SQLITE_BUSY;
+    }
+#if LOGGING_VFS_SHM_MMAP
+    if( shmFileLock(pNode, F_WRLCK, SHM_LOCK_BASE+ofst, n)!=SQLITE_OK ) return SQLITE_BUSY;
+#endif
+    for(int i=ofst; i<ofst+n; i++){
+        if( p->shmShared & (1<<i) ) pNode->aShared[i]--;
+        pNode->aExcl[i] = 1;
+    }
+    p->shmShared &= ~mask;
+    p->shmExcl |= mask;
+    return SQLITE_OK;
+}
+
+static int loggingShmLock(sqlite3_file *pFile, int ofst, int n, int flags){
+    LoggingFile *p = (LoggingFile*)pFile;
+    if( !p->pBlock ){
+        return p->pReal->pMethods->xShmLock(p->pReal, ofst, n, flags);
+    }
+    
+    ShmNode *pNode = p->pShm;
+    if( !pNode ) return SQLITE_IOERR_SHMLOCK;
+    sqlite3_mutex_enter(pNode->pMutex);
+    int rc = shmNodeLock(p, pNode, ofst, n, flags);
+    sqlite3_mutex_leave(pNode->pMutex);
+    return rc;
+}
+
+static void loggingShmBarrier(sqlite3_file *pFile){
+    LoggingFile *p = (LoggingFile*)pFile;
+    if( !p->pBlock ){
+        p->pReal->pMethods->xShmBarrier(p->pReal);
+        return;
+    }
+    atomic_thread_fence(memory_order_seq_cst);
+    if( p->pShm ){
+        sqlite3_mutex_enter(p->pShm->pMutex);
+        sqlite3_mutex_leave(p->pShm->pMutex);
+    }
+}
+
+static int loggingShmUnmap(sqlite3_file *pFile, int deleteFlag){
+    LoggingFile *p = (LoggingFile*)pFile;
+    if( !p->pBlock ){
+        return p->pReal->pMethods->xShmUnmap(p->pReal, deleteFlag);
+    }
+    if( !p->pShm ) return SQLITE_OK;
+    
+    loggingShmLock(pFile, 0, SQLITE_SHM_NLOCK, SQLITE_SHM_UNLOCK);
+    shmNodeRelease(p->pShm, deleteFlag);
+    p->pShm = 0;
+    return SQLITE_OK;
+}
+
+/*
+** Memory-mapped page reads. In block mode a page below the mmap_size limit
+** that lies within one clean block is returned as a pointer into the
+** backend's mapping of that block; anything else gets *pp = 0 and SQLite
+** falls back to xRead. Outside block mode the real file does it.
+*/
+static int loggingFetch(sqlite3_file *pFile, sqlite3_int64 iOfst, int iAmt, void **pp){
+    LoggingFile *p = (LoggingFile*)pFile;
+    int rc = SQLITE_OK;
+    *pp = 0;
+    
+    if( p->pBlock ){
+        if( iOfst+iAmt<=p->mmapSize ){
+            const void *pData;
+            if( block_fetch(p->pBlock, iOfst, iAmt, &pData)!=0 ){
+                rc = SQLITE_IOERR_MMAP;
+            }else{
+                *pp = (void*)pData;
+            }
+        }
+    }else if( p->pReal->pMethods->iVersion>=3 && p->pReal->pMethods->xFetch ){
+        rc = p->pReal->pMethods->xFetch(p->pReal, iOfst, iAmt, pp);
+    }
+    
+    logVfsOperation("FETCH", p->zName, "Fetch %d bytes at offset %lld: %s, rc=%d",
+                   iAmt, iOfst, *pp ? "mapped" : "not mapped", rc);
+    return rc;
+}
+
+/*
+** Release a page xFetch returned. A null pointer asks for every mapping
+** to go before a truncate or a new mmap_size; block mode maps page by
+** page, so there is nothing to drop then.
+*/
+static int loggingUnfetch(sqlite3_file *pFile, sqlite3_int64 iOfst, void *pPage){
+    LoggingFile *p = (LoggingFile*)pFile;
+    
+    if( p->pBlock ){
+        if( pPage ) block_unfetch(p->pBlock, iOfst, pPage);
+        return SQLITE_OK;
+    }
+    if( p->pReal->pMethods->iVersion>=3 && p->pReal->pMethods->xUnfetch ){
+        return p->pReal->pMethods->xUnfetch(p->pReal, iOfst, pPage);
+    }
+    return SQLITE_OK;
+}
+
 /*
 ** Methods for LoggingFile
 */
@@ -348,17 +1569,90 @@ static const sqlite3_io_methods loggingIoMethods = {
     loggingFileControl,             /* xFileControl */
     loggingSectorSize,              /* xSectorSize */
     loggingDeviceCharacteristics,   /* xDeviceCharacteristics */
-    0,                              /* xShmMap */
-    0,                              /* xShmLock */
-    0,                              /* xShmBarrier */
-    0,                              /* xShmUnmap */
-    0,                              /* xFetch */
-    0                               /* xUnfetch */
+    loggingShmMap,                  /* xShmMap */
+    loggingShmLock,                 /* xShmLock */
+    loggingShmBarrier,              /* xShmBarrier */
+    loggingShmUnmap,                /* xShmUnmap */
+    loggingFetch,                   /* xFetch */
+    loggingUnfetch                  /* xUnfetch */
 };
 
 /*
 ** Open a file.
 */
+/*
+** Per-file settings from URI parameters, for example
+** file:x.db?storage=block&block_size=16384&cache_mb=64
+**
+**   storage=block|file   block storage or the default VFS, whatever
+**                        sqlite3_loggingvfs_set_block_storage() says
+**   backend=NAME         block backend of a new store
+**   block_size=N         block size of a new store, 512 to 65536
+**   cache_mb=N           a read cache of N MB for this file alone
+**   compress=lz|none     compress the blocks of a new store
+**   checksum=crc32c|none keep a CRC32C of each block of a new store and
+**                        check it on every read
+**
+** Journals and WAL files see the parameters of their database and
+** otherwise follow the mode it was opened in. Other files have none.
+** Returns SQLITE_ERROR for values that make no sense.
+*/
+static int loggingUriOptions(const char *zName, int flags, int *pUseBlock,
+                             block_open_options_t *pOptions){
+    if( !zName || !(flags & (SQLITE_OPEN_MAIN_DB|SQLITE_OPEN_MAIN_JOURNAL|SQLITE_OPEN_WAL)) ){
+        return SQLITE_OK;
+    }
+    
+    const char *zStorage = sqlite3_uri_parameter(zName, "storage");
+    if( zStorage ){
+        if( strcmp(zStorage, "block")==0 ){
+            *pUseBlock = 1;
+        }else if( strcmp(zStorage, "file")==0 ){
+            *pUseBlock = 0;
+        }else{
+            return SQLITE_ERROR;
+        }
+    }else if( flags & (SQLITE_OPEN_MAIN_JOURNAL|SQLITE_OPEN_WAL) ){
+        char zDir[1024];
+        struct stat st;
+        snprintf(zDir, sizeof(zDir), "%s.blocks", sqlite3_filename_database(zName));
+        *pUseBlock = stat(zDir, &st)==0;
+    }
+    
+    pOptions->backend = sqlite3_uri_parameter(zName, "backend");
+    if( pOptions->backend && !block_find_backend(pOptions->backend) ){
+        return SQLITE_ERROR;
+    }
+    sqlite3_int64 blockSize = sqlite3_uri_int64(zName, "block_size", 0);
+    if( blockSize!=0 && (blockSize<BLOCK_SIZE_MIN || blockSize>BLOCK_SIZE_MAX
+                         || (blockSize & (blockSize-1))!=0) ){
+        return SQLITE_ERROR;
+    }
+    pOptions->block_size = (int)blockSize;
+    sqlite3_int64 cacheMb = sqlite3_uri_int64(zName, "cache_mb", 0);
+    if( cacheMb<0 ){
+        return SQLITE_ERROR;
+    }
+    pOptions->cache_bytes = cacheMb * 1024 * 1024;
+    const char *zCompress = sqlite3_uri_parameter(zName, "compress");
+    if( zCompress ){
+        if( strcmp(zCompress, "lz")==0 ){
+            pOptions->compress = BLOCK_COMPRESS_LZ;
+        }else if( strcmp(zCompress, "none")!=0 ){
+            return SQLITE_ERROR;
+        }
+    }
+    const char *zChecksum = sqlite3_uri_parameter(zName, "checksum");
+    if( zChecksum ){
+        if( strcmp(zChecksum, "crc32c")==0 ){
+            pOptions->checksum = 1;
+        }else if( strcmp(zChecksum, "none")!=0 ){
+            return SQLITE_ERROR;
+        }
+    }
+    return SQLITE_OK;
+}
+
 static int loggingOpen(
     sqlite3_vfs *pVfs,           /* The VFS */
     const char *zName,           /* File to open, or 0 for a temp file */
@@ -369,32 +1663,57 @@ static int loggingOpen(
     LoggingFile *p = (LoggingFile*)pFile;
     int rc;
     
+    unsigned long long t0 = traceNow();
+    unsigned long long s0 = statsNow();
     logVfsOperation("OPEN", zName, "Opening file with flags 0x%x", flags);
     
     /* Initialize the struct */
     p->pReal = 0;
     p->pBlock = 0;
+    p->blockSize = 0;
+    p->pLock = 0;
+    p->eLock = SQLITE_LOCK_NONE;
+    p->mmapSize = 0;
+    p->pShm = 0;
+    p->traceGen = 0;
+    p->role = statsRoleFromFlags(zName, flags);
+    
+    int useBlock = useBlockStorage;
+    block_open_options_t options = { 0, 0, 0, 0, 0 };
+    if( loggingUriOptions(zName, flags, &useBlock, &options)!=SQLITE_OK ){
+        logVfsOperation("OPEN", zName, "Invalid block storage parameters");
+        statsRecord(p->role, LOGGINGVFS_OP_OPEN, s0);
+        tracePathOperation(zName, VFS_TRACE_OPEN, flags, 0, SQLITE_CANTOPEN, t0);
+        return SQLITE_CANTOPEN;
+    }
     
-    if (useBlockStorage) {
-        /* Use block storage */
-        char *temp_filename = NULL;
-        const char *filename = zName;
-        if (!filename) {
-            temp_filename = sqlite3_mprintf("temp_file_%p", (void*)p);
-            filename = temp_filename;
-        }
-        
-        rc = block_open(filename, &p->pBlock);
-        
-        if (temp_filename) {
-            sqlite3_free(temp_filename);
+    if (useBlock) {
+        /* Use block storage. Temp databases, their journals, transient
+        ** tables and statement journals are never reopened by name, so they
+        ** stay in memory until they grow past the spill threshold. */
+        if( !zName || (flags & (SQLITE_OPEN_TEMP_DB|SQLITE_OPEN_TEMP_JOURNAL|
+                                SQLITE_OPEN_TRANSIENT_DB|SQLITE_OPEN_SUBJOURNAL)) ){
+            rc = block_open_temp(&p->pBlock);
+        } else {
+            rc = block_open_ex(zName, &options, &p->pBlock);
         }
         
         if (rc != 0) {
             logVfsOperation("OPEN", zName, "Failed to open block file, rc=%d", rc);
+            statsRecord(p->role, LOGGINGVFS_OP_OPEN, s0);
+            tracePathOperation(zName, VFS_TRACE_OPEN, flags, 0, SQLITE_CANTOPEN, t0);
             return SQLITE_CANTOPEN;
         }
         
+        p->blockSize = block_get_block_size(p->pBlock);
+        if( (flags & SQLITE_OPEN_MAIN_DB) && zName && lockNodeAcquire(zName, &p->pLock)!=SQLITE_OK ){
+            block_close(p->pBlock);
+            p->pBlock = 0;
+            logVfsOperation("OPEN", zName, "Out of memory for database locks");
+            statsRecord(p->role, LOGGINGVFS_OP_OPEN, s0);
+            tracePathOperation(zName, VFS_TRACE_OPEN, flags, 0, SQLITE_NOMEM, t0);
+            return SQLITE_NOMEM;
+        }
         if (pOutFlags) {
             *pOutFlags = flags;
         }
@@ -403,6 +1722,8 @@ static int loggingOpen(
         p->pReal = (sqlite3_file*)sqlite3_malloc(pDefaultVfs->szOsFile);
         if( p->pReal==0 ){
             logVfsOperation("OPEN", zName, "Failed to allocate memory for real file");
+            statsRecord(p->role, LOGGINGVFS_OP_OPEN, s0);
+            tracePathOperation(zName, VFS_TRACE_OPEN, flags, 0, SQLITE_NOMEM, t0);
             return SQLITE_NOMEM;
         }
         
@@ -410,6 +1731,8 @@ static int loggingOpen(
         if( rc!=SQLITE_OK ){
             sqlite3_free(p->pReal);
             logVfsOperation("OPEN", zName, "Failed to open real file, rc=%d", rc);
+            statsRecord(p->role, LOGGINGVFS_OP_OPEN, s0);
+            tracePathOperation(zName, VFS_TRACE_OPEN, flags, 0, rc, t0);
             return rc;
         }
     }
@@ -423,55 +1746,31 @@ static int loggingOpen(
     p->base.pMethods = &loggingIoMethods;
     
     logVfsOperation("OPEN", p->zName, "File opened successfully (%s)", 
-                   useBlockStorage ? "block storage" : "default VFS");
+                   p->pBlock ? "block storage" : "default VFS");
+    statsRecord(p->role, LOGGINGVFS_OP_OPEN, s0);
+    traceFileOperation(p, VFS_TRACE_OPEN, flags, 0, SQLITE_OK, t0);
     return SQLITE_OK;
 }
 
 /*
 ** Delete a file.
 */
-
-static int remove_directory_recursive(const char *path) {
-    DIR *d = opendir(path);
-    if (!d) return 0; /* Directory doesn't exist, consider success */
-    
-    struct dirent *entry;
-    int result = 0;
-    
-    while ((entry = readdir(d)) != NULL) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
-        }
-        
-        char full_path[1024];
-        snprintf(full_path, sizeof(full_path), "%s/%s", path, entry->d_name);
-        
-        if (unlink(full_path) != 0) {
-            result = -1;
-        }
-    }
-    
-    closedir(d);
-    
-    if (rmdir(path) != 0) {
-        result = -1;
-    }
-    
-    return result;
-}
-
 static int loggingDelete(sqlite3_vfs *pVfs, const char *zPath, int syncDir){
     int rc;
+    unsigned long long t0 = traceNow();
+    unsigned long long s0 = statsNow();
     
     logVfsOperation("DELETE", zPath, "Deleting file, syncDir=%d", syncDir);
     
-    if (useBlockStorage) {
-        /* For block storage, delete the block directory */
-        char block_dir[1024];
-        snprintf(block_dir, sizeof(block_dir), "%s.blocks", zPath);
-        
-        /* Remove the block directory and its contents using POSIX calls */
-        int dir_rc = remove_directory_recursive(block_dir);
+    /* Files keep the mode they were opened in, so a block store may need
+    ** deleting even when block storage is not the default */
+    char block_dir[1024];
+    struct stat st;
+    snprintf(block_dir, sizeof(block_dir), "%s.blocks", zPath);
+    if (useBlockStorage || stat(block_dir, &st) == 0) {
+        /* The block layer removes the directory, after a dedup store has
+        ** dropped its references to the shared objects */
+        int dir_rc = block_delete(zPath);
         
         /* For block storage, also try to delete regular file if it exists */
         pDefaultVfs->xDelete(pDefaultVfs, zPath, syncDir);
@@ -482,6 +1781,8 @@ static int loggingDelete(sqlite3_vfs *pVfs, const char *zPath, int syncDir){
     }
     
     logVfsOperation("DELETE", zPath, "Delete completed, rc=%d", rc);
+    statsRecord(statsRoleFromName(zPath), LOGGINGVFS_OP_DELETE, s0);
+    tracePathOperation(zPath, VFS_TRACE_DELETE, 0, syncDir, rc, t0);
     return rc;
 }
 
@@ -498,12 +1799,14 @@ static int loggingAccess(sqlite3_vfs *pVfs, const char *zPath, int flags, int *p
         case SQLITE_ACCESS_READ:      accessType = "READ"; break;
     }
     
+    unsigned long long t0 = traceNow();
     logVfsOperation("ACCESS", zPath, "Checking %s access", accessType);
     
     rc = pDefaultVfs->xAccess(pDefaultVfs, zPath, flags, pResOut);
     
     logVfsOperation("ACCESS", zPath, "Access check result: %s, rc=%d", 
                    *pResOut ? "GRANTED" : "DENIED", rc);
+    tracePathOperation(zPath, VFS_TRACE_ACCESS, *pResOut, flags, rc, t0);
     return rc;
 }
 
@@ -579,13 +1882,52 @@ static sqlite3_vfs loggingVfs = {
 };
 
 /*
-** Enable or disable block storage.
+** Enable or disable block storage for files opened afterwards, unless their
+** URI says otherwise. Open files keep the mode they were opened in.
 */
 void sqlite3_loggingvfs_set_block_storage(int enable){
     useBlockStorage = enable;
     logVfsOperation("CONFIG", NULL, "Block storage %s", enable ? "ENABLED" : "DISABLED");
 }
 
+/*
+** Choose where block-mode databases keep WAL shared memory from the next
+** connection on: LOGGINGVFS_SHM_HEAP or LOGGINGVFS_SHM_MMAP (an mmap'd
+** shm file in the block directory). Either way the database is for the
+** connections of one process, as its file locks are not seen outside it.
+*/
+int sqlite3_loggingvfs_set_shm_mode(int mode){
+    if( mode==LOGGINGVFS_SHM_HEAP || (mode==LOGGINGVFS_SHM_MMAP && LOGGING_VFS_SHM_MMAP) ){
+        shmMode = mode;
+        return SQLITE_OK;
+    }
+    return SQLITE_MISUSE;
+}
+
+/*
+** Set how many bytes a block-mode temporary file may hold in memory before
+** it spills to disk; 0 keeps temporary files in memory.
+*/
+void sqlite3_loggingvfs_set_temp_spill(long long nByte){
+    block_set_temp_spill(nByte);
+}
+
+/*
+** Set how many blocks block storage reads ahead of a table or index scan at
+** most; 0 turns read-ahead off.
+*/
+void sqlite3_loggingvfs_set_readahead(int nBlock){
+    block_set_readahead(nBlock);
+}
+
+/*
+** Set how long, in microseconds, the connection leading a group commit
+** waits for others syncing the same store to join it; 0 never waits.
+*/
+void sqlite3_loggingvfs_set_group_commit(int nMicros){
+    block_set_group_commit_window(nMicros);
+}
+
 /*
 ** Enable or disable logging.
 */
@@ -593,6 +1935,147 @@ void sqlite3_loggingvfs_set_logging(int enable){
     loggingEnabled = enable;
 }
 
+/*
+** Choose what happens when the log ring is full: 0 drops the record and
+** counts it (the default), 1 makes the caller wait for the writer.
+*/
+void sqlite3_loggingvfs_set_log_overflow(int block){
+#if LOGGING_VFS_ASYNC_LOG
+    atomic_store(&logBlockWhenFull, block!=0);
+#endif
+}
+
+/*
+** Start writing a binary trace of VFS calls to zPath (see vfs_trace.h),
+** replacing any trace in progress. A NULL path stops tracing.
+*/
+int sqlite3_loggingvfs_set_trace(const char *zPath){
+#if LOGGING_VFS_ASYNC_LOG
+    logStopWriter();
+#endif
+    sqlite3_mutex_enter(outputMutex());
+    if( traceFile ){
+        fclose(traceFile);
+        traceFile = 0;
+    }
+    traceForgetNames();
+    
+    int rc = SQLITE_OK;
+    if( zPath ){
+        FILE *f = fopen(zPath, "wb");
+        unsigned char header[VFS_TRACE_HEADER_SIZE];
+        vfs_trace_encode_header(header);
+        if( f && fwrite(header, 1, sizeof(header), f)==sizeof(header) ){
+            traceGeneration++;
+            traceFile = f;
+        }else{
+            if( f ) fclose(f);
+            rc = SQLITE_CANTOPEN;
+        }
+    }
+    sqlite3_mutex_leave(outputMutex());
+    
+#if LOGGING_VFS_ASYNC_LOG
+    logStartWriter();
+#endif
+    return rc;
+}
+
+/*
+** Get the latency statistics.
+*/
+void sqlite3_loggingvfs_stats(LoggingVfsStats *pStats){
+    static const double aPercent[] = { 0.50, 0.90, 0.99, 0.999 };
+    
+    for(int role=0; role<LOGGINGVFS_ROLE_COUNT; role++){
+        for(int op=0; op<LOGGINGVFS_OP_COUNT; op++){
+            LatencyHistogram *h = &statsHist[role][op];
+            LoggingVfsLatency *pOut = &pStats->aLatency[role][op];
+            long long *apOut[] = { &pOut->p50_ns, &pOut->p90_ns, &pOut->p99_ns, &pOut->p999_ns };
+            
+            // Counts come from the buckets so percentiles stay consistent
+            // with them while other threads keep recording
+            unsigned long long aBucket[HIST_BUCKETS];
+            unsigned long long count = 0;
+            for(int b=0; b<HIST_BUCKETS; b++){
+                aBucket[b] = atomic_load_explicit(&h->aBucket[b], memory_order_relaxed);
+                count += aBucket[b];
+            }
+            pOut->count = (long long)count;
+            pOut->total_ns = (long long)atomic_load(&h->total);
+            pOut->max_ns = (long long)atomic_load(&h->max);
+            
+            // Each percentile is the middle of the bucket holding it
+            int b = 0;
+            unsigned long long seen = 0;
+            for(int i=0; i<4; i++){
+                *apOut[i] = 0;
+                if( count==0 ) continue;
+                unsigned long long rank = (unsigned long long)(aPercent[i]*count + 0.999999);
+                if( rank<1 ) rank = 1;
+                while( b<HIST_BUCKETS-1 && seen+aBucket[b]<rank ) seen += aBucket[b++];
+                unsigned long long low = histBucketLow(b);
+                unsigned long long high = (b+1<HIST_BUCKETS) ? histBucketLow(b+1) - 1 : low;
+                long long mid = (long long)(low + (high - low)/2);
+                *apOut[i] = (mid > pOut->max_ns) ? pOut->max_ns : mid;
+            }
+        }
+    }
+}
+
+/*
+** Clear the latency statistics.
+*/
+void sqlite3_loggingvfs_reset_stats(void){
+    for(int role=0; role<LOGGINGVFS_ROLE_COUNT; role++){
+        for(int op=0; op<LOGGINGVFS_OP_COUNT; op++){
+            LatencyHistogram *h = &statsHist[role][op];
+            for(int b=0; b<HIST_BUCKETS; b++) atomic_store(&h->aBucket[b], 0);
+            atomic_store(&h->total, 0);
+            atomic_store(&h->max, 0);
+        }
+    }
+}
+
+/*
+** Enable or disable timing calls for the latency statistics.
+*/
+void sqlite3_loggingvfs_set_stats(int enable){
+    statsEnabled = enable;
+}
+
+const char *sqlite3_loggingvfs_op_name(int op){
+    static const char *const azName[LOGGINGVFS_OP_COUNT] = {
+        "READ", "WRITE", "SYNC", "TRUNCATE", "FILESIZE", "OPEN", "DELETE"
+    };
+    return (op>=0 && op<LOGGINGVFS_OP_COUNT) ? azName[op] : "UNKNOWN";
+}
+
+const char *sqlite3_loggingvfs_role_name(int role){
+    static const char *const azName[LOGGINGVFS_ROLE_COUNT] = { "main", "journal", "temp" };
+    return (role>=0 && role<LOGGINGVFS_ROLE_COUNT) ? azName[role] : "unknown";
+}
+
+/*
+** Write out all queued log records.
+*/
+void sqlite3_loggingvfs_flush_log(void){
+#if LOGGING_VFS_ASYNC_LOG
+    if( atomic_load(&logWriterRunning) ){
+        size_t target = atomic_load(&logEnqueuePos);
+        while( atomic_load(&logFlushedPos)<target && atomic_load(&logWriterRunning) ){
+            pthread_mutex_lock(&logMutex);
+            pthread_cond_signal(&logCond);
+            pthread_mutex_unlock(&logMutex);
+            sched_yield();
+        }
+        return;
+    }
+#endif
+    if( logFile ) fflush(logFile);
+    if( traceFile ) fflush(traceFile);
+}
+
 /*
 ** Register the logging VFS.
 */
@@ -615,6 +2098,10 @@ int sqlite3_loggingvfs_init(const char *logFilePath){
     
     loggingVfs.szOsFile = sizeof(LoggingFile);
     
+#if LOGGING_VFS_ASYNC_LOG
+    logStartWriter();
+#endif
+    
     logVfsOperation("INIT", NULL, "Logging VFS initialized with log file: %s, block storage: %s", 
                    loggingEnabled ? (logFilePath ? logFilePath : "stdout") : "DISABLED", useBlockStorage ? "ENABLED" : "DISABLED");
     
@@ -627,10 +2114,20 @@ int sqlite3_loggingvfs_init(const char *logFilePath){
 int sqlite3_loggingvfs_shutdown(){
     int rc = sqlite3_vfs_unregister(&loggingVfs);
     
+#if LOGGING_VFS_ASYNC_LOG
+    logStopWriter();
+#endif
+    sqlite3_mutex_enter(outputMutex());
+    if( traceFile ){
+        fclose(traceFile);
+        traceFile = 0;
+        traceForgetNames();
+    }
     if( logFile && logFile != stdout ){
         fclose(logFile);
         logFile = 0;
     }
+    sqlite3_mutex_leave(outputMutex());
     
     return rc;
 }
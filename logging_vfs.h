@@ -0,0 +1,110 @@
+/*
+** SQLite Logging VFS Extension - public interface
+*/
+#ifndef LOGGING_VFS_H
+#define LOGGING_VFS_H
+
+/*
+** Register the VFS as "logging", logging to logFilePath (stdout if NULL),
+** and unregister it again.
+*/
+int sqlite3_loggingvfs_init(const char *logFilePath);
+int sqlite3_loggingvfs_shutdown(void);
+
+/*
+** Runtime switches. Block storage is the default mode of files opened
+** afterwards; a database can also pick its own with URI parameters:
+**
+**   file:x.db?storage=block&backend=packed&block_size=16384&cache_mb=64
+**
+** storage is "block" or "file". backend and block_size apply when the
+** store is created, and cache_mb gives the file a read cache of its own.
+** Journals and WAL files follow their database.
+*/
+void sqlite3_loggingvfs_set_block_storage(int enable);
+void sqlite3_loggingvfs_set_logging(int enable);
+
+/*
+** Where block-mode databases keep WAL shared memory: on the heap (the
+** default), or in an mmap'd filename.blocks/shm file. Both serve the
+** connections of one process only, since block-mode database locks are
+** not seen by other processes. Returns SQLITE_MISUSE for a mode the
+** platform lacks.
+*/
+#define LOGGINGVFS_SHM_HEAP 0
+#define LOGGINGVFS_SHM_MMAP 1
+int sqlite3_loggingvfs_set_shm_mode(int mode);
+
+/*
+** In block mode, temp databases, transient tables and statement journals
+** live in memory until they grow past nByte (64MB by default), then spill
+** to a store under $TMPDIR that is removed on close. 0 never spills.
+*/
+void sqlite3_loggingvfs_set_temp_spill(long long nByte);
+
+/*
+** In block mode, reads at a steady stride (table and index scans) are
+** followed by background threads that load the next blocks into the read
+** cache, up to nBlock ahead (64 by default). 0 turns read-ahead off.
+*/
+void sqlite3_loggingvfs_set_readahead(int nBlock);
+
+/*
+** In block mode, xSync calls that reach a store while another connection is
+** syncing it are merged into that connection's next sync. The connection
+** leading a group first waits nMicros (0 by default) for others to join.
+*/
+void sqlite3_loggingvfs_set_group_commit(int nMicros);
+
+/*
+** Log ring overflow policy (0 = drop, 1 = wait) and flushing queued records.
+*/
+void sqlite3_loggingvfs_set_log_overflow(int block);
+void sqlite3_loggingvfs_flush_log(void);
+
+/*
+** Binary trace of VFS calls (see vfs_trace.h); NULL stops tracing.
+*/
+int sqlite3_loggingvfs_set_trace(const char *zPath);
+
+/*
+** Latency statistics. Every timed call lands in a log-linear histogram
+** for its method and the role of its file, with about 6% resolution.
+*/
+#define LOGGINGVFS_OP_READ      0
+#define LOGGINGVFS_OP_WRITE     1
+#define LOGGINGVFS_OP_SYNC      2
+#define LOGGINGVFS_OP_TRUNCATE  3
+#define LOGGINGVFS_OP_FILESIZE  4
+#define LOGGINGVFS_OP_OPEN      5
+#define LOGGINGVFS_OP_DELETE    6
+#define LOGGINGVFS_OP_COUNT     7
+
+#define LOGGINGVFS_ROLE_MAIN    0   /* main database */
+#define LOGGINGVFS_ROLE_JOURNAL 1   /* rollback journal, WAL, sub- and super-journals */
+#define LOGGINGVFS_ROLE_TEMP    2   /* temporary databases and journals */
+#define LOGGINGVFS_ROLE_COUNT   3
+
+typedef struct LoggingVfsLatency LoggingVfsLatency;
+struct LoggingVfsLatency {
+    long long count;
+    long long total_ns;
+    long long max_ns;
+    long long p50_ns;
+    long long p90_ns;
+    long long p99_ns;
+    long long p999_ns;
+};
+
+typedef struct LoggingVfsStats LoggingVfsStats;
+struct LoggingVfsStats {
+    LoggingVfsLatency aLatency[LOGGINGVFS_ROLE_COUNT][LOGGINGVFS_OP_COUNT];
+};
+
+void sqlite3_loggingvfs_stats(LoggingVfsStats *pStats);
+void sqlite3_loggingvfs_reset_stats(void);
+void sqlite3_loggingvfs_set_stats(int enable);   /* on by default */
+const char *sqlite3_loggingvfs_op_name(int op);
+const char *sqlite3_loggingvfs_role_name(int role);
+
+#endif /* LOGGING_VFS_H */
\ No newline at end of file
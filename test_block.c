@@ -4,6 +4,8 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <assert.h>
+#include <dirent.h>
+#include <fcntl.h>
 #include "block.h"
 
 #define TEST_FILE "test_block_file"
@@ -247,6 +249,1316 @@ void test_persistence() {
     printf("PASS\n");
 }
 
+// Test descriptor cache reuse, eviction and cross-handle truncation
+void test_fd_cache() {
+    printf("Testing descriptor cache... ");
+    
+    cleanup_test_files();
+    
+    // Reads would otherwise be served by the shared read cache
+    block_set_cache_capacity(0);
+    block_set_fd_cache_capacity(2);
+    
+    block_file_t *bf;
+    assert(block_open(TEST_FILE, &bf) == 0);
+    
+    char data[100];
+    memset(data, 'A', sizeof(data));
+    assert(block_write(bf, data, 100, 0) == 100);
+    assert(block_sync(bf) == 0);
+    assert(block_read(bf, data, 100, 0) == 100);
+    assert(block_read(bf, data, 100, 50) == 100);
+    
+    // One miss probing the new block, one opening it for write-back
+    block_fd_cache_stats_t stats;
+    block_get_fd_cache_stats(bf, &stats);
+    assert(stats.misses == 2);
+    assert(stats.hits == 2);
+    assert(stats.evictions == 0);
+    
+    // Touch three blocks through a two-entry cache
+    assert(block_write(bf, data, 100, 4096) == 100);
+    assert(block_write(bf, data, 100, 8192) == 100);
+    assert(block_sync(bf) == 0);
+    block_get_fd_cache_stats(bf, &stats);
+    assert(stats.evictions == 1);
+    
+    // Truncation through another handle must not leave stale descriptors
+    block_file_t *other;
+    assert(block_open(TEST_FILE, &other) == 0);
+    assert(block_truncate(other, 4096) == 0);
+    memset(data, 'B', sizeof(data));
+    assert(block_write(bf, data, 100, 8192) == 100);
+    assert(block_sync(bf) == 0);
+    
+    char buffer[100];
+    assert(block_read(other, buffer, 100, 8192) == 100);
+    assert(memcmp(buffer, data, 100) == 0);
+    
+    block_close(other);
+    block_close(bf);
+    
+    block_set_fd_cache_capacity(BLOCK_FD_CACHE_DEFAULT);
+    block_set_cache_capacity(BLOCK_CACHE_CAPACITY_DEFAULT);
+    
+    printf("PASS\n");
+}
+
+// Test that the manifest tracks the size and that older stores get one
+void test_manifest() {
+    printf("Testing manifest... ");
+    
+    cleanup_test_files();
+    
+    block_file_t *bf;
+    assert(block_open(TEST_FILE, &bf) == 0);
+    
+    char data[5000];
+    memset(data, 'M', sizeof(data));
+    assert(block_write(bf, data, 5000, 0) == 5000);
+    assert(block_file_size(bf) == 8192);
+    assert(block_truncate(bf, 6000) == 0);
+    assert(block_file_size(bf) == 6000);
+    
+    block_close(bf);
+    
+    struct stat st;
+    assert(stat(TEST_FILE ".blocks/manifest", &st) == 0);
+    
+    assert(block_open(TEST_FILE, &bf) == 0);
+    assert(block_file_size(bf) == 6000);
+    block_close(bf);
+    
+    // A store written before manifests existed
+    cleanup_test_files();
+    mkdir(TEST_FILE ".blocks", 0755);
+    FILE *f = fopen(TEST_FILE ".blocks/block_000002", "wb");
+    assert(f != NULL);
+    fwrite(data, 1, 100, f);
+    fclose(f);
+    
+    assert(block_open(TEST_FILE, &bf) == 0);
+    assert(block_file_size(bf) == 2 * 4096 + 100);
+    block_close(bf);
+    
+    printf("PASS\n");
+}
+
+// Test block numbers past the old 10,000 block limit and beyond 32 bits
+void test_large_offsets() {
+    printf("Testing large offsets... ");
+    
+    cleanup_test_files();
+    
+    block_file_t *bf;
+    assert(block_open(TEST_FILE, &bf) == 0);
+    
+    const char *data = "far away";
+    int len = strlen(data);
+    long long far = 20000LL * 4096 + 10;
+    long long very_far = (5LL << 32) * 4096;
+    
+    assert(block_write(bf, data, len, far) == len);
+    assert(block_file_size(bf) == 20001LL * 4096);
+    assert(block_write(bf, data, len, very_far) == len);
+    assert(block_file_size(bf) == very_far + 4096);
+    
+    // Blocks land in the fan-out tree, not the top-level directory
+    assert(block_sync(bf) == 0);
+    struct stat st;
+    assert(stat(TEST_FILE ".blocks/00/4e/block_0000000000004e20", &st) == 0);
+    
+    char buffer[16];
+    memset(buffer, 0, sizeof(buffer));
+    assert(block_read(bf, buffer, len, very_far) == len);
+    assert(memcmp(buffer, data, len) == 0);
+    
+    assert(block_truncate(bf, far + len) == 0);
+    assert(block_file_size(bf) == far + len);
+    memset(buffer, 0, sizeof(buffer));
+    assert(block_read(bf, buffer, len, far) == len);
+    assert(memcmp(buffer, data, len) == 0);
+    
+    block_close(bf);
+    
+    printf("PASS\n");
+}
+
+// Test that repeated writes are absorbed until sync
+void test_write_back() {
+    printf("Testing write-back... ");
+    
+    cleanup_test_files();
+    
+    block_file_t *bf;
+    assert(block_open(TEST_FILE, &bf) == 0);
+    
+    char data[4096];
+    for (int i = 0; i < 10; i++) {
+        memset(data, 'a' + i, sizeof(data));
+        assert(block_write(bf, data, 100, 4096 + i * 100) == 100);
+    }
+    
+    // Nothing reaches disk before the sync, but reads see the writes
+    struct stat st;
+    assert(stat(TEST_FILE ".blocks/00/00/block_0000000000000001", &st) != 0);
+    char buffer[100];
+    assert(block_read(bf, buffer, 100, 4096 + 900) == 100);
+    assert(buffer[0] == 'j');
+    
+    block_writeback_stats_t stats;
+    block_get_writeback_stats(bf, &stats);
+    assert(stats.writes_absorbed == 9);
+    assert(stats.dirty_blocks == 1);
+    
+    assert(block_sync(bf) == 0);
+    block_get_writeback_stats(bf, &stats);
+    assert(stats.blocks_flushed == 1);
+    assert(stats.dirty_blocks == 0);
+    assert(stat(TEST_FILE ".blocks/00/00/block_0000000000000001", &st) == 0);
+    
+    // A small dirty limit forces write-back without a sync
+    block_set_dirty_limit(2 * 4096);
+    for (int i = 0; i < 3; i++) {
+        assert(block_write(bf, data, 4096, (10 + i) * 4096LL) == 4096);
+    }
+    block_get_writeback_stats(bf, &stats);
+    assert(stats.dirty_blocks == 0);
+    block_set_dirty_limit(BLOCK_DIRTY_LIMIT_DEFAULT);
+    
+    block_close(bf);
+    
+    printf("PASS\n");
+}
+
+// Test that a scan does not push hot blocks out of the read cache
+void test_read_cache() {
+    printf("Testing read cache... ");
+    
+    cleanup_test_files();
+    
+    block_set_cache_capacity(16 * 4096);
+    
+    block_file_t *bf;
+    assert(block_open(TEST_FILE, &bf) == 0);
+    
+    char buffer[4096];
+    
+    // Hot blocks are seen once, age out of A1in, and come back as hot
+    for (int i = 0; i < 4; i++) assert(block_read(bf, buffer, 4096, i * 4096LL) == 4096);
+    for (int i = 0; i < 16; i++) assert(block_read(bf, buffer, 4096, (100 + i) * 4096LL) == 4096);
+    for (int i = 0; i < 4; i++) assert(block_read(bf, buffer, 4096, i * 4096LL) == 4096);
+    
+    block_cache_stats_t stats;
+    block_get_cache_stats(&stats);
+    assert(stats.ghost_hits == 4);
+    
+    // A long scan cycles through A1in only
+    for (int i = 0; i < 64; i++) assert(block_read(bf, buffer, 4096, (1000 + i) * 4096LL) == 4096);
+    
+    block_reset_cache_stats();
+    for (int i = 0; i < 4; i++) assert(block_read(bf, buffer, 4096, i * 4096LL) == 4096);
+    block_get_cache_stats(&stats);
+    assert(stats.hits == 4);
+    assert(stats.misses == 0);
+    assert(stats.hit_ratio == 1.0);
+    assert(stats.used <= 16 * 4096);
+    
+    // Written blocks are refreshed in the cache when they are flushed
+    memset(buffer, 'W', sizeof(buffer));
+    assert(block_write(bf, buffer, 4096, 0) == 4096);
+    assert(block_sync(bf) == 0);
+    memset(buffer, 0, sizeof(buffer));
+    assert(block_read(bf, buffer, 4096, 0) == 4096);
+    assert(buffer[0] == 'W' && buffer[4095] == 'W');
+    
+    block_close(bf);
+    
+    block_set_cache_capacity(BLOCK_CACHE_CAPACITY_DEFAULT);
+    
+    printf("PASS\n");
+}
+
+// Test the packed backend through the same API
+void test_packed_layout() {
+    printf("Testing packed layout... ");
+    
+    cleanup_test_files();
+    
+    assert(block_set_backend("packed") == 0);
+    
+    block_file_t *bf;
+    assert(block_open(TEST_FILE, &bf) == 0);
+    
+    char data[3 * 4096];
+    for (int i = 0; i < (int)sizeof(data); i++) {
+        data[i] = (char)(i % 251);
+    }
+    assert(block_write(bf, data, sizeof(data), 0) == (int)sizeof(data));
+    assert(block_write(bf, "tail", 4, 100 * 4096LL) == 4);
+    assert(block_sync(bf) == 0);
+    
+    // Everything lives in one segment and the index
+    struct stat st;
+    assert(stat(TEST_FILE ".blocks/segment_0000", &st) == 0);
+    assert(st.st_size == 4 * 4096);
+    assert(stat(TEST_FILE ".blocks/00", &st) != 0);
+    
+    block_close(bf);
+    assert(block_set_backend("fanout") == 0);
+    
+    // The store keeps its backend after the default changes
+    assert(block_open(TEST_FILE, &bf) == 0);
+    assert(block_file_size(bf) == 101 * 4096LL);
+    char buffer[sizeof(data)];
+    assert(block_read(bf, buffer, sizeof(buffer), 0) == (int)sizeof(buffer));
+    assert(memcmp(buffer, data, sizeof(data)) == 0);
+    
+    // Truncation frees slots, and freed slots are reused
+    assert(block_truncate(bf, 4096 + 10) == 0);
+    assert(block_file_size(bf) == 4096 + 10);
+    assert(stat(TEST_FILE ".blocks/segment_0000", &st) == 0);
+    assert(st.st_size == 2 * 4096);
+    memset(buffer, 0xFF, 100);
+    assert(block_read(bf, buffer, 100, 4096) == 100);
+    assert(memcmp(buffer, data + 4096, 10) == 0);
+    assert(buffer[10] == 0);
+    
+    // A partial last block keeps its exact size across a reopen
+    block_close(bf);
+    assert(block_open(TEST_FILE, &bf) == 0);
+    assert(block_file_size(bf) == 4096 + 10);
+    
+    assert(block_write(bf, data, 4096, 50 * 4096LL) == 4096);
+    assert(block_sync(bf) == 0);
+    assert(stat(TEST_FILE ".blocks/segment_0000", &st) == 0);
+    assert(st.st_size == 3 * 4096);
+    
+    block_close(bf);
+    
+    printf("PASS\n");
+}
+
+// A backend that counts the blocks stored through it
+static int counted_writes = 0;
+
+static int counting_write(void *state, long long block_num, const char *data) {
+    counted_writes++;
+    return block_find_backend("memory")->write(state, block_num, data);
+}
+
+// Test the memory backend and registering a custom backend
+void test_backends() {
+    printf("Testing backends... ");
+    
+    cleanup_test_files();
+    
+    assert(block_find_backend("fanout") != NULL);
+    assert(block_find_backend("no-such-backend") == NULL);
+    assert(block_set_backend("no-such-backend") != 0);
+    
+    block_file_t *bf;
+    assert(block_open_with(TEST_FILE, "no-such-backend", &bf) != 0);
+    
+    // Memory stores leave nothing on disk and are gone after the last close
+    assert(block_open_with(TEST_FILE, "memory", &bf) == 0);
+    assert(block_write(bf, "Memory", 6, 3 * 4096LL) == 6);
+    assert(block_sync(bf) == 0);
+    
+    block_file_t *bf2;
+    assert(block_open(TEST_FILE, &bf2) == 0);
+    char buffer[16];
+    assert(block_read(bf2, buffer, 6, 3 * 4096LL) == 6);
+    assert(memcmp(buffer, "Memory", 6) == 0);
+    assert(block_file_size(bf2) == 3 * 4096LL + 4096);
+    block_close(bf2);
+    
+    struct stat st;
+    assert(stat(TEST_FILE ".blocks", &st) != 0);
+    
+    assert(block_truncate(bf, 2) == 0);
+    assert(block_read(bf, buffer, 6, 3 * 4096LL) == 6);
+    assert(buffer[0] == 0);
+    block_close(bf);
+    
+    assert(block_open_with(TEST_FILE, "memory", &bf) == 0);
+    assert(block_file_size(bf) == 0);
+    block_close(bf);
+    
+    // A registered backend is used for the blocks written back
+    static block_backend_t counting;
+    counting = *block_find_backend("memory");
+    counting.name = "counting";
+    counting.write = counting_write;
+    assert(block_register_backend(&counting) == 0);
+    
+    assert(block_open_with(TEST_FILE, "counting", &bf) == 0);
+    char data[3 * 4096];
+    memset(data, 'C', sizeof(data));
+    assert(block_write(bf, data, sizeof(data), 0) == (int)sizeof(data));
+    assert(counted_writes == 0);
+    assert(block_sync(bf) == 0);
+    assert(counted_writes == 3);
+    block_close(bf);
+    
+    printf("PASS\n");
+}
+
+// Run an atomic batch against one backend: rollback, commit and reopen
+static void check_atomic_write(const char *backend) {
+    cleanup_test_files();
+    
+    block_file_t *bf;
+    assert(block_open_with(TEST_FILE, backend, &bf) == 0);
+    assert(block_supports_atomic_write(bf));
+    
+    char old_data[2 * 4096], new_data[3 * 4096], buffer[3 * 4096];
+    memset(old_data, 'O', sizeof(old_data));
+    memset(new_data, 'N', sizeof(new_data));
+    assert(block_write(bf, old_data, sizeof(old_data), 0) == (int)sizeof(old_data));
+    assert(block_sync(bf) == 0);
+    
+    // A rolled back batch leaves no trace, even past the dirty limit
+    block_set_dirty_limit(4096);
+    assert(block_begin_atomic_write(bf) == 0);
+    assert(block_begin_atomic_write(bf) != 0);
+    assert(block_write(bf, new_data, sizeof(new_data), 0) == (int)sizeof(new_data));
+    assert(block_read(bf, buffer, sizeof(buffer), 0) == (int)sizeof(buffer));
+    assert(memcmp(buffer, new_data, sizeof(new_data)) == 0);
+    assert(block_file_size(bf) == 3 * 4096);
+    assert(block_rollback_atomic_write(bf) == 0);
+    assert(block_file_size(bf) == 2 * 4096);
+    assert(block_read(bf, buffer, sizeof(old_data), 0) == (int)sizeof(old_data));
+    assert(memcmp(buffer, old_data, sizeof(old_data)) == 0);
+    
+    // A committed batch is all there
+    assert(block_begin_atomic_write(bf) == 0);
+    assert(block_write(bf, new_data, sizeof(new_data), 0) == (int)sizeof(new_data));
+    assert(block_commit_atomic_write(bf) == 0);
+    assert(block_commit_atomic_write(bf) != 0);
+    block_set_dirty_limit(BLOCK_DIRTY_LIMIT_DEFAULT);
+    
+    block_writeback_stats_t wb;
+    block_get_writeback_stats(bf, &wb);
+    assert(wb.dirty_blocks == 0);
+    assert(block_read(bf, buffer, sizeof(buffer), 0) == (int)sizeof(buffer));
+    assert(memcmp(buffer, new_data, sizeof(new_data)) == 0);
+    
+    block_close(bf);
+    if (strcmp(backend, "memory") != 0) {
+        assert(block_open(TEST_FILE, &bf) == 0);
+        assert(block_file_size(bf) == 3 * 4096);
+        memset(buffer, 0, sizeof(buffer));
+        assert(block_read(bf, buffer, sizeof(buffer), 0) == (int)sizeof(buffer));
+        assert(memcmp(buffer, new_data, sizeof(new_data)) == 0);
+        block_close(bf);
+    }
+}
+
+// Test atomic batches and finishing a committed batch on open
+void test_atomic_write() {
+    printf("Testing atomic writes... ");
+    
+    check_atomic_write("fanout");
+    check_atomic_write("packed");
+    check_atomic_write("memory");
+    
+    // A crash after the manifest switch: the staged block is published on
+    // the next open
+    cleanup_test_files();
+    block_file_t *bf;
+    assert(block_open(TEST_FILE, &bf) == 0);
+    assert(block_write(bf, "old", 3, 0) == 3);
+    assert(block_close(bf) == 0);
+    
+    char block[4096] = "new";
+    FILE *f = fopen(TEST_FILE ".blocks/00/00/block_0000000000000000.new", "w");
+    assert(f && fwrite(block, 1, sizeof(block), f) == sizeof(block));
+    fclose(f);
+    f = fopen(TEST_FILE ".blocks/manifest", "a");
+    assert(f && fprintf(f, "staged 0 0\n") > 0);
+    fclose(f);
+    
+    assert(block_open(TEST_FILE, &bf) == 0);
+    char buffer[4];
+    assert(block_read(bf, buffer, 4, 0) == 4);
+    assert(memcmp(buffer, "new", 4) == 0);
+    block_close(bf);
+    
+    // ...and only once
+    f = fopen(TEST_FILE ".blocks/manifest", "r");
+    char line[128];
+    while (f && fgets(line, sizeof(line), f)) {
+        assert(strncmp(line, "staged", 6) != 0);
+    }
+    fclose(f);
+    
+    printf("PASS\n");
+}
+
+// Count the entries of a directory, other than . and ..
+static int count_dir_entries(const char *path) {
+    DIR *d = opendir(path);
+    int count = 0;
+    struct dirent *entry;
+    while (d && (entry = readdir(d)) != NULL) {
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) count++;
+    }
+    if (d) closedir(d);
+    return count;
+}
+
+// Test temporary files in memory, spilling to disk and cleaning up
+void test_temp_files() {
+    printf("Testing temporary files... ");
+    
+    cleanup_test_files();
+    system("rm -rf " TEST_FILE ".tmp");
+    assert(mkdir(TEST_FILE ".tmp", 0755) == 0);
+    setenv("TMPDIR", TEST_FILE ".tmp", 1);
+    
+    char data[4096], buffer[4096];
+    memset(data, 'T', sizeof(data));
+    
+    // Small temporary files never touch the disk
+    block_file_t *bf, *bf2;
+    assert(block_open_temp(&bf) == 0);
+    assert(block_open_temp(&bf2) == 0);
+    assert(block_write(bf, data, sizeof(data), 4096) == (int)sizeof(data));
+    assert(block_read(bf2, buffer, sizeof(buffer), 4096) == (int)sizeof(buffer));
+    assert(buffer[0] == 0);
+    assert(block_sync(bf) == 0);
+    assert(count_dir_entries(TEST_FILE ".tmp") == 0);
+    block_close(bf2);
+    
+    // Past the threshold the blocks move to a store of their own
+    block_set_temp_spill(4 * 4096);
+    for (int i = 2; i < 8; i++) {
+        assert(block_write(bf, data, sizeof(data), i * 4096LL) == (int)sizeof(data));
+    }
+    assert(count_dir_entries(TEST_FILE ".tmp") == 1);
+    assert(block_sync(bf) == 0);
+    assert(block_file_size(bf) == 8 * 4096);
+    assert(block_read(bf, buffer, sizeof(buffer), 0) == (int)sizeof(buffer));
+    assert(buffer[0] == 0);
+    for (int i = 1; i < 8; i++) {
+        assert(block_read(bf, buffer, sizeof(buffer), i * 4096LL) == (int)sizeof(buffer));
+        assert(memcmp(buffer, data, sizeof(data)) == 0);
+    }
+    
+    assert(block_close(bf) == 0);
+    assert(count_dir_entries(TEST_FILE ".tmp") == 0);
+    
+    block_set_temp_spill(BLOCK_TEMP_SPILL_DEFAULT);
+    unsetenv("TMPDIR");
+    rmdir(TEST_FILE ".tmp");
+    
+    printf("PASS\n");
+}
+
+// Test per-file block sizes and read caches
+void test_block_sizes() {
+    printf("Testing block sizes... ");
+    
+    const char *backends[] = { "fanout", "packed", "memory" };
+    for (int b = 0; b < 3; b++) {
+        cleanup_test_files();
+    
+        block_open_options_t options = { backends[b], 16384, 1024 * 1024 };
+        block_file_t *bf;
+        assert(block_open_ex(TEST_FILE, &options, &bf) == 0);
+        assert(block_get_block_size(bf) == 16384);
+    
+        block_cache_stats_t stats;
+        block_get_file_cache_stats(bf, &stats);
+        assert(stats.capacity == 1024 * 1024);
+    
+        // Writes straddling 16KB blocks
+        char data[40000], buffer[40000];
+        for (int i = 0; i < (int)sizeof(data); i++) data[i] = (char)(i * 7);
+        assert(block_write(bf, data, sizeof(data), 10000) == (int)sizeof(data));
+        assert(block_file_size(bf) == 4 * 16384);
+        assert(block_sync(bf) == 0);
+        assert(block_read(bf, buffer, sizeof(buffer), 10000) == (int)sizeof(buffer));
+        assert(memcmp(buffer, data, sizeof(data)) == 0);
+    
+        assert(block_truncate(bf, 20000) == 0);
+        assert(block_read(bf, buffer, 20000, 0) == 20000);
+        assert(memcmp(buffer + 10000, data, 10000) == 0);
+        if (strcmp(backends[b], "memory") == 0) {
+            block_close(bf);
+            continue;
+        }
+        block_close(bf);
+    
+        // The store keeps its block size, whatever a later open asks for
+        assert(block_open(TEST_FILE, &bf) == 0);
+        assert(block_get_block_size(bf) == 16384);
+        assert(block_file_size(bf) == 20000);
+        memset(buffer, 0, sizeof(buffer));
+        assert(block_read(bf, buffer, 10000, 10000) == 10000);
+        assert(memcmp(buffer, data, 10000) == 0);
+        block_close(bf);
+    }
+    
+    block_open_options_t bad = { NULL, 1000, 0 };
+    block_file_t *bf;
+    assert(block_open_ex(TEST_FILE "_bad", &bad, &bf) != 0);
+    bad.block_size = 256;
+    assert(block_open_ex(TEST_FILE "_bad", &bad, &bf) != 0);
+    bad.block_size = 131072;
+    assert(block_open_ex(TEST_FILE "_bad", &bad, &bf) != 0);
+    
+    printf("PASS\n");
+}
+
+// Test memory-mapped reads of clean blocks
+void test_fetch() {
+    printf("Testing mapped reads... ");
+    
+    const char *backends[] = { "fanout", "packed", "memory" };
+    for (int b = 0; b < 3; b++) {
+        cleanup_test_files();
+    
+        block_file_t *bf;
+        assert(block_open_with(TEST_FILE, backends[b], &bf) == 0);
+        char data[4096];
+        for (int i = 0; i < 3; i++) {
+            memset(data, 'a' + i, sizeof(data));
+            assert(block_write(bf, data, sizeof(data), i * 4096LL) == (int)sizeof(data));
+        }
+    
+        // Dirty blocks are only in memory
+        const void *ptr;
+        assert(block_fetch(bf, 4096, 1024, &ptr) == 0);
+        assert(ptr == NULL);
+        assert(block_sync(bf) == 0);
+    
+        assert(block_fetch(bf, 4096 + 1024, 1024, &ptr) == 0);
+        if (strcmp(backends[b], "memory") == 0) {
+            assert(ptr == NULL);
+            block_close(bf);
+            continue;
+        }
+        assert(ptr != NULL);
+        assert(((const char *)ptr)[0] == 'b' && ((const char *)ptr)[1023] == 'b');
+    
+        // Flushed overwrites show through the mapping
+        memset(data, 'z', sizeof(data));
+        assert(block_write(bf, data, sizeof(data), 4096) == (int)sizeof(data));
+        assert(block_sync(bf) == 0);
+        assert(((const char *)ptr)[0] == 'z');
+        assert(block_unfetch(bf, 4096 + 1024, ptr) == 0);
+    
+        // Ranges across blocks, past the end or over holes are read instead
+        assert(block_fetch(bf, 4096 - 512, 1024, &ptr) == 0 && ptr == NULL);
+        assert(block_fetch(bf, 3 * 4096, 4096, &ptr) == 0 && ptr == NULL);
+        assert(block_write(bf, data, sizeof(data), 5 * 4096LL) == (int)sizeof(data));
+        assert(block_sync(bf) == 0);
+        assert(block_fetch(bf, 4 * 4096, 4096, &ptr) == 0 && ptr == NULL);
+    
+        // Batches keep their blocks to themselves until commit
+        assert(block_begin_atomic_write(bf) == 0);
+        assert(block_fetch(bf, 0, 4096, &ptr) == 0 && ptr == NULL);
+        assert(block_commit_atomic_write(bf) == 0);
+    
+        assert(block_fetch(bf, 0, 4096, &ptr) == 0 && ptr != NULL);
+        assert(memcmp(ptr, "aaaa", 4) == 0);
+        assert(block_unfetch(bf, 0, ptr) == 0);
+        block_close(bf);
+    }
+    
+    printf("PASS\n");
+}
+
+// Test read-ahead of sequential and strided reads
+void test_readahead() {
+    printf("Testing read-ahead... ");
+    
+    cleanup_test_files();
+    block_file_t *bf;
+    assert(block_open(TEST_FILE, &bf) == 0);
+    char data[4096];
+    for (int i = 0; i < 512; i++) {
+        memset(data, i & 0xff, sizeof(data));
+        assert(block_write(bf, data, sizeof(data), i * 4096LL) == (int)sizeof(data));
+    }
+    assert(block_close(bf) == 0);
+    
+    // Start from a cold cache
+    block_set_cache_capacity(0);
+    block_set_cache_capacity(BLOCK_CACHE_CAPACITY_DEFAULT);
+    assert(block_open(TEST_FILE, &bf) == 0);
+    
+    // A forward scan: once the stream is seen, blocks arrive ahead of it
+    block_readahead_stats_t stats;
+    for (int i = 0; i < 256; i++) {
+        assert(block_read(bf, data, sizeof(data), i * 4096LL) == (int)sizeof(data));
+        assert(data[0] == (char)(i & 0xff));
+        if (i == 2) usleep(100000);
+    }
+    block_get_readahead_stats(bf, &stats);
+    assert(stats.streams == 1);
+    assert(stats.issued > 0 && stats.issued <= 256 + BLOCK_READAHEAD_DEFAULT);
+    assert(stats.hits > 0);
+    assert(stats.hit_ratio > 0.0 && stats.hit_ratio <= 1.0);
+    
+    // A backward scan every third block
+    long long issued = stats.issued;
+    for (int i = 511; i >= 256; i -= 3) {
+        assert(block_read(bf, data, 100, i * 4096LL + 50) == 100);
+        assert(data[0] == (char)(i & 0xff));
+    }
+    block_get_readahead_stats(bf, &stats);
+    assert(stats.streams == 2);
+    assert(stats.issued > issued);
+    
+    // Scattered reads and a disabled read-ahead queue nothing
+    issued = stats.issued;
+    int scattered[] = { 7, 300, 12, 450, 99, 3, 200 };
+    for (int i = 0; i < 7; i++) {
+        assert(block_read(bf, data, sizeof(data), scattered[i] * 4096LL) == (int)sizeof(data));
+    }
+    block_set_readahead(0);
+    for (int i = 0; i < 64; i++) {
+        assert(block_read(bf, data, sizeof(data), i * 4096LL) == (int)sizeof(data));
+    }
+    block_get_readahead_stats(bf, &stats);
+    assert(stats.issued == issued);
+    block_set_readahead(BLOCK_READAHEAD_DEFAULT);
+    
+    // Closing waits for requests still queued
+    for (int i = 0; i < 64; i++) {
+        assert(block_read(bf, data, sizeof(data), i * 4096LL) == (int)sizeof(data));
+    }
+    assert(block_close(bf) == 0);
+    
+    printf("PASS\n");
+}
+
+void test_io_engines() {
+    printf("Testing I/O engines... ");
+    
+    const char *backends[] = { "fanout", "packed" };
+    int engines[] = { BLOCK_IO_ENGINE_POSIX, BLOCK_IO_ENGINE_URING };
+    block_set_fd_cache_capacity(8);
+    for (int e = 0; e < 2; e++) {
+        int engine = block_set_io_engine(engines[e]);
+        assert(engine == BLOCK_IO_ENGINE_POSIX || engine == engines[e]);
+        for (int b = 0; b < 2; b++) {
+            cleanup_test_files();
+            block_reset_io_stats();
+    
+            // A flush of many dirty blocks, a sync and a truncate each run
+            // as batches
+            block_file_t *bf;
+            char data[4096];
+            assert(block_open_with(TEST_FILE, backends[b], &bf) == 0);
+            for (int i = 0; i < 100; i++) {
+                memset(data, 'a' + i % 26, sizeof(data));
+                assert(block_write(bf, data, sizeof(data), i * 4096LL) == (int)sizeof(data));
+            }
+            assert(block_sync(bf) == 0);
+            assert(block_truncate(bf, 40 * 4096LL + 100) == 0);
+            assert(block_sync(bf) == 0);
+            assert(block_close(bf) == 0);
+    
+            block_io_stats_t stats;
+            block_get_io_stats(&stats);
+            assert(stats.batches > 0 && stats.ops >= 100);
+            if (engine == BLOCK_IO_ENGINE_URING) {
+                assert(stats.syscalls < stats.ops);
+            } else {
+                assert(stats.syscalls >= stats.ops);
+            }
+    
+            // Everything reads back from a cold cache
+            block_set_cache_capacity(0);
+            block_set_cache_capacity(BLOCK_CACHE_CAPACITY_DEFAULT);
+            assert(block_open_with(TEST_FILE, backends[b], &bf) == 0);
+            assert(block_file_size(bf) == 40 * 4096LL + 100);
+            for (int i = 0; i < 41; i++) {
+                int n = (i < 40) ? (int)sizeof(data) : 100;
+                assert(block_read(bf, data, sizeof(data), i * 4096LL) == (int)sizeof(data));
+                assert(data[0] == 'a' + i % 26 && data[n - 1] == 'a' + i % 26);
+                assert(n == (int)sizeof(data) || data[n] == 0);
+            }
+            assert(block_close(bf) == 0);
+        }
+    }
+    block_set_io_engine(BLOCK_IO_ENGINE_URING);
+    block_set_fd_cache_capacity(BLOCK_FD_CACHE_DEFAULT);
+    
+    printf("PASS\n");
+}
+
+void test_zero_blocks() {
+    printf("Testing zero-block elision... ");
+    
+    const char *backends[] = { "fanout", "packed", "memory" };
+    for (int b = 0; b < 3; b++) {
+        cleanup_test_files();
+        block_file_t *bf;
+        char data[4096];
+        char zeros[4096] = {0};
+        assert(block_open_with(TEST_FILE, backends[b], &bf) == 0);
+    
+        // Zeros never become a block; a zero byte late in a block does not
+        // fool the scan
+        assert(block_write(bf, zeros, sizeof(zeros), 0) == (int)sizeof(zeros));
+        memset(data, 'z', sizeof(data));
+        assert(block_write(bf, data, sizeof(data), 4096) == (int)sizeof(data));
+        memset(data, 0, sizeof(data));
+        data[4095] = 1;
+        assert(block_write(bf, data, sizeof(data), 2 * 4096) == (int)sizeof(data));
+        assert(block_sync(bf) == 0);
+    
+        block_writeback_stats_t stats;
+        block_get_writeback_stats(bf, &stats);
+        assert(stats.blocks_flushed == 3 && stats.blocks_elided == 1);
+        struct stat st;
+        if (b == 0) {
+            assert(stat(TEST_FILE ".blocks/00/00/block_0000000000000000", &st) != 0);
+            assert(stat(TEST_FILE ".blocks/00/00/block_0000000000000001", &st) == 0);
+            assert(stat(TEST_FILE ".blocks/00/00/block_0000000000000002", &st) == 0);
+        }
+    
+        // Zeroing a stored block removes it, directly and in a batch
+        assert(block_write(bf, zeros, sizeof(zeros), 4096) == (int)sizeof(zeros));
+        assert(block_sync(bf) == 0);
+        if (block_supports_atomic_write(bf)) {
+            assert(block_begin_atomic_write(bf) == 0);
+            assert(block_write(bf, zeros, sizeof(zeros), 2 * 4096) == (int)sizeof(zeros));
+            assert(block_commit_atomic_write(bf) == 0);
+        }
+        block_get_writeback_stats(bf, &stats);
+        assert(stats.blocks_elided == 3);
+        if (b == 0) {
+            assert(stat(TEST_FILE ".blocks/00/00/block_0000000000000001", &st) != 0);
+            assert(stat(TEST_FILE ".blocks/00/00/block_0000000000000002", &st) != 0);
+        }
+        if (b == 1) {
+            assert(stat(TEST_FILE ".blocks/segment_0000", &st) == 0 && st.st_size == 0);
+        }
+    
+        // The holes read as zeros and the size is unchanged
+        assert(block_file_size(bf) == 3 * 4096);
+        for (int i = 0; i < 3; i++) {
+            assert(block_read(bf, data, sizeof(data), i * 4096LL) == (int)sizeof(data));
+            assert(memcmp(data, zeros, sizeof(data)) == 0);
+        }
+        assert(block_close(bf) == 0);
+    }
+    
+    // A packed batch that committed before a crash, punching block 2 and
+    // staging block 0 in slot 3: the hole must not give the staged slot
+    // back before it is published
+    cleanup_test_files();
+    block_file_t *bf;
+    char data[4096];
+    assert(block_open_with(TEST_FILE, "packed", &bf) == 0);
+    for (int i = 0; i < 3; i++) {
+        memset(data, 'a' + i, sizeof(data));
+        assert(block_write(bf, data, sizeof(data), i * 4096LL) == (int)sizeof(data));
+    }
+    assert(block_close(bf) == 0);
+    memset(data, 'x', sizeof(data));
+    int fd = open(TEST_FILE ".blocks/segment_0000", O_WRONLY);
+    assert(fd >= 0 && pwrite(fd, data, sizeof(data), 3 * 4096) == (ssize_t)sizeof(data));
+    close(fd);
+    FILE *f = fopen(TEST_FILE ".blocks/manifest", "a");
+    assert(f && fprintf(f, "staged 2 -1\nstaged 0 3\n") > 0);
+    fclose(f);
+    
+    struct stat st;
+    assert(block_open(TEST_FILE, &bf) == 0);
+    assert(block_read(bf, data, sizeof(data), 0) == (int)sizeof(data) && data[0] == 'x' && data[4095] == 'x');
+    assert(block_read(bf, data, sizeof(data), 4096) == (int)sizeof(data) && data[0] == 'b');
+    assert(block_read(bf, data, sizeof(data), 2 * 4096) == (int)sizeof(data) && data[0] == 0);
+    assert(stat(TEST_FILE ".blocks/segment_0000", &st) == 0 && st.st_size == 4 * 4096);
+    
+    // Holes punched after a reopen still give trailing space back
+    memset(data, 0, sizeof(data));
+    assert(block_write(bf, data, sizeof(data), 0) == (int)sizeof(data));
+    assert(block_close(bf) == 0);
+    assert(stat(TEST_FILE ".blocks/segment_0000", &st) == 0 && st.st_size == 2 * 4096);
+    assert(block_open(TEST_FILE, &bf) == 0);
+    assert(block_write(bf, data, sizeof(data), 4096) == (int)sizeof(data));
+    assert(block_close(bf) == 0);
+    assert(stat(TEST_FILE ".blocks/segment_0000", &st) == 0 && st.st_size == 0);
+    
+    printf("PASS\n");
+}
+
+void test_compression() {
+    printf("Testing block compression... ");
+    
+    cleanup_test_files();
+    block_set_cache_capacity(0);
+    block_file_t *bf;
+    block_open_options_t options = { "fanout", 0, 0, BLOCK_COMPRESS_LZ };
+    assert(block_open_ex(TEST_FILE, &options, &bf) == 0);
+    
+    // Seven blocks of text-like rows, then one of noise that cannot shrink
+    char data[4096];
+    char expected[8][4096];
+    for (int i = 0; i < 7; i++) {
+        int n = 0;
+        for (int row = 0; n < 4096; row++) {
+            n += snprintf(expected[i] + n, 4096 - n, "row %d of block %d, name=user%d\n", row, i, row % 17);
+        }
+    }
+    srand(7);
+    for (int j = 0; j < 4096; j++) {
+        expected[7][j] = (char)(rand() & 0xff);
+    }
+    for (int i = 0; i < 8; i++) {
+        assert(block_write(bf, expected[i], 4096, i * 4096LL) == 4096);
+    }
+    assert(block_sync(bf) == 0);
+    
+    block_compress_stats_t stats;
+    block_get_compress_stats(bf, &stats);
+    assert(stats.blocks_compressed == 7 && stats.blocks_raw == 1);
+    assert(stats.bytes_in == 8 * 4096 && stats.ratio > 2.0);
+    struct stat st;
+    assert(stat(TEST_FILE ".blocks/00/00/block_0000000000000000", &st) == 0 && st.st_size < 4096 / 2);
+    assert(stat(TEST_FILE ".blocks/00/00/block_0000000000000007", &st) == 0 && st.st_size == 4096);
+    
+    // Whole and partial reads come back decompressed
+    for (int i = 0; i < 8; i++) {
+        assert(block_read(bf, data, 4096, i * 4096LL) == 4096);
+        assert(memcmp(data, expected[i], 4096) == 0);
+    }
+    assert(block_read(bf, data, 50, 2 * 4096 + 100) == 50);
+    assert(memcmp(data, expected[2] + 100, 50) == 0);
+    block_get_compress_stats(bf, &stats);
+    assert(stats.blocks_decompressed == 8);
+    
+    // Truncating into a compressed block keeps its head
+    assert(block_truncate(bf, 3 * 4096 + 100) == 0);
+    assert(block_sync(bf) == 0);
+    assert(block_file_size(bf) == 3 * 4096 + 100);
+    assert(block_truncate(bf, 4 * 4096) == 0);
+    assert(block_read(bf, data, 4096, 3 * 4096) == 4096);
+    assert(memcmp(data, expected[3], 100) == 0);
+    for (int j = 100; j < 4096; j++) {
+        assert(data[j] == 0);
+    }
+    
+    // Atomic batches stage compressed blocks
+    assert(block_begin_atomic_write(bf) == 0);
+    assert(block_write(bf, expected[5], 4096, 0) == 4096);
+    assert(block_write(bf, expected[7], 4096, 4096) == 4096);
+    assert(block_commit_atomic_write(bf) == 0);
+    assert(block_close(bf) == 0);
+    
+    // The store stays compressed whatever it is reopened with
+    assert(block_open_with(TEST_FILE, "fanout", &bf) == 0);
+    assert(block_read(bf, data, 4096, 0) == 4096 && memcmp(data, expected[5], 4096) == 0);
+    assert(block_read(bf, data, 4096, 4096) == 4096 && memcmp(data, expected[7], 4096) == 0);
+    assert(block_read(bf, data, 4096, 2 * 4096) == 4096 && memcmp(data, expected[2], 4096) == 0);
+    block_get_compress_stats(bf, &stats);
+    assert(stats.blocks_decompressed == 2);
+    assert(block_close(bf) == 0);
+    
+    // Packed slots have no room for a length, so nothing of such a store
+    // is created; and other stores count nothing
+    cleanup_test_files();
+    block_open_options_t packed = { "packed", 0, 0, BLOCK_COMPRESS_LZ };
+    assert(block_open_ex(TEST_FILE, &packed, &bf) != 0);
+    assert(stat(TEST_FILE ".blocks", &st) != 0);
+    assert(block_open(TEST_FILE, &bf) == 0);
+    assert(block_write(bf, expected[0], 4096, 0) == 4096);
+    assert(block_sync(bf) == 0);
+    block_get_compress_stats(bf, &stats);
+    assert(stats.blocks_compressed == 0 && stats.bytes_in == 0);
+    assert(block_close(bf) == 0);
+    
+    block_set_cache_capacity(BLOCK_CACHE_CAPACITY_DEFAULT);
+    printf("PASS\n");
+}
+
+// Objects in a dedup object directory, two levels down
+static int count_objects(const char *path) {
+    DIR *d = opendir(path);
+    int count = 0;
+    struct dirent *entry;
+    while (d && (entry = readdir(d)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+        char sub[512];
+        snprintf(sub, sizeof(sub), "%s/%s", path, entry->d_name);
+        DIR *d2 = opendir(sub);
+        struct dirent *entry2;
+        while (d2 && (entry2 = readdir(d2)) != NULL) {
+            if (entry2->d_name[0] == '.') continue;
+            char leaf[768];
+            snprintf(leaf, sizeof(leaf), "%s/%s", sub, entry2->d_name);
+            count += count_dir_entries(leaf);
+        }
+        if (d2) closedir(d2);
+    }
+    if (d) closedir(d);
+    return count;
+}
+
+static void write_filled(block_file_t *bf, long long block, char c) {
+    char data[4096];
+    memset(data, c, sizeof(data));
+    assert(block_write(bf, data, sizeof(data), block * 4096) == (int)sizeof(data));
+}
+
+static int holds_filled(block_file_t *bf, long long block, char c) {
+    char data[4096];
+    assert(block_read(bf, data, sizeof(data), block * 4096) == (int)sizeof(data));
+    for (int i = 0; i < 4096; i++) {
+        if (data[i] != c) return 0;
+    }
+    return 1;
+}
+
+void test_dedup() {
+    printf("Testing dedup store... ");
+    
+    cleanup_test_files();
+    system("rm -rf " TEST_FILE "_b.blocks " TEST_FILE "_c.blocks " TEST_FILE "_objects");
+    block_set_object_dir(TEST_FILE "_objects");
+    block_set_fsync(1);
+    
+    // Equal blocks share one object, within a store and across stores
+    block_file_t *a, *b, *c;
+    assert(block_open_with(TEST_FILE, "dedup", &a) == 0);
+    write_filled(a, 0, 'a');
+    write_filled(a, 1, 'b');
+    write_filled(a, 2, 'a');
+    write_filled(a, 3, 'c');
+    assert(block_sync(a) == 0);
+    assert(count_objects(TEST_FILE "_objects") == 3);
+    block_dedup_stats_t stats;
+    block_get_dedup_stats(a, &stats);
+    assert(stats.blocks_written == 4 && stats.objects_created == 3 && stats.blocks_shared == 1);
+    
+    assert(block_open_with(TEST_FILE "_b", "dedup", &b) == 0);
+    write_filled(b, 0, 'a');
+    write_filled(b, 1, 'b');
+    assert(block_sync(b) == 0);
+    assert(count_objects(TEST_FILE "_objects") == 3);
+    block_get_dedup_stats(b, &stats);
+    assert(stats.blocks_shared == 2 && stats.objects_created == 0);
+    
+    // Rewriting a block as it was costs nothing; an object lives on while
+    // another store refers to it, and goes with its last reference
+    write_filled(a, 0, 'a');
+    write_filled(a, 1, 'd');
+    assert(block_sync(a) == 0);
+    block_get_dedup_stats(a, &stats);
+    assert(stats.blocks_unchanged == 1);
+    assert(count_objects(TEST_FILE "_objects") == 4);
+    assert(holds_filled(b, 1, 'b'));
+    assert(block_truncate(b, 4096) == 0);
+    assert(block_sync(b) == 0);
+    assert(count_objects(TEST_FILE "_objects") == 3);
+    assert(block_close(b) == 0);
+    assert(block_open(TEST_FILE "_b", &b) == 0);
+    
+    // A clone reads the same and diverges on its own
+    assert(block_clone(a, TEST_FILE "_c") == 0);
+    assert(block_clone(a, TEST_FILE "_c") != 0);
+    assert(block_clone(b, TEST_FILE "_b") != 0);
+    assert(block_open(TEST_FILE "_c", &c) == 0);
+    assert(block_file_size(c) == 4 * 4096);
+    assert(holds_filled(c, 0, 'a') && holds_filled(c, 1, 'd') && holds_filled(c, 2, 'a') &&
+           holds_filled(c, 3, 'c'));
+    write_filled(c, 2, 'a');
+    write_filled(c, 3, 'e');
+    assert(block_sync(c) == 0);
+    block_get_dedup_stats(c, &stats);
+    assert(stats.blocks_unchanged == 1 && stats.objects_created == 1);
+    assert(holds_filled(a, 3, 'c'));
+    
+    // Atomic batches stage objects and publish them to the map
+    assert(block_supports_atomic_write(c));
+    assert(block_begin_atomic_write(c) == 0);
+    write_filled(c, 0, 'f');
+    write_filled(c, 1, 'd');
+    assert(block_commit_atomic_write(c) == 0);
+    assert(block_begin_atomic_write(c) == 0);
+    write_filled(c, 2, 'g');
+    assert(block_rollback_atomic_write(c) == 0);
+    assert(block_close(c) == 0);
+    assert(block_close(a) == 0);
+    assert(block_open(TEST_FILE "_c", &c) == 0);
+    assert(holds_filled(c, 0, 'f') && holds_filled(c, 1, 'd') && holds_filled(c, 2, 'a'));
+    assert(block_open(TEST_FILE, &a) == 0);
+    assert(holds_filled(a, 0, 'a') && holds_filled(a, 3, 'c'));
+    
+    // Deleting a store drops its references, leaving the objects the
+    // other stores' maps name
+    assert(block_close(c) == 0);
+    assert(count_objects(TEST_FILE "_objects") == 5);
+    assert(block_delete(TEST_FILE "_c") == 0);
+    assert(access(TEST_FILE "_c.blocks", F_OK) != 0);
+    assert(count_objects(TEST_FILE "_objects") == 3);
+    assert(holds_filled(a, 1, 'd') && holds_filled(b, 0, 'a'));
+    assert(block_delete(TEST_FILE "_c") == 0);
+    
+    // Once nothing refers to them, no objects are left
+    assert(block_truncate(a, 0) == 0 && block_truncate(b, 0) == 0);
+    assert(block_close(a) == 0 && block_close(b) == 0);
+    assert(count_objects(TEST_FILE "_objects") == 0);
+    
+    block_set_fsync(0);
+    block_set_object_dir(NULL);
+    system("rm -rf " TEST_FILE "_b.blocks " TEST_FILE "_c.blocks " TEST_FILE "_objects");
+    printf("PASS\n");
+}
+
+// Flip a byte of a stored block behind the block layer's back
+static void corrupt_block(const char *backend, long long block, int offset) {
+    char path[256];
+    long long at = offset;
+    if (strcmp(backend, "packed") == 0) {
+        unsigned char entry[8];
+        int fd = open(TEST_FILE ".blocks/index", O_RDONLY);
+        assert(fd >= 0 && pread(fd, entry, 8, block * 8) == 8);
+        close(fd);
+        at += (entry[0] - 1) * 4096LL;
+        snprintf(path, sizeof(path), TEST_FILE ".blocks/segment_0000");
+    } else {
+        snprintf(path, sizeof(path), TEST_FILE ".blocks/00/00/block_%016llx", block);
+    }
+    int fd = open(path, O_RDWR);
+    char byte;
+    assert(fd >= 0 && pread(fd, &byte, 1, at) == 1);
+    byte ^= 0x10;
+    assert(pwrite(fd, &byte, 1, at) == 1);
+    close(fd);
+}
+
+// CRC32C of a block filled with c, as the checksum layer enters it
+static unsigned block_crc_filled(char c) {
+    unsigned crc = 0xffffffff;
+    for (int i = 0; i < 4096; i++) {
+        crc ^= (unsigned char)c;
+        for (int bit = 0; bit < 8; bit++) crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));
+    }
+    crc = ~crc;
+    return crc ? crc : 0xffffffff;
+}
+
+void test_checksums() {
+    printf("Testing block checksums... ");
+    
+    block_set_cache_capacity(0);
+    block_set_object_dir(TEST_FILE "_objects");
+    const char *backends[] = { "fanout", "packed", "dedup", "fanout" };
+    for (int b = 0; b < 4; b++) {
+        cleanup_test_files();
+        system("rm -rf " TEST_FILE "_objects");
+        block_open_options_t options = { backends[b], 0, 0, b == 3 ? BLOCK_COMPRESS_LZ : 0, 1 };
+        block_file_t *bf;
+        assert(block_open_ex(TEST_FILE, &options, &bf) == 0);
+        for (int i = 0; i < 4; i++) {
+            write_filled(bf, i, 'a' + i);
+        }
+        write_filled(bf, 4, 0);
+        assert(block_sync(bf) == 0);
+    
+        // Stored blocks and holes check out, whole or in part
+        for (int i = 0; i < 4; i++) {
+            assert(holds_filled(bf, i, 'a' + i));
+        }
+        assert(holds_filled(bf, 4, 0));
+        char data[4096];
+        assert(block_read(bf, data, 10, 2 * 4096 + 50) == 10 && data[0] == 'c');
+        block_checksum_stats_t stats;
+        block_get_checksum_stats(bf, &stats);
+        assert(stats.blocks_verified == 6 && stats.failures == 0 && stats.last_failed_block == -1);
+    
+        // Truncation and batches keep the checksums current
+        assert(block_truncate(bf, 3 * 4096 + 100) == 0);
+        assert(block_truncate(bf, 4 * 4096) == 0);
+        assert(block_sync(bf) == 0);
+        assert(block_read(bf, data, 4096, 3 * 4096) == 4096);
+        assert(data[99] == 'd' && data[100] == 0);
+        assert(block_begin_atomic_write(bf) == 0);
+        write_filled(bf, 0, 'x');
+        assert(block_commit_atomic_write(bf) == 0);
+        assert(block_close(bf) == 0);
+        assert(block_open(TEST_FILE, &bf) == 0);
+        assert(holds_filled(bf, 0, 'x') && holds_filled(bf, 1, 'b'));
+    
+        // A damaged block fails to read, and reads again once rewritten
+        if (b < 2) {
+            corrupt_block(backends[b], 1, 77);
+            assert(block_read(bf, data, 4096, 4096) == -1);
+            assert(block_read(bf, data, 10, 4096 + 500) == -1);
+            assert(holds_filled(bf, 2, 'c'));
+            block_get_checksum_stats(bf, &stats);
+            assert(stats.failures == 2 && stats.last_failed_block == 1);
+            write_filled(bf, 1, 'y');
+            assert(block_sync(bf) == 0);
+            assert(holds_filled(bf, 1, 'y'));
+        }
+        assert(block_close(bf) == 0);
+    }
+    
+    // A packed batch that committed before a crash, of which only block 0
+    // reached its slot: block 1 is published with the checksum it was
+    // staged with, so its loss is caught rather than approved
+    cleanup_test_files();
+    block_file_t *bf;
+    block_open_options_t options = { "packed", 0, 0, 0, 1 };
+    assert(block_open_ex(TEST_FILE, &options, &bf) == 0);
+    for (int i = 0; i < 3; i++) {
+        write_filled(bf, i, 'a' + i);
+    }
+    assert(block_close(bf) == 0);
+    char data[4096];
+    memset(data, 'x', sizeof(data));
+    int fd = open(TEST_FILE ".blocks/segment_0000", O_WRONLY);
+    assert(fd >= 0 && pwrite(fd, data, sizeof(data), 3 * 4096) == (ssize_t)sizeof(data));
+    close(fd);
+    FILE *f = fopen(TEST_FILE ".blocks/manifest", "a");
+    assert(f && fprintf(f, "staged 0 3 %u\nstaged 1 4 %u\n", block_crc_filled('x'), block_crc_filled('y')) > 0);
+    fclose(f);
+    
+    block_checksum_stats_t stats;
+    assert(block_open(TEST_FILE, &bf) == 0);
+    block_get_checksum_stats(bf, &stats);
+    assert(stats.blocks_verified == 2 && stats.failures == 1 && stats.last_failed_block == 1);
+    assert(holds_filled(bf, 0, 'x') && holds_filled(bf, 2, 'c'));
+    assert(block_read(bf, data, 4096, 4096) == -1);
+    assert(block_close(bf) == 0);
+    
+    // A crash that kept new blocks but lost their table entries, taken as
+    // a copy of the store with the table of the last sync: the log names
+    // the blocks, so they read as written rather than failing
+    cleanup_test_files();
+    options.backend = "fanout";
+    assert(block_open_ex(TEST_FILE, &options, &bf) == 0);
+    write_filled(bf, 0, 'a');
+    write_filled(bf, 1, 'b');
+    assert(block_sync_durable(bf, BLOCK_SYNC_NORMAL) == 0);
+    system("cp " TEST_FILE ".blocks/checksums " TEST_FILE "_sums");
+    write_filled(bf, 0, 'x');
+    write_filled(bf, 1, 'y');
+    assert(block_sync(bf) == 0);
+    system("rm -rf " TEST_FILE "_crash.blocks && cp -r " TEST_FILE ".blocks " TEST_FILE "_crash.blocks && "
+           "mv " TEST_FILE "_sums " TEST_FILE "_crash.blocks/checksums");
+    assert(block_close(bf) == 0);
+    
+    assert(block_open(TEST_FILE "_crash", &bf) == 0);
+    assert(holds_filled(bf, 0, 'x') && holds_filled(bf, 1, 'y'));
+    block_get_checksum_stats(bf, &stats);
+    assert(stats.failures == 0);
+    assert(block_close(bf) == 0);
+    system("rm -rf " TEST_FILE "_crash.blocks");
+    
+    // Blocks written without a durable sync are still checked once the
+    // store has been closed cleanly
+    cleanup_test_files();
+    assert(block_open_ex(TEST_FILE, &options, &bf) == 0);
+    for (int i = 0; i < 4; i++) {
+        write_filled(bf, i, 'a' + i);
+    }
+    assert(block_sync(bf) == 0);
+    assert(block_close(bf) == 0);
+    corrupt_block("fanout", 2, 100);
+    assert(block_open(TEST_FILE, &bf) == 0);
+    assert(block_read(bf, data, 4096, 2 * 4096) == -1);
+    assert(holds_filled(bf, 3, 'd'));
+    block_get_checksum_stats(bf, &stats);
+    assert(stats.failures == 1 && stats.last_failed_block == 2);
+    assert(block_close(bf) == 0);
+    
+    // Stores without checksums report none
+    cleanup_test_files();
+    assert(block_open(TEST_FILE, &bf) == 0);
+    block_get_checksum_stats(bf, &stats);
+    assert(stats.blocks_verified == 0 && stats.last_failed_block == -1);
+    assert(block_close(bf) == 0);
+    
+    block_set_object_dir(NULL);
+    system("rm -rf " TEST_FILE "_objects");
+    block_set_cache_capacity(BLOCK_CACHE_CAPACITY_DEFAULT);
+    printf("PASS\n");
+}
+
+// Sync operations, opens of directories included, a durable sync issues
+// once the dirty blocks are written back
+static long long sync_ops(block_file_t *bf, int flags) {
+    block_io_stats_t stats;
+    assert(block_sync(bf) == 0);
+    block_reset_io_stats();
+    assert(block_sync_durable(bf, flags) == 0);
+    block_get_io_stats(&stats);
+    return stats.ops;
+}
+
+void test_durable_sync() {
+    printf("Testing durable sync... ");
+    
+    int engines[] = { BLOCK_IO_ENGINE_URING, BLOCK_IO_ENGINE_POSIX };
+    for (int e = 0; e < 2; e++) {
+        block_set_io_engine(engines[e]);
+        cleanup_test_files();
+        block_file_t *bf;
+        assert(block_open_with(TEST_FILE, "fanout", &bf) == 0);
+        for (int i = 0; i < 20; i++) {
+            write_filled(bf, i, 'a');
+        }
+        assert(block_sync_durable(bf, BLOCK_SYNC_NORMAL) == 0);
+        assert(sync_ops(bf, BLOCK_SYNC_NORMAL) == 0);
+        
+        // Rewritten blocks are synced alone, however many there are
+        write_filled(bf, 3, 'b');
+        assert(sync_ops(bf, BLOCK_SYNC_NORMAL) == 1);
+        for (int i = 0; i < 20; i++) {
+            write_filled(bf, i, 'c');
+        }
+        assert(sync_ops(bf, BLOCK_SYNC_FULL) == 20);
+        
+        // A new block syncs its file, then the directories that name it
+        // and the grown manifest: leaf, middle and block directory
+        write_filled(bf, 300, 'd');
+        assert(sync_ops(bf, BLOCK_SYNC_NORMAL) == 1 + 2 * 3);
+        
+        // A hole changes only its directory
+        write_filled(bf, 5, 0);
+        assert(sync_ops(bf, BLOCK_SYNC_NORMAL) == 2);
+        
+        // DATAONLY leaves the new size to the next sync
+        write_filled(bf, 400, 'e');
+        assert(sync_ops(bf, BLOCK_SYNC_DATAONLY) == 1 + 2);
+        assert(sync_ops(bf, BLOCK_SYNC_NORMAL) == 2);
+        assert(sync_ops(bf, BLOCK_SYNC_NORMAL) == 0);
+        assert(block_close(bf) == 0);
+        
+        assert(block_open(TEST_FILE, &bf) == 0);
+        assert(block_file_size(bf) == 401 * 4096);
+        assert(holds_filled(bf, 300, 'd') && holds_filled(bf, 5, 0) && holds_filled(bf, 19, 'c'));
+        assert(block_close(bf) == 0);
+    }
+    block_set_io_engine(BLOCK_IO_ENGINE_URING);
+    
+    // Packed stores sync the segments and index they wrote
+    cleanup_test_files();
+    block_file_t *bf;
+    assert(block_open_with(TEST_FILE, "packed", &bf) == 0);
+    for (int i = 0; i < 4; i++) {
+        write_filled(bf, i, 'p');
+    }
+    assert(block_sync_durable(bf, BLOCK_SYNC_NORMAL) == 0);
+    write_filled(bf, 2, 'q');
+    assert(sync_ops(bf, BLOCK_SYNC_NORMAL) == 1);
+    write_filled(bf, 4, 'r');
+    assert(sync_ops(bf, BLOCK_SYNC_NORMAL) == 2 + 2);
+    assert(block_close(bf) == 0);
+    
+    printf("PASS\n");
+}
+
 int main() {
     printf("Running block I/O tests...\n\n");
     
@@ -258,6 +1570,24 @@ int main() {
     test_file_size();
     test_truncate();
     test_persistence();
+    test_fd_cache();
+    test_manifest();
+    test_large_offsets();
+    test_write_back();
+    test_read_cache();
+    test_packed_layout();
+    test_backends();
+    test_atomic_write();
+    test_temp_files();
+    test_block_sizes();
+    test_fetch();
+    test_readahead();
+    test_io_engines();
+    test_zero_blocks();
+    test_compression();
+    test_dedup();
+    test_checksums();
+    test_durable_sync();
     
     cleanup_test_files();
     
@@ -0,0 +1,296 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <pthread.h>
+#include "sqlite3.h"
+#include "logging_vfs.h"
+#include "block.h"
+
+// Multithreaded stress test for the block layer and the logging VFS. Each
+// thread uses handles or connections of its own, as SQLite's multi-thread
+// mode requires. Build against an SQLITE_THREADSAFE=1 SQLite.
+
+#define TEST_FILE "test_threads_block.dat"
+#define TEST_DB "test_threads.db"
+#define TEST_LOG "test_threads.log"
+#define ROWS_PER_THREAD 200
+#define BLOCK_ROUNDS 200
+#define COMMIT_ROUNDS 25
+
+static int thread_count = 8;
+
+void cleanup_all_test_data() {
+    printf("  Cleaning up test data...\n");
+    
+    unlink(TEST_DB);
+    unlink(TEST_LOG);
+    system("rm -rf " TEST_FILE ".blocks");
+    system("rm -rf " TEST_DB ".blocks " TEST_DB "-journal.blocks " TEST_DB "-wal.blocks");
+    system("rm -rf test_threads_*.db.blocks test_threads_*.db-journal.blocks");
+    
+    printf("  Cleanup complete.\n");
+}
+
+// Run fn on thread_count threads, passing each its index
+static void run_threads(void *(*fn)(void *)) {
+    pthread_t *threads = malloc(thread_count * sizeof(pthread_t));
+    long *ids = malloc(thread_count * sizeof(long));
+    assert(threads && ids);
+    for (int i = 0; i < thread_count; i++) {
+        ids[i] = i;
+        assert(pthread_create(&threads[i], NULL, fn, &ids[i]) == 0);
+    }
+    for (int i = 0; i < thread_count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    free(ids);
+}
+
+// Test 1: threads write their own blocks of one file and read everyone's
+static void *block_worker(void *arg) {
+    long id = *(long *)arg;
+    block_file_t *bf;
+    assert(block_open(TEST_FILE, &bf) == 0);
+    
+    char data[BLOCK_SIZE_DEFAULT];
+    char check[BLOCK_SIZE_DEFAULT];
+    for (int round = 0; round < BLOCK_ROUNDS; round++) {
+        // Block id of every group of thread_count blocks belongs to this thread
+        long long block = (long long)(round % 16) * thread_count + id;
+        memset(data, 'A' + (int)(id % 26), sizeof(data));
+        memcpy(data, &round, sizeof(round));
+        assert(block_write(bf, data, sizeof(data), block * sizeof(data)) == sizeof(data));
+        assert(block_read(bf, check, sizeof(check), block * sizeof(check)) == sizeof(check));
+        assert(memcmp(data, check, sizeof(data)) == 0);
+        
+        // Others' blocks are either unwritten or wholly theirs
+        long long other = (long long)(round % 16) * thread_count + (id + 1) % thread_count;
+        assert(block_read(bf, check, sizeof(check), other * sizeof(check)) == sizeof(check));
+        for (int i = sizeof(round); i < (int)sizeof(check); i++) {
+            assert(check[i] == check[sizeof(round)]);
+        }
+        if (round % 50 == 49) {
+            assert(block_sync(bf) == 0);
+        }
+    }
+    
+    assert(block_close(bf) == 0);
+    return NULL;
+}
+
+void test_block_layer() {
+    printf("Test 1: Block layer shared by %d threads\n", thread_count);
+    cleanup_all_test_data();
+    
+    run_threads(block_worker);
+    
+    // Every block holds the last round its thread wrote there
+    block_file_t *bf;
+    assert(block_open(TEST_FILE, &bf) == 0);
+    assert(block_file_size(bf) == 16LL * thread_count * BLOCK_SIZE_DEFAULT);
+    char data[BLOCK_SIZE_DEFAULT];
+    for (long long block = 0; block < 16LL * thread_count; block++) {
+        int round;
+        assert(block_read(bf, data, sizeof(data), block * sizeof(data)) == sizeof(data));
+        memcpy(&round, data, sizeof(round));
+        assert(round % 16 == block / thread_count && round >= BLOCK_ROUNDS - 16);
+        assert(data[BLOCK_SIZE_DEFAULT - 1] == 'A' + (int)(block % thread_count % 26));
+    }
+    assert(block_close(bf) == 0);
+    
+    printf("  PASSED\n\n");
+}
+
+// Tests 2 and 3: connections on one database insert and count rows
+static void *sql_worker(void *arg) {
+    long id = *(long *)arg;
+    sqlite3 *db;
+    int rc = sqlite3_open_v2(TEST_DB, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_NOMUTEX, "logging");
+    assert(rc == SQLITE_OK);
+    sqlite3_busy_timeout(db, 30000);
+    assert(sqlite3_exec(db, "PRAGMA mmap_size=67108864", NULL, NULL, NULL) == SQLITE_OK);
+    
+    sqlite3_stmt *insert, *count;
+    assert(sqlite3_prepare_v2(db, "INSERT INTO t(thread, n, payload) VALUES(?, ?, randomblob(300))",
+                              -1, &insert, NULL) == SQLITE_OK);
+    assert(sqlite3_prepare_v2(db, "SELECT count(*) FROM t WHERE thread = ?", -1, &count, NULL) == SQLITE_OK);
+    
+    for (int n = 0; n < ROWS_PER_THREAD; n += 10) {
+        // IMMEDIATE takes the write lock up front, so writers queue on the
+        // busy handler instead of deadlocking
+        assert(sqlite3_exec(db, "BEGIN IMMEDIATE", NULL, NULL, NULL) == SQLITE_OK);
+        for (int i = n; i < n + 10; i++) {
+            sqlite3_bind_int(insert, 1, (int)id);
+            sqlite3_bind_int(insert, 2, i);
+            assert(sqlite3_step(insert) == SQLITE_DONE);
+            sqlite3_reset(insert);
+        }
+        assert(sqlite3_exec(db, "COMMIT", NULL, NULL, NULL) == SQLITE_OK);
+        
+        sqlite3_bind_int(count, 1, (int)id);
+        assert(sqlite3_step(count) == SQLITE_ROW);
+        assert(sqlite3_column_int(count, 0) == n + 10);
+        sqlite3_reset(count);
+    }
+    
+    sqlite3_finalize(insert);
+    sqlite3_finalize(count);
+    sqlite3_close(db);
+    return NULL;
+}
+
+static void check_rows(void) {
+    sqlite3 *db;
+    sqlite3_stmt *stmt;
+    assert(sqlite3_open_v2(TEST_DB, &db, SQLITE_OPEN_READWRITE, "logging") == SQLITE_OK);
+    assert(sqlite3_prepare_v2(db, "SELECT count(*), count(DISTINCT thread) FROM t", -1, &stmt, NULL) == SQLITE_OK);
+    assert(sqlite3_step(stmt) == SQLITE_ROW);
+    assert(sqlite3_column_int(stmt, 0) == thread_count * ROWS_PER_THREAD);
+    assert(sqlite3_column_int(stmt, 1) == thread_count);
+    sqlite3_finalize(stmt);
+    
+    assert(sqlite3_prepare_v2(db, "PRAGMA integrity_check", -1, &stmt, NULL) == SQLITE_OK);
+    assert(sqlite3_step(stmt) == SQLITE_ROW);
+    assert(strcmp((const char *)sqlite3_column_text(stmt, 0), "ok") == 0);
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+}
+
+static void run_sql_test(const char *mode) {
+    cleanup_all_test_data();
+    assert(sqlite3_loggingvfs_init(TEST_LOG) == SQLITE_OK);
+    sqlite3_loggingvfs_set_block_storage(1);
+    
+    sqlite3 *db;
+    char sql[128];
+    assert(sqlite3_open_v2(TEST_DB, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, "logging") == SQLITE_OK);
+    snprintf(sql, sizeof(sql), "PRAGMA journal_mode=%s", mode);
+    assert(sqlite3_exec(db, sql, NULL, NULL, NULL) == SQLITE_OK);
+    assert(sqlite3_exec(db, "CREATE TABLE t(thread INTEGER, n INTEGER, payload BLOB)",
+                        NULL, NULL, NULL) == SQLITE_OK);
+    
+    run_threads(sql_worker);
+    sqlite3_close(db);
+    
+    check_rows();
+    sqlite3_loggingvfs_set_block_storage(0);
+    sqlite3_loggingvfs_shutdown();
+}
+
+void test_rollback_journal() {
+    printf("Test 2: %d connections on one database, rollback journal\n", thread_count);
+    run_sql_test("DELETE");
+    printf("  PASSED\n\n");
+}
+
+void test_wal() {
+    printf("Test 3: %d connections on one database, WAL\n", thread_count);
+    run_sql_test("WAL");
+    printf("  PASSED\n\n");
+}
+
+// Test 4: every thread works on a database of its own
+static void *own_db_worker(void *arg) {
+    long id = *(long *)arg;
+    char name[64];
+    snprintf(name, sizeof(name), "test_threads_%ld.db", id);
+    
+    sqlite3 *db;
+    assert(sqlite3_open_v2(name, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX,
+                           "logging") == SQLITE_OK);
+    assert(sqlite3_exec(db, "CREATE TABLE t(n INTEGER, payload BLOB);"
+                            "WITH RECURSIVE c(n) AS (SELECT 1 UNION ALL SELECT n + 1 FROM c WHERE n < 2000) "
+                            "INSERT INTO t SELECT n, randomblob(200) FROM c;"
+                            "CREATE INDEX t_n ON t(n);", NULL, NULL, NULL) == SQLITE_OK);
+    
+    sqlite3_stmt *stmt;
+    assert(sqlite3_prepare_v2(db, "SELECT count(*), sum(n) FROM t", -1, &stmt, NULL) == SQLITE_OK);
+    assert(sqlite3_step(stmt) == SQLITE_ROW);
+    assert(sqlite3_column_int(stmt, 0) == 2000);
+    assert(sqlite3_column_int64(stmt, 1) == 2000LL * 2001 / 2);
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+    return NULL;
+}
+
+void test_own_databases() {
+    printf("Test 4: %d threads, one database each\n", thread_count);
+    cleanup_all_test_data();
+    assert(sqlite3_loggingvfs_init(TEST_LOG) == SQLITE_OK);
+    sqlite3_loggingvfs_set_block_storage(1);
+    
+    run_threads(own_db_worker);
+    
+    sqlite3_loggingvfs_set_block_storage(0);
+    sqlite3_loggingvfs_shutdown();
+    printf("  PASSED\n\n");
+}
+
+// Test 5: threads commit to one store at once, each syncing durably
+static void *commit_worker(void *arg) {
+    long id = *(long *)arg;
+    block_file_t *bf;
+    assert(block_open(TEST_FILE, &bf) == 0);
+    
+    char data[BLOCK_SIZE_DEFAULT];
+    for (int round = 0; round < COMMIT_ROUNDS; round++) {
+        memset(data, 'a' + round % 26, sizeof(data));
+        assert(block_write(bf, data, sizeof(data), id * sizeof(data)) == sizeof(data));
+        assert(block_sync_durable(bf, BLOCK_SYNC_NORMAL) == 0);
+    }
+    
+    assert(block_close(bf) == 0);
+    return NULL;
+}
+
+void test_group_commit() {
+    printf("Test 5: Group commit of %d threads syncing one store\n", thread_count);
+    cleanup_all_test_data();
+    
+    // A handle held open keeps the counters
+    block_file_t *bf;
+    assert(block_open(TEST_FILE, &bf) == 0);
+    block_set_group_commit_window(2000);
+    run_threads(commit_worker);
+    block_set_group_commit_window(0);
+    
+    block_writeback_stats_t stats;
+    block_get_writeback_stats(bf, &stats);
+    printf("  %lld syncs in %lld group syncs\n", stats.syncs, stats.sync_batches);
+    assert(stats.syncs == (long long)thread_count * COMMIT_ROUNDS);
+    assert(stats.sync_batches >= COMMIT_ROUNDS && stats.sync_batches <= stats.syncs);
+    assert(thread_count == 1 || stats.sync_batches < stats.syncs);
+    
+    char data[BLOCK_SIZE_DEFAULT];
+    for (long long block = 0; block < thread_count; block++) {
+        assert(block_read(bf, data, sizeof(data), block * sizeof(data)) == sizeof(data));
+        assert(data[0] == 'a' + (COMMIT_ROUNDS - 1) % 26);
+    }
+    assert(block_close(bf) == 0);
+    
+    printf("  PASSED\n\n");
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1) {
+        thread_count = atoi(argv[1]);
+    }
+    if (thread_count < 1 || !sqlite3_threadsafe()) {
+        fprintf(stderr, "Usage: test_threads [threads], with a threadsafe SQLite\n");
+        return 1;
+    }
+    printf("Running multithreaded tests...\n\n");
+    
+    test_block_layer();
+    test_rollback_journal();
+    test_wal();
+    test_own_databases();
+    test_group_commit();
+    
+    cleanup_all_test_data();
+    printf("All tests PASSED! ✅\n");
+    return 0;
+}
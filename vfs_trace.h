@@ -0,0 +1,120 @@
+#ifndef VFS_TRACE_H
+#define VFS_TRACE_H
+
+#include <stdint.h>
+#include <string.h>
+
+// Binary trace of VFS calls, written by the logging VFS and read by
+// vfs_trace_dump. A 16-byte header is followed by fixed 32-byte records,
+// all little-endian:
+//
+//   header: "wasqltr1", uint32 version, uint32 record size
+//   record: uint64 start time (ns since the epoch)
+//           int64  offset (READ/WRITE offset, TRUNCATE size, FILESIZE result,
+//                  OPEN flags, ACCESS result)
+//           uint32 length (READ/WRITE bytes, name length for NAME, else the
+//                  call's flags or lock level)
+//           int32  rc
+//           uint32 duration (ns, saturating)
+//           uint16 file id
+//           uint8  op
+//           uint8  reserved
+//
+// File names appear once, in a NAME record giving the id used for them from
+// then on. The name follows the record, zero-padded to a whole record.
+
+#define VFS_TRACE_MAGIC "wasqltr1"
+#define VFS_TRACE_VERSION 1
+#define VFS_TRACE_HEADER_SIZE 16
+#define VFS_TRACE_RECORD_SIZE 32
+
+enum {
+    VFS_TRACE_NAME = 0,
+    VFS_TRACE_OPEN,
+    VFS_TRACE_CLOSE,
+    VFS_TRACE_READ,
+    VFS_TRACE_WRITE,
+    VFS_TRACE_TRUNCATE,
+    VFS_TRACE_SYNC,
+    VFS_TRACE_FILESIZE,
+    VFS_TRACE_LOCK,
+    VFS_TRACE_UNLOCK,
+    VFS_TRACE_CHECK_RESERVED,
+    VFS_TRACE_FILE_CONTROL,
+    VFS_TRACE_DELETE,
+    VFS_TRACE_ACCESS,
+    VFS_TRACE_OP_COUNT
+};
+
+typedef struct {
+    uint64_t start_ns;
+    int64_t offset;
+    uint32_t length;
+    int32_t rc;
+    uint32_t duration_ns;
+    uint16_t file_id;
+    uint8_t op;
+} vfs_trace_record_t;
+
+static inline const char *vfs_trace_op_name(int op) {
+    static const char *const names[VFS_TRACE_OP_COUNT] = {
+        "NAME", "OPEN", "CLOSE", "READ", "WRITE", "TRUNCATE", "SYNC", "FILESIZE",
+        "LOCK", "UNLOCK", "CHECK_RESERVED", "FILE_CONTROL", "DELETE", "ACCESS"
+    };
+    return (op >= 0 && op < VFS_TRACE_OP_COUNT) ? names[op] : "UNKNOWN";
+}
+
+static inline void vfs_trace_put(unsigned char *out, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        out[i] = (unsigned char)(value >> (8 * i));
+    }
+}
+
+static inline uint64_t vfs_trace_get(const unsigned char *in, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) {
+        value |= (uint64_t)in[i] << (8 * i);
+    }
+    return value;
+}
+
+static inline void vfs_trace_encode_header(unsigned char *out) {
+    memcpy(out, VFS_TRACE_MAGIC, 8);
+    vfs_trace_put(out + 8, VFS_TRACE_VERSION, 4);
+    vfs_trace_put(out + 12, VFS_TRACE_RECORD_SIZE, 4);
+}
+
+// Returns 0 if the header is one this version reads
+static inline int vfs_trace_check_header(const unsigned char *in) {
+    return (memcmp(in, VFS_TRACE_MAGIC, 8) == 0 &&
+            vfs_trace_get(in + 8, 4) == VFS_TRACE_VERSION &&
+            vfs_trace_get(in + 12, 4) == VFS_TRACE_RECORD_SIZE) ? 0 : -1;
+}
+
+static inline void vfs_trace_encode(const vfs_trace_record_t *r, unsigned char *out) {
+    vfs_trace_put(out, r->start_ns, 8);
+    vfs_trace_put(out + 8, (uint64_t)r->offset, 8);
+    vfs_trace_put(out + 16, r->length, 4);
+    vfs_trace_put(out + 20, (uint32_t)r->rc, 4);
+    vfs_trace_put(out + 24, r->duration_ns, 4);
+    vfs_trace_put(out + 28, r->file_id, 2);
+    out[30] = r->op;
+    out[31] = 0;
+}
+
+static inline void vfs_trace_decode(const unsigned char *in, vfs_trace_record_t *r) {
+    r->start_ns = vfs_trace_get(in, 8);
+    r->offset = (int64_t)vfs_trace_get(in + 8, 8);
+    r->length = (uint32_t)vfs_trace_get(in + 16, 4);
+    r->rc = (int32_t)(uint32_t)vfs_trace_get(in + 20, 4);
+    r->duration_ns = (uint32_t)vfs_trace_get(in + 24, 4);
+    r->file_id = (uint16_t)vfs_trace_get(in + 28, 2);
+    r->op = in[30];
+}
+
+// Bytes of zero padding after a name of the given length
+static inline int vfs_trace_name_padding(uint32_t length) {
+    return (VFS_TRACE_RECORD_SIZE - length % VFS_TRACE_RECORD_SIZE) % VFS_TRACE_RECORD_SIZE;
+}
+
+#endif // VFS_TRACE_H
\ No newline at end of file
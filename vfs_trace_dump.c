@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "vfs_trace.h"
+
+// Pretty-print a binary VFS trace written by sqlite3_loggingvfs_set_trace().
+//
+//   vfs_trace_dump trace.bin        one line per call
+//   vfs_trace_dump -s trace.bin     per-operation totals only
+
+#define MAX_FILE_IDS 65536
+
+typedef struct {
+    long long count;
+    long long bytes;
+    long long errors;
+    unsigned long long total_ns;
+    unsigned long long max_ns;
+} op_summary_t;
+
+static char *file_names[MAX_FILE_IDS];
+
+static const char *file_name(unsigned id) {
+    if (id == 0) return "-";
+    return file_names[id] ? file_names[id] : "?";
+}
+
+static void print_record(const vfs_trace_record_t *r) {
+    time_t secs = (time_t)(r->start_ns / 1000000000ULL);
+    struct tm tm;
+    char when[32];
+    gmtime_r(&secs, &tm);
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+    
+    printf("%s.%09llu %10.3fus %-14s %s", when, (unsigned long long)(r->start_ns % 1000000000ULL),
+           r->duration_ns / 1000.0, vfs_trace_op_name(r->op), file_name(r->file_id));
+    
+    switch (r->op) {
+        case VFS_TRACE_READ:
+        case VFS_TRACE_WRITE:
+            printf(" offset=%lld len=%u", (long long)r->offset, r->length);
+            break;
+        case VFS_TRACE_TRUNCATE:
+        case VFS_TRACE_FILESIZE:
+            printf(" size=%lld", (long long)r->offset);
+            break;
+        case VFS_TRACE_OPEN:
+            printf(" flags=0x%llx", (long long)r->offset);
+            break;
+        case VFS_TRACE_ACCESS:
+            printf(" flags=%u result=%lld", r->length, (long long)r->offset);
+            break;
+        case VFS_TRACE_CHECK_RESERVED:
+            printf(" result=%lld", (long long)r->offset);
+            break;
+        case VFS_TRACE_CLOSE:
+            break;
+        default:
+            printf(" arg=%u", r->length);
+            break;
+    }
+    printf(" rc=%d\n", r->rc);
+}
+
+static void print_summary(const op_summary_t *summary, long long names) {
+    printf("%-14s %10s %14s %8s %12s %12s\n", "op", "calls", "bytes", "errors", "avg us", "max us");
+    for (int op = 1; op < VFS_TRACE_OP_COUNT; op++) {
+        const op_summary_t *s = &summary[op];
+        if (s->count == 0) continue;
+        printf("%-14s %10lld %14lld %8lld %12.3f %12.3f\n", vfs_trace_op_name(op), s->count, s->bytes,
+               s->errors, s->total_ns / 1000.0 / s->count, s->max_ns / 1000.0);
+    }
+    printf("%lld file names\n", names);
+}
+
+int main(int argc, char **argv) {
+    int summary_only = 0;
+    const char *path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-s") == 0) {
+            summary_only = 1;
+        } else {
+            path = argv[i];
+        }
+    }
+    if (!path) {
+        fprintf(stderr, "usage: %s [-s] trace.bin\n", argv[0]);
+        return 2;
+    }
+    
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return 1;
+    }
+    
+    unsigned char raw[VFS_TRACE_RECORD_SIZE];
+    if (fread(raw, 1, VFS_TRACE_HEADER_SIZE, f) != VFS_TRACE_HEADER_SIZE || vfs_trace_check_header(raw) != 0) {
+        fprintf(stderr, "%s: not a VFS trace\n", path);
+        fclose(f);
+        return 1;
+    }
+    
+    op_summary_t summary[VFS_TRACE_OP_COUNT];
+    memset(summary, 0, sizeof(summary));
+    long long names = 0;
+    int result = 0;
+    
+    while (fread(raw, 1, VFS_TRACE_RECORD_SIZE, f) == VFS_TRACE_RECORD_SIZE) {
+        vfs_trace_record_t r;
+        vfs_trace_decode(raw, &r);
+        
+        if (r.op == VFS_TRACE_NAME) {
+            long long padded = r.length + vfs_trace_name_padding(r.length);
+            char *name = malloc(padded + 1);
+            if (!name || fread(name, 1, padded, f) != (size_t)padded) {
+                fprintf(stderr, "%s: truncated name record\n", path);
+                free(name);
+                result = 1;
+                break;
+            }
+            name[r.length] = '\0';
+            free(file_names[r.file_id]);
+            file_names[r.file_id] = name;
+            names++;
+            continue;
+        }
+        
+        if (r.op < VFS_TRACE_OP_COUNT) {
+            op_summary_t *s = &summary[r.op];
+            s->count++;
+            if (r.op == VFS_TRACE_READ || r.op == VFS_TRACE_WRITE) s->bytes += r.length;
+            if (r.rc != 0) s->errors++;
+            s->total_ns += r.duration_ns;
+            if (r.duration_ns > s->max_ns) s->max_ns = r.duration_ns;
+        }
+        if (!summary_only) {
+            print_record(&r);
+        }
+    }
+    
+    if (summary_only) {
+        print_summary(summary, names);
+    }
+    
+    for (int i = 0; i < MAX_FILE_IDS; i++) {
+        free(file_names[i]);
+    }
+    fclose(f);
+    return result;
+}
\ No newline at end of file
@@ -0,0 +1,255 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "block.h"
+#include "vfs_trace.h"
+
+// Replay a binary VFS trace against the block layer, to measure a storage
+// change against a captured workload.
+//
+//   vfs_trace_replay [-b backend] [-d dir] [-t] trace.bin
+//
+//   -b  backend for the replayed stores (default: the block layer default)
+//   -d  directory the stores are created in (default: replay.d)
+//   -t  keep the original timing between calls instead of going flat out
+//
+// OPEN, CLOSE, READ, WRITE, TRUNCATE, SYNC, FILESIZE and DELETE are
+// re-issued; other calls are skipped. Writes carry a fixed
+// pattern, since traces hold no data.
+
+#define MAX_FILE_IDS 65536
+#define MAX_OPEN_PER_FILE 8
+#define MAX_PATH_LEN 1024
+
+typedef struct {
+    char *path;                        // where the file is replayed
+    block_file_t *open[MAX_OPEN_PER_FILE];  // handles, most recent last
+    int open_count;
+} replay_file_t;
+
+typedef struct {
+    unsigned long long *ns;
+    long long count;
+    long long cap;
+    long long bytes;
+    long long errors;
+} op_latency_t;
+
+static replay_file_t files[MAX_FILE_IDS];
+static op_latency_t latency[VFS_TRACE_OP_COUNT];
+
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void record_latency(int op, unsigned long long ns, long long bytes, int failed) {
+    op_latency_t *l = &latency[op];
+    if (l->count == l->cap) {
+        long long cap = l->cap ? l->cap * 2 : 1024;
+        unsigned long long *grown = realloc(l->ns, cap * sizeof(unsigned long long));
+        if (!grown) return;
+        l->ns = grown;
+        l->cap = cap;
+    }
+    l->ns[l->count++] = ns;
+    l->bytes += bytes;
+    if (failed) l->errors++;
+}
+
+static int compare_ns(const void *a, const void *b) {
+    unsigned long long x = *(const unsigned long long *)a;
+    unsigned long long y = *(const unsigned long long *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile_us(op_latency_t *l, double p) {
+    long long i = (long long)(p * (l->count - 1) + 0.5);
+    return l->ns[i] / 1000.0;
+}
+
+static int is_replayed(int op) {
+    switch (op) {
+        case VFS_TRACE_OPEN: case VFS_TRACE_CLOSE: case VFS_TRACE_READ: case VFS_TRACE_WRITE:
+        case VFS_TRACE_TRUNCATE: case VFS_TRACE_SYNC: case VFS_TRACE_FILESIZE: case VFS_TRACE_DELETE:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// Replay one call. Returns -1 if the block layer reported an error.
+// Block sync flags for the xSync flags a trace records, mapped as
+// loggingSync maps them (SQLITE_SYNC_FULL is 3, SQLITE_SYNC_DATAONLY 0x10)
+static int sync_flags(uint32_t flags) {
+    int result = BLOCK_SYNC_NORMAL;
+    if ((flags & 0x0F) == 3) result |= BLOCK_SYNC_FULL;
+    if (flags & 0x10) result |= BLOCK_SYNC_DATAONLY;
+    return result;
+}
+
+static int replay_record(const vfs_trace_record_t *r, const char *backend, char *buf, int buf_size) {
+    replay_file_t *f = &files[r->file_id];
+    block_file_t *bf = f->open_count ? f->open[f->open_count - 1] : NULL;
+    
+    switch (r->op) {
+        case VFS_TRACE_OPEN:
+            if (!f->path || f->open_count == MAX_OPEN_PER_FILE || r->rc != 0) return 0;
+            if (block_open_with(f->path, backend, &f->open[f->open_count]) != 0) return -1;
+            f->open_count++;
+            return 0;
+        case VFS_TRACE_CLOSE:
+            if (!bf) return 0;
+            f->open_count--;
+            return block_close(bf);
+        case VFS_TRACE_READ:
+            if (!bf || (int)r->length > buf_size) return 0;
+            return (block_read(bf, buf, r->length, r->offset) == (int)r->length) ? 0 : -1;
+        case VFS_TRACE_WRITE:
+            if (!bf || (int)r->length > buf_size) return 0;
+            return (block_write(bf, buf, r->length, r->offset) == (int)r->length) ? 0 : -1;
+        case VFS_TRACE_TRUNCATE:
+            return bf ? block_truncate(bf, r->offset) : 0;
+        case VFS_TRACE_SYNC:
+            return bf ? block_sync_durable(bf, sync_flags(r->length)) : 0;
+        case VFS_TRACE_FILESIZE:
+            return (!bf || block_file_size(bf) >= 0) ? 0 : -1;
+        case VFS_TRACE_DELETE: {
+            // Stores that are still open, like memory stores, go with their last close
+            if (!f->path || f->open_count > 0) return 0;
+            return block_delete(f->path);
+        }
+        default:
+            return 0;
+    }
+}
+
+int main(int argc, char **argv) {
+    const char *backend = NULL;
+    const char *dir = "replay.d";
+    const char *path = NULL;
+    int timed = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "b:d:t")) != -1) {
+        switch (opt) {
+            case 'b': backend = optarg; break;
+            case 'd': dir = optarg; break;
+            case 't': timed = 1; break;
+            default: path = NULL; optind = argc + 1; break;
+        }
+    }
+    if (optind == argc - 1) path = argv[optind];
+    if (!path) {
+        fprintf(stderr, "usage: %s [-b backend] [-d dir] [-t] trace.bin\n", argv[0]);
+        return 2;
+    }
+    if (backend && !block_find_backend(backend)) {
+        fprintf(stderr, "unknown backend: %s\n", backend);
+        return 2;
+    }
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        perror(dir);
+        return 1;
+    }
+    
+    FILE *trace = fopen(path, "rb");
+    if (!trace) {
+        perror(path);
+        return 1;
+    }
+    unsigned char raw[VFS_TRACE_RECORD_SIZE];
+    if (fread(raw, 1, VFS_TRACE_HEADER_SIZE, trace) != VFS_TRACE_HEADER_SIZE || vfs_trace_check_header(raw) != 0) {
+        fprintf(stderr, "%s: not a VFS trace\n", path);
+        fclose(trace);
+        return 1;
+    }
+    
+    int buf_size = 1 << 20;
+    char *buf = malloc(buf_size);
+    if (!buf) return 1;
+    memset(buf, 0x5a, buf_size);
+    
+    unsigned long long trace_start = 0;
+    unsigned long long replay_start = now_ns();
+    long long calls = 0;
+    int result = 0;
+    
+    while (fread(raw, 1, VFS_TRACE_RECORD_SIZE, trace) == VFS_TRACE_RECORD_SIZE) {
+        vfs_trace_record_t r;
+        vfs_trace_decode(raw, &r);
+        
+        if (r.op == VFS_TRACE_NAME) {
+            // Replay every file under dir by its base name
+            int padded = r.length + vfs_trace_name_padding(r.length);
+            char *name = malloc(padded + 1);
+            if (!name || fread(name, 1, padded, trace) != (size_t)padded) {
+                fprintf(stderr, "%s: truncated name record\n", path);
+                free(name);
+                result = 1;
+                break;
+            }
+            name[r.length] = '\0';
+            const char *base = strrchr(name, '/');
+            base = base ? base + 1 : name;
+            char replay_path[MAX_PATH_LEN];
+            snprintf(replay_path, sizeof(replay_path), "%s/%s", dir, base);
+            free(files[r.file_id].path);
+            files[r.file_id].path = strdup(replay_path);
+            free(name);
+            continue;
+        }
+        if (!is_replayed(r.op)) continue;
+        
+        if (timed) {
+            // Wait until the call is as far into the replay as it was into the trace
+            if (!trace_start) trace_start = r.start_ns;
+            unsigned long long due = replay_start + (r.start_ns - trace_start);
+            unsigned long long t = now_ns();
+            if (due > t) {
+                struct timespec ts = { (time_t)((due - t) / 1000000000ULL), (long)((due - t) % 1000000000ULL) };
+                nanosleep(&ts, NULL);
+            }
+        }
+        
+        unsigned long long t0 = now_ns();
+        int rc = replay_record(&r, backend, buf, buf_size);
+        unsigned long long elapsed = now_ns() - t0;
+        long long bytes = (r.op == VFS_TRACE_READ || r.op == VFS_TRACE_WRITE) ? r.length : 0;
+        record_latency(r.op, elapsed, bytes, rc != 0);
+        calls++;
+    }
+    
+    // Close what the trace left open, as the last close would
+    for (int i = 0; i < MAX_FILE_IDS; i++) {
+        while (files[i].open_count > 0) {
+            block_close(files[i].open[--files[i].open_count]);
+        }
+        free(files[i].path);
+    }
+    double seconds = (now_ns() - replay_start) / 1e9;
+    
+    printf("%lld calls in %.3fs: %.0f calls/s, read %.2f MB/s, write %.2f MB/s\n", calls, seconds,
+           calls / seconds, latency[VFS_TRACE_READ].bytes / seconds / 1e6,
+           latency[VFS_TRACE_WRITE].bytes / seconds / 1e6);
+    printf("%-14s %10s %8s %10s %10s %10s %10s %10s\n", "op", "calls", "errors",
+           "p50 us", "p90 us", "p99 us", "p99.9 us", "max us");
+    for (int op = 1; op < VFS_TRACE_OP_COUNT; op++) {
+        op_latency_t *l = &latency[op];
+        if (l->count == 0) continue;
+        qsort(l->ns, l->count, sizeof(unsigned long long), compare_ns);
+        printf("%-14s %10lld %8lld %10.2f %10.2f %10.2f %10.2f %10.2f\n", vfs_trace_op_name(op),
+               l->count, l->errors, percentile_us(l, 0.50), percentile_us(l, 0.90),
+               percentile_us(l, 0.99), percentile_us(l, 0.999), l->ns[l->count - 1] / 1000.0);
+        if (l->errors) result = 1;
+        free(l->ns);
+    }
+    
+    free(buf);
+    fclose(trace);
+    return result;
+}
\ No newline at end of file